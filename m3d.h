@@ -1,12 +1,21 @@
 #ifndef __GUARD_MATH3D_H__
 #define __GUARD_MATH3D_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef M3D_STATIC
     #define M3D_DEF static
 #else
     #define M3D_DEF extern
 #endif
 
+#if defined(_MSC_VER) || defined(__GNUC__)
+    #define M3D_RESTRICT __restrict
+#else
+    #define M3D_RESTRICT
+#endif
+
 union Vec2 {
     struct { float x, y; };
     struct { float s, t; };
@@ -60,6 +69,13 @@ union Vec4 {
     float & operator [] (size_t i)       { return data[i]; }
 };
 
+// Half precision (IEEE 754 binary16) storage types.  These are only
+// meant for storage and are converted to and from the float vector
+// types for any arithmetic.
+struct Half2 { uint16_t x, y; };
+struct Half3 { uint16_t x, y, z; };
+struct Half4 { uint16_t x, y, z, w; };
+
 
 M3D_DEF Vec2  vec2(float x, float y);
 M3D_DEF Vec2  operator - (Vec2 a);
@@ -116,6 +132,63 @@ M3D_DEF float length(Vec4 v);
 M3D_DEF Vec4  normalize(Vec4 v);
 
 
+// Double precision counterparts of Vec3, Vec4 and Mat4 for large
+// world coordinates.  The hot path is expected to stay in float by
+// converting to camera relative positions with to_camera_relative.
+union DVec3 {
+    struct { double x, y, z; };
+    double data[3];
+
+    double   operator [] (size_t i) const { return data[i]; }
+    double & operator [] (size_t i)       { return data[i]; }
+};
+
+union DVec4 {
+    struct { double x, y, z, w; };
+    struct { DVec3 xyz; double __ignored0; };
+    double data[4];
+
+    double   operator [] (size_t i) const { return data[i]; }
+    double & operator [] (size_t i)       { return data[i]; }
+};
+
+M3D_DEF DVec3  dvec3(double x, double y, double z);
+M3D_DEF DVec3  dvec3(Vec3 v);
+M3D_DEF Vec3   vec3(DVec3 v);
+M3D_DEF DVec3  operator - (DVec3 a);
+M3D_DEF DVec3  operator - (DVec3 a, DVec3 b);
+M3D_DEF DVec3  operator + (DVec3 a, DVec3 b);
+M3D_DEF DVec3  operator * (double scale, DVec3 a);
+M3D_DEF DVec3  operator * (DVec3 a, double scale);
+M3D_DEF DVec3  operator / (DVec3 a, double scale);
+M3D_DEF DVec3& operator += (DVec3 &a, DVec3 b);
+M3D_DEF DVec3& operator *= (DVec3 &a, double scale);
+M3D_DEF DVec3  hadamard(DVec3 a, DVec3 b);
+M3D_DEF double dot(DVec3 a, DVec3 b);
+M3D_DEF DVec3  cross(DVec3 a, DVec3 b);
+M3D_DEF double len_sq(DVec3 v);
+M3D_DEF double length(DVec3 v);
+M3D_DEF DVec3  normalize(DVec3 v);
+
+M3D_DEF DVec4  dvec4(double x, double y, double z, double w);
+M3D_DEF DVec4  dvec4(DVec3 v3, double w);
+M3D_DEF DVec4  dvec4(Vec4 v);
+M3D_DEF Vec4   vec4(DVec4 v);
+M3D_DEF DVec4  operator - (DVec4 a);
+M3D_DEF DVec4  operator - (DVec4 a, DVec4 b);
+M3D_DEF DVec4  operator + (DVec4 a, DVec4 b);
+M3D_DEF DVec4  operator * (double scale, DVec4 a);
+M3D_DEF DVec4  operator * (DVec4 a, double scale);
+M3D_DEF DVec4  operator / (DVec4 a, double scale);
+M3D_DEF DVec4& operator += (DVec4 &a, DVec4 b);
+M3D_DEF DVec4& operator *= (DVec4 &a, double scale);
+M3D_DEF DVec4  hadamard(DVec4 a, DVec4 b);
+M3D_DEF double dot(DVec4 a, DVec4 b);
+M3D_DEF double len_sq(DVec4 v);
+M3D_DEF double length(DVec4 v);
+M3D_DEF DVec4  normalize(DVec4 v);
+
+
 struct Mat4 {
     float data[16];
 
@@ -128,26 +201,869 @@ struct Mat4 {
     }
 };
 
+struct Mat3 {
+    float data[9];
+
+    float at(int row, int col) const {
+        return data[(col * 3) + row];
+    }
+
+    float & at(int row, int col) {
+        return data[(col * 3) + row];
+    }
+};
+
+struct DMat4 {
+    double data[16];
+
+    double at(int row, int col) const {
+        return data[(col * 4) + row];
+    }
+
+    double & at(int row, int col) {
+        return data[(col * 4) + row];
+    }
+};
+
+// Affine transform with the implicit (0, 0, 0, 1) bottom row of a
+// Mat4 dropped.  Stored column major like Mat4 so data[9..11] is the
+// translation.
+struct Mat3x4 {
+    float data[12];
+
+    float at(int row, int col) const {
+        return data[(col * 3) + row];
+    }
+
+    float & at(int row, int col) {
+        return data[(col * 3) + row];
+    }
+};
+
+// Unit dual quaternion for rigid transforms.  Quaternions are stored
+// as (x, y, z, w) with w being the scalar part.
+struct DualQuat {
+    Vec4 real;
+    Vec4 dual;
+};
+
 M3D_DEF Mat4 identity();
 M3D_DEF Mat4 orthoGL(float left, float right, float top, float bottom, float near, float far);
 M3D_DEF Mat4 perspectiveGL(float left, float right, float top, float bottom, float near, float far);
 M3D_DEF Mat4 perspectiveGL(float horizontal_fov, float aspect_ht_over_wd, float near, float far);
+M3D_DEF Mat4 inverse_orthoGL(float left, float right, float top, float bottom, float near, float far);
+M3D_DEF Mat4 inverse_perspectiveGL(float left, float right, float top, float bottom, float near, float far);
+M3D_DEF Mat4 inverse_perspectiveGL(float horizontal_fov, float aspect_ht_over_wd, float near, float far);
 M3D_DEF Mat4 translate(float x, float y, float z);
 M3D_DEF Mat4 rotation(float angle, Vec3 axis);
 M3D_DEF Mat4 scale(float x, float y, float z);
+M3D_DEF Mat4 mat4(DualQuat const &dq);
+M3D_DEF Mat4 mat4(Mat3x4 const &A);
+M3D_DEF Mat4 mat4(Mat3 const &A);
 M3D_DEF Mat4 inverse(Mat4 const &A, bool *isInvertible = nullptr);
 M3D_DEF Mat4 operator + (Mat4 const &A, Mat4 const &B);
+M3D_DEF Mat4 operator - (Mat4 const &A, Mat4 const &B);
 M3D_DEF Mat4 operator * (Mat4 const &A, Mat4 const &B);
 M3D_DEF Vec4 operator * (Mat4 const &A, Vec4 const &b);
 
+// Forms that write their result in place for chains of matrix math.
+// out of mul_into must not point at A or B, A *= B may pass the same
+// matrix for both.  inverse_inplace returns false and leaves A alone
+// when it is not invertible.
+M3D_DEF void  mul_into(Mat4 *M3D_RESTRICT out, Mat4 const &A, Mat4 const &B);
+M3D_DEF Mat4& operator += (Mat4 &A, Mat4 const &B);
+M3D_DEF Mat4& operator -= (Mat4 &A, Mat4 const &B);
+M3D_DEF Mat4& operator *= (Mat4 &A, Mat4 const &B);
+M3D_DEF bool  inverse_inplace(Mat4 *A);
+
+// Batched A * vec4(p, 1) without a perspective divide for Vec3 points
+// and A * p for Vec4s.  Large arrays are split across threads with
+// OpenMP.
+M3D_DEF void transform_points(Mat4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void transform_points(Mat4 const &A, Vec4 const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count);
+
+
+
+// The double matrix constructors carry a d prefix as overloading on
+// double arguments would make calls with integer literals ambiguous.
+M3D_DEF DMat4 didentity();
+M3D_DEF DMat4 dtranslate(double x, double y, double z);
+M3D_DEF DMat4 drotation(double angle, DVec3 axis);
+M3D_DEF DMat4 dscale(double x, double y, double z);
+M3D_DEF DMat4 dmat4(Mat4 const &A);
+M3D_DEF Mat4  mat4(DMat4 const &A);
+M3D_DEF DMat4 inverse(DMat4 const &A, bool *isInvertible = nullptr);
+M3D_DEF DMat4 operator + (DMat4 const &A, DMat4 const &B);
+M3D_DEF DMat4 operator * (DMat4 const &A, DMat4 const &B);
+M3D_DEF DVec4 operator * (DMat4 const &A, DVec4 const &b);
+
+// Float positions relative to the camera with the subtraction done in
+// double precision, i.e. out[i] = vec3(in[i] - camera).
+M3D_DEF void to_camera_relative(DVec3 camera, DVec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+
+// Window rectangle and depth range in the OpenGL convention, i.e.
+// screen y grows upwards from (x, y) and depth maps to [near, far].
+struct Viewport {
+    float x, y;
+    float width, height;
+    float near_depth, far_depth;
+};
+
+// Outcode bits of a clip space position (x, y, z, w) for each of the
+// planes the point lies outside of.
+enum {
+    M3D_CLIP_LEFT   = 1 << 0,   // x < -w
+    M3D_CLIP_RIGHT  = 1 << 1,   // x >  w
+    M3D_CLIP_BOTTOM = 1 << 2,   // y < -w
+    M3D_CLIP_TOP    = 1 << 3,   // y >  w
+    M3D_CLIP_NEAR   = 1 << 4,   // z < -w
+    M3D_CLIP_FAR    = 1 << 5    // z >  w
+};
+
+struct Ray {
+    Vec3 origin;
+    Vec3 direction;
+};
+
+M3D_DEF Viewport viewport(float x, float y, float width, float height);
+M3D_DEF Vec3     project_point(Mat4 const &view_proj, Viewport const &vp, Vec3 p, uint8_t *clip_flags = nullptr);
+
+// Transforms points to clip space, divides by w and maps the result
+// to the viewport in one pass.  The screen positions of points with
+// any clip flag set are not meaningful, clip_flags may be null.
+M3D_DEF void project_points(Mat4 const &view_proj, Viewport const &vp,
+                            Vec3 const *M3D_RESTRICT points,
+                            Vec3       *M3D_RESTRICT screen,
+                            uint8_t    *M3D_RESTRICT clip_flags,
+                            size_t count);
+
+// Rays from the near plane through each pixel (window coordinates in
+// the same convention as project_points) with unit length directions.
+M3D_DEF void unproject_rays(Mat4 const &inv_view_proj, Viewport const &vp,
+                            Vec2 const *M3D_RESTRICT pixels,
+                            Ray        *M3D_RESTRICT rays,
+                            size_t count);
+
+M3D_DEF Mat3 mat3(Mat4 const &A);
+M3D_DEF Mat3 transpose(Mat3 const &A);
+M3D_DEF Mat3 inverse(Mat3 const &A, bool *isInvertible = nullptr);
+M3D_DEF Mat3 operator * (Mat3 const &A, Mat3 const &B);
+M3D_DEF Vec3 operator * (Mat3 const &A, Vec3 b);
+
+// Cofactor matrix of the upper 3x3 of A which is the inverse
+// transpose scaled by the determinant.  Normals transformed by it
+// only need renormalizing, but point the other way when A mirrors.
+M3D_DEF Mat3 normal_matrix(Mat4 const &A);
+M3D_DEF void normal_matrix(Mat4 const *M3D_RESTRICT in, Mat3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void transform_normals(Mat3 const &N, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+
+M3D_DEF Mat3x4 mat3x4(Mat4 const &A);
+M3D_DEF Mat3x4 inverse(Mat3x4 const &A, bool *isInvertible = nullptr);
+M3D_DEF Mat3x4 operator * (Mat3x4 const &A, Mat3x4 const &B);
+M3D_DEF Vec3   transform_point(Mat3x4 const &A, Vec3 p);
+M3D_DEF Vec3   transform_dir(Mat3x4 const &A, Vec3 d);
+M3D_DEF void   transform_points(Mat3x4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void   transform_dirs(Mat3x4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void   multiply(Mat3x4 const *M3D_RESTRICT A, Mat3x4 const *M3D_RESTRICT B, Mat3x4 *M3D_RESTRICT out, size_t count);
+M3D_DEF void   mat3x4(Mat4 const *M3D_RESTRICT in, Mat3x4 *M3D_RESTRICT out, size_t count);
+M3D_DEF void   mat4(Mat3x4 const *M3D_RESTRICT in, Mat4 *M3D_RESTRICT out, size_t count);
+M3D_DEF DualQuat dual_quat(float angle, Vec3 axis, Vec3 translation);
+M3D_DEF DualQuat dual_quat(Mat4 const &rigid);
+M3D_DEF DualQuat operator + (DualQuat const &a, DualQuat const &b);
+M3D_DEF DualQuat operator * (float scale, DualQuat const &a);
+M3D_DEF DualQuat operator * (DualQuat const &a, DualQuat const &b);
+M3D_DEF DualQuat normalize(DualQuat const &dq);
+M3D_DEF DualQuat blend(DualQuat const *dqs, float const *weights, size_t count);
+M3D_DEF Vec3     transform_point(DualQuat const &dq, Vec3 p);
+M3D_DEF Vec3     transform_dir(DualQuat const &dq, Vec3 d);
+M3D_DEF void     transform_points(DualQuat const &dq, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     transform_dirs(DualQuat const &dq, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+
+// Dual quaternion linear blend skinning with four influences per
+// vertex, i.e. joints[4*i + k] and weights[4*i + k] for vertex i.
+// Normals are optional and both normal pointers may be null.
+M3D_DEF void skin(DualQuat const *M3D_RESTRICT palette,
+                  uint16_t const *M3D_RESTRICT joints,
+                  float    const *M3D_RESTRICT weights,
+                  Vec3     const *M3D_RESTRICT positions,
+                  Vec3     const *M3D_RESTRICT normals,
+                  Vec3           *M3D_RESTRICT out_positions,
+                  Vec3           *M3D_RESTRICT out_normals,
+                  size_t count);
+
+
+// Local translation, rotation (quaternion as in DualQuat), and scale
+// of a node which compose as translate * rotate * scale.
+struct Transform {
+    Vec3 translation;
+    Vec4 rotation;
+    Vec3 scale;
+};
+
+// Flat transform hierarchy over caller owned arrays of count nodes.
+// Nodes must be sorted by depth with every parent at a lower index
+// than its children and a parent of -1 for roots.  After filling in
+// the arrays call hierarchy_build_levels which groups the nodes into
+// levels, level L spanning [level_starts[L], level_starts[L+1]), so
+// level_starts must have room for one more entry than there are
+// levels.  Nodes within a level are independent of each other and
+// are updated in parallel when compiled with OpenMP.
+struct Hierarchy {
+    int32_t   *parents;
+    Transform *locals;
+    Mat4      *worlds;
+    uint8_t   *dirty;
+    uint32_t  *level_starts;
+    size_t     count;
+    size_t     level_count;
+    size_t     max_levels;
+};
+
+M3D_DEF Transform transform(Vec3 translation, float angle, Vec3 axis, Vec3 scale);
+M3D_DEF Mat4      mat4(Transform const &t);
+M3D_DEF bool      hierarchy_build_levels(Hierarchy *h);
+M3D_DEF void      hierarchy_set_local(Hierarchy *h, size_t node, Transform const &local);
+M3D_DEF void      hierarchy_update(Hierarchy *h);
+M3D_DEF void      hierarchy_update_all(Hierarchy *h);
+
+
+M3D_DEF uint16_t to_half(float f);
+M3D_DEF Half2    to_half(Vec2 v);
+M3D_DEF Half3    to_half(Vec3 v);
+M3D_DEF Half4    to_half(Vec4 v);
+M3D_DEF float    from_half(uint16_t h);
+M3D_DEF Vec2     from_half(Half2 h);
+M3D_DEF Vec3     from_half(Half3 h);
+M3D_DEF Vec4     from_half(Half4 h);
+M3D_DEF void     to_half(float const *M3D_RESTRICT in, uint16_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     to_half(Vec2 const *M3D_RESTRICT in, Half2 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     to_half(Vec3 const *M3D_RESTRICT in, Half3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     to_half(Vec4 const *M3D_RESTRICT in, Half4 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     from_half(uint16_t const *M3D_RESTRICT in, float *M3D_RESTRICT out, size_t count);
+M3D_DEF void     from_half(Half2 const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     from_half(Half3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     from_half(Half4 const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count);
+
+// Octahedral encoding of unit vectors into two snorm components,
+// the x component in the low bits and y in the high bits.  With
+// round to nearest quantization the maximum angular error measured
+// over the sphere is below 0.004 degrees for 2x16 bits and below 0.96
+// degrees for 2x8 bits.
+M3D_DEF uint32_t encode_oct16(Vec3 n);
+M3D_DEF Vec3     decode_oct16(uint32_t p);
+M3D_DEF uint16_t encode_oct8(Vec3 n);
+M3D_DEF Vec3     decode_oct8(uint16_t p);
+M3D_DEF void     encode_oct16(Vec3 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     decode_oct16(uint32_t const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     encode_oct8(Vec3 const *M3D_RESTRICT in, uint16_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     decode_oct8(uint16_t const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count);
+
+// Fixed point quantization with the first component in the low bits.
+// Values are clamped to [-1, 1] for snorm and [0, 1] for unorm.
+M3D_DEF uint32_t pack_snorm16(Vec2 v);
+M3D_DEF uint32_t pack_unorm16(Vec2 v);
+M3D_DEF uint32_t pack_snorm8(Vec4 v);
+M3D_DEF uint32_t pack_unorm8(Vec4 v);
+M3D_DEF Vec2     unpack_snorm16(uint32_t p);
+M3D_DEF Vec2     unpack_unorm16(uint32_t p);
+M3D_DEF Vec4     unpack_snorm8(uint32_t p);
+M3D_DEF Vec4     unpack_unorm8(uint32_t p);
+M3D_DEF void     pack_snorm16(Vec2 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     pack_unorm16(Vec2 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     pack_snorm8(Vec4 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     pack_unorm8(Vec4 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count);
+M3D_DEF void     unpack_snorm16(uint32_t const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     unpack_unorm16(uint32_t const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     unpack_snorm8(uint32_t const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count);
+M3D_DEF void     unpack_unorm8(uint32_t const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count);
+
+// Axis aligned box, boxes built from no points are inverted (min
+// greater than max) so they grow correctly when merged.
+struct AABB {
+    Vec3 min;
+    Vec3 max;
+};
+
+// Nearest hit of a ray, t is the distance limit on input and the hit
+// distance on output.  The hit point is (1 - u - v) * a + u * b + v * c
+// for the triangle (a, b, c) at index prim.
+struct RayHit {
+    float    t;
+    float    u, v;
+    uint32_t prim;
+};
+
+// Rays in struct of arrays form, one ray per lane.  The inverse
+// direction is filled in by ray_packet and t, u, v, and prim hold the
+// nearest hit of each lane as in RayHit.  Hit masks returned by the
+// packet tests have bit i set when lane i hit.
+struct RayPacket4 {
+    float    ox[4], oy[4], oz[4];
+    float    dx[4], dy[4], dz[4];
+    float    ix[4], iy[4], iz[4];
+    float    t[4];
+    float    u[4], v[4];
+    uint32_t prim[4];
+};
+
+struct RayPacket8 {
+    float    ox[8], oy[8], oz[8];
+    float    dx[8], dy[8], dz[8];
+    float    ix[8], iy[8], iz[8];
+    float    t[8];
+    float    u[8], v[8];
+    uint32_t prim[8];
+};
+
+M3D_DEF AABB aabb(Vec3 const *points, size_t count);
+M3D_DEF AABB merge(AABB const &a, AABB const &b);
+
+// Slab test of the ray segment [0, t_max] against the box, the entry
+// distance (zero when the origin is inside) is written to t_near.
+M3D_DEF bool intersect(Ray const &ray, AABB const &box, float t_max, float *t_near = nullptr);
+
+// Moller-Trumbore test against the triangle (a, b, c) from either side,
+// hits behind the origin are rejected.
+M3D_DEF bool intersect(Ray const &ray, Vec3 a, Vec3 b, Vec3 c, float *t, float *u, float *v);
+
+// Triangle soups store triangle i as triangles[3*i + 0..2].  The
+// nearest hit closer than hit->t is written to hit and true is
+// returned when there was one.
+M3D_DEF bool intersect_nearest(Ray const &ray, Vec3 const *M3D_RESTRICT triangles, size_t count, RayHit *hit);
+
+// Packs up to 4 or 8 rays with a distance limit of t_max, lanes past
+// count are disabled and never report hits.
+M3D_DEF void     ray_packet(Ray const *rays, size_t count, float t_max, RayPacket4 *packet);
+M3D_DEF void     ray_packet(Ray const *rays, size_t count, float t_max, RayPacket8 *packet);
+M3D_DEF uint32_t intersect(RayPacket4 const &packet, AABB const &box);
+M3D_DEF uint32_t intersect(RayPacket8 const &packet, AABB const &box);
+M3D_DEF uint32_t intersect_nearest(RayPacket4 *packet, Vec3 const *M3D_RESTRICT triangles, size_t count);
+M3D_DEF uint32_t intersect_nearest(RayPacket8 *packet, Vec3 const *M3D_RESTRICT triangles, size_t count);
+
+enum {
+    M3D_BVH_LEAF_SIZE = 4,      // most primitives in a leaf
+    M3D_BVH_MAX_DEPTH = 64,     // traversal stacks hold 4 times this
+    M3D_BVH_EMPTY     = -1      // child of an unused node slot
+};
+
+// Four wide BVH node of 128 bytes, allocating the node array on a 64
+// byte boundary keeps every node on two cache lines.  The child boxes
+// are stored as struct of arrays so a ray or box is tested against all
+// four at once.  A child with count == 0 is the inner node
+// nodes[child] while count > 0 is a leaf of the primitives
+// prims[child .. child + count).  Unused slots have an inverted box,
+// count == 0, and child == M3D_BVH_EMPTY.
+struct BVHNode {
+    float    min_x[4], min_y[4], min_z[4];
+    float    max_x[4], max_y[4], max_z[4];
+    uint32_t child[4];
+    uint32_t count[4];
+};
+
+// Bounding volume hierarchy over caller owned arrays, nodes needs
+// room for bvh_max_nodes(prim_count) nodes and prims for prim_count
+// indices.  The root is nodes[0].  costs is optional and, when set,
+// has room for one float per node in which the build records the
+// surface area heuristic cost of every subtree for bvh_degraded.  The
+// functions below write through costs whenever it is not null, so set
+// a BVH up with bvh_init, or zero-initialize it, before the first
+// build.
+struct BVH {
+    BVHNode  *nodes;
+    uint32_t *prims;
+    float    *costs;
+    size_t    node_count;
+    size_t    prim_count;
+    AABB      bounds;
+};
+
+// Top down binned SAH build, the scratch memory must be at least
+// bvh_scratch_size(count) bytes and aligned for floats.  The levels of
+// the tree are built one after the other, with the nodes of a level
+// built in parallel, or for the first few levels the binning of each
+// node split across threads, when compiled with OpenMP.
+M3D_DEF void   bvh_init(BVH *bvh, BVHNode *nodes, uint32_t *prims, float *costs = nullptr);
+M3D_DEF size_t bvh_max_nodes(size_t prim_count);
+M3D_DEF size_t bvh_scratch_size(size_t prim_count);
+M3D_DEF void   bvh_build(BVH *bvh, AABB const *M3D_RESTRICT boxes, size_t count, void *scratch);
+M3D_DEF void   bvh_build(BVH *bvh, Vec3 const *M3D_RESTRICT triangles, size_t count, void *scratch);
+
+// Recomputes the boxes bottom up after the primitives moved, keeping
+// the tree as it is.  Subtrees below the top few nodes are refit in
+// parallel when compiled with OpenMP.
+M3D_DEF void bvh_refit(BVH *bvh, AABB const *M3D_RESTRICT boxes);
+M3D_DEF void bvh_refit(BVH *bvh, Vec3 const *M3D_RESTRICT triangles);
+
+// Refitting keeps the tree valid but its quality drops as primitives
+// drift apart.  bvh_degraded finds the topmost subtrees whose surface
+// area heuristic cost grew by more than a factor of max_growth (e.g.
+// 1.5) since they were built, it needs costs and returns the total
+// like bvh_overlap.  bvh_rebuild rebuilds one such subtree from the
+// positions it was last refit with.  It appends new nodes to the node
+// array and returns false without changing anything when there is no
+// room left, in which case build the whole tree again.
+M3D_DEF size_t bvh_degraded(BVH const &bvh, float max_growth, uint32_t *M3D_RESTRICT out, size_t max_out);
+M3D_DEF bool   bvh_rebuild(BVH *bvh, uint32_t node, AABB const *M3D_RESTRICT boxes, void *scratch);
+M3D_DEF bool   bvh_rebuild(BVH *bvh, uint32_t node, Vec3 const *M3D_RESTRICT triangles, void *scratch);
+
+// Nearest hit of rays against the triangle soup the BVH was built
+// from, hit->t is the distance limit on input as in intersect_nearest.
+// The array version traces the rays in parallel.
+M3D_DEF bool bvh_intersect(BVH const &bvh, Vec3 const *M3D_RESTRICT triangles, Ray const &ray, RayHit *hit);
+M3D_DEF void bvh_intersect(BVH const &bvh, Vec3 const *M3D_RESTRICT triangles,
+                           Ray const *M3D_RESTRICT rays, RayHit *M3D_RESTRICT hits, size_t count);
+
+// Primitives in leaves whose boxes overlap box.  At most max_out of
+// them are written to out but the total is returned, the primitives
+// themselves are not tested so these are only candidates.
+M3D_DEF size_t bvh_overlap(BVH const &bvh, AABB const &box, uint32_t *M3D_RESTRICT out, size_t max_out);
+
+// Morton codes of positions quantized to a grid over bounds, 10 bits
+// per axis for 30 bit codes and 21 bits per axis for 63 bit codes,
+// with x in the lowest bit of each group of three.  Positions outside
+// of bounds are clamped to it.
+M3D_DEF uint32_t morton30(AABB const &bounds, Vec3 p);
+M3D_DEF uint64_t morton63(AABB const &bounds, Vec3 p);
+M3D_DEF void     morton30(AABB const &bounds, Vec3 const *M3D_RESTRICT points, uint32_t *M3D_RESTRICT codes, size_t count);
+M3D_DEF void     morton63(AABB const &bounds, Vec3 const *M3D_RESTRICT points, uint64_t *M3D_RESTRICT codes, size_t count);
+
+// Stable least significant digit radix sort of codes, eight bits per
+// pass, which also fills order with the original index of each sorted
+// code.  Passes over bytes that are the same in every code are
+// skipped.  The scratch memory must be at least
+// radix_sort_scratch_size(count) bytes and 8 byte aligned.
+M3D_DEF size_t radix_sort_scratch_size(size_t count);
+M3D_DEF void   radix_sort(uint32_t *M3D_RESTRICT codes, uint32_t *M3D_RESTRICT order, size_t count, void *scratch);
+M3D_DEF void   radix_sort(uint64_t *M3D_RESTRICT codes, uint32_t *M3D_RESTRICT order, size_t count, void *scratch);
+
+// Gathers out[i] = in[order[i]] for elements of element_size bytes so
+// any number of attribute arrays can follow the sorted codes.
+M3D_DEF void reorder(uint32_t const *M3D_RESTRICT order, void const *M3D_RESTRICT in, void *M3D_RESTRICT out,
+                     size_t element_size, size_t count);
+
+// Uniform grid of cubic cells hashed into a power of two table of
+// buckets, over caller owned arrays.  points and indices need room for
+// point_count entries and cells for hash_grid_table_size(point_count)
+// + 1.  hash_grid_build stores the points sorted by bucket, with
+// indices holding the original index of each, so the points of bucket
+// b are points[cells[b] .. cells[b + 1]).  Queries are fastest with a
+// cell size close to the usual query radius.
+struct HashGrid {
+    Vec3     *points;
+    uint32_t *indices;
+    uint32_t *cells;
+    size_t    point_count;
+    size_t    table_size;
+    float     cell_size;
+    AABB      bounds;
+};
+
+// The build is a parallel counting sort of the points by bucket with
+// radix_sort, the scratch memory must be at least
+// hash_grid_scratch_size(count) bytes and 8 byte aligned.
+M3D_DEF size_t hash_grid_table_size(size_t point_count);
+M3D_DEF size_t hash_grid_scratch_size(size_t point_count);
+M3D_DEF void   hash_grid_build(HashGrid *grid, Vec3 const *M3D_RESTRICT points, size_t count, float cell_size, void *scratch);
+
+// Original indices of the points within radius of center.  At most
+// max_out of them are written to out but the total is returned.
+M3D_DEF size_t hash_grid_radius(HashGrid const &grid, Vec3 center, float radius, uint32_t *M3D_RESTRICT out, size_t max_out);
+
+// The k points nearest to p, closest first, with their squared
+// distances, returning how many were found which is only less than k
+// when the grid holds fewer points.  The array version answers count
+// queries in parallel, writing k results per query and filling the
+// unused ones with ~0u and the largest float.
+M3D_DEF size_t hash_grid_nearest(HashGrid const &grid, Vec3 p, size_t k,
+                                 uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq);
+M3D_DEF void   hash_grid_nearest(HashGrid const &grid, Vec3 const *M3D_RESTRICT queries, size_t count, size_t k,
+                                 uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq);
+
+// Merges each vertex into the lowest numbered kept vertex within eps
+// of it, vertices without one are kept.  Every vertex ends up within
+// eps of the one it was merged into, so a chain of vertices less than
+// eps apart is not collapsed into its first vertex.  The kept vertices
+// are moved to the front of points, in their original order, and
+// their number is returned.  remap[i] is the new
+// index of vertex i.  The scratch memory must be at least
+// weld_vertices_scratch_size(count) bytes and 8 byte aligned.
+M3D_DEF size_t weld_vertices_scratch_size(size_t count);
+M3D_DEF size_t weld_vertices(Vec3 *points, size_t count, float eps, uint32_t *M3D_RESTRICT remap, void *scratch);
+
+enum {
+    M3D_KDTREE_LEAF_SIZE = 16   // point slots in a leaf
+};
+
+// Balanced k-d tree over caller owned arrays.  There are
+// kdtree_leaf_count(point_count) leaves, a power of two, each holding 8
+// to 16 points in M3D_KDTREE_LEAF_SIZE slots, so x, y, z, and indices
+// need room for leaf_count * M3D_KDTREE_LEAF_SIZE entries.  Leaf j is
+// slots [16 j, 16 j + 16) with unused slots far away and indexed ~0u.
+// The leaf_count - 1 inner nodes are stored in heap order, node i has
+// the children 2 i + 1 and 2 i + 2 and splits[i] along axes[i] (0 for
+// x, 1 for y, 2 for z), so splits and axes need room for leaf_count - 1
+// entries.  The leaves are the nodes after the inner ones.
+struct KDTree {
+    float    *x;
+    float    *y;
+    float    *z;
+    uint32_t *indices;
+    float    *splits;
+    uint8_t  *axes;
+    size_t    point_count;
+    size_t    leaf_count;
+    AABB      bounds;
+};
+
+// Splits at the median along the longest side of each node, building
+// the nodes of each level in parallel when compiled with OpenMP.  The
+// scratch memory must be at least kdtree_scratch_size(count) bytes and
+// aligned for floats.
+M3D_DEF size_t kdtree_leaf_count(size_t point_count);
+M3D_DEF size_t kdtree_scratch_size(size_t point_count);
+M3D_DEF void   kdtree_build(KDTree *tree, Vec3 const *M3D_RESTRICT points, size_t count, void *scratch);
+
+// Exact k nearest neighbour and radius queries, which behave like
+// hash_grid_nearest and hash_grid_radius.  The array versions answer
+// count queries in parallel.  The batched radius query writes at most
+// max_out indices per query to out + i * max_out and the total of
+// query i to totals[i].
+M3D_DEF size_t kdtree_nearest(KDTree const &tree, Vec3 p, size_t k,
+                              uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq);
+M3D_DEF void   kdtree_nearest(KDTree const &tree, Vec3 const *M3D_RESTRICT queries, size_t count, size_t k,
+                              uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq);
+M3D_DEF size_t kdtree_radius(KDTree const &tree, Vec3 center, float radius, uint32_t *M3D_RESTRICT out, size_t max_out);
+M3D_DEF void   kdtree_radius(KDTree const &tree, Vec3 const *M3D_RESTRICT centers, size_t count, float radius,
+                             uint32_t *M3D_RESTRICT out, size_t max_out, uint32_t *M3D_RESTRICT totals);
+
+// Signed singular value decomposition A = U * diag(sigma) * V^T with U
+// and V rotations and sigma sorted by magnitude, largest first.  Only
+// sigma.z can be negative, when A mirrors, so U * transpose(V) is the
+// rotation nearest to A as needed by shape matching and Kabsch
+// alignment.  The decomposition goes through a Jacobi eigensolve of
+// A^T A, so singular values much smaller than the largest lose
+// precision.
+M3D_DEF void svd(Mat3 const &A, Mat3 *U, Vec3 *sigma, Mat3 *V);
+M3D_DEF void svd(Mat3 const *M3D_RESTRICT A, Mat3 *M3D_RESTRICT U, Vec3 *M3D_RESTRICT sigma, Mat3 *M3D_RESTRICT V,
+                 size_t count);
+
+// Eigenvalues of the symmetric matrix A, largest first, and the
+// rotation whose columns are the matching eigenvectors.
+M3D_DEF void eigen_symmetric(Mat3 const &A, Vec3 *values, Mat3 *vectors);
+M3D_DEF void eigen_symmetric(Mat3 const *M3D_RESTRICT A, Vec3 *M3D_RESTRICT values, Mat3 *M3D_RESTRICT vectors,
+                             size_t count);
+
+// Oriented box, the columns of axes are the unit box axes and
+// half_extents the half sizes along them.
+struct OBB {
+    Vec3 center;
+    Mat3 axes;
+    Vec3 half_extents;
+};
+
+// Planes of a view frustum with normals of unit length pointing
+// inwards, i.e. point p is on the inside of plane i when
+// nx[i] * p.x + ny[i] * p.y + nz[i] * p.z + d[i] >= 0.  The left,
+// right, bottom, top, near, and far planes come first in the order of
+// the M3D_CLIP bits, planes 6 and 7 pad to eight lanes and never cull.
+struct Frustum {
+    float nx[8], ny[8], nz[8], d[8];
+};
+
+// Planes from a view projection matrix with the OpenGL clip volume of
+// -w <= x, y, z <= w, e.g. perspectiveGL(...) * view.
+M3D_DEF Frustum frustum(Mat4 const &view_proj);
+
+// Covariance (divided by count) of the points about their mean, which
+// is written to mean when it is not null.  The sums are done in double
+// precision over chunks that are added up in parallel.
+M3D_DEF Mat3 covariance(Vec3 const *points, size_t count, Vec3 *mean = nullptr);
+
+// Box along the eigenvectors of the covariance of the points, or the
+// axis aligned box when that is smaller, as happens for evenly spread
+// points where the principal axes are not well defined.  Boxes of
+// about the same volume, e.g. around flat point sets, are compared by
+// surface area.
+M3D_DEF OBB obb(Vec3 const *points, size_t count);
+
+// A box is culled only when it lies fully outside one of the planes,
+// so boxes near the frustum corners can be kept although they are
+// outside.  The array versions test count boxes at once, eight to a
+// register, and write 1 to visible or overlap for each box or pair a[i]
+// and b[i] that passes, 0 otherwise.
+M3D_DEF bool intersect(Frustum const &frustum, OBB const &box);
+M3D_DEF void intersect(Frustum const &frustum, OBB const *M3D_RESTRICT boxes, uint8_t *M3D_RESTRICT visible,
+                       size_t count);
+
+// Separating axis test over the 3 + 3 face normals and 9 edge cross
+// products of the two boxes.
+M3D_DEF bool intersect(OBB const &a, OBB const &b);
+M3D_DEF void intersect(OBB const *M3D_RESTRICT a, OBB const *M3D_RESTRICT b, uint8_t *M3D_RESTRICT overlap,
+                       size_t count);
+
+// Bounding sphere, a negative radius marks an empty sphere which
+// merges like an inverted AABB.
+struct Sphere {
+    Vec3  center;
+    float radius;
+};
+
+// Spheres in struct of arrays form with sphere i at
+// (x[i], y[i], z[i]) and of radius[i].
+struct Spheres {
+    float *x;
+    float *y;
+    float *z;
+    float *radius;
+};
+
+// Approximate bounding sphere in the manner of EPOS and Ritter.  The
+// two furthest apart of the extreme points along 7 directions span the
+// initial sphere, which is then grown towards the point furthest
+// outside of it until all points are inside.  Every pass over the
+// points runs in parallel and the result is usually within a few
+// percent of the smallest sphere.  No points give an empty sphere.
+M3D_DEF Sphere sphere(Vec3 const *points, size_t count);
+M3D_DEF Sphere merge(Sphere const &a, Sphere const &b);
+
+// The radius is scaled by a bound on the largest stretch of the upper
+// 3x3 of A, which is its longest column for rotations and scales, so
+// the result bounds the transformed sphere under any scale or shear.
+// The array version transforms sphere i by matrices[i].
+M3D_DEF Sphere transform_sphere(Mat4 const &A, Sphere const &s);
+M3D_DEF void   transform_spheres(Mat4 const *M3D_RESTRICT matrices, Sphere const *M3D_RESTRICT in,
+                                 Sphere *M3D_RESTRICT out, size_t count);
+
+// Touching spheres overlap.  The pairwise version writes 1 to overlap
+// when sphere i of a overlaps sphere i of b and 0 otherwise.  The
+// query version writes the indices of at most max_out of the count
+// spheres overlapping s to out, in order, and returns how many there
+// are in total.
+M3D_DEF bool   intersect(Sphere const &a, Sphere const &b);
+M3D_DEF void   intersect(Spheres const &a, Spheres const &b, uint8_t *M3D_RESTRICT overlap, size_t count);
+M3D_DEF size_t intersect(Sphere const &s, Spheres const &spheres, size_t count,
+                         uint32_t *M3D_RESTRICT out, size_t max_out);
+
+// Caller owned state of an incremental sort and sweep broadphase over
+// count boxes.  order holds the box indices sorted by their minimum
+// along axis and is kept from one update to the next, so boxes that
+// only moved a little are sorted again in close to linear time.
+// bounds needs room for sort_sweep_bounds_size(count) floats and holds
+// the sorted boxes in struct of arrays form during an update.
+struct SortSweep {
+    uint32_t *order;
+    float    *bounds;
+    size_t    count;
+    int       axis;
+};
+
+// Picks the axis along which the box centers spread the most and fully
+// sorts the boxes along it.  The scratch memory must be at least
+// sort_sweep_scratch_size(count) bytes and 8 byte aligned.
+M3D_DEF size_t sort_sweep_bounds_size(size_t count);
+M3D_DEF size_t sort_sweep_scratch_size(size_t count);
+M3D_DEF void   sort_sweep_init(SortSweep *sweep, AABB const *boxes, size_t count, void *scratch);
+
+// Sorts the moved boxes again by insertion and sweeps along axis,
+// testing the other two axes of eight boxes at a time.  Each
+// overlapping pair (touching counts) is written once with the smaller
+// index first as pairs[2 k] and pairs[2 k + 1], at most max_pairs of
+// them, and the total number of pairs is returned.
+M3D_DEF size_t sort_sweep_update(SortSweep *sweep, AABB const *M3D_RESTRICT boxes,
+                                 uint32_t *M3D_RESTRICT pairs, size_t max_pairs);
+
+// Segment from a to b swept by a sphere of radius.
+struct Capsule {
+    Vec3  a;
+    Vec3  b;
+    float radius;
+};
+
+// Convex hull vertices in struct of arrays form.
+struct Hull {
+    float const *x;
+    float const *y;
+    float const *z;
+    size_t       count;
+};
+
+// A convex shape for gjk and epa given by its support function, which
+// returns the point of the shape furthest along direction (not
+// necessarily of unit length).  shape is passed through to support and
+// the optional transform places the shape, since the support of A * S
+// along d is A applied to the support of S along transpose(A) * d this
+// works for any scale or shear.
+struct Convex {
+    Vec3          (*support)(void const *shape, Vec3 direction);
+    void const     *shape;
+    Mat3x4 const   *transform;
+};
+
+// Support functions for shape pointing to a Vec3, Sphere, OBB,
+// Capsule, or Hull.  The hull version searches eight vertices at a
+// time and handles up to 2^24 vertices.
+M3D_DEF Vec3 support_point(void const *point, Vec3 direction);
+M3D_DEF Vec3 support_sphere(void const *sphere, Vec3 direction);
+M3D_DEF Vec3 support_obb(void const *box, Vec3 direction);
+M3D_DEF Vec3 support_capsule(void const *capsule, Vec3 direction);
+M3D_DEF Vec3 support_hull(void const *hull, Vec3 direction);
+M3D_DEF Vec3 support(Convex const &shape, Vec3 direction);
+
+// Simplex of the Minkowski difference a - b, vertex k being a[k] - b[k]
+// with a[k] and b[k] the supports of the shapes along dirs[k] and
+// -dirs[k].  A zeroed simplex starts gjk from scratch.  Passing the
+// simplex of the previous frame warm starts gjk, as its directions are
+// evaluated again on the moved shapes, which usually leaves one or two
+// iterations to do.
+struct GjkSimplex {
+    Vec3 a[4];
+    Vec3 b[4];
+    Vec3 dirs[4];
+    int  count;
+};
+
+// Closest points of separated shapes, or the deepest points of
+// overlapping ones, with the unit normal pointing from a to b.
+// distance is the separation, negative for a penetration, and moving b
+// by -distance * normal makes overlapping shapes touch.
+struct ConvexResult {
+    Vec3  point_a;
+    Vec3  point_b;
+    Vec3  normal;
+    float distance;
+};
+
+// Gilbert, Johnson, and Keerthi's distance algorithm.  Returns true
+// when the shapes overlap, in which case only a distance of zero is
+// written to result and epa can take the simplex to find the
+// penetration.
+M3D_DEF bool gjk(Convex const &a, Convex const &b, GjkSimplex *simplex, ConvexResult *result);
+
+// Expanding polytope penetration depth from the simplex of an
+// overlapping gjk call.  Round shapes are approximated by at most 64
+// support points.  Returns false, with a distance of zero, when the
+// shapes only touch or are flat so no polytope can be built.
+M3D_DEF bool epa(Convex const &a, Convex const &b, GjkSimplex const &simplex, ConvexResult *result);
+
+// Particles in struct of arrays form with particle i at
+// (x[i], y[i], z[i]).  integrate_euler moves them with the velocities
+// vx, vy, vz or, when vx is null, with the half precision velocities
+// hvx, hvy, hvz.  integrate_verlet takes the velocity from the previous
+// positions px, py, pz instead and leaves the velocity arrays alone.
+struct Particles {
+    float    *x;
+    float    *y;
+    float    *z;
+    float    *vx;
+    float    *vy;
+    float    *vz;
+    uint16_t *hvx;
+    uint16_t *hvy;
+    uint16_t *hvz;
+    float    *px;
+    float    *py;
+    float    *pz;
+};
+
+// drag is the fraction of the velocity lost per second, speeds are
+// clamped to max_speed and positions to the box between lower and
+// upper.  FLT_MAX from <float.h>, negated for lower, leaves either
+// unclamped.
+struct ParticleForces {
+    Vec3  gravity;
+    float drag;
+    float max_speed;
+    Vec3  lower;
+    Vec3  upper;
+};
+
+// One step of dt seconds for count particles, gravity, drag, and the
+// clamps applied in the same pass over the arrays.  Semi-implicit Euler
+// updates the velocity first and moves with the new one.
+M3D_DEF void integrate_euler(Particles const &particles, ParticleForces const &forces, float dt, size_t count);
+M3D_DEF void integrate_verlet(Particles const &particles, ParticleForces const &forces, float dt, size_t count);
+
+// Three copies of count transforms shared between one writer thread
+// and one reader thread without locks.  The writer fills the slot from
+// transform_buffer_write and hands it over with transform_buffer_publish,
+// a single atomic exchange.  transform_buffer_read gives the reader the
+// most recently published slot, which stays untouched until its next
+// call, so it never waits and never sees a half written frame.
+//
+// The write slot holds the transforms of two frames ago, so the writer
+// has to write all count transforms each frame, e.g. by pointing a
+// Hierarchy's worlds at it before hierarchy_update_all.
+struct TransformBuffer {
+    Mat4     *slots[3];
+    size_t    count;
+    uint32_t  back;     // writer's slot
+    uint32_t  middle;   // last published slot, exchanged by both threads
+    uint32_t  front;    // reader's slot
+};
+
+// storage holds 3 * count transforms, all set to the identity.
+M3D_DEF void        transform_buffer_init(TransformBuffer *buffer, Mat4 *storage, size_t count);
+M3D_DEF Mat4       *transform_buffer_write(TransformBuffer *buffer);
+M3D_DEF void        transform_buffer_publish(TransformBuffer *buffer);
+M3D_DEF Mat4 const *transform_buffer_read(TransformBuffer *buffer);
+
+enum {
+    M3D_CACHE_LINE         = 64,
+    M3D_PAGES_HUGE         = 1 << 0,   // 2 MB pages when the OS has them
+    M3D_PAGES_FIRST_TOUCH  = 1 << 1    // fault pages in from the OpenMP threads
+};
+
+// Page aligned memory straight from the OS, or null.  M3D_PAGES_HUGE
+// asks for huge pages (MAP_HUGETLB, then transparent huge pages through
+// madvise on Linux, MEM_LARGE_PAGES on Windows) and falls back to
+// normal pages.  M3D_PAGES_FIRST_TOUCH writes every page from a static
+// OpenMP loop so on NUMA machines each thread's share of the memory is
+// placed on its node, the same share M3D_PARALLEL_FOR gives it in the
+// batched functions.  pages_free takes the size and flags passed to
+// pages_alloc.
+M3D_DEF void *pages_alloc(size_t size, uint32_t flags);
+M3D_DEF void  pages_free(void *memory, size_t size, uint32_t flags);
+
+// Linear allocator over caller owned memory, e.g. from pages_alloc,
+// for per frame arrays and the scratch memory of the batched
+// functions.  arena_alloc returns null when the arena is full.
+// arena_reset frees everything allocated since arena->used was mark,
+// all of it by default.
+struct Arena {
+    unsigned char *base;
+    size_t         size;
+    size_t         used;
+};
+
+M3D_DEF void  arena_init(Arena *arena, void *memory, size_t size);
+M3D_DEF void *arena_alloc(Arena *arena, size_t size, size_t alignment = M3D_CACHE_LINE);
+M3D_DEF void  arena_reset(Arena *arena, size_t mark = 0);
+
+// Fixed size items from caller owned memory, each item_size rounded up
+// to a multiple of alignment (a power of two).  Freed items are reused
+// first, untouched memory is only handed out once the free list is
+// empty.  pool_alloc returns null when the pool is empty.
+struct Pool {
+    unsigned char *base;
+    size_t         item_size;
+    size_t         capacity;
+    size_t         unused;      // first item never handed out
+    void          *free_list;
+};
+
+M3D_DEF bool  pool_init(Pool *pool, void *memory, size_t size, size_t item_size, size_t alignment = M3D_CACHE_LINE);
+M3D_DEF void *pool_alloc(Pool *pool);
+M3D_DEF void  pool_free(Pool *pool, void *item);
 
 M3D_DEF float to_radians(float angle_in_degrees);
 M3D_DEF float clamp(float val, float a, float b);
 
 M3D_DEF float min_of(float a, float b);
 M3D_DEF Vec2  min_of(Vec2 a, Vec2 b);
+M3D_DEF Vec3  min_of(Vec3 a, Vec3 b);
 M3D_DEF float max_of(float a, float b);
 M3D_DEF Vec2  max_of(Vec2 a, Vec2 b);
+M3D_DEF Vec3  max_of(Vec3 a, Vec3 b);
 
 M3D_DEF float lerp(float t, float a, float b);
 M3D_DEF Vec2  lerp(float t, Vec2 a, Vec2 b);
@@ -172,10 +1088,46 @@ M3D_DEF Vec4  lerp(float t, Vec4 a, Vec4 b);
     #define M3D_TANF  tanf
     #define M3D_FABSF fabsf
     #define M3D_SQRTF sqrtf
+
+    #define M3D_COS   cos
+    #define M3D_SIN   sin
+    #define M3D_FABS  fabs
+    #define M3D_SQRT  sqrt
+#endif
+
+// Double precision versions that are not provided fall back to the
+// float ones, so only the DVec3, DVec4, and DMat4 functions using them
+// lose precision.
+#if !defined(M3D_COS)
+    #define M3D_COS(x)  double(M3D_COSF(float(x)))
+#endif
+#if !defined(M3D_SIN)
+    #define M3D_SIN(x)  double(M3D_SINF(float(x)))
+#endif
+#if !defined(M3D_FABS)
+    #define M3D_FABS(x) double(M3D_FABSF(float(x)))
+#endif
+#if !defined(M3D_SQRT)
+    #define M3D_SQRT(x) double(M3D_SQRTF(float(x)))
+#endif
+
+#if defined(M3D_USE_F16C) || defined(M3D_USE_AVX) || defined(M3D_USE_BMI2)
+    #include <immintrin.h>
 #endif
 
 const float M3D_PI           = 3.14159265359f;
 const float M3D_PI_DEG_RATIO = M3D_PI / 180.0f;
+const float M3D_FLOAT_MAX    = 3.402823466e+38f;
+
+#if defined(_OPENMP)
+    #if defined(_MSC_VER)
+        #define M3D_PARALLEL_FOR __pragma(omp parallel for schedule(static))
+    #else
+        #define M3D_PARALLEL_FOR _Pragma("omp parallel for schedule(static)")
+    #endif
+#else
+    #define M3D_PARALLEL_FOR
+#endif
 
 
 /**** BEGIN Miscellaneous definitions ****/
@@ -193,6 +1145,16 @@ inline M3D_DEF Vec2 max_of(Vec2 a, Vec2 b)
     return vec2(max_of(a.x, b.x), max_of(a.y, b.y));
 }
 
+inline M3D_DEF Vec3 min_of(Vec3 a, Vec3 b)
+{
+    return vec3(min_of(a.x, b.x), min_of(a.y, b.y), min_of(a.z, b.z));
+}
+
+inline M3D_DEF Vec3 max_of(Vec3 a, Vec3 b)
+{
+    return vec3(max_of(a.x, b.x), max_of(a.y, b.y), max_of(a.z, b.z));
+}
+
 inline M3D_DEF float to_radians(float angle_in_deg)
 {
     return angle_in_deg * M3D_PI_DEG_RATIO;
@@ -208,6 +1170,26 @@ inline M3D_DEF Vec2  lerp(float t, Vec2 a, Vec2 b)   { return ((1 - t) * a) + (t
 inline M3D_DEF Vec3  lerp(float t, Vec3 a, Vec3 b)   { return ((1 - t) * a) + (t * b); }
 inline M3D_DEF Vec4  lerp(float t, Vec4 a, Vec4 b)   { return ((1 - t) * a) + (t * b); }
 
+// Chunks of about 16k items for parallel reductions, at most
+// M3D_REDUCE_CHUNKS so the partial results fit in arrays on the stack.
+#define M3D_REDUCE_CHUNKS 64
+
+static inline int m3d_reduce_chunks(size_t count)
+{
+    size_t chunks = count / 16384;
+    return chunks < 1 ? 1 : (chunks > M3D_REDUCE_CHUNKS ? M3D_REDUCE_CHUNKS : int(chunks));
+}
+
+// Index of the lowest set bit of a nonzero mask.
+static inline int m3d_lowest_bit(uint32_t mask)
+{
+    int bit = 0;
+    while (!(mask & 1u)) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+}
 
 /**** END Miscellaneous definitions ****/
 
@@ -284,6 +1266,63 @@ M3D_DEF Mat4 perspectiveGL(float horiz_fov, float aspect_ht_over_wd, float n, fl
     return result;
 }
 
+M3D_DEF Mat4 inverse_orthoGL(float l, float r, float t, float b, float n, float f)
+{
+    Mat4 result = Mat4{};
+
+    // Main diagonal
+    result.at(0, 0) = (r - l) / 2.0f;
+    result.at(1, 1) = (t - b) / 2.0f;
+    result.at(2, 2) = -(f - n) / 2.0f;
+
+    // column 4
+    result.at(0, 3) = (r + l) / 2.0f;
+    result.at(1, 3) = (t + b) / 2.0f;
+    result.at(2, 3) = -(f + n) / 2.0f;
+    result.at(3, 3) = 1.0f;
+
+    return result;
+}
+
+M3D_DEF Mat4 inverse_perspectiveGL(float l, float r, float t, float b, float n, float f)
+{
+    Mat4 result = Mat4 {};
+
+    // x/y diagonal
+    result.at(0, 0) = (r - l) / (2*n);
+    result.at(1, 1) = (t - b) / (2*n);
+
+    // column 3
+    result.at(3, 2) = -(f - n) / (2*f*n);
+
+    // column 4
+    result.at(0, 3) = (r + l) / (2*n);
+    result.at(1, 3) = (t + b) / (2*n);
+    result.at(2, 3) = -1.0f;
+    result.at(3, 3) = (f + n) / (2*f*n);
+
+    return result;
+}
+
+M3D_DEF Mat4 inverse_perspectiveGL(float horiz_fov, float aspect_ht_over_wd, float n, float f)
+{
+    Mat4  result = Mat4 {};
+    float wd     = M3D_TANF(to_radians(horiz_fov / 2.0f));
+
+    // x/y diagonal
+    result.at(0, 0) = wd;
+    result.at(1, 1) = wd * aspect_ht_over_wd;
+
+    // column 3
+    result.at(3, 2) = -(f - n) / (2*f*n);
+
+    // column 4
+    result.at(2, 3) = -1.0f;
+    result.at(3, 3) = (f + n) / (2*f*n);
+
+    return result;
+}
+
 inline M3D_DEF Mat4 translate(float x, float y, float z)
 {
     Mat4 result = identity();
@@ -336,9 +1375,10 @@ inline M3D_DEF Mat4 scale(float x, float y, float z)
     return result;
 }
 
-M3D_DEF Mat4 inverse(Mat4 const &A, bool *isInvertible)
+// Adjugate of A into out, returning the determinant.
+static inline float m3d_adjugate(Mat4 *M3D_RESTRICT out, Mat4 const &A)
 {
-    Mat4 inv;
+    Mat4 &inv = *out;
 
     inv.at(0,0) = ((A.at(1,1) * A.at(2,2) * A.at(3,3)) - 
                    (A.at(1,1) * A.at(3,2) * A.at(2,3)) - 
@@ -452,10 +1492,16 @@ M3D_DEF Mat4 inverse(Mat4 const &A, bool *isInvertible)
                    (A.at(0,2) * A.at(1,0) * A.at(2,1)) - 
                    (A.at(0,2) * A.at(2,0) * A.at(1,1)));
 
-    float det = ((A.at(0,0) * inv.at(0,0)) +
-                 (A.at(1,0) * inv.at(0,1)) +
-                 (A.at(2,0) * inv.at(0,2)) +
-                 (A.at(3,0) * inv.at(0,3)));
+    return ((A.at(0,0) * inv.at(0,0)) +
+            (A.at(1,0) * inv.at(0,1)) +
+            (A.at(2,0) * inv.at(0,2)) +
+            (A.at(3,0) * inv.at(0,3)));
+}
+
+M3D_DEF Mat4 inverse(Mat4 const &A, bool *isInvertible)
+{
+    Mat4  inv;
+    float det = m3d_adjugate(&inv, A);
 
     if (M3D_FABSF(det) < M3D_INVERSE_MATRIX_EPSILON) {
         if (isInvertible != nullptr)
@@ -475,9 +1521,25 @@ M3D_DEF Mat4 inverse(Mat4 const &A, bool *isInvertible)
     return inv;
 }
 
+M3D_DEF bool inverse_inplace(Mat4 *A)
+{
+    Mat4  inv;
+    float det = m3d_adjugate(&inv, *A);
+
+    if (M3D_FABSF(det) < M3D_INVERSE_MATRIX_EPSILON)
+        return false;
+
+    det = 1.0f / det;
+
+    for (int i = 0; i < 16; ++i)
+        A->data[i] = inv.data[i] * det;
+
+    return true;
+}
+
 M3D_DEF Mat4 operator + (Mat4 const &A, Mat4 const &B)
 {
-    Mat4 result = Mat4 {};
+    Mat4 result;
 
     result.at(0,0) = A.at(0,0) + B.at(0,0);
     result.at(1,0) = A.at(1,0) + B.at(1,0);
@@ -499,22 +1561,68 @@ M3D_DEF Mat4 operator + (Mat4 const &A, Mat4 const &B)
     return result;
 }
 
-M3D_DEF Mat4 operator * (Mat4 const  &A, Mat4 const &B)
+M3D_DEF Mat4 operator - (Mat4 const &A, Mat4 const &B)
 {
-    Mat4 result = Mat4 {};
+    Mat4 result;
 
+    for (int i = 0; i < 16; ++i)
+        result.data[i] = A.data[i] - B.data[i];
+
+    return result;
+}
+
+// Each column of the result is a sum of the columns of A, which the
+// compiler keeps in vector registers as out cannot alias them.
+M3D_DEF void mul_into(Mat4 *M3D_RESTRICT out, Mat4 const &A, Mat4 const &B)
+{
     for (int c = 0; c < 4; ++c) {
+        float b0 = B.at(0, c);
+        float b1 = B.at(1, c);
+        float b2 = B.at(2, c);
+        float b3 = B.at(3, c);
+
         for (int r = 0; r < 4; ++r) {
-            result.at(r, c) = ((A.at(r, 0) * B.at(0, c)) +
-                               (A.at(r, 1) * B.at(1, c)) +
-                               (A.at(r, 2) * B.at(2, c)) +
-                               (A.at(r, 3) * B.at(3, c)));
+            out->at(r, c) = ((A.at(r, 0) * b0) +
+                             (A.at(r, 1) * b1) +
+                             (A.at(r, 2) * b2) +
+                             (A.at(r, 3) * b3));
         }
     }
+}
 
+M3D_DEF Mat4 operator * (Mat4 const  &A, Mat4 const &B)
+{
+    Mat4 result;
+    mul_into(&result, A, B);
     return result;
 }
 
+M3D_DEF Mat4& operator += (Mat4 &A, Mat4 const &B)
+{
+    for (int i = 0; i < 16; ++i)
+        A.data[i] += B.data[i];
+
+    return A;
+}
+
+M3D_DEF Mat4& operator -= (Mat4 &A, Mat4 const &B)
+{
+    for (int i = 0; i < 16; ++i)
+        A.data[i] -= B.data[i];
+
+    return A;
+}
+
+// mul_into keeps A and B in registers through its restrict out, which
+// beats writing A a row at a time with every store possibly changing B.
+M3D_DEF Mat4& operator *= (Mat4 &A, Mat4 const &B)
+{
+    Mat4 result;
+    mul_into(&result, A, B);
+    A = result;
+    return A;
+}
+
 M3D_DEF Vec4 operator * (Mat4 const &A, Vec4 const &b) {
     Vec4 result = Vec4 {};
 
@@ -527,297 +1635,6788 @@ M3D_DEF Vec4 operator * (Mat4 const &A, Vec4 const &b) {
 
     return result;
 }
-/**** END Mat4 definitions ****/
-
 
-/**** BEGIN Vec2 definitions ****/
-inline M3D_DEF Vec2 vec2(float x, float y)
+M3D_DEF void transform_points(Mat4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
 {
-    return Vec2 { x, y };
-}
+    Vec3 c0 = vec3(A.at(0,0), A.at(1,0), A.at(2,0));
+    Vec3 c1 = vec3(A.at(0,1), A.at(1,1), A.at(2,1));
+    Vec3 c2 = vec3(A.at(0,2), A.at(1,2), A.at(2,2));
+    Vec3 c3 = vec3(A.at(0,3), A.at(1,3), A.at(2,3));
 
-inline M3D_DEF Vec2 operator - (Vec2 a)
-{
-    return Vec2 { -a.x, -a.y };
-}
+    ptrdiff_t n = ptrdiff_t(count);
 
-inline M3D_DEF Vec2 operator - (Vec2 a, Vec2 b)
-{
-    return Vec2 { a.x - b.x, a.y - b.y };
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        Vec3 p = in[i];
+        out[i] = (c0 * p.x) + (c1 * p.y) + (c2 * p.z) + c3;
+    }
 }
 
-inline M3D_DEF Vec2 operator + (Vec2 a, Vec2 b)
+M3D_DEF void transform_points(Mat4 const &A, Vec4 const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count)
 {
-    return Vec2 { a.x + b.x, a.y + b.y };
-}
+    Vec4 c0 = vec4(A.at(0,0), A.at(1,0), A.at(2,0), A.at(3,0));
+    Vec4 c1 = vec4(A.at(0,1), A.at(1,1), A.at(2,1), A.at(3,1));
+    Vec4 c2 = vec4(A.at(0,2), A.at(1,2), A.at(2,2), A.at(3,2));
+    Vec4 c3 = vec4(A.at(0,3), A.at(1,3), A.at(2,3), A.at(3,3));
 
-inline M3D_DEF Vec2 operator * (float scale, Vec2 a)
-{
-    return Vec2 { scale * a.x, scale * a.y };
-}
+    ptrdiff_t n = ptrdiff_t(count);
 
-inline M3D_DEF Vec2 operator * (Vec2 a, float scale)
-{
-    return scale * a;
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        Vec4 p = in[i];
+        out[i] = (c0 * p.x) + (c1 * p.y) + (c2 * p.z) + (c3 * p.w);
+    }
 }
+/**** END Mat4 definitions ****/
 
-inline M3D_DEF Vec2 operator / (Vec2 a, float scale)
-{
-    return a * (1.0f / scale);
-}
 
-inline M3D_DEF Vec2& operator += (Vec2 &a, Vec2 b)
+/**** BEGIN Mat3 definitions ****/
+inline M3D_DEF Mat3 mat3(Mat4 const &A)
 {
-    a = a + b;
-    return a;
-}
+    Mat3 result;
 
-inline M3D_DEF Vec2& operator *= (Vec2 &a, float scale)
-{
-    a.x *= scale;
-    a.y *= scale;
-    return a;
-}
+    for (int c = 0; c < 3; ++c)
+        for (int r = 0; r < 3; ++r)
+            result.at(r, c) = A.at(r, c);
 
-inline M3D_DEF Vec2 hadamard(Vec2 a, Vec2 b)
-{
-    return Vec2{ a.x*b.x, a.y*b.y };
+    return result;
 }
 
-inline M3D_DEF float dot(Vec2 a, Vec2 b)
+inline M3D_DEF Mat4 mat4(Mat3 const &A)
 {
-    return a.x*b.x + a.y*b.y;
+    Mat4 result = identity();
+
+    for (int c = 0; c < 3; ++c)
+        for (int r = 0; r < 3; ++r)
+            result.at(r, c) = A.at(r, c);
+
+    return result;
 }
 
-inline M3D_DEF float len_sq(Vec2 v)
+inline M3D_DEF Mat3 transpose(Mat3 const &A)
 {
-    return dot(v, v);
+    Mat3 result;
+
+    for (int c = 0; c < 3; ++c)
+        for (int r = 0; r < 3; ++r)
+            result.at(r, c) = A.at(c, r);
+
+    return result;
 }
 
-inline M3D_DEF float length(Vec2 v)
+M3D_DEF Mat3 inverse(Mat3 const &A, bool *isInvertible)
 {
-    return M3D_SQRTF(len_sq(v));
+    Mat3 inv;
+
+    inv.at(0,0) = A.at(1,1) * A.at(2,2) - A.at(1,2) * A.at(2,1);
+    inv.at(0,1) = A.at(0,2) * A.at(2,1) - A.at(0,1) * A.at(2,2);
+    inv.at(0,2) = A.at(0,1) * A.at(1,2) - A.at(0,2) * A.at(1,1);
+    inv.at(1,0) = A.at(1,2) * A.at(2,0) - A.at(1,0) * A.at(2,2);
+    inv.at(1,1) = A.at(0,0) * A.at(2,2) - A.at(0,2) * A.at(2,0);
+    inv.at(1,2) = A.at(0,2) * A.at(1,0) - A.at(0,0) * A.at(1,2);
+    inv.at(2,0) = A.at(1,0) * A.at(2,1) - A.at(1,1) * A.at(2,0);
+    inv.at(2,1) = A.at(0,1) * A.at(2,0) - A.at(0,0) * A.at(2,1);
+    inv.at(2,2) = A.at(0,0) * A.at(1,1) - A.at(0,1) * A.at(1,0);
+
+    float det = ((A.at(0,0) * inv.at(0,0)) +
+                 (A.at(0,1) * inv.at(1,0)) +
+                 (A.at(0,2) * inv.at(2,0)));
+
+    if (M3D_FABSF(det) < M3D_INVERSE_MATRIX_EPSILON) {
+        if (isInvertible != nullptr)
+            *isInvertible = false;
+    }
+    else {
+        if (isInvertible != nullptr)
+            *isInvertible = true;
+
+        det = 1.0f / det;
+
+        for (int i = 0; i < 9; ++i)
+            inv.data[i] *= det;
+    }
+
+    return inv;
 }
 
-inline M3D_DEF Vec2 normalize(Vec2 v)
+M3D_DEF Mat3 operator * (Mat3 const &A, Mat3 const &B)
 {
-    Vec2  r   = Vec2{};
-    float len = length(v);
+    Mat3 result;
 
-    r.x = v.x / len;
-    r.y = v.y / len;
+    for (int c = 0; c < 3; ++c) {
+        for (int r = 0; r < 3; ++r) {
+            result.at(r, c) = ((A.at(r, 0) * B.at(0, c)) +
+                               (A.at(r, 1) * B.at(1, c)) +
+                               (A.at(r, 2) * B.at(2, c)));
+        }
+    }
 
-    return r;
+    return result;
+}
+
+inline M3D_DEF Vec3 operator * (Mat3 const &A, Vec3 b)
+{
+    return Vec3 {
+        A.at(0,0)*b.x + A.at(0,1)*b.y + A.at(0,2)*b.z,
+        A.at(1,0)*b.x + A.at(1,1)*b.y + A.at(1,2)*b.z,
+        A.at(2,0)*b.x + A.at(2,1)*b.y + A.at(2,2)*b.z,
+    };
 }
-/**** END Vec2 definitions ****/
 
+inline M3D_DEF Mat3 normal_matrix(Mat4 const &A)
+{
+    Vec3 c0 = vec3(A.at(0,0), A.at(1,0), A.at(2,0));
+    Vec3 c1 = vec3(A.at(0,1), A.at(1,1), A.at(2,1));
+    Vec3 c2 = vec3(A.at(0,2), A.at(1,2), A.at(2,2));
 
-/**** BEGIN Vec3 definitions ****/
-inline M3D_DEF Vec3 vec3(float x, float y, float z)
-{    return Vec3 { x, y, z };
+    // the columns of the cofactor matrix are the pairwise cross
+    // products of the columns of A
+    Vec3 n0 = cross(c1, c2);
+    Vec3 n1 = cross(c2, c0);
+    Vec3 n2 = cross(c0, c1);
+
+    Mat3 N = {
+        {
+            n0.x, n0.y, n0.z,
+            n1.x, n1.y, n1.z,
+            n2.x, n2.y, n2.z
+        }
+    };
+
+    return N;
 }
 
-inline M3D_DEF Vec3 vec3(Vec2 v2)
+M3D_DEF void normal_matrix(Mat4 const *M3D_RESTRICT in, Mat3 *M3D_RESTRICT out, size_t count)
 {
-    return vec3(v2, 0);
+    ptrdiff_t n = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = normal_matrix(in[i]);
 }
 
-inline M3D_DEF Vec3 vec3(Vec2 v2, float z)
+M3D_DEF void transform_normals(Mat3 const &N, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
 {
-    return Vec3 { v2.x, v2.y, z };
+    Mat3      M = N;
+    ptrdiff_t n = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = normalize(M * in[i]);
 }
+/**** END Mat3 definitions ****/
 
-inline M3D_DEF Vec3 operator - (Vec3 a)
+
+/**** BEGIN Projection definitions ****/
+inline M3D_DEF Viewport viewport(float x, float y, float width, float height)
 {
-    return Vec3 { -a.x, -a.y, -a.z };
+    Viewport vp = { x, y, width, height, 0.0f, 1.0f };
+    return vp;
 }
 
-inline M3D_DEF Vec3 operator - (Vec3 a, Vec3 b)
+static inline uint8_t m3d_outcode(Vec4 c)
 {
-    return Vec3 {a.x - b.x, a.y - b.y, a.z - b.z };
+    return uint8_t(((c.x < -c.w) ? M3D_CLIP_LEFT   : 0) |
+                   ((c.x >  c.w) ? M3D_CLIP_RIGHT  : 0) |
+                   ((c.y < -c.w) ? M3D_CLIP_BOTTOM : 0) |
+                   ((c.y >  c.w) ? M3D_CLIP_TOP    : 0) |
+                   ((c.z < -c.w) ? M3D_CLIP_NEAR   : 0) |
+                   ((c.z >  c.w) ? M3D_CLIP_FAR    : 0));
 }
 
-inline M3D_DEF Vec3 operator + (Vec3 a, Vec3 b)
+#if defined(M3D_USE_AVX)
+// Eight packed Vec3s as x, y, and z registers and back, the three
+// registers of 24 floats are transposed with lane shuffles.
+static inline void m3d_load_vec3x8(float const *p, __m256 *x, __m256 *y, __m256 *z)
 {
-    return Vec3 { a.x + b.x, a.y + b.y, a.z + b.z };
+    __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 0)), _mm_loadu_ps(p + 12), 1);
+    __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+    __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+    __m256 xy  = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+    __m256 yz  = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+
+    *x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    *y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    *z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
 }
 
-inline M3D_DEF Vec3 operator * (float scale, Vec3 a)
+static inline void m3d_store_vec3x8(float *p, __m256 x, __m256 y, __m256 z)
 {
-    return Vec3 { scale * a.x, scale * a.y, scale * a.z };
+    __m256 xy  = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 yz  = _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+    __m256 zx  = _mm256_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 m03 = _mm256_shuffle_ps(xy, zx, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 m14 = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 m25 = _mm256_shuffle_ps(zx, yz, _MM_SHUFFLE(3, 1, 3, 1));
+
+    _mm_storeu_ps(p + 0,  _mm256_castps256_ps128(m03));
+    _mm_storeu_ps(p + 4,  _mm256_castps256_ps128(m14));
+    _mm_storeu_ps(p + 8,  _mm256_castps256_ps128(m25));
+    _mm_storeu_ps(p + 12, _mm256_extractf128_ps(m03, 1));
+    _mm_storeu_ps(p + 16, _mm256_extractf128_ps(m14, 1));
+    _mm_storeu_ps(p + 20, _mm256_extractf128_ps(m25, 1));
 }
 
-inline M3D_DEF Vec3 operator * (Vec3 a, float scale)
+// Flag bit where a is below b, as float bits so it can be or'ed.
+static inline __m256 m3d_outcode_bit(__m256 a, __m256 b, int bit)
 {
-    return scale * a;
+    return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), _mm256_castsi256_ps(_mm256_set1_epi32(bit)));
 }
 
-inline M3D_DEF Vec3 operator / (Vec3 a, float scale)
+// Eight points with the same operations in the same order as the
+// scalar loop, so both give the same results.
+static inline void m3d_project_points8(Mat4 const &A, __m256 const scale[3], __m256 const bias[3],
+                                       float const *points, float *screen, uint8_t *clip_flags)
 {
-    return a * (1.0f / scale);
+    __m256 px, py, pz;
+    m3d_load_vec3x8(points, &px, &py, &pz);
+
+    __m256 clip[4];
+    for (int r = 0; r < 4; ++r) {
+        clip[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(A.at(r, 0)), px),
+                                                            _mm256_mul_ps(_mm256_set1_ps(A.at(r, 1)), py)),
+                                              _mm256_mul_ps(_mm256_set1_ps(A.at(r, 2)), pz)),
+                                _mm256_set1_ps(A.at(r, 3)));
+    }
+
+    __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), clip[3]);
+    __m256 sx  = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(clip[0], inv), scale[0]), bias[0]);
+    __m256 sy  = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(clip[1], inv), scale[1]), bias[1]);
+    __m256 sz  = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(clip[2], inv), scale[2]), bias[2]);
+    m3d_store_vec3x8(screen, sx, sy, sz);
+
+    if (clip_flags) {
+        __m256 w     = clip[3];
+        __m256 neg_w = _mm256_sub_ps(_mm256_setzero_ps(), w);
+        __m256 codes = _mm256_or_ps(_mm256_or_ps(m3d_outcode_bit(clip[0], neg_w, M3D_CLIP_LEFT),
+                                                 m3d_outcode_bit(w, clip[0], M3D_CLIP_RIGHT)),
+                                    _mm256_or_ps(m3d_outcode_bit(clip[1], neg_w, M3D_CLIP_BOTTOM),
+                                                 m3d_outcode_bit(w, clip[1], M3D_CLIP_TOP)));
+        codes = _mm256_or_ps(codes, _mm256_or_ps(m3d_outcode_bit(clip[2], neg_w, M3D_CLIP_NEAR),
+                                                 m3d_outcode_bit(w, clip[2], M3D_CLIP_FAR)));
+
+        int32_t bits[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(bits), _mm256_castps_si256(codes));
+        for (int i = 0; i < 8; ++i)
+            clip_flags[i] = uint8_t(bits[i]);
+    }
 }
+#endif
 
-inline M3D_DEF Vec3& operator += (Vec3 &a, Vec3 b)
+M3D_DEF Vec3 project_point(Mat4 const &view_proj, Viewport const &vp, Vec3 p, uint8_t *clip_flags)
 {
-    a = a + b;
-    return a;
+    Vec3 screen;
+    uint8_t flags;
+
+    project_points(view_proj, vp, &p, &screen, &flags, 1);
+    if (clip_flags != nullptr)
+        *clip_flags = flags;
+
+    return screen;
 }
 
-inline M3D_DEF Vec3& operator *= (Vec3 &a, float scale)
+M3D_DEF void project_points(Mat4 const &view_proj, Viewport const &vp,
+                            Vec3 const *M3D_RESTRICT points,
+                            Vec3       *M3D_RESTRICT screen,
+                            uint8_t    *M3D_RESTRICT clip_flags,
+                            size_t count)
 {
-    a.x *= scale;
-    a.y *= scale;
-    a.z *= scale;
-    return a;
+    Vec4 c0 = vec4(view_proj.at(0,0), view_proj.at(1,0), view_proj.at(2,0), view_proj.at(3,0));
+    Vec4 c1 = vec4(view_proj.at(0,1), view_proj.at(1,1), view_proj.at(2,1), view_proj.at(3,1));
+    Vec4 c2 = vec4(view_proj.at(0,2), view_proj.at(1,2), view_proj.at(2,2), view_proj.at(3,2));
+    Vec4 c3 = vec4(view_proj.at(0,3), view_proj.at(1,3), view_proj.at(2,3), view_proj.at(3,3));
+
+    // NDC [-1, 1] to window coordinates folded into a scale and bias
+    Vec3 scale = vec3(0.5f * vp.width, 0.5f * vp.height, 0.5f * (vp.far_depth - vp.near_depth));
+    Vec3 bias  = vec3(vp.x + scale.x, vp.y + scale.y, vp.near_depth + scale.z);
+
+    ptrdiff_t n     = ptrdiff_t(count);
+    ptrdiff_t first = 0;
+
+#if defined(M3D_USE_AVX)
+    __m256 const    lanes_scale[3] = { _mm256_set1_ps(scale.x), _mm256_set1_ps(scale.y), _mm256_set1_ps(scale.z) };
+    __m256 const    lanes_bias[3]  = { _mm256_set1_ps(bias.x), _mm256_set1_ps(bias.y), _mm256_set1_ps(bias.z) };
+    ptrdiff_t const blocks         = n / 8;
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        m3d_project_points8(view_proj, lanes_scale, lanes_bias, points[8 * b].data,
+                            screen[8 * b].data, clip_flags ? clip_flags + 8 * b : nullptr);
+    }
+
+    first = 8 * blocks;
+#endif
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = first; i < n; ++i) {
+        Vec3  p    = points[i];
+        Vec4  clip = (c0 * p.x) + (c1 * p.y) + (c2 * p.z) + c3;
+        float inv  = 1.0f / clip.w;
+
+        screen[i] = hadamard(clip.xyz * inv, scale) + bias;
+        if (clip_flags)
+            clip_flags[i] = m3d_outcode(clip);
+    }
 }
 
-inline M3D_DEF Vec3 hadamard(Vec3 a, Vec3 b)
+M3D_DEF void unproject_rays(Mat4 const &inv_view_proj, Viewport const &vp,
+                            Vec2 const *M3D_RESTRICT pixels,
+                            Ray        *M3D_RESTRICT rays,
+                            size_t count)
 {
-    return Vec3 { a.x*b.x, a.y*b.y, a.z*b.z };
+    Vec4 c0 = vec4(inv_view_proj.at(0,0), inv_view_proj.at(1,0), inv_view_proj.at(2,0), inv_view_proj.at(3,0));
+    Vec4 c1 = vec4(inv_view_proj.at(0,1), inv_view_proj.at(1,1), inv_view_proj.at(2,1), inv_view_proj.at(3,1));
+    Vec4 c2 = vec4(inv_view_proj.at(0,2), inv_view_proj.at(1,2), inv_view_proj.at(2,2), inv_view_proj.at(3,2));
+    Vec4 c3 = vec4(inv_view_proj.at(0,3), inv_view_proj.at(1,3), inv_view_proj.at(2,3), inv_view_proj.at(3,3));
+
+    // The pixel to NDC mapping is folded into the matrix columns so
+    // the near and far points only differ by a constant:
+    //     near = px * X + py * Y + (B - c2)
+    //     far  = px * X + py * Y + (B + c2)
+    float sx = 2.0f / vp.width;
+    float sy = 2.0f / vp.height;
+    Vec4  X  = sx * c0;
+    Vec4  Y  = sy * c1;
+    Vec4  B  = c3 - ((1.0f + vp.x * sx) * c0) - ((1.0f + vp.y * sy) * c1);
+    Vec4  Kn = B - c2;
+    Vec4  Kf = B + c2;
+
+    ptrdiff_t n = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        Vec2 p    = pixels[i];
+        Vec4 a    = (X * p.x) + (Y * p.y);
+        Vec4 pn   = a + Kn;
+        Vec4 pf   = a + Kf;
+        Vec3 o    = pn.xyz / pn.w;
+
+        rays[i].origin    = o;
+        rays[i].direction = normalize((pf.xyz / pf.w) - o);
+    }
 }
+/**** END Projection definitions ****/
 
-inline M3D_DEF float dot(Vec3 a, Vec3 b)
+
+/**** BEGIN Mat3x4 definitions ****/
+inline M3D_DEF Mat3x4 mat3x4(Mat4 const &A)
 {
-    return a.x*b.x + a.y*b.y + a.z*b.z;
+    Mat3x4 result;
+
+    for (int c = 0; c < 4; ++c)
+        for (int r = 0; r < 3; ++r)
+            result.at(r, c) = A.at(r, c);
+
+    return result;
 }
 
-inline M3D_DEF Vec3 cross(Vec3 a, Vec3 b)
+inline M3D_DEF Mat4 mat4(Mat3x4 const &A)
+{
+    Mat4 result;
+
+    for (int c = 0; c < 4; ++c) {
+        for (int r = 0; r < 3; ++r)
+            result.at(r, c) = A.at(r, c);
+        result.at(3, c) = 0.0f;
+    }
+    result.at(3, 3) = 1.0f;
+
+    return result;
+}
+
+M3D_DEF Mat3x4 inverse(Mat3x4 const &A, bool *isInvertible)
+{
+    Mat3x4 inv;
+
+    // adjugate of the upper 3x3
+    inv.at(0,0) = A.at(1,1) * A.at(2,2) - A.at(1,2) * A.at(2,1);
+    inv.at(0,1) = A.at(0,2) * A.at(2,1) - A.at(0,1) * A.at(2,2);
+    inv.at(0,2) = A.at(0,1) * A.at(1,2) - A.at(0,2) * A.at(1,1);
+    inv.at(1,0) = A.at(1,2) * A.at(2,0) - A.at(1,0) * A.at(2,2);
+    inv.at(1,1) = A.at(0,0) * A.at(2,2) - A.at(0,2) * A.at(2,0);
+    inv.at(1,2) = A.at(0,2) * A.at(1,0) - A.at(0,0) * A.at(1,2);
+    inv.at(2,0) = A.at(1,0) * A.at(2,1) - A.at(1,1) * A.at(2,0);
+    inv.at(2,1) = A.at(0,1) * A.at(2,0) - A.at(0,0) * A.at(2,1);
+    inv.at(2,2) = A.at(0,0) * A.at(1,1) - A.at(0,1) * A.at(1,0);
+
+    float det = ((A.at(0,0) * inv.at(0,0)) +
+                 (A.at(0,1) * inv.at(1,0)) +
+                 (A.at(0,2) * inv.at(2,0)));
+
+    if (M3D_FABSF(det) < M3D_INVERSE_MATRIX_EPSILON) {
+        if (isInvertible != nullptr)
+            *isInvertible = false;
+    }
+    else {
+        if (isInvertible != nullptr)
+            *isInvertible = true;
+
+        det = 1.0f / det;
+
+        for (int i = 0; i < 9; ++i)
+            inv.data[i] *= det;
+    }
+
+    // translation is -inv(upper 3x3) * t
+    for (int r = 0; r < 3; ++r) {
+        inv.at(r, 3) = -((inv.at(r, 0) * A.at(0, 3)) +
+                         (inv.at(r, 1) * A.at(1, 3)) +
+                         (inv.at(r, 2) * A.at(2, 3)));
+    }
+
+    return inv;
+}
+
+M3D_DEF Mat3x4 operator * (Mat3x4 const &A, Mat3x4 const &B)
+{
+    Mat3x4 result;
+
+    for (int r = 0; r < 3; ++r) {
+        float a0 = A.at(r, 0);
+        float a1 = A.at(r, 1);
+        float a2 = A.at(r, 2);
+
+        result.at(r, 0) = (a0 * B.at(0, 0)) + (a1 * B.at(1, 0)) + (a2 * B.at(2, 0));
+        result.at(r, 1) = (a0 * B.at(0, 1)) + (a1 * B.at(1, 1)) + (a2 * B.at(2, 1));
+        result.at(r, 2) = (a0 * B.at(0, 2)) + (a1 * B.at(1, 2)) + (a2 * B.at(2, 2));
+        result.at(r, 3) = (a0 * B.at(0, 3)) + (a1 * B.at(1, 3)) + (a2 * B.at(2, 3)) + A.at(r, 3);
+    }
+
+    return result;
+}
+
+inline M3D_DEF Vec3 transform_point(Mat3x4 const &A, Vec3 p)
 {
     return Vec3 {
-        a.y*b.z - a.z*b.y,
-        a.z*b.x - a.x*b.z,
-        a.x*b.y - a.y*b.x,
+        A.at(0,0)*p.x + A.at(0,1)*p.y + A.at(0,2)*p.z + A.at(0,3),
+        A.at(1,0)*p.x + A.at(1,1)*p.y + A.at(1,2)*p.z + A.at(1,3),
+        A.at(2,0)*p.x + A.at(2,1)*p.y + A.at(2,2)*p.z + A.at(2,3),
     };
 }
 
-inline M3D_DEF float len_sq(Vec3 v)
+inline M3D_DEF Vec3 transform_dir(Mat3x4 const &A, Vec3 d)
 {
-    return dot(v, v);
+    return Vec3 {
+        A.at(0,0)*d.x + A.at(0,1)*d.y + A.at(0,2)*d.z,
+        A.at(1,0)*d.x + A.at(1,1)*d.y + A.at(1,2)*d.z,
+        A.at(2,0)*d.x + A.at(2,1)*d.y + A.at(2,2)*d.z,
+    };
 }
 
-inline M3D_DEF float length(Vec3 v)
+M3D_DEF void transform_points(Mat3x4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
 {
-    return M3D_SQRTF(len_sq(v));
+    Mat3x4    M = A;
+    ptrdiff_t n = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = transform_point(M, in[i]);
 }
 
-inline M3D_DEF Vec3 normalize(Vec3 v)
+M3D_DEF void transform_dirs(Mat3x4 const &A, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
 {
-    Vec3  r   = Vec3{};
-    float len = length(v);
+    Mat3x4    M = A;
+    ptrdiff_t n = ptrdiff_t(count);
 
-    r.x = v.x / len;
-    r.y = v.y / len;
-    r.z = v.z / len;
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = transform_dir(M, in[i]);
+}
 
-    return r;
+M3D_DEF void multiply(Mat3x4 const *M3D_RESTRICT A, Mat3x4 const *M3D_RESTRICT B, Mat3x4 *M3D_RESTRICT out, size_t count)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = A[i] * B[i];
 }
-/**** END Vec3 definitions ****/
 
+M3D_DEF void mat3x4(Mat4 const *M3D_RESTRICT in, Mat3x4 *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = mat3x4(in[i]);
+}
 
-/**** BEGIN Vec4 definitions ****/
-inline M3D_DEF Vec4 vec4(float x, float y, float z, float w)
+M3D_DEF void mat4(Mat3x4 const *M3D_RESTRICT in, Mat4 *M3D_RESTRICT out, size_t count)
 {
-    return Vec4 { x, y, z, w };
+    for (size_t i = 0; i < count; ++i)
+        out[i] = mat4(in[i]);
 }
+/**** END Mat3x4 definitions ****/
 
-inline M3D_DEF Vec4 vec4(Vec2 v2)
+
+/**** BEGIN DualQuat definitions ****/
+static inline Vec4 m3d_quat_mul(Vec4 a, Vec4 b)
 {
-    return Vec4 { v2.x, v2.y, 0, 0 };
+    return Vec4 {
+        a.w*b.x + b.w*a.x + a.y*b.z - a.z*b.y,
+        a.w*b.y + b.w*a.y + a.z*b.x - a.x*b.z,
+        a.w*b.z + b.w*a.z + a.x*b.y - a.y*b.x,
+        a.w*b.w - a.x*b.x - a.y*b.y - a.z*b.z
+    };
 }
 
-inline M3D_DEF Vec4 vec4(Vec2 v2, float z, float w)
+static inline Vec3 m3d_dq_translation(Vec4 r, Vec4 d)
 {
-    return Vec4 { v2.x, v2.y, z, w };
+    return 2.0f * ((r.w * d.xyz) - (d.w * r.xyz) + cross(r.xyz, d.xyz));
 }
 
-inline M3D_DEF Vec4 vec4(Vec3 v3)
+static inline Vec3 m3d_quat_rotate(Vec4 r, Vec3 v)
 {
-    return Vec4 { v3.x, v3.y, v3.z, 0 };
+    return v + 2.0f * cross(r.xyz, cross(r.xyz, v) + r.w * v);
 }
 
-inline M3D_DEF Vec4 vec4(Vec3 v3, float w)
+M3D_DEF DualQuat dual_quat(float angle, Vec3 axis, Vec3 translation)
 {
-    return Vec4 { v3.x, v3.y, v3.z, w };
+    axis = normalize(axis);
+
+    float    half = to_radians(angle) * 0.5f;
+    DualQuat dq;
+
+    dq.real = vec4(M3D_SINF(half) * axis, M3D_COSF(half));
+    dq.dual = 0.5f * m3d_quat_mul(vec4(translation, 0.0f), dq.real);
+
+    return dq;
 }
 
-inline M3D_DEF Vec4 operator - (Vec4 a)
+M3D_DEF DualQuat dual_quat(Mat4 const &M)
 {
-    return Vec4 { -a.x, -a.y, -a.z, -a.w };
+    Vec4  q     = Vec4 {};
+    float trace = M.at(0,0) + M.at(1,1) + M.at(2,2);
+
+    if (trace > 0.0f) {
+        float s = M3D_SQRTF(trace + 1.0f) * 2.0f;
+        q.w = 0.25f * s;
+        q.x = (M.at(2,1) - M.at(1,2)) / s;
+        q.y = (M.at(0,2) - M.at(2,0)) / s;
+        q.z = (M.at(1,0) - M.at(0,1)) / s;
+    }
+    else if (M.at(0,0) > M.at(1,1) && M.at(0,0) > M.at(2,2)) {
+        float s = M3D_SQRTF(1.0f + M.at(0,0) - M.at(1,1) - M.at(2,2)) * 2.0f;
+        q.w = (M.at(2,1) - M.at(1,2)) / s;
+        q.x = 0.25f * s;
+        q.y = (M.at(0,1) + M.at(1,0)) / s;
+        q.z = (M.at(0,2) + M.at(2,0)) / s;
+    }
+    else if (M.at(1,1) > M.at(2,2)) {
+        float s = M3D_SQRTF(1.0f + M.at(1,1) - M.at(0,0) - M.at(2,2)) * 2.0f;
+        q.w = (M.at(0,2) - M.at(2,0)) / s;
+        q.x = (M.at(0,1) + M.at(1,0)) / s;
+        q.y = 0.25f * s;
+        q.z = (M.at(1,2) + M.at(2,1)) / s;
+    }
+    else {
+        float s = M3D_SQRTF(1.0f + M.at(2,2) - M.at(0,0) - M.at(1,1)) * 2.0f;
+        q.w = (M.at(1,0) - M.at(0,1)) / s;
+        q.x = (M.at(0,2) + M.at(2,0)) / s;
+        q.y = (M.at(1,2) + M.at(2,1)) / s;
+        q.z = 0.25f * s;
+    }
+
+    DualQuat dq;
+    Vec4     t = vec4(M.at(0,3), M.at(1,3), M.at(2,3), 0.0f);
+
+    dq.real = normalize(q);
+    dq.dual = 0.5f * m3d_quat_mul(t, dq.real);
+
+    return dq;
 }
 
-inline M3D_DEF Vec4 operator - (Vec4 a, Vec4 b)
+M3D_DEF Mat4 mat4(DualQuat const &dq)
 {
-    return Vec4 { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w };
+    Mat4  R = identity();
+    Vec4  q = dq.real;
+    Vec3  t = m3d_dq_translation(dq.real, dq.dual);
+    float x = q.x, y = q.y, z = q.z, w = q.w;
+
+    // column 1
+    R.at(0,0) = 1 - 2*(y*y + z*z);
+    R.at(1,0) = 2*(x*y + w*z);
+    R.at(2,0) = 2*(x*z - w*y);
+
+    // column 2
+    R.at(0,1) = 2*(x*y - w*z);
+    R.at(1,1) = 1 - 2*(x*x + z*z);
+    R.at(2,1) = 2*(y*z + w*x);
+
+    // column 3
+    R.at(0,2) = 2*(x*z + w*y);
+    R.at(1,2) = 2*(y*z - w*x);
+    R.at(2,2) = 1 - 2*(x*x + y*y);
+
+    // column 4
+    R.at(0,3) = t.x;
+    R.at(1,3) = t.y;
+    R.at(2,3) = t.z;
+
+    return R;
 }
 
-inline M3D_DEF Vec4 operator + (Vec4 a, Vec4 b)
+inline M3D_DEF DualQuat operator + (DualQuat const &a, DualQuat const &b)
 {
-    return Vec4 { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w };
+    DualQuat result;
+    result.real = a.real + b.real;
+    result.dual = a.dual + b.dual;
+    return result;
 }
 
-inline M3D_DEF Vec4 operator * (float scale, Vec4 a)
+inline M3D_DEF DualQuat operator * (float scale, DualQuat const &a)
 {
-    return Vec4 { scale * a.x, scale * a.y, scale * a.z, scale * a.w };
+    DualQuat result;
+    result.real = scale * a.real;
+    result.dual = scale * a.dual;
+    return result;
 }
 
-inline M3D_DEF Vec4 operator * (Vec4 a, float scale)
+inline M3D_DEF DualQuat operator * (DualQuat const &a, DualQuat const &b)
 {
-    return Vec4 { scale * a.x, scale * a.y, scale * a.z, scale * a.w };
+    DualQuat result;
+    result.real = m3d_quat_mul(a.real, b.real);
+    result.dual = m3d_quat_mul(a.real, b.dual) + m3d_quat_mul(a.dual, b.real);
+    return result;
 }
 
-inline M3D_DEF Vec4 operator / (Vec4 a, float scale)
+M3D_DEF DualQuat normalize(DualQuat const &dq)
 {
-    return a * (1.0f / scale);
+    float    inv = 1.0f / length(dq.real);
+    DualQuat result;
+
+    result.real = inv * dq.real;
+    result.dual = inv * dq.dual;
+
+    // keep the dual part orthogonal to the real part
+    result.dual = result.dual - dot(result.real, result.dual) * result.real;
+
+    return result;
 }
 
-inline M3D_DEF Vec4& operator += (Vec4 &a, Vec4 b)
+M3D_DEF DualQuat blend(DualQuat const *dqs, float const *weights, size_t count)
 {
-    a = a + b;
-    return a;
+    DualQuat result = DualQuat {};
+
+    for (size_t i = 0; i < count; ++i) {
+        // pick the shortest path relative to the first rotation
+        float w = weights[i];
+        if (dot(dqs[i].real, dqs[0].real) < 0.0f)
+            w = -w;
+
+        result.real += w * dqs[i].real;
+        result.dual += w * dqs[i].dual;
+    }
+
+    return normalize(result);
 }
 
-inline M3D_DEF Vec4& operator *= (Vec4 &a, float scale)
+inline M3D_DEF Vec3 transform_point(DualQuat const &dq, Vec3 p)
 {
-    a.x *= scale;
-    a.y *= scale;
-    a.z *= scale;
-    a.w *= scale;
-    return a;
+    return m3d_quat_rotate(dq.real, p) + m3d_dq_translation(dq.real, dq.dual);
 }
 
-inline M3D_DEF Vec4 hadamard(Vec4 a, Vec4 b)
+inline M3D_DEF Vec3 transform_dir(DualQuat const &dq, Vec3 d)
 {
-    return Vec4 { a.x*b.x, a.y*b.y, a.z*b.z, a.w*b.w };
+    return m3d_quat_rotate(dq.real, d);
 }
 
-inline M3D_DEF float dot(Vec4 a, Vec4 b)
+#if defined(M3D_USE_AVX)
+static inline void m3d_cross8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz,
+                              __m256 *x, __m256 *y, __m256 *z)
 {
-    return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+    *x = _mm256_sub_ps(_mm256_mul_ps(ay, bz), _mm256_mul_ps(az, by));
+    *y = _mm256_sub_ps(_mm256_mul_ps(az, bx), _mm256_mul_ps(ax, bz));
+    *z = _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(ay, bx));
 }
 
-inline M3D_DEF float len_sq(Vec4 v)
+// m3d_quat_rotate on eight lanes, same operations in the same order.
+static inline void m3d_quat_rotate8(__m256 const r[4], __m256 *x, __m256 *y, __m256 *z)
 {
-    return dot(v, v);
+    __m256 cx, cy, cz, ex, ey, ez;
+    m3d_cross8(r[0], r[1], r[2], *x, *y, *z, &cx, &cy, &cz);
+    cx = _mm256_add_ps(cx, _mm256_mul_ps(r[3], *x));
+    cy = _mm256_add_ps(cy, _mm256_mul_ps(r[3], *y));
+    cz = _mm256_add_ps(cz, _mm256_mul_ps(r[3], *z));
+    m3d_cross8(r[0], r[1], r[2], cx, cy, cz, &ex, &ey, &ez);
+
+    __m256 two = _mm256_set1_ps(2.0f);
+    *x = _mm256_add_ps(*x, _mm256_mul_ps(two, ex));
+    *y = _mm256_add_ps(*y, _mm256_mul_ps(two, ey));
+    *z = _mm256_add_ps(*z, _mm256_mul_ps(two, ez));
 }
 
-inline M3D_DEF float length(Vec4 v)
+// Eight Vec4s scattered in memory as x, y, z and w registers, lanes i
+// and i+4 share a 128-bit half so the transpose stays in lane.
+static inline void m3d_load_vec4x8(float const *const p[8], __m256 out[4])
 {
-    return M3D_SQRTF(len_sq(v));
+    __m256 a0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p[0])), _mm_loadu_ps(p[4]), 1);
+    __m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p[1])), _mm_loadu_ps(p[5]), 1);
+    __m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p[2])), _mm_loadu_ps(p[6]), 1);
+    __m256 a3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p[3])), _mm_loadu_ps(p[7]), 1);
+    __m256 t0 = _mm256_unpacklo_ps(a0, a1);
+    __m256 t1 = _mm256_unpackhi_ps(a0, a1);
+    __m256 t2 = _mm256_unpacklo_ps(a2, a3);
+    __m256 t3 = _mm256_unpackhi_ps(a2, a3);
+
+    out[0] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    out[1] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    out[2] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    out[3] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
 }
 
-inline M3D_DEF Vec4 normalize(Vec4 v)
+static inline void m3d_load_dual_quat8(DualQuat const *palette, uint16_t const *joints, int k,
+                                       __m256 r[4], __m256 d[4])
 {
-    Vec4  r   = Vec4{};
-    float len = length(v);
+    float const *real[8];
+    float const *dual[8];
+    for (int l = 0; l < 8; ++l) {
+        real[l] = palette[joints[4*l + k]].real.data;
+        dual[l] = palette[joints[4*l + k]].dual.data;
+    }
+    m3d_load_vec4x8(real, r);
+    m3d_load_vec4x8(dual, d);
+}
 
-    r.x = v.x / len;
-    r.y = v.y / len;
-    r.z = v.z / len;
-    r.w = v.w / len;
+// Eight vertices of skin, same operations in the same order as the
+// scalar loop so both give the same results.
+static inline void m3d_skin8(DualQuat const *palette, uint16_t const *joints, float const *weights,
+                             float const *positions, float const *normals,
+                             float *out_positions, float *out_normals)
+{
+    float const *rows[8];
+    for (int l = 0; l < 8; ++l)
+        rows[l] = weights + 4*l;
 
-    return r;
+    __m256 w[4], r0[4], d0[4], r[4], d[4];
+    m3d_load_vec4x8(rows, w);
+    m3d_load_dual_quat8(palette, joints, 0, r0, d0);
+    for (int c = 0; c < 4; ++c) {
+        r[c] = _mm256_mul_ps(w[0], r0[c]);
+        d[c] = _mm256_mul_ps(w[0], d0[c]);
+    }
+
+    __m256 const sign = _mm256_set1_ps(-0.0f);
+    for (int k = 1; k < 4; ++k) {
+        __m256 rk[4], dk[4];
+        m3d_load_dual_quat8(palette, joints, k, rk, dk);
+
+        __m256 dp = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rk[0], r0[0]),
+                                                              _mm256_mul_ps(rk[1], r0[1])),
+                                                _mm256_mul_ps(rk[2], r0[2])),
+                                  _mm256_mul_ps(rk[3], r0[3]));
+        __m256 flip = _mm256_and_ps(_mm256_cmp_ps(dp, _mm256_setzero_ps(), _CMP_LT_OQ), sign);
+        __m256 wk   = _mm256_xor_ps(w[k], flip);
+        for (int c = 0; c < 4; ++c) {
+            r[c] = _mm256_add_ps(r[c], _mm256_mul_ps(wk, rk[c]));
+            d[c] = _mm256_add_ps(d[c], _mm256_mul_ps(wk, dk[c]));
+        }
+    }
+
+    __m256 len_sq = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r[0], r[0]),
+                                                              _mm256_mul_ps(r[1], r[1])),
+                                                _mm256_mul_ps(r[2], r[2])),
+                                  _mm256_mul_ps(r[3], r[3]));
+    __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(len_sq));
+    for (int c = 0; c < 4; ++c) {
+        r[c] = _mm256_mul_ps(r[c], inv);
+        d[c] = _mm256_mul_ps(d[c], inv);
+    }
+
+    // m3d_dq_translation: 2 * ((r.w * d.xyz) - (d.w * r.xyz) + cross(r.xyz, d.xyz))
+    __m256 cx, cy, cz;
+    m3d_cross8(r[0], r[1], r[2], d[0], d[1], d[2], &cx, &cy, &cz);
+    __m256 two = _mm256_set1_ps(2.0f);
+    __m256 tx  = _mm256_mul_ps(two, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(r[3], d[0]), _mm256_mul_ps(d[3], r[0])), cx));
+    __m256 ty  = _mm256_mul_ps(two, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(r[3], d[1]), _mm256_mul_ps(d[3], r[1])), cy));
+    __m256 tz  = _mm256_mul_ps(two, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(r[3], d[2]), _mm256_mul_ps(d[3], r[2])), cz));
+
+    __m256 px, py, pz;
+    m3d_load_vec3x8(positions, &px, &py, &pz);
+    m3d_quat_rotate8(r, &px, &py, &pz);
+    m3d_store_vec3x8(out_positions, _mm256_add_ps(px, tx), _mm256_add_ps(py, ty), _mm256_add_ps(pz, tz));
+
+    if (normals && out_normals) {
+        __m256 nx, ny, nz;
+        m3d_load_vec3x8(normals, &nx, &ny, &nz);
+        m3d_quat_rotate8(r, &nx, &ny, &nz);
+        m3d_store_vec3x8(out_normals, nx, ny, nz);
+    }
 }
-/**** END Vec4 definitions ****/
+#endif
+
+M3D_DEF void transform_points(DualQuat const &dq, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    Vec4 r = dq.real;
+    Vec3 t = m3d_dq_translation(dq.real, dq.dual);
+
+    ptrdiff_t n     = ptrdiff_t(count);
+    ptrdiff_t first = 0;
+#if defined(M3D_USE_AVX)
+    __m256 const    lanes_r[4] = { _mm256_set1_ps(r.x), _mm256_set1_ps(r.y), _mm256_set1_ps(r.z), _mm256_set1_ps(r.w) };
+    __m256 const    lanes_t[3] = { _mm256_set1_ps(t.x), _mm256_set1_ps(t.y), _mm256_set1_ps(t.z) };
+    ptrdiff_t const blocks     = n / 8;
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        __m256 x, y, z;
+        m3d_load_vec3x8(in[8 * b].data, &x, &y, &z);
+        m3d_quat_rotate8(lanes_r, &x, &y, &z);
+        m3d_store_vec3x8(out[8 * b].data, _mm256_add_ps(x, lanes_t[0]),
+                         _mm256_add_ps(y, lanes_t[1]), _mm256_add_ps(z, lanes_t[2]));
+    }
+
+    first = 8 * blocks;
+#endif
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = first; i < n; ++i)
+        out[i] = m3d_quat_rotate(r, in[i]) + t;
+}
+
+M3D_DEF void transform_dirs(DualQuat const &dq, Vec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    Vec4 r = dq.real;
+
+    ptrdiff_t n     = ptrdiff_t(count);
+    ptrdiff_t first = 0;
+#if defined(M3D_USE_AVX)
+    __m256 const    lanes_r[4] = { _mm256_set1_ps(r.x), _mm256_set1_ps(r.y), _mm256_set1_ps(r.z), _mm256_set1_ps(r.w) };
+    ptrdiff_t const blocks     = n / 8;
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        __m256 x, y, z;
+        m3d_load_vec3x8(in[8 * b].data, &x, &y, &z);
+        m3d_quat_rotate8(lanes_r, &x, &y, &z);
+        m3d_store_vec3x8(out[8 * b].data, x, y, z);
+    }
+
+    first = 8 * blocks;
+#endif
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = first; i < n; ++i)
+        out[i] = m3d_quat_rotate(r, in[i]);
+}
+
+M3D_DEF void skin(DualQuat const *M3D_RESTRICT palette,
+                  uint16_t const *M3D_RESTRICT joints,
+                  float    const *M3D_RESTRICT weights,
+                  Vec3     const *M3D_RESTRICT positions,
+                  Vec3     const *M3D_RESTRICT normals,
+                  Vec3           *M3D_RESTRICT out_positions,
+                  Vec3           *M3D_RESTRICT out_normals,
+                  size_t count)
+{
+    ptrdiff_t n     = ptrdiff_t(count);
+    ptrdiff_t first = 0;
+#if defined(M3D_USE_AVX)
+    ptrdiff_t const blocks = n / 8;
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        m3d_skin8(palette, joints + 32 * b, weights + 32 * b, positions[8 * b].data,
+                  normals ? normals[8 * b].data : nullptr, out_positions[8 * b].data,
+                  out_normals ? out_normals[8 * b].data : nullptr);
+    }
+
+    first = 8 * blocks;
+#endif
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = first; i < n; ++i) {
+        uint16_t const *j = joints + 4*i;
+        float    const *w = weights + 4*i;
+
+        Vec4 r0 = palette[j[0]].real;
+        Vec4 r  = w[0] * r0;
+        Vec4 d  = w[0] * palette[j[0]].dual;
+
+        for (int k = 1; k < 4; ++k) {
+            DualQuat const &dq = palette[j[k]];
+            float wk = dot(dq.real, r0) < 0.0f ? -w[k] : w[k];
+            r += wk * dq.real;
+            d += wk * dq.dual;
+        }
+
+        // Dividing the blend by the real norm is enough here, the
+        // translation extraction does not need an orthogonal dual part.
+        float inv = 1.0f / length(r);
+        r *= inv;
+        d *= inv;
+
+        out_positions[i] = m3d_quat_rotate(r, positions[i]) + m3d_dq_translation(r, d);
+        if (normals && out_normals)
+            out_normals[i] = m3d_quat_rotate(r, normals[i]);
+    }
+}
+/**** END DualQuat definitions ****/
+
+
+/**** BEGIN Hierarchy definitions ****/
+M3D_DEF Transform transform(Vec3 translation, float angle, Vec3 axis, Vec3 scale)
+{
+    Transform t;
+
+    t.translation = translation;
+    t.rotation    = dual_quat(angle, axis, vec3(0, 0, 0)).real;
+    t.scale       = scale;
+
+    return t;
+}
+
+M3D_DEF Mat4 mat4(Transform const &t)
+{
+    DualQuat dq = DualQuat {};
+    dq.real = t.rotation;
+
+    Mat4 M = mat4(dq);
+
+    for (int r = 0; r < 3; ++r) {
+        M.at(r, 0) *= t.scale.x;
+        M.at(r, 1) *= t.scale.y;
+        M.at(r, 2) *= t.scale.z;
+    }
+
+    M.at(0, 3) = t.translation.x;
+    M.at(1, 3) = t.translation.y;
+    M.at(2, 3) = t.translation.z;
+
+    return M;
+}
+
+M3D_DEF bool hierarchy_build_levels(Hierarchy *h)
+{
+    h->level_count = 0;
+    if (h->count == 0 || h->max_levels == 0)
+        return h->count == 0;
+
+    // Nodes are depth sorted so a node either belongs to the current
+    // level (its parent is in the previous level) or starts the next
+    // one (its parent is in the current level).
+    size_t prev  = 0;
+    size_t start = 0;
+
+    h->level_starts[0] = 0;
+    h->level_count     = 1;
+
+    for (size_t i = 0; i < h->count; ++i) {
+        int32_t p = h->parents[i];
+
+        if (p < 0) {
+            if (h->level_count != 1)
+                return false;
+            continue;
+        }
+
+        if (size_t(p) >= i)
+            return false;
+
+        if (size_t(p) >= start) {
+            if (h->level_count == h->max_levels)
+                return false;
+            prev  = start;
+            start = i;
+            h->level_starts[h->level_count++] = uint32_t(i);
+        }
+        else if (size_t(p) < prev) {
+            return false;
+        }
+    }
+
+    h->level_starts[h->level_count] = uint32_t(h->count);
+    return true;
+}
+
+inline M3D_DEF void hierarchy_set_local(Hierarchy *h, size_t node, Transform const &local)
+{
+    h->locals[node] = local;
+    h->dirty[node]  = 1;
+}
+
+M3D_DEF void hierarchy_update(Hierarchy *h)
+{
+    int32_t   const *parents = h->parents;
+    Transform const *locals  = h->locals;
+    Mat4            *worlds  = h->worlds;
+    uint8_t         *dirty   = h->dirty;
+
+    for (size_t L = 0; L < h->level_count; ++L) {
+        ptrdiff_t begin = ptrdiff_t(h->level_starts[L]);
+        ptrdiff_t end   = ptrdiff_t(h->level_starts[L + 1]);
+
+        // Only the previous level is read here and it is already up
+        // to date, so a dirty parent marks its children as dirty.
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = begin; i < end; ++i) {
+            int32_t p = parents[i];
+
+            if (p >= 0)
+                dirty[i] |= dirty[p];
+
+            if (dirty[i])
+                worlds[i] = p >= 0 ? worlds[p] * mat4(locals[i]) : mat4(locals[i]);
+        }
+    }
+
+    ptrdiff_t count = ptrdiff_t(h->count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < count; ++i)
+        dirty[i] = 0;
+}
+
+M3D_DEF void hierarchy_update_all(Hierarchy *h)
+{
+    ptrdiff_t count = ptrdiff_t(h->count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < count; ++i)
+        h->dirty[i] = 1;
+
+    hierarchy_update(h);
+}
+/**** END Hierarchy definitions ****/
+
+
+/**** BEGIN Vec2 definitions ****/
+inline M3D_DEF Vec2 vec2(float x, float y)
+{
+    return Vec2 { x, y };
+}
+
+inline M3D_DEF Vec2 operator - (Vec2 a)
+{
+    return Vec2 { -a.x, -a.y };
+}
+
+inline M3D_DEF Vec2 operator - (Vec2 a, Vec2 b)
+{
+    return Vec2 { a.x - b.x, a.y - b.y };
+}
+
+inline M3D_DEF Vec2 operator + (Vec2 a, Vec2 b)
+{
+    return Vec2 { a.x + b.x, a.y + b.y };
+}
+
+inline M3D_DEF Vec2 operator * (float scale, Vec2 a)
+{
+    return Vec2 { scale * a.x, scale * a.y };
+}
+
+inline M3D_DEF Vec2 operator * (Vec2 a, float scale)
+{
+    return scale * a;
+}
+
+inline M3D_DEF Vec2 operator / (Vec2 a, float scale)
+{
+    return a * (1.0f / scale);
+}
+
+inline M3D_DEF Vec2& operator += (Vec2 &a, Vec2 b)
+{
+    a = a + b;
+    return a;
+}
+
+inline M3D_DEF Vec2& operator *= (Vec2 &a, float scale)
+{
+    a.x *= scale;
+    a.y *= scale;
+    return a;
+}
+
+inline M3D_DEF Vec2 hadamard(Vec2 a, Vec2 b)
+{
+    return Vec2{ a.x*b.x, a.y*b.y };
+}
+
+inline M3D_DEF float dot(Vec2 a, Vec2 b)
+{
+    return a.x*b.x + a.y*b.y;
+}
+
+inline M3D_DEF float len_sq(Vec2 v)
+{
+    return dot(v, v);
+}
+
+inline M3D_DEF float length(Vec2 v)
+{
+    return M3D_SQRTF(len_sq(v));
+}
+
+inline M3D_DEF Vec2 normalize(Vec2 v)
+{
+    Vec2  r   = Vec2{};
+    float len = length(v);
+
+    r.x = v.x / len;
+    r.y = v.y / len;
+
+    return r;
+}
+/**** END Vec2 definitions ****/
+
+
+/**** BEGIN Vec3 definitions ****/
+inline M3D_DEF Vec3 vec3(float x, float y, float z)
+{    return Vec3 { x, y, z };
+}
+
+inline M3D_DEF Vec3 vec3(Vec2 v2)
+{
+    return vec3(v2, 0);
+}
+
+inline M3D_DEF Vec3 vec3(Vec2 v2, float z)
+{
+    return Vec3 { v2.x, v2.y, z };
+}
+
+inline M3D_DEF Vec3 operator - (Vec3 a)
+{
+    return Vec3 { -a.x, -a.y, -a.z };
+}
+
+inline M3D_DEF Vec3 operator - (Vec3 a, Vec3 b)
+{
+    return Vec3 {a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+inline M3D_DEF Vec3 operator + (Vec3 a, Vec3 b)
+{
+    return Vec3 { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+inline M3D_DEF Vec3 operator * (float scale, Vec3 a)
+{
+    return Vec3 { scale * a.x, scale * a.y, scale * a.z };
+}
+
+inline M3D_DEF Vec3 operator * (Vec3 a, float scale)
+{
+    return scale * a;
+}
+
+inline M3D_DEF Vec3 operator / (Vec3 a, float scale)
+{
+    return a * (1.0f / scale);
+}
+
+inline M3D_DEF Vec3& operator += (Vec3 &a, Vec3 b)
+{
+    a = a + b;
+    return a;
+}
+
+inline M3D_DEF Vec3& operator *= (Vec3 &a, float scale)
+{
+    a.x *= scale;
+    a.y *= scale;
+    a.z *= scale;
+    return a;
+}
+
+inline M3D_DEF Vec3 hadamard(Vec3 a, Vec3 b)
+{
+    return Vec3 { a.x*b.x, a.y*b.y, a.z*b.z };
+}
+
+inline M3D_DEF float dot(Vec3 a, Vec3 b)
+{
+    return a.x*b.x + a.y*b.y + a.z*b.z;
+}
+
+inline M3D_DEF Vec3 cross(Vec3 a, Vec3 b)
+{
+    return Vec3 {
+        a.y*b.z - a.z*b.y,
+        a.z*b.x - a.x*b.z,
+        a.x*b.y - a.y*b.x,
+    };
+}
+
+inline M3D_DEF float len_sq(Vec3 v)
+{
+    return dot(v, v);
+}
+
+inline M3D_DEF float length(Vec3 v)
+{
+    return M3D_SQRTF(len_sq(v));
+}
+
+inline M3D_DEF Vec3 normalize(Vec3 v)
+{
+    Vec3  r   = Vec3{};
+    float len = length(v);
+
+    r.x = v.x / len;
+    r.y = v.y / len;
+    r.z = v.z / len;
+
+    return r;
+}
+/**** END Vec3 definitions ****/
+
+
+/**** BEGIN Vec4 definitions ****/
+inline M3D_DEF Vec4 vec4(float x, float y, float z, float w)
+{
+    return Vec4 { x, y, z, w };
+}
+
+inline M3D_DEF Vec4 vec4(Vec2 v2)
+{
+    return Vec4 { v2.x, v2.y, 0, 0 };
+}
+
+inline M3D_DEF Vec4 vec4(Vec2 v2, float z, float w)
+{
+    return Vec4 { v2.x, v2.y, z, w };
+}
+
+inline M3D_DEF Vec4 vec4(Vec3 v3)
+{
+    return Vec4 { v3.x, v3.y, v3.z, 0 };
+}
+
+inline M3D_DEF Vec4 vec4(Vec3 v3, float w)
+{
+    return Vec4 { v3.x, v3.y, v3.z, w };
+}
+
+inline M3D_DEF Vec4 operator - (Vec4 a)
+{
+    return Vec4 { -a.x, -a.y, -a.z, -a.w };
+}
+
+inline M3D_DEF Vec4 operator - (Vec4 a, Vec4 b)
+{
+    return Vec4 { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w };
+}
+
+inline M3D_DEF Vec4 operator + (Vec4 a, Vec4 b)
+{
+    return Vec4 { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w };
+}
+
+inline M3D_DEF Vec4 operator * (float scale, Vec4 a)
+{
+    return Vec4 { scale * a.x, scale * a.y, scale * a.z, scale * a.w };
+}
+
+inline M3D_DEF Vec4 operator * (Vec4 a, float scale)
+{
+    return Vec4 { scale * a.x, scale * a.y, scale * a.z, scale * a.w };
+}
+
+inline M3D_DEF Vec4 operator / (Vec4 a, float scale)
+{
+    return a * (1.0f / scale);
+}
+
+inline M3D_DEF Vec4& operator += (Vec4 &a, Vec4 b)
+{
+    a = a + b;
+    return a;
+}
+
+inline M3D_DEF Vec4& operator *= (Vec4 &a, float scale)
+{
+    a.x *= scale;
+    a.y *= scale;
+    a.z *= scale;
+    a.w *= scale;
+    return a;
+}
+
+inline M3D_DEF Vec4 hadamard(Vec4 a, Vec4 b)
+{
+    return Vec4 { a.x*b.x, a.y*b.y, a.z*b.z, a.w*b.w };
+}
+
+inline M3D_DEF float dot(Vec4 a, Vec4 b)
+{
+    return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+}
+
+inline M3D_DEF float len_sq(Vec4 v)
+{
+    return dot(v, v);
+}
+
+inline M3D_DEF float length(Vec4 v)
+{
+    return M3D_SQRTF(len_sq(v));
+}
+
+inline M3D_DEF Vec4 normalize(Vec4 v)
+{
+    Vec4  r   = Vec4{};
+    float len = length(v);
+
+    r.x = v.x / len;
+    r.y = v.y / len;
+    r.z = v.z / len;
+    r.w = v.w / len;
+
+    return r;
+}
+/**** END Vec4 definitions ****/
+
+
+/**** BEGIN DVec3 definitions ****/
+inline M3D_DEF DVec3 dvec3(double x, double y, double z)
+{
+    return DVec3 { x, y, z };
+}
+
+inline M3D_DEF DVec3 dvec3(Vec3 v)
+{
+    return DVec3 { v.x, v.y, v.z };
+}
+
+inline M3D_DEF Vec3 vec3(DVec3 v)
+{
+    return Vec3 { float(v.x), float(v.y), float(v.z) };
+}
+
+inline M3D_DEF DVec3 operator - (DVec3 a)
+{
+    return DVec3 { -a.x, -a.y, -a.z };
+}
+
+inline M3D_DEF DVec3 operator - (DVec3 a, DVec3 b)
+{
+    return DVec3 { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+inline M3D_DEF DVec3 operator + (DVec3 a, DVec3 b)
+{
+    return DVec3 { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+inline M3D_DEF DVec3 operator * (double scale, DVec3 a)
+{
+    return DVec3 { scale * a.x, scale * a.y, scale * a.z };
+}
+
+inline M3D_DEF DVec3 operator * (DVec3 a, double scale)
+{
+    return scale * a;
+}
+
+inline M3D_DEF DVec3 operator / (DVec3 a, double scale)
+{
+    return a * (1.0 / scale);
+}
+
+inline M3D_DEF DVec3& operator += (DVec3 &a, DVec3 b)
+{
+    a = a + b;
+    return a;
+}
+
+inline M3D_DEF DVec3& operator *= (DVec3 &a, double scale)
+{
+    a.x *= scale;
+    a.y *= scale;
+    a.z *= scale;
+    return a;
+}
+
+inline M3D_DEF DVec3 hadamard(DVec3 a, DVec3 b)
+{
+    return DVec3 { a.x*b.x, a.y*b.y, a.z*b.z };
+}
+
+inline M3D_DEF double dot(DVec3 a, DVec3 b)
+{
+    return a.x*b.x + a.y*b.y + a.z*b.z;
+}
+
+inline M3D_DEF DVec3 cross(DVec3 a, DVec3 b)
+{
+    return DVec3 {
+        a.y*b.z - a.z*b.y,
+        a.z*b.x - a.x*b.z,
+        a.x*b.y - a.y*b.x,
+    };
+}
+
+inline M3D_DEF double len_sq(DVec3 v)
+{
+    return dot(v, v);
+}
+
+inline M3D_DEF double length(DVec3 v)
+{
+    return M3D_SQRT(len_sq(v));
+}
+
+inline M3D_DEF DVec3 normalize(DVec3 v)
+{
+    return v / length(v);
+}
+/**** END DVec3 definitions ****/
+
+
+/**** BEGIN DVec4 definitions ****/
+inline M3D_DEF DVec4 dvec4(double x, double y, double z, double w)
+{
+    return DVec4 { x, y, z, w };
+}
+
+inline M3D_DEF DVec4 dvec4(DVec3 v3, double w)
+{
+    return DVec4 { v3.x, v3.y, v3.z, w };
+}
+
+inline M3D_DEF DVec4 dvec4(Vec4 v)
+{
+    return DVec4 { v.x, v.y, v.z, v.w };
+}
+
+inline M3D_DEF Vec4 vec4(DVec4 v)
+{
+    return Vec4 { float(v.x), float(v.y), float(v.z), float(v.w) };
+}
+
+inline M3D_DEF DVec4 operator - (DVec4 a)
+{
+    return DVec4 { -a.x, -a.y, -a.z, -a.w };
+}
+
+inline M3D_DEF DVec4 operator - (DVec4 a, DVec4 b)
+{
+    return DVec4 { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w };
+}
+
+inline M3D_DEF DVec4 operator + (DVec4 a, DVec4 b)
+{
+    return DVec4 { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w };
+}
+
+inline M3D_DEF DVec4 operator * (double scale, DVec4 a)
+{
+    return DVec4 { scale * a.x, scale * a.y, scale * a.z, scale * a.w };
+}
+
+inline M3D_DEF DVec4 operator * (DVec4 a, double scale)
+{
+    return scale * a;
+}
+
+inline M3D_DEF DVec4 operator / (DVec4 a, double scale)
+{
+    return a * (1.0 / scale);
+}
+
+inline M3D_DEF DVec4& operator += (DVec4 &a, DVec4 b)
+{
+    a = a + b;
+    return a;
+}
+
+inline M3D_DEF DVec4& operator *= (DVec4 &a, double scale)
+{
+    a.x *= scale;
+    a.y *= scale;
+    a.z *= scale;
+    a.w *= scale;
+    return a;
+}
+
+inline M3D_DEF DVec4 hadamard(DVec4 a, DVec4 b)
+{
+    return DVec4 { a.x*b.x, a.y*b.y, a.z*b.z, a.w*b.w };
+}
+
+inline M3D_DEF double dot(DVec4 a, DVec4 b)
+{
+    return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+}
+
+inline M3D_DEF double len_sq(DVec4 v)
+{
+    return dot(v, v);
+}
+
+inline M3D_DEF double length(DVec4 v)
+{
+    return M3D_SQRT(len_sq(v));
+}
+
+inline M3D_DEF DVec4 normalize(DVec4 v)
+{
+    return v / length(v);
+}
+/**** END DVec4 definitions ****/
+
+
+/**** BEGIN DMat4 definitions ****/
+inline M3D_DEF DMat4 didentity()
+{
+    return DMat4 {
+        {
+            1, 0, 0, 0,
+            0, 1, 0, 0,
+            0, 0, 1, 0,
+            0, 0, 0, 1
+        }
+    };
+}
+
+inline M3D_DEF DMat4 dtranslate(double x, double y, double z)
+{
+    DMat4 result = didentity();
+
+    result.at(0, 3) = x;
+    result.at(1, 3) = y;
+    result.at(2, 3) = z;
+
+    return result;
+}
+
+M3D_DEF DMat4 drotation(double angle, DVec3 axis)
+{
+    axis = normalize(axis);
+
+    DMat4  R  = didentity();
+    double ng = angle * (3.14159265358979323846 / 180.0);
+    double c  = M3D_COS(ng);
+    double s  = M3D_SIN(ng);
+    double x  = axis.x;
+    double y  = axis.y;
+    double z  = axis.z;
+
+    // column 1
+    R.at(0,0) = c + (1 - c) * x*x;
+    R.at(1,0) = (1 - c) * x*y + s*z;
+    R.at(2,0) = (1 - c) * x*z - s*y;
+
+    // column 2
+    R.at(0,1) = (1 - c) * x*y - s*z;
+    R.at(1,1) = c + (1 - c) * y*y;
+    R.at(2,1) = (1 - c) * y*z + s*x;
+
+    // column 3
+    R.at(0,2) = (1 - c) * x*z + s*y;
+    R.at(1,2) = (1 - c) * y*z - s*x;
+    R.at(2,2) = c + (1 - c) * z*z;
+
+    return R;
+}
+
+inline M3D_DEF DMat4 dscale(double x, double y, double z)
+{
+    DMat4 result = didentity();
+
+    result.at(0,0) = x;
+    result.at(1,1) = y;
+    result.at(2,2) = z;
+
+    return result;
+}
+
+inline M3D_DEF DMat4 dmat4(Mat4 const &A)
+{
+    DMat4 result;
+
+    for (int i = 0; i < 16; ++i)
+        result.data[i] = A.data[i];
+
+    return result;
+}
+
+inline M3D_DEF Mat4 mat4(DMat4 const &A)
+{
+    Mat4 result;
+
+    for (int i = 0; i < 16; ++i)
+        result.data[i] = float(A.data[i]);
+
+    return result;
+}
+
+M3D_DEF DMat4 inverse(DMat4 const &A, bool *isInvertible)
+{
+    // 2x2 sub-determinants of the upper (s) and lower (c) two rows
+    double s0 = A.at(0,0) * A.at(1,1) - A.at(1,0) * A.at(0,1);
+    double s1 = A.at(0,0) * A.at(1,2) - A.at(1,0) * A.at(0,2);
+    double s2 = A.at(0,0) * A.at(1,3) - A.at(1,0) * A.at(0,3);
+    double s3 = A.at(0,1) * A.at(1,2) - A.at(1,1) * A.at(0,2);
+    double s4 = A.at(0,1) * A.at(1,3) - A.at(1,1) * A.at(0,3);
+    double s5 = A.at(0,2) * A.at(1,3) - A.at(1,2) * A.at(0,3);
+
+    double c5 = A.at(2,2) * A.at(3,3) - A.at(3,2) * A.at(2,3);
+    double c4 = A.at(2,1) * A.at(3,3) - A.at(3,1) * A.at(2,3);
+    double c3 = A.at(2,1) * A.at(3,2) - A.at(3,1) * A.at(2,2);
+    double c2 = A.at(2,0) * A.at(3,3) - A.at(3,0) * A.at(2,3);
+    double c1 = A.at(2,0) * A.at(3,2) - A.at(3,0) * A.at(2,2);
+    double c0 = A.at(2,0) * A.at(3,1) - A.at(3,0) * A.at(2,1);
+
+    double det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+
+    DMat4 inv;
+
+    inv.at(0,0) = ( A.at(1,1) * c5 - A.at(1,2) * c4 + A.at(1,3) * c3);
+    inv.at(0,1) = (-A.at(0,1) * c5 + A.at(0,2) * c4 - A.at(0,3) * c3);
+    inv.at(0,2) = ( A.at(3,1) * s5 - A.at(3,2) * s4 + A.at(3,3) * s3);
+    inv.at(0,3) = (-A.at(2,1) * s5 + A.at(2,2) * s4 - A.at(2,3) * s3);
+
+    inv.at(1,0) = (-A.at(1,0) * c5 + A.at(1,2) * c2 - A.at(1,3) * c1);
+    inv.at(1,1) = ( A.at(0,0) * c5 - A.at(0,2) * c2 + A.at(0,3) * c1);
+    inv.at(1,2) = (-A.at(3,0) * s5 + A.at(3,2) * s2 - A.at(3,3) * s1);
+    inv.at(1,3) = ( A.at(2,0) * s5 - A.at(2,2) * s2 + A.at(2,3) * s1);
+
+    inv.at(2,0) = ( A.at(1,0) * c4 - A.at(1,1) * c2 + A.at(1,3) * c0);
+    inv.at(2,1) = (-A.at(0,0) * c4 + A.at(0,1) * c2 - A.at(0,3) * c0);
+    inv.at(2,2) = ( A.at(3,0) * s4 - A.at(3,1) * s2 + A.at(3,3) * s0);
+    inv.at(2,3) = (-A.at(2,0) * s4 + A.at(2,1) * s2 - A.at(2,3) * s0);
+
+    inv.at(3,0) = (-A.at(1,0) * c3 + A.at(1,1) * c1 - A.at(1,2) * c0);
+    inv.at(3,1) = ( A.at(0,0) * c3 - A.at(0,1) * c1 + A.at(0,2) * c0);
+    inv.at(3,2) = (-A.at(3,0) * s3 + A.at(3,1) * s1 - A.at(3,2) * s0);
+    inv.at(3,3) = ( A.at(2,0) * s3 - A.at(2,1) * s1 + A.at(2,2) * s0);
+
+    if (M3D_FABS(det) < M3D_INVERSE_MATRIX_EPSILON) {
+        if (isInvertible != nullptr)
+            *isInvertible = false;
+    }
+    else {
+        if (isInvertible != nullptr)
+            *isInvertible = true;
+
+        det = 1.0 / det;
+
+        for (int i = 0; i < 16; ++i)
+            inv.data[i] *= det;
+    }
+
+    return inv;
+}
+
+M3D_DEF DMat4 operator + (DMat4 const &A, DMat4 const &B)
+{
+    DMat4 result;
+
+    for (int i = 0; i < 16; ++i)
+        result.data[i] = A.data[i] + B.data[i];
+
+    return result;
+}
+
+M3D_DEF DMat4 operator * (DMat4 const &A, DMat4 const &B)
+{
+    DMat4 result;
+
+    for (int c = 0; c < 4; ++c) {
+        for (int r = 0; r < 4; ++r) {
+            result.at(r, c) = ((A.at(r, 0) * B.at(0, c)) +
+                               (A.at(r, 1) * B.at(1, c)) +
+                               (A.at(r, 2) * B.at(2, c)) +
+                               (A.at(r, 3) * B.at(3, c)));
+        }
+    }
+
+    return result;
+}
+
+M3D_DEF DVec4 operator * (DMat4 const &A, DVec4 const &b)
+{
+    DVec4 result;
+
+    for (int r = 0; r < 4; ++r) {
+        result[r] = ((A.at(r, 0) * b.x) +
+                     (A.at(r, 1) * b.y) +
+                     (A.at(r, 2) * b.z) +
+                     (A.at(r, 3) * b.w));
+    }
+
+    return result;
+}
+
+M3D_DEF void to_camera_relative(DVec3 camera, DVec3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_AVX)
+    // Four DVec3s are twelve doubles which become three AVX registers
+    // whose lanes cycle through x, y and z, so the camera is subtracted
+    // with three rotated copies of it.
+    __m256d cam0 = _mm256_setr_pd(camera.x, camera.y, camera.z, camera.x);
+    __m256d cam1 = _mm256_setr_pd(camera.y, camera.z, camera.x, camera.y);
+    __m256d cam2 = _mm256_setr_pd(camera.z, camera.x, camera.y, camera.z);
+
+    double const *src = in[0].data;
+    float        *dst = reinterpret_cast<float *>(out);
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d a = _mm256_sub_pd(_mm256_loadu_pd(src + 3*i + 0), cam0);
+        __m256d b = _mm256_sub_pd(_mm256_loadu_pd(src + 3*i + 4), cam1);
+        __m256d c = _mm256_sub_pd(_mm256_loadu_pd(src + 3*i + 8), cam2);
+
+        _mm_storeu_ps(dst + 3*i + 0, _mm256_cvtpd_ps(a));
+        _mm_storeu_ps(dst + 3*i + 4, _mm256_cvtpd_ps(b));
+        _mm_storeu_ps(dst + 3*i + 8, _mm256_cvtpd_ps(c));
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = vec3(in[i] - camera);
+}
+/**** END DMat4 definitions ****/
+
+
+/**** BEGIN Half definitions ****/
+union M3dFloatBits {
+    float    f;
+    uint32_t u;
+};
+
+// Round to nearest even conversion, overflow goes to infinity and
+// NaNs stay (quiet) NaNs.
+M3D_DEF uint16_t to_half(float value)
+{
+    M3dFloatBits f;
+    M3dFloatBits const denorm_magic = { 0.5f };   // ((127 - 15) + (23 - 10) + 1) << 23
+    uint32_t     const f16_max      = (127 + 16) << 23;
+    uint32_t     const f32_inf      = 255 << 23;
+    uint16_t     result;
+
+    f.f = value;
+
+    uint32_t sign = f.u & 0x80000000u;
+    f.u ^= sign;
+
+    if (f.u >= f16_max) {
+        result = f.u > f32_inf ? 0x7e00 : 0x7c00;
+    }
+    else if (f.u < (113 << 23)) {
+        // Subnormal or zero, adding the magic value lines up the
+        // mantissa bits and lets the FPU do the rounding.
+        f.f   += denorm_magic.f;
+        result = uint16_t(f.u - denorm_magic.u);
+    }
+    else {
+        uint32_t mant_odd = (f.u >> 13) & 1;
+        f.u   += (uint32_t(15 - 127) << 23) + 0xfff + mant_odd;
+        result = uint16_t(f.u >> 13);
+    }
+
+    return uint16_t(result | (sign >> 16));
+}
+
+M3D_DEF float from_half(uint16_t h)
+{
+    M3dFloatBits       o;
+    M3dFloatBits const magic       = { 6.103515625e-05f };   // 113 << 23
+    uint32_t     const shifted_exp = 0x7c00 << 13;
+
+    o.u = uint32_t(h & 0x7fff) << 13;
+    uint32_t exp = shifted_exp & o.u;
+    o.u += (127 - 15) << 23;
+
+    if (exp == shifted_exp) {
+        // infinity or NaN
+        o.u += (128 - 16) << 23;
+    }
+    else if (exp == 0) {
+        // zero or subnormal
+        o.u += 1 << 23;
+        o.f -= magic.f;
+    }
+
+    o.u |= uint32_t(h & 0x8000) << 16;
+    return o.f;
+}
+
+inline M3D_DEF Half2 to_half(Vec2 v)
+{
+    Half2 h = { to_half(v.x), to_half(v.y) };
+    return h;
+}
+
+inline M3D_DEF Half3 to_half(Vec3 v)
+{
+    Half3 h = { to_half(v.x), to_half(v.y), to_half(v.z) };
+    return h;
+}
+
+inline M3D_DEF Half4 to_half(Vec4 v)
+{
+    Half4 h = { to_half(v.x), to_half(v.y), to_half(v.z), to_half(v.w) };
+    return h;
+}
+
+inline M3D_DEF Vec2 from_half(Half2 h)
+{
+    return vec2(from_half(h.x), from_half(h.y));
+}
+
+inline M3D_DEF Vec3 from_half(Half3 h)
+{
+    return vec3(from_half(h.x), from_half(h.y), from_half(h.z));
+}
+
+inline M3D_DEF Vec4 from_half(Half4 h)
+{
+    return vec4(from_half(h.x), from_half(h.y), from_half(h.z), from_half(h.w));
+}
+
+M3D_DEF void to_half(float const *M3D_RESTRICT in, uint16_t *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_F16C)
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), h);
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = to_half(in[i]);
+}
+
+M3D_DEF void from_half(uint16_t const *M3D_RESTRICT in, float *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_F16C)
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = from_half(in[i]);
+}
+
+// The vector and half types are tightly packed arrays of their
+// components so the array versions convert them as flat arrays.
+M3D_DEF void to_half(Vec2 const *M3D_RESTRICT in, Half2 *M3D_RESTRICT out, size_t count)
+{
+    to_half(in[0].data, &out[0].x, 2 * count);
+}
+
+M3D_DEF void to_half(Vec3 const *M3D_RESTRICT in, Half3 *M3D_RESTRICT out, size_t count)
+{
+    to_half(in[0].data, &out[0].x, 3 * count);
+}
+
+M3D_DEF void to_half(Vec4 const *M3D_RESTRICT in, Half4 *M3D_RESTRICT out, size_t count)
+{
+    to_half(in[0].data, &out[0].x, 4 * count);
+}
+
+M3D_DEF void from_half(Half2 const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count)
+{
+    from_half(&in[0].x, out[0].data, 2 * count);
+}
+
+M3D_DEF void from_half(Half3 const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    from_half(&in[0].x, out[0].data, 3 * count);
+}
+
+M3D_DEF void from_half(Half4 const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count)
+{
+    from_half(&in[0].x, out[0].data, 4 * count);
+}
+/**** END Half definitions ****/
+
+
+/**** BEGIN Packing definitions ****/
+// Sign manipulation is done on the bits so that batched loops over
+// data with random signs do not turn into mispredicted branches.
+static inline float m3d_copysign(float magnitude, float sign)
+{
+    M3dFloatBits m, s;
+    m.f = magnitude;
+    s.f = sign;
+    m.u = (m.u & 0x7fffffffu) | (s.u & 0x80000000u);
+    return m.f;
+}
+
+static inline float m3d_select_negative(float cond, float if_negative, float otherwise)
+{
+    M3dFloatBits c, a, b;
+    c.f = cond;
+    a.f = if_negative;
+    b.f = otherwise;
+
+    uint32_t mask = uint32_t(int32_t(c.u) >> 31);
+    a.u = (a.u & mask) | (b.u & ~mask);
+    return a.f;
+}
+
+static inline int32_t m3d_round(float x)
+{
+    return int32_t(x + m3d_copysign(0.5f, x));
+}
+
+static inline uint32_t m3d_snorm(float v, float range, uint32_t mask)
+{
+    return uint32_t(m3d_round(clamp(v, -1.0f, 1.0f) * range)) & mask;
+}
+
+static inline uint32_t m3d_unorm(float v, float range)
+{
+    return uint32_t(m3d_round(clamp(v, 0.0f, 1.0f) * range));
+}
+
+static inline float m3d_from_snorm16(uint32_t bits)
+{
+    return max_of(float(int16_t(uint16_t(bits))) * (1.0f / 32767.0f), -1.0f);
+}
+
+static inline float m3d_from_snorm8(uint32_t bits)
+{
+    return max_of(float(int8_t(uint8_t(bits))) * (1.0f / 127.0f), -1.0f);
+}
+
+// Projects a unit vector onto the octahedron and unfolds the lower
+// hemisphere over the diagonals into the [-1, 1] square.
+static inline Vec2 m3d_oct_wrap(Vec3 n)
+{
+    float inv = 1.0f / (M3D_FABSF(n.x) + M3D_FABSF(n.y) + M3D_FABSF(n.z));
+    float x   = n.x * inv;
+    float y   = n.y * inv;
+
+    float fx = m3d_copysign(1.0f - M3D_FABSF(y), x);
+    float fy = m3d_copysign(1.0f - M3D_FABSF(x), y);
+
+    return vec2(m3d_select_negative(n.z, fx, x), m3d_select_negative(n.z, fy, y));
+}
+
+static inline Vec3 m3d_oct_unwrap(float x, float y)
+{
+    float z = 1.0f - M3D_FABSF(x) - M3D_FABSF(y);
+    float t = max_of(-z, 0.0f);
+
+    x -= m3d_copysign(t, x);
+    y -= m3d_copysign(t, y);
+
+    return normalize(vec3(x, y, z));
+}
+
+inline M3D_DEF uint32_t encode_oct16(Vec3 n)
+{
+    Vec2 p = m3d_oct_wrap(n);
+    return m3d_snorm(p.x, 32767.0f, 0xffff) | (m3d_snorm(p.y, 32767.0f, 0xffff) << 16);
+}
+
+inline M3D_DEF Vec3 decode_oct16(uint32_t p)
+{
+    return m3d_oct_unwrap(m3d_from_snorm16(p), m3d_from_snorm16(p >> 16));
+}
+
+inline M3D_DEF uint16_t encode_oct8(Vec3 n)
+{
+    Vec2 p = m3d_oct_wrap(n);
+    return uint16_t(m3d_snorm(p.x, 127.0f, 0xff) | (m3d_snorm(p.y, 127.0f, 0xff) << 8));
+}
+
+inline M3D_DEF Vec3 decode_oct8(uint16_t p)
+{
+    return m3d_oct_unwrap(m3d_from_snorm8(p), m3d_from_snorm8(uint32_t(p) >> 8));
+}
+
+#if defined(M3D_USE_AVX)
+// The oct helpers above for eight vectors, with the same operations in
+// the same order so the batches match the single vector functions.
+// AVX has no 256-bit integer operations, so the integer packing is
+// done on 128-bit halves.
+static inline __m256 m3d_oct_copysign8(__m256 m, __m256 s)
+{
+    __m256 const sign = _mm256_set1_ps(-0.0f);
+    return _mm256_or_ps(_mm256_andnot_ps(sign, m), _mm256_and_ps(sign, s));
+}
+
+static inline void m3d_oct_wrap8(float const *p, __m256 *wx, __m256 *wy)
+{
+    __m256 const sign = _mm256_set1_ps(-0.0f);
+    __m256 const one  = _mm256_set1_ps(1.0f);
+    __m256 nx, ny, nz;
+    m3d_load_vec3x8(p, &nx, &ny, &nz);
+
+    __m256 ax  = _mm256_andnot_ps(sign, nx);
+    __m256 ay  = _mm256_andnot_ps(sign, ny);
+    __m256 az  = _mm256_andnot_ps(sign, nz);
+    __m256 inv = _mm256_div_ps(one, _mm256_add_ps(_mm256_add_ps(ax, ay), az));
+    __m256 x   = _mm256_mul_ps(nx, inv);
+    __m256 y   = _mm256_mul_ps(ny, inv);
+
+    __m256 fx = m3d_oct_copysign8(_mm256_sub_ps(one, _mm256_andnot_ps(sign, y)), x);
+    __m256 fy = m3d_oct_copysign8(_mm256_sub_ps(one, _mm256_andnot_ps(sign, x)), y);
+
+    // lanes with the sign bit of z set, -0 included, as a full mask
+    // for and/andnot since GCC splits blendv into single lanes
+    // without AVX2
+    __m256 lower = _mm256_cmp_ps(m3d_oct_copysign8(one, nz), _mm256_setzero_ps(), _CMP_LT_OQ);
+
+    *wx = _mm256_or_ps(_mm256_and_ps(lower, fx), _mm256_andnot_ps(lower, x));
+    *wy = _mm256_or_ps(_mm256_and_ps(lower, fy), _mm256_andnot_ps(lower, y));
+}
+
+static inline void m3d_oct_snorm8(__m256 v, float range, __m128i *lo, __m128i *hi)
+{
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+    v = _mm256_mul_ps(v, _mm256_set1_ps(range));
+    v = _mm256_add_ps(v, m3d_oct_copysign8(_mm256_set1_ps(0.5f), v));
+
+    __m256i r = _mm256_cvttps_epi32(v);
+    *lo = _mm256_castsi256_si128(r);
+    *hi = _mm256_extractf128_si256(r, 1);
+}
+
+static inline void m3d_oct_unwrap8(__m256 x, __m256 y, float *p)
+{
+    __m256 const sign = _mm256_set1_ps(-0.0f);
+    __m256 z = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_andnot_ps(sign, x)),
+                             _mm256_andnot_ps(sign, y));
+    __m256 t = _mm256_max_ps(_mm256_xor_ps(z, sign), _mm256_setzero_ps());
+
+    x = _mm256_sub_ps(x, m3d_oct_copysign8(t, x));
+    y = _mm256_sub_ps(y, m3d_oct_copysign8(t, y));
+
+    __m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+                                              _mm256_mul_ps(z, z)));
+    m3d_store_vec3x8(p, _mm256_div_ps(x, len), _mm256_div_ps(y, len), _mm256_div_ps(z, len));
+}
+
+static inline __m256 m3d_oct_from_snorm8(__m128i lo, __m128i hi, float scale)
+{
+    __m256 v = _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+    return _mm256_max_ps(_mm256_mul_ps(v, _mm256_set1_ps(scale)), _mm256_set1_ps(-1.0f));
+}
+#endif
+
+M3D_DEF void encode_oct16(Vec3 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_AVX)
+    __m128i const mask = _mm_set1_epi32(0xffff);
+
+    for (; i + 8 <= count; i += 8) {
+        __m256  x, y;
+        __m128i xlo, xhi, ylo, yhi;
+        m3d_oct_wrap8(in[i].data, &x, &y);
+        m3d_oct_snorm8(x, 32767.0f, &xlo, &xhi);
+        m3d_oct_snorm8(y, 32767.0f, &ylo, &yhi);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_or_si128(_mm_and_si128(xlo, mask), _mm_slli_epi32(ylo, 16)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 4),
+                         _mm_or_si128(_mm_and_si128(xhi, mask), _mm_slli_epi32(yhi, 16)));
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = encode_oct16(in[i]);
+}
+
+M3D_DEF void decode_oct16(uint32_t const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_AVX)
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i + 4));
+        __m256  x  = m3d_oct_from_snorm8(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+                                         _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16), 1.0f / 32767.0f);
+        __m256  y  = m3d_oct_from_snorm8(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16), 1.0f / 32767.0f);
+        m3d_oct_unwrap8(x, y, out[i].data);
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = decode_oct16(in[i]);
+}
+
+M3D_DEF void encode_oct8(Vec3 const *M3D_RESTRICT in, uint16_t *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_AVX)
+    __m128i const mask = _mm_set1_epi32(0xff);
+
+    for (; i + 8 <= count; i += 8) {
+        __m256  x, y;
+        __m128i xlo, xhi, ylo, yhi;
+        m3d_oct_wrap8(in[i].data, &x, &y);
+        m3d_oct_snorm8(x, 127.0f, &xlo, &xhi);
+        m3d_oct_snorm8(y, 127.0f, &ylo, &yhi);
+
+        __m128i lo = _mm_or_si128(_mm_and_si128(xlo, mask), _mm_slli_epi32(_mm_and_si128(ylo, mask), 8));
+        __m128i hi = _mm_or_si128(_mm_and_si128(xhi, mask), _mm_slli_epi32(_mm_and_si128(yhi, mask), 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi32(lo, hi));
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = encode_oct8(in[i]);
+}
+
+M3D_DEF void decode_oct8(uint16_t const *M3D_RESTRICT in, Vec3 *M3D_RESTRICT out, size_t count)
+{
+    size_t i = 0;
+
+#if defined(M3D_USE_AVX)
+    for (; i + 8 <= count; i += 8) {
+        __m128i p  = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+        __m128i lo = _mm_cvtepu16_epi32(p);
+        __m128i hi = _mm_cvtepu16_epi32(_mm_srli_si128(p, 8));
+        __m256  x  = m3d_oct_from_snorm8(_mm_srai_epi32(_mm_slli_epi32(lo, 24), 24),
+                                         _mm_srai_epi32(_mm_slli_epi32(hi, 24), 24), 1.0f / 127.0f);
+        __m256  y  = m3d_oct_from_snorm8(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 24),
+                                         _mm_srai_epi32(_mm_slli_epi32(hi, 16), 24), 1.0f / 127.0f);
+        m3d_oct_unwrap8(x, y, out[i].data);
+    }
+#endif
+
+    for (; i < count; ++i)
+        out[i] = decode_oct8(in[i]);
+}
+
+inline M3D_DEF uint32_t pack_snorm16(Vec2 v)
+{
+    return m3d_snorm(v.x, 32767.0f, 0xffff) | (m3d_snorm(v.y, 32767.0f, 0xffff) << 16);
+}
+
+inline M3D_DEF uint32_t pack_unorm16(Vec2 v)
+{
+    return m3d_unorm(v.x, 65535.0f) | (m3d_unorm(v.y, 65535.0f) << 16);
+}
+
+inline M3D_DEF uint32_t pack_snorm8(Vec4 v)
+{
+    return ((m3d_snorm(v.x, 127.0f, 0xff))       |
+            (m3d_snorm(v.y, 127.0f, 0xff) << 8)  |
+            (m3d_snorm(v.z, 127.0f, 0xff) << 16) |
+            (m3d_snorm(v.w, 127.0f, 0xff) << 24));
+}
+
+inline M3D_DEF uint32_t pack_unorm8(Vec4 v)
+{
+    return ((m3d_unorm(v.x, 255.0f))       |
+            (m3d_unorm(v.y, 255.0f) << 8)  |
+            (m3d_unorm(v.z, 255.0f) << 16) |
+            (m3d_unorm(v.w, 255.0f) << 24));
+}
+
+inline M3D_DEF Vec2 unpack_snorm16(uint32_t p)
+{
+    return vec2(m3d_from_snorm16(p), m3d_from_snorm16(p >> 16));
+}
+
+inline M3D_DEF Vec2 unpack_unorm16(uint32_t p)
+{
+    float const s = 1.0f / 65535.0f;
+    return vec2(float(p & 0xffff) * s, float(p >> 16) * s);
+}
+
+inline M3D_DEF Vec4 unpack_snorm8(uint32_t p)
+{
+    return vec4(m3d_from_snorm8(p),
+                m3d_from_snorm8(p >> 8),
+                m3d_from_snorm8(p >> 16),
+                m3d_from_snorm8(p >> 24));
+}
+
+inline M3D_DEF Vec4 unpack_unorm8(uint32_t p)
+{
+    float const s = 1.0f / 255.0f;
+    return vec4(float(p & 0xff) * s,
+                float((p >> 8) & 0xff) * s,
+                float((p >> 16) & 0xff) * s,
+                float(p >> 24) * s);
+}
+
+M3D_DEF void pack_snorm16(Vec2 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = pack_snorm16(in[i]);
+}
+
+M3D_DEF void pack_unorm16(Vec2 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = pack_unorm16(in[i]);
+}
+
+M3D_DEF void pack_snorm8(Vec4 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = pack_snorm8(in[i]);
+}
+
+M3D_DEF void pack_unorm8(Vec4 const *M3D_RESTRICT in, uint32_t *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = pack_unorm8(in[i]);
+}
+
+M3D_DEF void unpack_snorm16(uint32_t const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = unpack_snorm16(in[i]);
+}
+
+M3D_DEF void unpack_unorm16(uint32_t const *M3D_RESTRICT in, Vec2 *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = unpack_unorm16(in[i]);
+}
+
+M3D_DEF void unpack_snorm8(uint32_t const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = unpack_snorm8(in[i]);
+}
+
+M3D_DEF void unpack_unorm8(uint32_t const *M3D_RESTRICT in, Vec4 *M3D_RESTRICT out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = unpack_unorm8(in[i]);
+}
+/**** END Packing definitions ****/
+
+
+/**** BEGIN Ray definitions ****/
+M3D_DEF AABB aabb(Vec3 const *points, size_t count)
+{
+    AABB box = {
+        vec3( M3D_FLOAT_MAX,  M3D_FLOAT_MAX,  M3D_FLOAT_MAX),
+        vec3(-M3D_FLOAT_MAX, -M3D_FLOAT_MAX, -M3D_FLOAT_MAX)
+    };
+
+    for (size_t i = 0; i < count; ++i) {
+        box.min = min_of(box.min, points[i]);
+        box.max = max_of(box.max, points[i]);
+    }
+
+    return box;
+}
+
+inline M3D_DEF AABB merge(AABB const &a, AABB const &b)
+{
+    AABB box = { min_of(a.min, b.min), max_of(a.max, b.max) };
+    return box;
+}
+
+// A zero direction component gives an infinite inverse so that slab
+// is either all or nothing.  Rays lying exactly in one of the slab
+// planes give 0 * inf = NaN and may go either way.
+M3D_DEF bool intersect(Ray const &ray, AABB const &box, float t_max, float *t_near)
+{
+    float lo = 0.0f;
+    float hi = t_max;
+
+    for (int k = 0; k < 3; ++k) {
+        float inv = 1.0f / ray.direction.data[k];
+        float t0  = (box.min.data[k] - ray.origin.data[k]) * inv;
+        float t1  = (box.max.data[k] - ray.origin.data[k]) * inv;
+
+        lo = max_of(min_of(t0, t1), lo);
+        hi = min_of(max_of(t0, t1), hi);
+    }
+
+    if (t_near)
+        *t_near = lo;
+
+    return lo <= hi;
+}
+
+M3D_DEF bool intersect(Ray const &ray, Vec3 a, Vec3 b, Vec3 c, float *t, float *u, float *v)
+{
+    Vec3  e1  = b - a;
+    Vec3  e2  = c - a;
+    Vec3  p   = cross(ray.direction, e2);
+    float det = dot(e1, p);
+
+    if (det == 0.0f)
+        return false;
+
+    float inv = 1.0f / det;
+    Vec3  s   = ray.origin - a;
+    Vec3  q   = cross(s, e1);
+
+    *u = dot(s, p) * inv;
+    *v = dot(ray.direction, q) * inv;
+    *t = dot(e2, q) * inv;
+
+    return *u >= 0.0f && *v >= 0.0f && *u + *v <= 1.0f && *t >= 0.0f;
+}
+
+#if defined(M3D_USE_AVX)
+// Vertex j of eight triangles starting at p, p[9 k + 3 j + 0..2] for
+// triangle k, as x, y, and z registers.  Each load reads four floats,
+// so one float past the last vertex must be readable.
+static inline void m3d_load_vertices8(float const *p, __m256 *x, __m256 *y, __m256 *z)
+{
+    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 0)),  _mm_loadu_ps(p + 36), 1);
+    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 9)),  _mm_loadu_ps(p + 45), 1);
+    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 18)), _mm_loadu_ps(p + 54), 1);
+    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 27)), _mm_loadu_ps(p + 63), 1);
+    __m256 xy01 = _mm256_unpacklo_ps(r0, r1);
+    __m256 zw01 = _mm256_unpackhi_ps(r0, r1);
+    __m256 xy23 = _mm256_unpacklo_ps(r2, r3);
+    __m256 zw23 = _mm256_unpackhi_ps(r2, r3);
+
+    *x = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(1, 0, 1, 0));
+    *y = _mm256_shuffle_ps(xy01, xy23, _MM_SHUFFLE(3, 2, 3, 2));
+    *z = _mm256_shuffle_ps(zw01, zw23, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+// The scalar test of intersect_nearest for eight triangles, one per
+// lane, with the ray broadcast.
+static inline void m3d_intersect_triangles8(Ray const &ray, float const *tri, float *ts, float *us, float *vs)
+{
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const one  = _mm256_set1_ps(1.0f);
+    __m256 const dx   = _mm256_set1_ps(ray.direction.x);
+    __m256 const dy   = _mm256_set1_ps(ray.direction.y);
+    __m256 const dz   = _mm256_set1_ps(ray.direction.z);
+
+    __m256 ax, ay, az, bx, by, bz, cx, cy, cz;
+    m3d_load_vertices8(tri + 0, &ax, &ay, &az);
+    m3d_load_vertices8(tri + 3, &bx, &by, &bz);
+    m3d_load_vertices8(tri + 6, &cx, &cy, &cz);
+
+    __m256 e1x = _mm256_sub_ps(bx, ax), e1y = _mm256_sub_ps(by, ay), e1z = _mm256_sub_ps(bz, az);
+    __m256 e2x = _mm256_sub_ps(cx, ax), e2y = _mm256_sub_ps(cy, ay), e2z = _mm256_sub_ps(cz, az);
+    __m256 sx  = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), ax);
+    __m256 sy  = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), ay);
+    __m256 sz  = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), az);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+                               _mm256_mul_ps(e1z, pz));
+    __m256 inv = _mm256_div_ps(one, det);
+    __m256 u   = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+                                             _mm256_mul_ps(sz, pz)), inv);
+    __m256 v   = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                             _mm256_mul_ps(dz, qz)), inv);
+    __m256 t   = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                             _mm256_mul_ps(e2z, qz)), inv);
+
+    __m256 ok = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+
+    _mm256_storeu_ps(ts, _mm256_or_ps(_mm256_and_ps(ok, t), _mm256_andnot_ps(ok, _mm256_set1_ps(M3D_FLOAT_MAX))));
+    _mm256_storeu_ps(us, u);
+    _mm256_storeu_ps(vs, v);
+}
+#endif
+
+// Triangles are tested eight at a time into small arrays without
+// branches, misses get a distance of M3D_FLOAT_MAX, and only then is
+// the nearest of the eight picked out.  With AVX the eight are one
+// register each, except for the last block whose loads would read past
+// the end of the triangles.
+M3D_DEF bool intersect_nearest(Ray const &ray, Vec3 const *M3D_RESTRICT triangles, size_t count, RayHit *hit)
+{
+    Vec3 const o     = ray.origin;
+    Vec3 const d     = ray.direction;
+    bool       found = false;
+
+    for (size_t base = 0; base < count; base += 8) {
+        size_t n = count - base < 8 ? count - base : 8;
+        float  ts[8], us[8], vs[8];
+        size_t k = 0;
+
+#if defined(M3D_USE_AVX)
+        if (base + 8 < count) {
+            m3d_intersect_triangles8(ray, triangles[3 * base].data, ts, us, vs);
+            k = 8;
+        }
+#endif
+
+        for (; k < n; ++k) {
+            Vec3 const *tri = triangles + 3 * (base + k);
+            Vec3  e1  = tri[1] - tri[0];
+            Vec3  e2  = tri[2] - tri[0];
+            Vec3  p   = cross(d, e2);
+            float det = dot(e1, p);
+            float inv = 1.0f / det;
+            Vec3  s   = o - tri[0];
+            Vec3  q   = cross(s, e1);
+            float u   = dot(s, p) * inv;
+            float v   = dot(d, q) * inv;
+            float t   = dot(e2, q) * inv;
+            bool  ok  = (det != 0.0f) & (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) & (t >= 0.0f);
+
+            ts[k] = ok ? t : M3D_FLOAT_MAX;
+            us[k] = u;
+            vs[k] = v;
+        }
+
+        for (k = 0; k < n; ++k) {
+            if (ts[k] < hit->t) {
+                hit->t    = ts[k];
+                hit->u    = us[k];
+                hit->v    = vs[k];
+                hit->prim = uint32_t(base + k);
+                found     = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Lane arrays of a RayPacket4 or RayPacket8 so both widths share the
+// same loops.
+struct M3dRayLanes {
+    float    *o[3];
+    float    *d[3];
+    float    *inv[3];
+    float    *t;
+    float    *u;
+    float    *v;
+    uint32_t *prim;
+    int       width;
+};
+
+#define M3D_RAY_LANES(packet, n) {                                     \
+        { (packet).ox, (packet).oy, (packet).oz },                      \
+        { (packet).dx, (packet).dy, (packet).dz },                      \
+        { (packet).ix, (packet).iy, (packet).iz },                      \
+        (packet).t, (packet).u, (packet).v, (packet).prim, (n)          \
+    }
+
+static inline void m3d_ray_packet(Ray const *rays, size_t count, float t_max, M3dRayLanes L)
+{
+    for (int i = 0; i < L.width; ++i) {
+        bool on  = size_t(i) < count;
+        Vec3 o   = on ? rays[i].origin    : vec3(0, 0, 0);
+        Vec3 dir = on ? rays[i].direction : vec3(0, 0, 1);
+
+        for (int k = 0; k < 3; ++k) {
+            L.o[k][i]   = o.data[k];
+            L.d[k][i]   = dir.data[k];
+            L.inv[k][i] = 1.0f / dir.data[k];
+        }
+
+        L.t[i]    = on ? t_max : -1.0f;
+        L.u[i]    = 0.0f;
+        L.v[i]    = 0.0f;
+        L.prim[i] = ~0u;
+    }
+}
+
+static inline uint32_t m3d_intersect_packet(M3dRayLanes L, AABB const &box)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i < L.width; ++i) {
+        float lo = 0.0f;
+        float hi = L.t[i];
+
+        for (int k = 0; k < 3; ++k) {
+            float t0 = (box.min.data[k] - L.o[k][i]) * L.inv[k][i];
+            float t1 = (box.max.data[k] - L.o[k][i]) * L.inv[k][i];
+
+            lo = max_of(min_of(t0, t1), lo);
+            hi = min_of(max_of(t0, t1), hi);
+        }
+
+        mask |= uint32_t(lo <= hi) << i;
+    }
+
+    return mask;
+}
+
+// One triangle against every lane, a lane only takes the hit when it
+// is nearer than what the lane already has.
+static inline uint32_t m3d_intersect_packet(M3dRayLanes L, Vec3 a, Vec3 b, Vec3 c, uint32_t prim)
+{
+    Vec3 const e1   = b - a;
+    Vec3 const e2   = c - a;
+    uint32_t   mask = 0;
+
+    float const *M3D_RESTRICT ox = L.o[0];
+    float const *M3D_RESTRICT oy = L.o[1];
+    float const *M3D_RESTRICT oz = L.o[2];
+    float const *M3D_RESTRICT dxs = L.d[0];
+    float const *M3D_RESTRICT dys = L.d[1];
+    float const *M3D_RESTRICT dzs = L.d[2];
+    float       *M3D_RESTRICT ts = L.t;
+    float       *M3D_RESTRICT us = L.u;
+    float       *M3D_RESTRICT vs = L.v;
+    uint32_t    *M3D_RESTRICT ps = L.prim;
+
+    for (int i = 0; i < L.width; ++i) {
+        float dx  = dxs[i], dy = dys[i], dz = dzs[i];
+        float sx  = ox[i] - a.x, sy = oy[i] - a.y, sz = oz[i] - a.z;
+        float px  = dy * e2.z - dz * e2.y;
+        float py  = dz * e2.x - dx * e2.z;
+        float pz  = dx * e2.y - dy * e2.x;
+        float qx  = sy * e1.z - sz * e1.y;
+        float qy  = sz * e1.x - sx * e1.z;
+        float qz  = sx * e1.y - sy * e1.x;
+        float det = e1.x * px + e1.y * py + e1.z * pz;
+        float inv = 1.0f / det;
+        float u   = (sx * px + sy * py + sz * pz) * inv;
+        float v   = (dx * qx + dy * qy + dz * qz) * inv;
+        float t   = (e2.x * qx + e2.y * qy + e2.z * qz) * inv;
+        bool  ok  = (det != 0.0f) & (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) &
+                    (t >= 0.0f) & (t < ts[i]);
+
+        ts[i]  = ok ? t : ts[i];
+        us[i]  = ok ? u : us[i];
+        vs[i]  = ok ? v : vs[i];
+        ps[i]  = ok ? prim : ps[i];
+        mask  |= uint32_t(ok) << i;
+    }
+
+    return mask;
+}
+
+static inline uint32_t m3d_intersect_nearest(M3dRayLanes L, Vec3 const *M3D_RESTRICT triangles, size_t count)
+{
+    uint32_t mask = 0;
+
+    for (size_t i = 0; i < count; ++i)
+        mask |= m3d_intersect_packet(L, triangles[3*i + 0], triangles[3*i + 1], triangles[3*i + 2], uint32_t(i));
+
+    return mask;
+}
+
+M3D_DEF void ray_packet(Ray const *rays, size_t count, float t_max, RayPacket4 *packet)
+{
+    M3dRayLanes L = M3D_RAY_LANES(*packet, 4);
+    m3d_ray_packet(rays, count, t_max, L);
+}
+
+M3D_DEF void ray_packet(Ray const *rays, size_t count, float t_max, RayPacket8 *packet)
+{
+    M3dRayLanes L = M3D_RAY_LANES(*packet, 8);
+    m3d_ray_packet(rays, count, t_max, L);
+}
+
+// The lane views only write through t, u, v, and prim which the box
+// tests never do, so casting away const here is safe.
+M3D_DEF uint32_t intersect(RayPacket4 const &packet, AABB const &box)
+{
+    M3dRayLanes L = M3D_RAY_LANES(const_cast<RayPacket4 &>(packet), 4);
+    return m3d_intersect_packet(L, box);
+}
+
+M3D_DEF uint32_t intersect(RayPacket8 const &packet, AABB const &box)
+{
+#if defined(M3D_USE_AVX)
+    // _mm256_min_ps and _mm256_max_ps return the second operand when
+    // either is NaN, the same as min_of and max_of.
+    __m256 lo = _mm256_setzero_ps();
+    __m256 hi = _mm256_loadu_ps(packet.t);
+
+    float const *o[3]   = { packet.ox, packet.oy, packet.oz };
+    float const *inv[3] = { packet.ix, packet.iy, packet.iz };
+
+    for (int k = 0; k < 3; ++k) {
+        __m256 org = _mm256_loadu_ps(o[k]);
+        __m256 rcp = _mm256_loadu_ps(inv[k]);
+        __m256 t0  = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.data[k]), org), rcp);
+        __m256 t1  = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.data[k]), org), rcp);
+
+        lo = _mm256_max_ps(_mm256_min_ps(t0, t1), lo);
+        hi = _mm256_min_ps(_mm256_max_ps(t0, t1), hi);
+    }
+
+    return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ)));
+#else
+    M3dRayLanes L = M3D_RAY_LANES(const_cast<RayPacket8 &>(packet), 8);
+    return m3d_intersect_packet(L, box);
+#endif
+}
+
+M3D_DEF uint32_t intersect_nearest(RayPacket4 *packet, Vec3 const *M3D_RESTRICT triangles, size_t count)
+{
+    M3dRayLanes L = M3D_RAY_LANES(*packet, 4);
+    return m3d_intersect_nearest(L, triangles, count);
+}
+
+M3D_DEF uint32_t intersect_nearest(RayPacket8 *packet, Vec3 const *M3D_RESTRICT triangles, size_t count)
+{
+#if defined(M3D_USE_AVX)
+    // Same as m3d_intersect_packet with the rays and their nearest
+    // hits kept in registers for the whole triangle list.
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const one  = _mm256_set1_ps(1.0f);
+
+    __m256 ox = _mm256_loadu_ps(packet->ox);
+    __m256 oy = _mm256_loadu_ps(packet->oy);
+    __m256 oz = _mm256_loadu_ps(packet->oz);
+    __m256 dx = _mm256_loadu_ps(packet->dx);
+    __m256 dy = _mm256_loadu_ps(packet->dy);
+    __m256 dz = _mm256_loadu_ps(packet->dz);
+    __m256 t  = _mm256_loadu_ps(packet->t);
+    __m256 u  = _mm256_loadu_ps(packet->u);
+    __m256 v  = _mm256_loadu_ps(packet->v);
+    __m256 id = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(packet->prim)));
+    __m256 hits = zero;
+
+    for (size_t i = 0; i < count; ++i) {
+        Vec3 a  = triangles[3*i + 0];
+        Vec3 e1 = triangles[3*i + 1] - a;
+        Vec3 e2 = triangles[3*i + 2] - a;
+
+        __m256 e1x = _mm256_set1_ps(e1.x), e1y = _mm256_set1_ps(e1.y), e1z = _mm256_set1_ps(e1.z);
+        __m256 e2x = _mm256_set1_ps(e2.x), e2y = _mm256_set1_ps(e2.y), e2z = _mm256_set1_ps(e2.z);
+        __m256 sx  = _mm256_sub_ps(ox, _mm256_set1_ps(a.x));
+        __m256 sy  = _mm256_sub_ps(oy, _mm256_set1_ps(a.y));
+        __m256 sz  = _mm256_sub_ps(oz, _mm256_set1_ps(a.z));
+
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+                                   _mm256_mul_ps(e1z, pz));
+        __m256 inv = _mm256_div_ps(one, det);
+        __m256 uu  = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+                                                 _mm256_mul_ps(sz, pz)), inv);
+        __m256 vv  = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                                 _mm256_mul_ps(dz, qz)), inv);
+        __m256 tt  = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                                 _mm256_mul_ps(e2z, qz)), inv);
+
+        __m256 ok = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(tt, t, _CMP_LT_OQ));
+
+        // GCC splits blendv into single lanes without AVX2, ok is a
+        // full mask so and, andnot, and or do the same
+        t    = _mm256_or_ps(_mm256_and_ps(ok, tt), _mm256_andnot_ps(ok, t));
+        u    = _mm256_or_ps(_mm256_and_ps(ok, uu), _mm256_andnot_ps(ok, u));
+        v    = _mm256_or_ps(_mm256_and_ps(ok, vv), _mm256_andnot_ps(ok, v));
+        id   = _mm256_or_ps(_mm256_and_ps(ok, _mm256_castsi256_ps(_mm256_set1_epi32(int(i)))),
+                            _mm256_andnot_ps(ok, id));
+        hits = _mm256_or_ps(hits, ok);
+    }
+
+    _mm256_storeu_ps(packet->t, t);
+    _mm256_storeu_ps(packet->u, u);
+    _mm256_storeu_ps(packet->v, v);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(packet->prim), _mm256_castps_si256(id));
+
+    return uint32_t(_mm256_movemask_ps(hits));
+#else
+    M3dRayLanes L = M3D_RAY_LANES(*packet, 8);
+    return m3d_intersect_nearest(L, triangles, count);
+#endif
+}
+
+#undef M3D_RAY_LANES
+/**** END Ray definitions ****/
+
+
+/**** BEGIN BVH definitions ****/
+#define M3D_BVH_BINS   16
+#define M3D_BVH_CHUNKS 64
+
+struct M3dBVHBin {
+    AABB     box;
+    uint32_t count;
+};
+
+// Partial results of one chunk of the primitives of a split.
+struct M3dBVHChunk {
+    AABB      bounds;
+    M3dBVHBin bins[3][M3D_BVH_BINS];
+};
+
+// A node still to be built from recs[begin, end) within box.
+struct M3dBVHWork {
+    AABB     box;
+    uint32_t node;
+    uint32_t begin;
+    uint32_t end;
+};
+
+// Primitive boxes are copied next to their index and the records
+// themselves are partitioned so every pass reads memory in order.
+// The centroid is kept doubled as min + max.
+struct M3dBVHPrim {
+    Vec3     min;
+    uint32_t id;
+    Vec3     max;
+    uint32_t pad;
+};
+
+struct M3dBVHBuild {
+    M3dBVHPrim  *recs;
+    M3dBVHChunk *chunks;
+};
+
+struct M3dBVHEntry {
+    uint32_t node;
+    float    t;
+};
+
+static inline AABB m3d_empty_aabb()
+{
+    AABB box = {
+        vec3( M3D_FLOAT_MAX,  M3D_FLOAT_MAX,  M3D_FLOAT_MAX),
+        vec3(-M3D_FLOAT_MAX, -M3D_FLOAT_MAX, -M3D_FLOAT_MAX)
+    };
+    return box;
+}
+
+static inline float m3d_half_area(AABB const &box)
+{
+    Vec3 d = box.max - box.min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static inline size_t m3d_bvh_level_capacity(size_t count)
+{
+    // nodes of one level have disjoint ranges of more than a leaf
+    return count / (M3D_BVH_LEAF_SIZE + 1) + 1;
+}
+
+static inline int m3d_bvh_bin(float c, float c_min, float scale)
+{
+    return int(min_of((c - c_min) * scale, float(M3D_BVH_BINS - 1)));
+}
+
+static void m3d_bvh_bounds_chunk(M3dBVHBuild const &ctx, uint32_t begin, uint32_t end, M3dBVHChunk *out)
+{
+    AABB bounds = m3d_empty_aabb();
+
+    for (uint32_t i = begin; i < end; ++i) {
+        bounds.min = min_of(bounds.min, ctx.recs[i].min);
+        bounds.max = max_of(bounds.max, ctx.recs[i].max);
+    }
+
+    out->bounds = bounds;
+}
+
+static void m3d_bvh_bin_chunk(M3dBVHBuild const &ctx, uint32_t begin, uint32_t end,
+                              Vec3 c_min, Vec3 scale, M3dBVHChunk *out)
+{
+    for (int k = 0; k < 3; ++k) {
+        for (int b = 0; b < M3D_BVH_BINS; ++b) {
+            out->bins[k][b].box   = m3d_empty_aabb();
+            out->bins[k][b].count = 0;
+        }
+    }
+
+    for (uint32_t i = begin; i < end; ++i) {
+        M3dBVHPrim const &r = ctx.recs[i];
+        Vec3              c = r.min + r.max;
+
+        for (int k = 0; k < 3; ++k) {
+            M3dBVHBin &bin = out->bins[k][m3d_bvh_bin(c.data[k], c_min.data[k], scale.data[k])];
+            bin.box.min = min_of(bin.box.min, r.min);
+            bin.box.max = max_of(bin.box.max, r.max);
+            bin.count++;
+        }
+    }
+}
+
+// Runs one of the chunk passes over recs[begin, end), in parallel
+// when there are several chunks, and returns where the results are.
+#define M3D_BVH_RUN_CHUNKS(chunks, parts, begin, end, call)                            \
+    do {                                                                                \
+        if ((chunks) > 1) {                                                             \
+            uint32_t  run_size = ((end) - (begin) + uint32_t(chunks) - 1) / uint32_t(chunks); \
+            ptrdiff_t run_n    = ptrdiff_t(chunks);                                     \
+            M3D_PARALLEL_FOR                                                            \
+            for (ptrdiff_t c = 0; c < run_n; ++c) {                                     \
+                uint32_t lo = (begin) + uint32_t(c) * run_size;                         \
+                uint32_t hi = lo + run_size < (end) ? lo + run_size : (end);            \
+                M3dBVHChunk *part = (parts) + c;                                        \
+                call;                                                                   \
+            }                                                                           \
+        }                                                                               \
+        else {                                                                          \
+            uint32_t lo = (begin), hi = (end);                                          \
+            M3dBVHChunk *part = (parts);                                                \
+            call;                                                                       \
+        }                                                                               \
+    } while (0)
+
+// Splits recs[begin, end) in two, reorders it so the left half comes
+// first, and returns the start of the right half.  The split is the
+// lowest surface area heuristic cost over 16 bins along each axis of
+// box, the bounds of the range, or when forced or no bin boundary
+// separates the centroids simply the middle.  Binning over the bounds
+// instead of the centroid bounds saves a pass over the range for
+// hardly any loss of tree quality.
+static uint32_t m3d_bvh_split(M3dBVHBuild const &ctx, uint32_t begin, uint32_t end, AABB const &box,
+                              bool median, bool parallel, AABB *left, AABB *right)
+{
+    uint32_t const n = end - begin;
+
+    int chunks = parallel ? int(n / 16384) : 1;
+    chunks = chunks < 1 ? 1 : (chunks > M3D_BVH_CHUNKS ? M3D_BVH_CHUNKS : chunks);
+
+    M3dBVHChunk  local;
+    M3dBVHChunk *parts = chunks > 1 ? ctx.chunks : &local;
+
+    AABB  cb        = { 2.0f * box.min, 2.0f * box.max };
+    Vec3  extent    = cb.max - cb.min;
+    int   axis      = -1;
+    int   split_bin = 0;
+    float best_cost = M3D_FLOAT_MAX;
+
+    M3dBVHBin bins[3][M3D_BVH_BINS];
+
+    if (!median && (extent.x > 0.0f || extent.y > 0.0f || extent.z > 0.0f)) {
+        Vec3 scale;
+        for (int k = 0; k < 3; ++k)
+            scale.data[k] = extent.data[k] > 0.0f ? (M3D_BVH_BINS * 0.99999f) / extent.data[k] : 0.0f;
+
+        M3D_BVH_RUN_CHUNKS(chunks, parts, begin, end, m3d_bvh_bin_chunk(ctx, lo, hi, cb.min, scale, part));
+
+        for (int k = 0; k < 3; ++k) {
+            for (int b = 0; b < M3D_BVH_BINS; ++b) {
+                bins[k][b] = parts[0].bins[k][b];
+                for (int c = 1; c < chunks; ++c) {
+                    bins[k][b].box    = merge(bins[k][b].box, parts[c].bins[k][b].box);
+                    bins[k][b].count += parts[c].bins[k][b].count;
+                }
+            }
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            if (extent.data[k] <= 0.0f)
+                continue;
+
+            // cost of everything right of each split, swept from the right
+            float    right_cost[M3D_BVH_BINS];
+            AABB     acc   = m3d_empty_aabb();
+            uint32_t count = 0;
+
+            for (int b = M3D_BVH_BINS - 1; b > 0; --b) {
+                acc    = merge(acc, bins[k][b].box);
+                count += bins[k][b].count;
+                right_cost[b] = count ? float(count) * m3d_half_area(acc) : 0.0f;
+            }
+
+            acc   = m3d_empty_aabb();
+            count = 0;
+
+            for (int b = 0; b < M3D_BVH_BINS - 1; ++b) {
+                acc    = merge(acc, bins[k][b].box);
+                count += bins[k][b].count;
+
+                float cost = (count ? float(count) * m3d_half_area(acc) : 0.0f) + right_cost[b + 1];
+                if (count > 0 && count < n && cost < best_cost) {
+                    best_cost = cost;
+                    axis      = k;
+                    split_bin = b;
+                }
+            }
+        }
+    }
+
+    if (axis < 0) {
+        uint32_t mid = begin + n / 2;
+        *left  = m3d_empty_aabb();
+        *right = m3d_empty_aabb();
+        for (uint32_t i = begin; i < end; ++i) {
+            AABB *side = i < mid ? left : right;
+            side->min = min_of(side->min, ctx.recs[i].min);
+            side->max = max_of(side->max, ctx.recs[i].max);
+        }
+        return mid;
+    }
+
+    float const c_min = cb.min.data[axis];
+    float const scale = (M3D_BVH_BINS * 0.99999f) / extent.data[axis];
+
+    uint32_t i = begin;
+    uint32_t j = end;
+    while (i < j) {
+        M3dBVHPrim r = ctx.recs[i];
+        if (m3d_bvh_bin(r.min.data[axis] + r.max.data[axis], c_min, scale) <= split_bin) {
+            ++i;
+        }
+        else {
+            ctx.recs[i] = ctx.recs[--j];
+            ctx.recs[j] = r;
+        }
+    }
+
+    *left  = m3d_empty_aabb();
+    *right = m3d_empty_aabb();
+    for (int b = 0; b < M3D_BVH_BINS; ++b) {
+        if (b <= split_bin)
+            *left  = merge(*left, bins[axis][b].box);
+        else
+            *right = merge(*right, bins[axis][b].box);
+    }
+
+    return i;
+}
+
+// Splits the range of w into up to four children, always splitting the
+// child with the largest surface area next, and writes them to node.
+// Children too big for a leaf keep their range in child and count and
+// are turned into inner nodes by the caller.
+static void m3d_bvh_build_node(M3dBVHBuild const &ctx, BVHNode *node, M3dBVHWork const &w,
+                               bool median, bool parallel)
+{
+    uint32_t begin[4] = { w.begin };
+    uint32_t end[4]   = { w.end };
+    AABB     box[4]   = { w.box };
+    int      n        = w.end > w.begin ? 1 : 0;
+
+    while (n > 0 && n < 4) {
+        int   j    = -1;
+        float area = -1.0f;
+
+        for (int k = 0; k < n; ++k) {
+            if (end[k] - begin[k] > M3D_BVH_LEAF_SIZE && m3d_half_area(box[k]) > area) {
+                area = m3d_half_area(box[k]);
+                j    = k;
+            }
+        }
+
+        if (j < 0)
+            break;
+
+        AABB     all = box[j];
+        uint32_t mid = m3d_bvh_split(ctx, begin[j], end[j], all, median, parallel, &box[j], &box[n]);
+        begin[n] = mid;
+        end[n]   = end[j];
+        end[j]   = mid;
+        ++n;
+    }
+
+    for (int k = 0; k < 4; ++k) {
+        AABB b = k < n ? box[k] : m3d_empty_aabb();
+
+        node->min_x[k] = b.min.x;
+        node->min_y[k] = b.min.y;
+        node->min_z[k] = b.min.z;
+        node->max_x[k] = b.max.x;
+        node->max_y[k] = b.max.y;
+        node->max_z[k] = b.max.z;
+        node->child[k] = k < n ? begin[k] : uint32_t(M3D_BVH_EMPTY);
+        node->count[k] = k < n ? end[k] - begin[k] : 0;
+    }
+}
+
+inline M3D_DEF size_t bvh_max_nodes(size_t prim_count)
+{
+    return prim_count / 2 + 1;
+}
+
+M3D_DEF size_t bvh_scratch_size(size_t prim_count)
+{
+    return (prim_count * sizeof(M3dBVHPrim) +
+            2 * m3d_bvh_level_capacity(prim_count) * sizeof(M3dBVHWork) +
+            M3D_BVH_CHUNKS * sizeof(M3dBVHChunk));
+}
+
+// Where primitive boxes come from, either triangles or boxes is set.
+struct M3dBVHSource {
+    Vec3 const *triangles;
+    AABB const *boxes;
+};
+
+static inline AABB m3d_bvh_prim_box(M3dBVHSource const &src, uint32_t id)
+{
+    if (src.boxes)
+        return src.boxes[id];
+
+    Vec3 const *tri = src.triangles + 3 * size_t(id);
+    AABB        box = { min_of(min_of(tri[0], tri[1]), tri[2]), max_of(max_of(tri[0], tri[1]), tri[2]) };
+    return box;
+}
+
+// Fills the records at the start of the scratch for the primitives
+// ids[0 .. count), or 0 .. count when ids is null.
+static void m3d_bvh_fill(M3dBVHSource const &src, uint32_t const *ids, size_t count, void *scratch)
+{
+    M3dBVHPrim *recs = static_cast<M3dBVHPrim *>(scratch);
+
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        uint32_t id  = ids ? ids[i] : uint32_t(i);
+        AABB     box = m3d_bvh_prim_box(src, id);
+
+        recs[i].min = box.min;
+        recs[i].max = box.max;
+        recs[i].id  = id;
+        recs[i].pad = 0;
+    }
+}
+
+// Builds the subtree below the node root, at the given depth, over
+// the count records at the start of the scratch which become
+// prims[first .. first + count).  New inner nodes are appended after
+// node_count and the bounds of the subtree are returned.
+static AABB m3d_bvh_build(BVH *bvh, uint32_t root, uint32_t first, size_t count, int depth, void *scratch)
+{
+    M3dBVHPrim *recs  = static_cast<M3dBVHPrim *>(scratch);
+    M3dBVHWork *level = reinterpret_cast<M3dBVHWork *>(recs + count);
+    M3dBVHWork *next  = level + m3d_bvh_level_capacity(count);
+
+    M3dBVHBuild ctx;
+    ctx.recs   = recs;
+    ctx.chunks = reinterpret_cast<M3dBVHChunk *>(next + m3d_bvh_level_capacity(count));
+
+    M3dBVHChunk *parts  = ctx.chunks;
+    int          chunks = int(count / 16384);
+    chunks = chunks < 1 ? 1 : (chunks > M3D_BVH_CHUNKS ? M3D_BVH_CHUNKS : chunks);
+
+    M3D_BVH_RUN_CHUNKS(chunks, parts, 0u, uint32_t(count), m3d_bvh_bounds_chunk(ctx, lo, hi, part));
+
+    AABB bounds = parts[0].bounds;
+    for (int c = 1; c < chunks; ++c)
+        bounds = merge(bounds, parts[c].bounds);
+
+    level[0].box   = bounds;
+    level[0].node  = root;
+    level[0].begin = 0;
+    level[0].end   = uint32_t(count);
+
+    size_t level_count = 1;
+
+    for (; level_count > 0; ++depth) {
+        // Past this depth every split is at the middle so each level
+        // at least halves the largest child.  With up to 2^32
+        // primitives the inner nodes end by depth 44 + 29 = 73, which
+        // is deeper than M3D_BVH_MAX_DEPTH.  The traversals push at
+        // most 3 entries per level plus the root, 3 * 73 + 1 = 220,
+        // and their stacks hold 4 * M3D_BVH_MAX_DEPTH = 256.
+        bool median = depth >= M3D_BVH_MAX_DEPTH - 20;
+
+        if (level_count < 32) {
+            for (size_t i = 0; i < level_count; ++i)
+                m3d_bvh_build_node(ctx, bvh->nodes + level[i].node, level[i], median, true);
+        }
+        else {
+            ptrdiff_t m = ptrdiff_t(level_count);
+            M3D_PARALLEL_FOR
+            for (ptrdiff_t i = 0; i < m; ++i)
+                m3d_bvh_build_node(ctx, bvh->nodes + level[i].node, level[i], median, false);
+        }
+
+        // number the inner nodes of the next level in order so the
+        // layout does not depend on the thread count
+        size_t next_count = 0;
+
+        for (size_t i = 0; i < level_count; ++i) {
+            BVHNode *node = bvh->nodes + level[i].node;
+
+            for (int k = 0; k < 4; ++k) {
+                if (node->count[k] == 0)
+                    continue;
+
+                if (node->count[k] <= M3D_BVH_LEAF_SIZE) {
+                    node->child[k] += first;
+                    continue;
+                }
+
+                M3dBVHWork &w = next[next_count++];
+                w.box.min = vec3(node->min_x[k], node->min_y[k], node->min_z[k]);
+                w.box.max = vec3(node->max_x[k], node->max_y[k], node->max_z[k]);
+                w.node    = uint32_t(bvh->node_count++);
+                w.begin   = node->child[k];
+                w.end     = node->child[k] + node->count[k];
+
+                node->child[k] = w.node;
+                node->count[k] = 0;
+            }
+        }
+
+        M3dBVHWork *t = level;
+        level       = next;
+        next        = t;
+        level_count = next_count;
+    }
+
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        bvh->prims[first + i] = recs[i].id;
+
+    return bounds;
+}
+
+struct M3dBVHCost {
+    float    *store;
+    float     max_growth;
+    uint32_t *out;
+    size_t    max_out;
+    size_t    total;
+};
+
+// Surface area heuristic cost of the subtree below a node relative to
+// the surface area of the node, counting one for every node visited
+// and one for every primitive tested.  Costs are stored when store is
+// set, otherwise nodes whose cost grew by more than max_growth over
+// the stored cost are reported.  Reports from below a node are taken
+// back when the node itself is reported so only the topmost remain.
+static float m3d_bvh_cost(BVH const &bvh, uint32_t index, M3dBVHCost *ctx)
+{
+    BVHNode const &node  = bvh.nodes[index];
+    size_t  const  mark  = ctx->total;
+    AABB           box   = m3d_empty_aabb();
+    float          area[4];
+    float          sub[4];
+
+    for (int k = 0; k < 4; ++k) {
+        AABB b = {
+            vec3(node.min_x[k], node.min_y[k], node.min_z[k]),
+            vec3(node.max_x[k], node.max_y[k], node.max_z[k])
+        };
+        bool used = node.child[k] != uint32_t(M3D_BVH_EMPTY) || node.count[k] != 0;
+
+        box     = merge(box, b);
+        area[k] = used ? m3d_half_area(b) : 0.0f;
+        sub[k]  = !used ? 0.0f : (node.count[k] ? float(node.count[k]) : m3d_bvh_cost(bvh, node.child[k], ctx));
+    }
+
+    float total = m3d_half_area(box);
+    float cost  = 1.0f;
+
+    for (int k = 0; k < 4; ++k)
+        cost += (total > 0.0f ? area[k] / total : 1.0f) * sub[k];
+
+    if (ctx->store) {
+        ctx->store[index] = cost;
+    }
+    else if (cost > ctx->max_growth * bvh.costs[index]) {
+        ctx->total = mark;
+        if (ctx->total < ctx->max_out)
+            ctx->out[ctx->total] = index;
+        ctx->total++;
+    }
+
+    return cost;
+}
+
+static void m3d_bvh_store_costs(BVH *bvh, uint32_t root)
+{
+    if (bvh->costs && bvh->prim_count > 0) {
+        M3dBVHCost ctx = { bvh->costs, 0.0f, nullptr, 0, 0 };
+        m3d_bvh_cost(*bvh, root, &ctx);
+    }
+}
+
+M3D_DEF void bvh_init(BVH *bvh, BVHNode *nodes, uint32_t *prims, float *costs)
+{
+    bvh->nodes      = nodes;
+    bvh->prims      = prims;
+    bvh->costs      = costs;
+    bvh->node_count = 0;
+    bvh->prim_count = 0;
+    bvh->bounds     = m3d_empty_aabb();
+}
+
+static void m3d_bvh_build(BVH *bvh, M3dBVHSource const &src, size_t count, void *scratch)
+{
+    m3d_bvh_fill(src, nullptr, count, scratch);
+
+    bvh->prim_count = count;
+    bvh->node_count = 1;
+    bvh->bounds     = m3d_bvh_build(bvh, 0, 0, count, 0, scratch);
+
+    m3d_bvh_store_costs(bvh, 0);
+}
+
+M3D_DEF void bvh_build(BVH *bvh, AABB const *M3D_RESTRICT boxes, size_t count, void *scratch)
+{
+    M3dBVHSource src = { nullptr, boxes };
+    m3d_bvh_build(bvh, src, count, scratch);
+}
+
+M3D_DEF void bvh_build(BVH *bvh, Vec3 const *M3D_RESTRICT triangles, size_t count, void *scratch)
+{
+    M3dBVHSource src = { triangles, nullptr };
+    m3d_bvh_build(bvh, src, count, scratch);
+}
+
+// Refits the subtree below a node depth first and returns its bounds.
+// Unused children keep their inverted boxes which merge as nothing.
+static AABB m3d_bvh_refit(BVH *bvh, M3dBVHSource const &src, uint32_t index, bool recurse)
+{
+    BVHNode &node = bvh->nodes[index];
+    AABB     box  = m3d_empty_aabb();
+
+    for (int k = 0; k < 4; ++k) {
+        AABB b;
+
+        if (node.count[k] > 0) {
+            b = m3d_bvh_prim_box(src, bvh->prims[node.child[k]]);
+            for (uint32_t i = node.child[k] + 1; i < node.child[k] + node.count[k]; ++i)
+                b = merge(b, m3d_bvh_prim_box(src, bvh->prims[i]));
+        }
+        else if (node.child[k] != uint32_t(M3D_BVH_EMPTY)) {
+            if (recurse) {
+                b = m3d_bvh_refit(bvh, src, node.child[k], true);
+            }
+            else {
+                BVHNode const &c = bvh->nodes[node.child[k]];
+                b = m3d_empty_aabb();
+                for (int j = 0; j < 4; ++j) {
+                    b.min = min_of(b.min, vec3(c.min_x[j], c.min_y[j], c.min_z[j]));
+                    b.max = max_of(b.max, vec3(c.max_x[j], c.max_y[j], c.max_z[j]));
+                }
+            }
+        }
+        else {
+            continue;
+        }
+
+        node.min_x[k] = b.min.x;
+        node.min_y[k] = b.min.y;
+        node.min_z[k] = b.min.z;
+        node.max_x[k] = b.max.x;
+        node.max_y[k] = b.max.y;
+        node.max_z[k] = b.max.z;
+        box = merge(box, b);
+    }
+
+    return box;
+}
+
+// The top of the tree is expanded breadth first until there are enough
+// subtrees to go around the threads.  The subtrees are refit in
+// parallel and then the top nodes one by one from the bottom up.
+static void m3d_bvh_refit(BVH *bvh, M3dBVHSource const &src)
+{
+    uint32_t top[256];
+    uint32_t frontier[256];
+    size_t   top_count      = 0;
+    size_t   frontier_count = 0;
+
+    if (bvh->prim_count == 0)
+        return;
+
+    frontier[frontier_count++] = 0;
+
+    // nodes move to top after their parents so refitting top in
+    // reverse order always sees the children done first
+    for (size_t i = 0; i < frontier_count && frontier_count < 64 && top_count < 255; ) {
+        BVHNode const &node  = bvh->nodes[frontier[i]];
+        bool           inner = false;
+
+        for (int k = 0; k < 4; ++k)
+            inner = inner || (node.count[k] == 0 && node.child[k] != uint32_t(M3D_BVH_EMPTY));
+
+        if (!inner) {
+            ++i;
+            continue;
+        }
+
+        top[top_count++] = frontier[i];
+        frontier[i]      = frontier[--frontier_count];
+
+        for (int k = 0; k < 4; ++k) {
+            if (node.count[k] == 0 && node.child[k] != uint32_t(M3D_BVH_EMPTY))
+                frontier[frontier_count++] = node.child[k];
+        }
+    }
+
+    ptrdiff_t n = ptrdiff_t(frontier_count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        m3d_bvh_refit(bvh, src, frontier[i], true);
+
+    AABB bounds = m3d_empty_aabb();
+    for (size_t i = top_count; i > 0; --i)
+        bounds = m3d_bvh_refit(bvh, src, top[i - 1], false);
+
+    bvh->bounds = top_count > 0 ? bounds : m3d_bvh_refit(bvh, src, 0, false);
+}
+
+M3D_DEF void bvh_refit(BVH *bvh, AABB const *M3D_RESTRICT boxes)
+{
+    M3dBVHSource src = { nullptr, boxes };
+    m3d_bvh_refit(bvh, src);
+}
+
+M3D_DEF void bvh_refit(BVH *bvh, Vec3 const *M3D_RESTRICT triangles)
+{
+    M3dBVHSource src = { triangles, nullptr };
+    m3d_bvh_refit(bvh, src);
+}
+
+M3D_DEF size_t bvh_degraded(BVH const &bvh, float max_growth, uint32_t *M3D_RESTRICT out, size_t max_out)
+{
+    if (!bvh.costs || bvh.prim_count == 0)
+        return 0;
+
+    M3dBVHCost ctx = { nullptr, max_growth, out, max_out, 0 };
+    m3d_bvh_cost(bvh, 0, &ctx);
+    return ctx.total;
+}
+
+// Rebuilding the root is a plain build.  Any other subtree covers a
+// contiguous range of prims which is rebuilt into new nodes appended
+// to the array, its old nodes other than the root are abandoned.  The
+// boxes above the subtree are left as they are since they were refit
+// from the same positions.
+static bool m3d_bvh_rebuild(BVH *bvh, uint32_t root, M3dBVHSource const &src, void *scratch)
+{
+    if (root == 0) {
+        m3d_bvh_build(bvh, src, bvh->prim_count, scratch);
+        return true;
+    }
+
+    // find the depth of root and the range of prims below it
+    struct Entry { uint32_t node; int depth; bool inside; };
+    Entry    stack[4 * M3D_BVH_MAX_DEPTH];
+    int      sp    = 0;
+    int      depth = -1;
+    uint32_t first = uint32_t(bvh->prim_count);
+    uint32_t last  = 0;
+
+    stack[sp].node   = 0;
+    stack[sp].depth  = 0;
+    stack[sp].inside = false;
+    ++sp;
+
+    while (sp > 0) {
+        Entry e = stack[--sp];
+        if (e.node == root) {
+            depth    = e.depth;
+            e.inside = true;
+        }
+
+        BVHNode const &node = bvh->nodes[e.node];
+        for (int k = 0; k < 4; ++k) {
+            if (node.count[k] > 0 && e.inside) {
+                uint32_t end = node.child[k] + node.count[k];
+                first = node.child[k] < first ? node.child[k] : first;
+                last  = end > last ? end : last;
+            }
+            else if (node.count[k] == 0 && node.child[k] != uint32_t(M3D_BVH_EMPTY)) {
+                stack[sp].node   = node.child[k];
+                stack[sp].depth  = e.depth + 1;
+                stack[sp].inside = e.inside;
+                ++sp;
+            }
+        }
+    }
+
+    if (depth < 0 || last <= first)
+        return false;
+
+    size_t count = last - first;
+    if (bvh->node_count + bvh_max_nodes(count) > bvh_max_nodes(bvh->prim_count))
+        return false;
+
+    m3d_bvh_fill(src, bvh->prims + first, count, scratch);
+    m3d_bvh_build(bvh, root, first, count, depth, scratch);
+    m3d_bvh_store_costs(bvh, root);
+
+    return true;
+}
+
+M3D_DEF bool bvh_rebuild(BVH *bvh, uint32_t node, AABB const *M3D_RESTRICT boxes, void *scratch)
+{
+    M3dBVHSource src = { nullptr, boxes };
+    return m3d_bvh_rebuild(bvh, node, src, scratch);
+}
+
+M3D_DEF bool bvh_rebuild(BVH *bvh, uint32_t node, Vec3 const *M3D_RESTRICT triangles, void *scratch)
+{
+    M3dBVHSource src = { triangles, nullptr };
+    return m3d_bvh_rebuild(bvh, node, src, scratch);
+}
+
+// Slab test of a ray against the four child boxes of a node, the entry
+// distances go to t_near and bit k is set when child k is hit before
+// t_max.  Unused children are not rejected by this and have to be
+// skipped by the caller.
+static inline uint32_t m3d_bvh_slab4(BVHNode const &node, Vec3 o, Vec3 inv, float t_max, float *t_near)
+{
+#if defined(M3D_USE_AVX)
+    __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+    __m128 ix = _mm_set1_ps(inv.x), iy = _mm_set1_ps(inv.y), iz = _mm_set1_ps(inv.z);
+
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), ox), ix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x), ox), ix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), oy), iy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y), oy), iy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), oz), iz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z), oz), iz);
+
+    __m128 lo = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                           _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+    __m128 hi = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                           _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+
+    _mm_storeu_ps(t_near, lo);
+    return uint32_t(_mm_movemask_ps(_mm_cmple_ps(lo, hi)));
+#else
+    uint32_t mask = 0;
+
+    for (int k = 0; k < 4; ++k) {
+        float tx0 = (node.min_x[k] - o.x) * inv.x;
+        float tx1 = (node.max_x[k] - o.x) * inv.x;
+        float ty0 = (node.min_y[k] - o.y) * inv.y;
+        float ty1 = (node.max_y[k] - o.y) * inv.y;
+        float tz0 = (node.min_z[k] - o.z) * inv.z;
+        float tz1 = (node.max_z[k] - o.z) * inv.z;
+
+        float lo = max_of(max_of(min_of(tx0, tx1), min_of(ty0, ty1)), max_of(min_of(tz0, tz1), 0.0f));
+        float hi = min_of(min_of(max_of(tx0, tx1), max_of(ty0, ty1)), min_of(max_of(tz0, tz1), t_max));
+
+        t_near[k] = lo;
+        mask     |= uint32_t(lo <= hi) << k;
+    }
+
+    return mask;
+#endif
+}
+
+static inline uint32_t m3d_bvh_overlap4(BVHNode const &node, AABB const &box)
+{
+#if defined(M3D_USE_AVX)
+    __m128 ok = _mm_cmple_ps(_mm_loadu_ps(node.min_x), _mm_set1_ps(box.max.x));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_loadu_ps(node.min_y), _mm_set1_ps(box.max.y)));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_loadu_ps(node.min_z), _mm_set1_ps(box.max.z)));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(_mm_loadu_ps(node.max_x), _mm_set1_ps(box.min.x)));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(_mm_loadu_ps(node.max_y), _mm_set1_ps(box.min.y)));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(_mm_loadu_ps(node.max_z), _mm_set1_ps(box.min.z)));
+    return uint32_t(_mm_movemask_ps(ok));
+#else
+    uint32_t mask = 0;
+
+    for (int k = 0; k < 4; ++k) {
+        bool ok = ((node.min_x[k] <= box.max.x) & (node.min_y[k] <= box.max.y) & (node.min_z[k] <= box.max.z) &
+                   (node.max_x[k] >= box.min.x) & (node.max_y[k] >= box.min.y) & (node.max_z[k] >= box.min.z));
+        mask |= uint32_t(ok) << k;
+    }
+
+    return mask;
+#endif
+}
+
+// Children are visited nearest first and a stack entry is dropped
+// when a closer hit was found after it was pushed.
+M3D_DEF bool bvh_intersect(BVH const &bvh, Vec3 const *M3D_RESTRICT triangles, Ray const &ray, RayHit *hit)
+{
+    M3dBVHEntry stack[4 * M3D_BVH_MAX_DEPTH];
+    int         sp    = 0;
+    bool        found = false;
+    Vec3        inv   = vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+    if (bvh.prim_count == 0)
+        return false;
+
+    stack[sp].node = 0;
+    stack[sp].t    = 0.0f;
+    ++sp;
+
+    while (sp > 0) {
+        M3dBVHEntry entry = stack[--sp];
+        if (entry.t > hit->t)
+            continue;
+
+        BVHNode const &node = bvh.nodes[entry.node];
+        float          t_near[4];
+        uint32_t       mask = m3d_bvh_slab4(node, ray.origin, inv, hit->t, t_near);
+
+        M3dBVHEntry inner[4];
+        int         inner_count = 0;
+
+        for (int k = 0; k < 4; ++k) {
+            if (!(mask & (1u << k)) || node.child[k] == uint32_t(M3D_BVH_EMPTY))
+                continue;
+
+            if (node.count[k] == 0) {
+                // keep the inner children sorted far to near
+                int j = inner_count++;
+                while (j > 0 && inner[j - 1].t < t_near[k]) {
+                    inner[j] = inner[j - 1];
+                    --j;
+                }
+                inner[j].node = node.child[k];
+                inner[j].t    = t_near[k];
+                continue;
+            }
+
+            for (uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; ++i) {
+                Vec3 const *tri = triangles + 3 * size_t(bvh.prims[i]);
+                float t, u, v;
+
+                if (intersect(ray, tri[0], tri[1], tri[2], &t, &u, &v) && t < hit->t) {
+                    hit->t    = t;
+                    hit->u    = u;
+                    hit->v    = v;
+                    hit->prim = bvh.prims[i];
+                    found     = true;
+                }
+            }
+        }
+
+        for (int j = 0; j < inner_count; ++j) {
+            if (inner[j].t <= hit->t)
+                stack[sp++] = inner[j];
+        }
+    }
+
+    return found;
+}
+
+M3D_DEF void bvh_intersect(BVH const &bvh, Vec3 const *M3D_RESTRICT triangles,
+                           Ray const *M3D_RESTRICT rays, RayHit *M3D_RESTRICT hits, size_t count)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        bvh_intersect(bvh, triangles, rays[i], hits + i);
+}
+
+M3D_DEF size_t bvh_overlap(BVH const &bvh, AABB const &box, uint32_t *M3D_RESTRICT out, size_t max_out)
+{
+    uint32_t stack[4 * M3D_BVH_MAX_DEPTH];
+    int      sp    = 0;
+    size_t   total = 0;
+
+    if (bvh.prim_count == 0)
+        return 0;
+
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+        BVHNode const &node = bvh.nodes[stack[--sp]];
+        uint32_t       mask = m3d_bvh_overlap4(node, box);
+
+        for (int k = 0; k < 4; ++k) {
+            if (!(mask & (1u << k)) || node.child[k] == uint32_t(M3D_BVH_EMPTY))
+                continue;
+
+            if (node.count[k] == 0) {
+                stack[sp++] = node.child[k];
+                continue;
+            }
+
+            for (uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; ++i) {
+                if (total < max_out)
+                    out[total] = bvh.prims[i];
+                ++total;
+            }
+        }
+    }
+
+    return total;
+}
+
+#undef M3D_BVH_RUN_CHUNKS
+#undef M3D_BVH_BINS
+#undef M3D_BVH_CHUNKS
+/**** END BVH definitions ****/
+
+
+/**** BEGIN Morton definitions ****/
+#define M3D_RADIX_CHUNKS 64
+
+// Spreads the low bits of x out to every third bit.
+static inline uint32_t m3d_spread10(uint32_t x)
+{
+#if defined(M3D_USE_BMI2)
+    return _pdep_u32(x, 0x09249249u);
+#else
+    x &= 0x3ff;
+    x  = (x | (x << 16)) & 0x030000ffu;
+    x  = (x | (x <<  8)) & 0x0300f00fu;
+    x  = (x | (x <<  4)) & 0x030c30c3u;
+    x  = (x | (x <<  2)) & 0x09249249u;
+    return x;
+#endif
+}
+
+static inline uint64_t m3d_spread21(uint64_t x)
+{
+#if defined(M3D_USE_BMI2)
+    return _pdep_u64(x, 0x1249249249249249ull);
+#else
+    x &= 0x1fffff;
+    x  = (x | (x << 32)) & 0x001f00000000ffffull;
+    x  = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x  = (x | (x <<  8)) & 0x100f00f00f00f00full;
+    x  = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+    x  = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+#endif
+}
+
+// Grid cells per unit along each axis for a grid of cells^3 over box.
+static inline Vec3 m3d_morton_scale(AABB const &box, float cells)
+{
+    Vec3 e = box.max - box.min;
+    return vec3(e.x > 0.0f ? cells / e.x : 0.0f,
+                e.y > 0.0f ? cells / e.y : 0.0f,
+                e.z > 0.0f ? cells / e.z : 0.0f);
+}
+
+static inline uint32_t m3d_morton30(Vec3 p, Vec3 lo, Vec3 scale)
+{
+    Vec3 q = hadamard(p - lo, scale);
+    uint32_t x = uint32_t(clamp(q.x, 0.0f, 1023.0f));
+    uint32_t y = uint32_t(clamp(q.y, 0.0f, 1023.0f));
+    uint32_t z = uint32_t(clamp(q.z, 0.0f, 1023.0f));
+
+    return m3d_spread10(x) | (m3d_spread10(y) << 1) | (m3d_spread10(z) << 2);
+}
+
+static inline uint64_t m3d_morton63(Vec3 p, Vec3 lo, Vec3 scale)
+{
+    Vec3 q = hadamard(p - lo, scale);
+    uint64_t x = uint64_t(clamp(q.x, 0.0f, 2097151.0f));
+    uint64_t y = uint64_t(clamp(q.y, 0.0f, 2097151.0f));
+    uint64_t z = uint64_t(clamp(q.z, 0.0f, 2097151.0f));
+
+    return m3d_spread21(x) | (m3d_spread21(y) << 1) | (m3d_spread21(z) << 2);
+}
+
+M3D_DEF uint32_t morton30(AABB const &bounds, Vec3 p)
+{
+    return m3d_morton30(p, bounds.min, m3d_morton_scale(bounds, 1024.0f));
+}
+
+M3D_DEF uint64_t morton63(AABB const &bounds, Vec3 p)
+{
+    return m3d_morton63(p, bounds.min, m3d_morton_scale(bounds, 2097152.0f));
+}
+
+M3D_DEF void morton30(AABB const &bounds, Vec3 const *M3D_RESTRICT points, uint32_t *M3D_RESTRICT codes, size_t count)
+{
+    Vec3 const lo    = bounds.min;
+    Vec3 const scale = m3d_morton_scale(bounds, 1024.0f);
+
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        codes[i] = m3d_morton30(points[i], lo, scale);
+}
+
+M3D_DEF void morton63(AABB const &bounds, Vec3 const *M3D_RESTRICT points, uint64_t *M3D_RESTRICT codes, size_t count)
+{
+    Vec3 const lo    = bounds.min;
+    Vec3 const scale = m3d_morton_scale(bounds, 2097152.0f);
+
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        codes[i] = m3d_morton63(points[i], lo, scale);
+}
+
+M3D_DEF size_t radix_sort_scratch_size(size_t count)
+{
+    return (count * sizeof(uint64_t) +
+            count * sizeof(uint32_t) +
+            M3D_RADIX_CHUNKS * 256 * sizeof(uint32_t));
+}
+
+static inline uint32_t m3d_radix_digit(void const *keys, int key_size, size_t i, int shift)
+{
+    if (key_size == 4)
+        return (static_cast<uint32_t const *>(keys)[i] >> shift) & 0xff;
+    else
+        return uint32_t(static_cast<uint64_t const *>(keys)[i] >> shift) & 0xff;
+}
+
+static inline void m3d_radix_move(void const *src, void *dst, int key_size, size_t from, size_t to)
+{
+    if (key_size == 4)
+        static_cast<uint32_t *>(dst)[to] = static_cast<uint32_t const *>(src)[from];
+    else
+        static_cast<uint64_t *>(dst)[to] = static_cast<uint64_t const *>(src)[from];
+}
+
+// The keys are split into chunks which are counted and scattered in
+// parallel.  Every chunk gets its own offsets into each bucket, laid
+// out bucket by bucket and chunk by chunk, so the sort stays stable
+// and does not depend on the thread count.
+static void m3d_radix_sort(void *codes, int key_size, uint32_t *M3D_RESTRICT order, size_t count, void *scratch)
+{
+    unsigned char *mem       = static_cast<unsigned char *>(scratch);
+    void          *keys_tmp  = mem;
+    uint32_t      *order_tmp = reinterpret_cast<uint32_t *>(mem + count * sizeof(uint64_t));
+    uint32_t      *hist      = order_tmp + count;
+
+    int chunks = int(count / 65536);
+    chunks = chunks < 1 ? 1 : (chunks > M3D_RADIX_CHUNKS ? M3D_RADIX_CHUNKS : chunks);
+
+    size_t const    chunk_size = (count + size_t(chunks) - 1) / size_t(chunks);
+    ptrdiff_t const n          = ptrdiff_t(count);
+    ptrdiff_t const m          = ptrdiff_t(chunks);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        order[i] = uint32_t(i);
+
+    void     *src_keys  = codes;
+    void     *dst_keys  = keys_tmp;
+    uint32_t *src_order = order;
+    uint32_t *dst_order = order_tmp;
+
+    for (int shift = 0; shift < 8 * key_size; shift += 8) {
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t c = 0; c < m; ++c) {
+            uint32_t *h     = hist + 256 * c;
+            size_t    begin = size_t(c) * chunk_size;
+            size_t    end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+            for (int d = 0; d < 256; ++d)
+                h[d] = 0;
+            for (size_t i = begin; i < end; ++i)
+                h[m3d_radix_digit(src_keys, key_size, i, shift)]++;
+        }
+
+        uint32_t sum  = 0;
+        bool     skip = false;
+
+        for (int d = 0; d < 256; ++d) {
+            uint32_t bucket = 0;
+            for (int c = 0; c < chunks; ++c) {
+                uint32_t t = hist[256 * c + d];
+                hist[256 * c + d] = sum + bucket;
+                bucket += t;
+            }
+            skip = skip || bucket == count;
+            sum += bucket;
+        }
+
+        if (skip)
+            continue;
+
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t c = 0; c < m; ++c) {
+            uint32_t *h     = hist + 256 * c;
+            size_t    begin = size_t(c) * chunk_size;
+            size_t    end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t to = h[m3d_radix_digit(src_keys, key_size, i, shift)]++;
+                m3d_radix_move(src_keys, dst_keys, key_size, i, to);
+                dst_order[to] = src_order[i];
+            }
+        }
+
+        void *t = src_keys;
+        src_keys = dst_keys;
+        dst_keys = t;
+
+        uint32_t *o = src_order;
+        src_order = dst_order;
+        dst_order = o;
+    }
+
+    if (src_keys != codes) {
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = 0; i < n; ++i) {
+            m3d_radix_move(src_keys, codes, key_size, size_t(i), size_t(i));
+            order[i] = src_order[i];
+        }
+    }
+}
+
+M3D_DEF void radix_sort(uint32_t *M3D_RESTRICT codes, uint32_t *M3D_RESTRICT order, size_t count, void *scratch)
+{
+    m3d_radix_sort(codes, 4, order, count, scratch);
+}
+
+M3D_DEF void radix_sort(uint64_t *M3D_RESTRICT codes, uint32_t *M3D_RESTRICT order, size_t count, void *scratch)
+{
+    m3d_radix_sort(codes, 8, order, count, scratch);
+}
+
+// Elements made of whole 32 bit words are copied a word at a time,
+// anything else byte by byte.
+M3D_DEF void reorder(uint32_t const *M3D_RESTRICT order, void const *M3D_RESTRICT in, void *M3D_RESTRICT out,
+                     size_t element_size, size_t count)
+{
+    ptrdiff_t const n       = ptrdiff_t(count);
+    bool      const aligned = ((uintptr_t(in) | uintptr_t(out)) & 3) == 0;
+
+    if (aligned && element_size == 12) {
+        uint32_t const *src = static_cast<uint32_t const *>(in);
+        uint32_t       *dst = static_cast<uint32_t *>(out);
+
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = 0; i < n; ++i) {
+            uint32_t const *s = src + 3 * size_t(order[i]);
+            dst[3*i + 0] = s[0];
+            dst[3*i + 1] = s[1];
+            dst[3*i + 2] = s[2];
+        }
+    }
+    else if (aligned && element_size % 4 == 0) {
+        uint32_t const *src   = static_cast<uint32_t const *>(in);
+        uint32_t       *dst   = static_cast<uint32_t *>(out);
+        size_t    const words = element_size / 4;
+
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = 0; i < n; ++i) {
+            for (size_t k = 0; k < words; ++k)
+                dst[size_t(i) * words + k] = src[size_t(order[i]) * words + k];
+        }
+    }
+    else {
+        unsigned char const *src = static_cast<unsigned char const *>(in);
+        unsigned char       *dst = static_cast<unsigned char *>(out);
+
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = 0; i < n; ++i) {
+            for (size_t k = 0; k < element_size; ++k)
+                dst[size_t(i) * element_size + k] = src[size_t(order[i]) * element_size + k];
+        }
+    }
+}
+
+#undef M3D_RADIX_CHUNKS
+/**** END Morton definitions ****/
+
+
+/**** BEGIN HashGrid definitions ****/
+struct M3dGridCell {
+    int32_t x, y, z;
+};
+
+// Points of the cells x0 .. x1 of one row, in at most two runs of the
+// sorted points since the buckets of a row may wrap around the table.
+struct M3dGridRow {
+    uint32_t begin[2];
+    uint32_t end[2];
+};
+
+static inline int32_t m3d_grid_floor(float v)
+{
+    float   f = clamp(v, -1073741824.0f, 1073741824.0f);
+    int32_t i = int32_t(f);
+    return float(i) > f ? i - 1 : i;
+}
+
+static inline M3dGridCell m3d_grid_cell(Vec3 p, float inv_cell)
+{
+    M3dGridCell c = {
+        m3d_grid_floor(p.x * inv_cell),
+        m3d_grid_floor(p.y * inv_cell),
+        m3d_grid_floor(p.z * inv_cell)
+    };
+    return c;
+}
+
+// The hash is linear in x so the cells of a row land in neighbouring
+// buckets, which a query then reads as one run of points.
+static inline uint32_t m3d_grid_hash(int32_t x, int32_t y, int32_t z, size_t table_size)
+{
+    uint32_t h = uint32_t(x) + ((uint32_t(y) * 73856093u) ^ (uint32_t(z) * 19349663u));
+    return h & uint32_t(table_size - 1);
+}
+
+static inline M3dGridRow m3d_grid_row(HashGrid const &grid, int32_t x0, int32_t x1, int32_t y, int32_t z)
+{
+    M3dGridRow row;
+
+    if (size_t(int64_t(x1) - int64_t(x0)) + 1 >= grid.table_size) {
+        row.begin[0] = 0;
+        row.end[0]   = uint32_t(grid.point_count);
+        row.begin[1] = row.end[1] = 0;
+        return row;
+    }
+
+    uint32_t b0 = m3d_grid_hash(x0, y, z, grid.table_size);
+    uint32_t b1 = m3d_grid_hash(x1, y, z, grid.table_size);
+
+    if (b0 <= b1) {
+        row.begin[0] = grid.cells[b0];
+        row.end[0]   = grid.cells[b1 + 1];
+        row.begin[1] = row.end[1] = 0;
+    }
+    else {
+        row.begin[0] = grid.cells[b0];
+        row.end[0]   = uint32_t(grid.point_count);
+        row.begin[1] = 0;
+        row.end[1]   = grid.cells[b1 + 1];
+    }
+
+    return row;
+}
+
+// Other cells hash to the same buckets as a row, so a point found
+// there only counts when it is in the row.
+static inline bool m3d_grid_in_row(Vec3 p, float inv_cell, int32_t x0, int32_t x1, int32_t y, int32_t z)
+{
+    M3dGridCell c = m3d_grid_cell(p, inv_cell);
+    return c.y == y && c.z == z && c.x >= x0 && c.x <= x1;
+}
+
+// Cells overlapping the box, clipped to the cells holding points.
+static inline bool m3d_grid_range(HashGrid const &grid, Vec3 lo, Vec3 hi, M3dGridCell *first, M3dGridCell *last)
+{
+    float const inv_cell = 1.0f / grid.cell_size;
+
+    M3dGridCell a = m3d_grid_cell(max_of(lo, grid.bounds.min), inv_cell);
+    M3dGridCell b = m3d_grid_cell(min_of(hi, grid.bounds.max), inv_cell);
+    *first = a;
+    *last  = b;
+
+    return grid.point_count > 0 && a.x <= b.x && a.y <= b.y && a.z <= b.z;
+}
+
+M3D_DEF size_t hash_grid_table_size(size_t point_count)
+{
+    size_t size = 16;
+    while (size < point_count)
+        size *= 2;
+
+    return size;
+}
+
+M3D_DEF size_t hash_grid_scratch_size(size_t point_count)
+{
+    return radix_sort_scratch_size(point_count) + point_count * sizeof(uint32_t);
+}
+
+M3D_DEF void hash_grid_build(HashGrid *grid, Vec3 const *M3D_RESTRICT points, size_t count, float cell_size, void *scratch)
+{
+    unsigned char *mem  = static_cast<unsigned char *>(scratch);
+    uint32_t      *keys = reinterpret_cast<uint32_t *>(mem + radix_sort_scratch_size(count));
+
+    grid->point_count = count;
+    grid->table_size  = hash_grid_table_size(count);
+    grid->cell_size   = cell_size;
+    grid->bounds      = aabb(points, count);
+
+    float const     inv_cell   = 1.0f / cell_size;
+    size_t const    table_size = grid->table_size;
+    ptrdiff_t const n          = ptrdiff_t(count);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        M3dGridCell c = m3d_grid_cell(points[i], inv_cell);
+        keys[i] = m3d_grid_hash(c.x, c.y, c.z, table_size);
+    }
+
+    radix_sort(keys, grid->indices, count, scratch);
+    reorder(grid->indices, points, grid->points, sizeof(Vec3), count);
+
+    // Bucket b starts at the first sorted key >= b, every bucket
+    // between two neighbouring keys is written by the later one.
+    uint32_t *cells = grid->cells;
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i <= n; ++i) {
+        size_t lo = i == 0 ? 0 : size_t(keys[i - 1]) + 1;
+        size_t hi = i == n ? table_size : size_t(keys[i]);
+
+        for (size_t b = lo; b <= hi; ++b)
+            cells[b] = uint32_t(i);
+    }
+}
+
+M3D_DEF size_t hash_grid_radius(HashGrid const &grid, Vec3 center, float radius, uint32_t *M3D_RESTRICT out, size_t max_out)
+{
+    M3dGridCell first, last;
+    if (!m3d_grid_range(grid, center - vec3(radius, radius, radius), center + vec3(radius, radius, radius), &first, &last))
+        return 0;
+
+    float const r2       = radius * radius;
+    float const inv_cell = 1.0f / grid.cell_size;
+    size_t      found    = 0;
+
+    // Visiting more rows than there are buckets would read the same
+    // points many times over, scanning everything once is cheaper.
+    int64_t rows = int64_t(last.y - first.y + 1) * int64_t(last.z - first.z + 1);
+    if (rows >= int64_t(grid.table_size)) {
+        for (size_t j = 0; j < grid.point_count; ++j) {
+            if (len_sq(grid.points[j] - center) <= r2) {
+                if (found < max_out)
+                    out[found] = grid.indices[j];
+                ++found;
+            }
+        }
+        return found;
+    }
+
+    for (int32_t z = first.z; z <= last.z; ++z) {
+        for (int32_t y = first.y; y <= last.y; ++y) {
+            M3dGridRow row = m3d_grid_row(grid, first.x, last.x, y, z);
+
+            for (int run = 0; run < 2; ++run) {
+                for (uint32_t j = row.begin[run]; j < row.end[run]; ++j) {
+                    Vec3 p = grid.points[j];
+                    if (len_sq(p - center) <= r2 && m3d_grid_in_row(p, inv_cell, first.x, last.x, y, z)) {
+                        if (found < max_out)
+                            out[found] = grid.indices[j];
+                        ++found;
+                    }
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+// Inserts into the k nearest so far, which are sorted by distance, the
+// caller has already checked that d beats the k-th when there are k.
+static inline void m3d_insert_nearest(uint32_t index, float d, size_t k, size_t *found,
+                                      uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    size_t n = *found;
+    size_t i = n < k ? n++ : k - 1;
+
+    for (; i > 0 && dist_sq[i - 1] > d; --i) {
+        dist_sq[i] = dist_sq[i - 1];
+        out[i]     = out[i - 1];
+    }
+    dist_sq[i] = d;
+    out[i]     = index;
+    *found     = n;
+}
+
+static inline void m3d_grid_nearest_row(HashGrid const &grid, Vec3 p, float inv_cell, int32_t x0, int32_t x1, int32_t y, int32_t z,
+                                        size_t k, size_t *found, uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    M3dGridRow row = m3d_grid_row(grid, x0, x1, y, z);
+
+    for (int run = 0; run < 2; ++run) {
+        for (uint32_t j = row.begin[run]; j < row.end[run]; ++j) {
+            Vec3  q = grid.points[j];
+            float d = len_sq(q - p);
+
+            if ((*found == k && d >= dist_sq[k - 1]) || !m3d_grid_in_row(q, inv_cell, x0, x1, y, z))
+                continue;
+
+            m3d_insert_nearest(grid.indices[j], d, k, found, out, dist_sq);
+        }
+    }
+}
+
+// Searches shells of cells around the cell of p, one cell thicker each
+// time, until the k-th nearest point so far is closer than anything
+// outside the searched cube can be.
+M3D_DEF size_t hash_grid_nearest(HashGrid const &grid, Vec3 p, size_t k,
+                                 uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    k = k < grid.point_count ? k : grid.point_count;
+    if (k == 0)
+        return 0;
+
+    float const inv_cell = 1.0f / grid.cell_size;
+    float const cs       = grid.cell_size;
+
+    M3dGridCell c  = m3d_grid_cell(p, inv_cell);
+    M3dGridCell lo = m3d_grid_cell(grid.bounds.min, inv_cell);
+    M3dGridCell hi = m3d_grid_cell(grid.bounds.max, inv_cell);
+
+    // shells that hold no points at all are skipped
+    int32_t r = 0;
+    r = lo.x - c.x > r ? lo.x - c.x : r;
+    r = lo.y - c.y > r ? lo.y - c.y : r;
+    r = lo.z - c.z > r ? lo.z - c.z : r;
+    r = c.x - hi.x > r ? c.x - hi.x : r;
+    r = c.y - hi.y > r ? c.y - hi.y : r;
+    r = c.z - hi.z > r ? c.z - hi.z : r;
+
+    size_t found = 0;
+
+    for (;; ++r) {
+        int32_t x0 = c.x - r > lo.x ? c.x - r : lo.x,  x1 = c.x + r < hi.x ? c.x + r : hi.x;
+        int32_t y0 = c.y - r > lo.y ? c.y - r : lo.y,  y1 = c.y + r < hi.y ? c.y + r : hi.y;
+        int32_t z0 = c.z - r > lo.z ? c.z - r : lo.z,  z1 = c.z + r < hi.z ? c.z + r : hi.z;
+
+        for (int32_t z = z0; z <= z1; ++z) {
+            for (int32_t y = y0; y <= y1; ++y) {
+                // rows inside the shell only add their two end cells
+                if (z == c.z - r || z == c.z + r || y == c.y - r || y == c.y + r) {
+                    if (x0 <= x1)
+                        m3d_grid_nearest_row(grid, p, inv_cell, x0, x1, y, z, k, &found, out, dist_sq);
+                }
+                else {
+                    if (c.x - r >= x0)
+                        m3d_grid_nearest_row(grid, p, inv_cell, c.x - r, c.x - r, y, z, k, &found, out, dist_sq);
+                    if (c.x + r <= x1)
+                        m3d_grid_nearest_row(grid, p, inv_cell, c.x + r, c.x + r, y, z, k, &found, out, dist_sq);
+                }
+            }
+        }
+
+        bool covered = c.x - r <= lo.x && c.x + r >= hi.x &&
+                       c.y - r <= lo.y && c.y + r >= hi.y &&
+                       c.z - r <= lo.z && c.z + r >= hi.z;
+        if (covered)
+            break;
+
+        if (found == k) {
+            float gap = M3D_FLOAT_MAX;
+            gap = min_of(gap, p.x - float(c.x - r) * cs);
+            gap = min_of(gap, float(c.x + r + 1) * cs - p.x);
+            gap = min_of(gap, p.y - float(c.y - r) * cs);
+            gap = min_of(gap, float(c.y + r + 1) * cs - p.y);
+            gap = min_of(gap, p.z - float(c.z - r) * cs);
+            gap = min_of(gap, float(c.z + r + 1) * cs - p.z);
+
+            if (gap > 0.0f && dist_sq[k - 1] <= gap * gap)
+                break;
+        }
+    }
+
+    return found;
+}
+
+M3D_DEF void hash_grid_nearest(HashGrid const &grid, Vec3 const *M3D_RESTRICT queries, size_t count, size_t k,
+                               uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        uint32_t *o = out + size_t(i) * k;
+        float    *d = dist_sq + size_t(i) * k;
+
+        for (size_t j = hash_grid_nearest(grid, queries[i], k, o, d); j < k; ++j) {
+            o[j] = ~0u;
+            d[j] = M3D_FLOAT_MAX;
+        }
+    }
+}
+
+M3D_DEF size_t weld_vertices_scratch_size(size_t count)
+{
+    return (hash_grid_scratch_size(count) +
+            count * sizeof(Vec3) +
+            count * sizeof(uint32_t) +
+            (hash_grid_table_size(count) + 1) * sizeof(uint32_t));
+}
+
+// The lowest value among the grid vertices numbered below limit that
+// are within eps of p, or none.  Without kept the values are the
+// vertex numbers and the distances are to the vertices, with kept they
+// are remap[j] and the distances are to kept[remap[j]].
+static uint32_t m3d_weld_lowest(HashGrid const &grid, Vec3 p, float eps, uint32_t limit, uint32_t none,
+                                Vec3 const *kept, uint32_t const *remap)
+{
+    float const eps2     = eps * eps;
+    float const inv_cell = 1.0f / grid.cell_size;
+    uint32_t    lowest   = none;
+    M3dGridCell first, last;
+
+    m3d_grid_range(grid, p - vec3(eps, eps, eps), p + vec3(eps, eps, eps), &first, &last);
+
+    for (int32_t z = first.z; z <= last.z; ++z) {
+        for (int32_t y = first.y; y <= last.y; ++y) {
+            M3dGridRow row = m3d_grid_row(grid, first.x, last.x, y, z);
+
+            for (int run = 0; run < 2; ++run) {
+                for (uint32_t j = row.begin[run]; j < row.end[run]; ++j) {
+                    uint32_t index = grid.indices[j];
+                    if (index >= limit)
+                        continue;
+
+                    uint32_t value = kept ? remap[index] : index;
+                    Vec3     q     = kept ? kept[value] : grid.points[j];
+                    if (value < lowest && len_sq(q - p) <= eps2 &&
+                        m3d_grid_in_row(grid.points[j], inv_cell, first.x, last.x, y, z))
+                        lowest = value;
+                }
+            }
+        }
+    }
+
+    return lowest;
+}
+
+M3D_DEF size_t weld_vertices(Vec3 *points, size_t count, float eps, uint32_t *M3D_RESTRICT remap, void *scratch)
+{
+    unsigned char *mem = static_cast<unsigned char *>(scratch) + hash_grid_scratch_size(count);
+
+    HashGrid grid = {};
+    grid.points  = reinterpret_cast<Vec3 *>(mem);
+    grid.indices = reinterpret_cast<uint32_t *>(mem + count * sizeof(Vec3));
+    grid.cells   = grid.indices + count;
+
+    // Cells much wider than eps keep almost every query to the cell of
+    // the vertex itself, about one per vertex for points on a surface.
+    AABB  box    = aabb(points, count);
+    Vec3  extent = count > 0 ? box.max - box.min : vec3(0, 0, 0);
+    float cell   = max_of(max_of(extent.x, extent.y), extent.z) / M3D_SQRTF(float(count > 0 ? count : 1));
+    cell = max_of(cell, 4.0f * eps);
+
+    hash_grid_build(&grid, points, count, cell > 0.0f ? cell : 1.0f, scratch);
+
+    float const eps2 = eps * eps;
+
+    // The lowest numbered vertex within eps of each vertex, visited in
+    // grid order so neighbouring queries read the same buckets.
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        uint32_t index = grid.indices[i];
+        remap[index] = m3d_weld_lowest(grid, grid.points[i], eps, index, index, nullptr, nullptr);
+    }
+
+    // Targets come before the vertices merged into them so their new
+    // index is known by the time it is needed, and points[i] is not
+    // overwritten before it is visited.  When the target itself was
+    // merged into a vertex further than eps away the kept vertices
+    // near i are searched again, which only happens along chains.
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t target = remap[i];
+
+        if (target != uint32_t(i)) {
+            target = remap[target];
+            if (len_sq(points[target] - points[i]) > eps2)
+                target = m3d_weld_lowest(grid, points[i], eps, uint32_t(i), uint32_t(unique), points, remap);
+        }
+
+        if (target >= uint32_t(unique)) {
+            points[unique] = points[i];
+            remap[i] = uint32_t(unique++);
+        }
+        else {
+            remap[i] = target;
+        }
+    }
+
+    return unique;
+}
+/**** END HashGrid definitions ****/
+
+
+/**** BEGIN KDTree definitions ****/
+#define M3D_KDTREE_FAR 1e30f
+
+struct M3dKDPoint {
+    float    p[3];
+    uint32_t id;
+};
+
+struct M3dKDRange {
+    uint32_t begin;
+    uint32_t end;
+    AABB     box;
+};
+
+struct M3dKDEntry {
+    uint32_t node;
+    float    dist_sq;
+};
+
+M3D_DEF size_t kdtree_leaf_count(size_t point_count)
+{
+    size_t leaves = 1;
+    while (leaves * M3D_KDTREE_LEAF_SIZE < point_count)
+        leaves *= 2;
+
+    return leaves;
+}
+
+M3D_DEF size_t kdtree_scratch_size(size_t point_count)
+{
+    return point_count * sizeof(M3dKDPoint) + 2 * kdtree_leaf_count(point_count) * sizeof(M3dKDRange);
+}
+
+// Quickselect, leaves the nth smallest along axis at nth with nothing
+// larger before and nothing smaller after it.
+static void m3d_kdtree_select(M3dKDPoint *pts, size_t count, size_t nth, int axis)
+{
+    size_t lo = 0;
+    size_t hi = count - 1;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        float  a   = pts[lo].p[axis];
+        float  b   = pts[mid].p[axis];
+        float  c   = pts[hi].p[axis];
+        float  pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+        size_t i = lo;
+        size_t j = hi;
+        while (i <= j) {
+            while (pts[i].p[axis] < pivot)
+                ++i;
+            while (pts[j].p[axis] > pivot)
+                --j;
+            if (i <= j) {
+                M3dKDPoint t = pts[i];
+                pts[i] = pts[j];
+                pts[j] = t;
+                ++i;
+                if (j == 0)
+                    break;
+                --j;
+            }
+        }
+
+        if (nth <= j)
+            hi = j;
+        else if (nth >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+M3D_DEF void kdtree_build(KDTree *tree, Vec3 const *M3D_RESTRICT points, size_t count, void *scratch)
+{
+    M3dKDPoint *pts    = static_cast<M3dKDPoint *>(scratch);
+    M3dKDRange *ranges = reinterpret_cast<M3dKDRange *>(pts + count);
+
+    size_t const leaves = kdtree_leaf_count(count);
+
+    tree->point_count = count;
+    tree->leaf_count  = leaves;
+    tree->bounds      = aabb(points, count);
+
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        pts[i].p[0] = points[i].x;
+        pts[i].p[1] = points[i].y;
+        pts[i].p[2] = points[i].z;
+        pts[i].id   = uint32_t(i);
+    }
+
+    ranges[0].begin = 0;
+    ranges[0].end   = uint32_t(count);
+    ranges[0].box   = tree->bounds;
+
+    // One level at a time, the first node of level l is 2^l - 1.
+    for (size_t first = 0, width = 1; first < leaves - 1; first += width, width *= 2) {
+        ptrdiff_t m = ptrdiff_t(width);
+        M3D_PARALLEL_FOR
+        for (ptrdiff_t i = 0; i < m; ++i) {
+            size_t            node  = first + size_t(i);
+            M3dKDRange const &range = ranges[node];
+            Vec3              e     = range.box.max - range.box.min;
+            int               axis  = e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+            uint32_t          mid   = range.begin + (range.end - range.begin) / 2;
+            float             split = 0.0f;
+
+            if (range.end > range.begin) {
+                m3d_kdtree_select(pts + range.begin, range.end - range.begin, mid - range.begin, axis);
+                split = pts[mid].p[axis];
+            }
+            else {
+                split = range.box.min[axis];
+            }
+
+            tree->splits[node] = split;
+            tree->axes[node]   = uint8_t(axis);
+
+            M3dKDRange &left  = ranges[2 * node + 1];
+            M3dKDRange &right = ranges[2 * node + 2];
+            left.begin  = range.begin;
+            left.end    = mid;
+            left.box    = range.box;
+            right.begin = mid;
+            right.end   = range.end;
+            right.box   = range.box;
+            left.box.max[axis]  = split;
+            right.box.min[axis] = split;
+        }
+    }
+
+    ptrdiff_t l = ptrdiff_t(leaves);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t j = 0; j < l; ++j) {
+        M3dKDRange const &range = ranges[leaves - 1 + size_t(j)];
+        size_t            slot  = size_t(j) * M3D_KDTREE_LEAF_SIZE;
+
+        for (uint32_t k = 0; k < M3D_KDTREE_LEAF_SIZE; ++k) {
+            bool used = range.begin + k < range.end;
+            M3dKDPoint const &q = pts[used ? range.begin + k : 0];
+
+            tree->x[slot + k]       = used ? q.p[0] : M3D_KDTREE_FAR;
+            tree->y[slot + k]       = used ? q.p[1] : M3D_KDTREE_FAR;
+            tree->z[slot + k]       = used ? q.p[2] : M3D_KDTREE_FAR;
+            tree->indices[slot + k] = used ? q.id : ~0u;
+        }
+    }
+}
+
+// Squared distances from p to the sixteen slots of a leaf and the mask
+// of those no further than limit.  Unused slots are far away, but a
+// limit of infinity, or one that overflows when squared, still reaches
+// them, so the mask is cut to the used slots at the front of the leaf.
+static inline uint32_t m3d_kdtree_scan(KDTree const &tree, size_t leaf, Vec3 p, float limit, float *M3D_RESTRICT d)
+{
+    float const    *x       = tree.x + leaf * M3D_KDTREE_LEAF_SIZE;
+    float const    *y       = tree.y + leaf * M3D_KDTREE_LEAF_SIZE;
+    float const    *z       = tree.z + leaf * M3D_KDTREE_LEAF_SIZE;
+    uint32_t const *indices = tree.indices + leaf * M3D_KDTREE_LEAF_SIZE;
+
+    uint32_t used = 0;
+    while (used < M3D_KDTREE_LEAF_SIZE && indices[used] != ~0u)
+        ++used;
+    uint32_t const occupied = (1u << used) - 1u;
+
+#if defined(M3D_USE_AVX)
+    __m256   px = _mm256_set1_ps(p.x), py = _mm256_set1_ps(p.y), pz = _mm256_set1_ps(p.z);
+    __m256   lim  = _mm256_set1_ps(limit);
+    uint32_t mask = 0;
+
+    for (int h = 0; h < M3D_KDTREE_LEAF_SIZE; h += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + h), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + h), py);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + h), pz);
+        __m256 dd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+        _mm256_storeu_ps(d + h, dd);
+        mask |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(dd, lim, _CMP_LE_OQ))) << h;
+    }
+
+    return mask & occupied;
+#else
+    for (int k = 0; k < M3D_KDTREE_LEAF_SIZE; ++k) {
+        float dx = x[k] - p.x;
+        float dy = y[k] - p.y;
+        float dz = z[k] - p.z;
+        d[k] = dx * dx + dy * dy + dz * dz;
+    }
+
+    uint32_t mask = 0;
+    for (int k = 0; k < M3D_KDTREE_LEAF_SIZE; ++k)
+        mask |= uint32_t(d[k] <= limit) << k;
+
+    return mask & occupied;
+#endif
+}
+
+// Depth first, nearer child first, skipping subtrees whose splitting
+// plane is further away than the k-th nearest point so far.
+M3D_DEF size_t kdtree_nearest(KDTree const &tree, Vec3 p, size_t k,
+                              uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    k = k < tree.point_count ? k : tree.point_count;
+    if (k == 0)
+        return 0;
+
+    size_t const inner = tree.leaf_count - 1;
+    size_t       found = 0;
+    float        d[M3D_KDTREE_LEAF_SIZE];
+
+    // The tree is less than 32 levels deep for 32 bit indices.
+    M3dKDEntry stack[64];
+    int        top = 0;
+
+    stack[top].node    = 0;
+    stack[top].dist_sq = 0.0f;
+    ++top;
+
+    while (top > 0) {
+        M3dKDEntry entry = stack[--top];
+        if (found == k && entry.dist_sq >= dist_sq[k - 1])
+            continue;
+
+        size_t node = entry.node;
+        while (node < inner) {
+            float diff = p[tree.axes[node]] - tree.splits[node];
+            stack[top].node    = uint32_t(diff < 0.0f ? 2 * node + 2 : 2 * node + 1);
+            stack[top].dist_sq = max_of(entry.dist_sq, diff * diff);
+            ++top;
+            node = diff < 0.0f ? 2 * node + 1 : 2 * node + 2;
+        }
+
+        size_t   leaf  = node - inner;
+        float    limit = found == k ? dist_sq[k - 1] : M3D_FLOAT_MAX;
+        uint32_t mask  = m3d_kdtree_scan(tree, leaf, p, limit, d);
+
+        while (mask) {
+            int bit = m3d_lowest_bit(mask);
+            mask &= mask - 1;
+
+            if (found < k || d[bit] < dist_sq[k - 1])
+                m3d_insert_nearest(tree.indices[leaf * M3D_KDTREE_LEAF_SIZE + size_t(bit)], d[bit], k, &found, out, dist_sq);
+        }
+    }
+
+    return found;
+}
+
+M3D_DEF void kdtree_nearest(KDTree const &tree, Vec3 const *M3D_RESTRICT queries, size_t count, size_t k,
+                            uint32_t *M3D_RESTRICT out, float *M3D_RESTRICT dist_sq)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        uint32_t *o = out + size_t(i) * k;
+        float    *d = dist_sq + size_t(i) * k;
+
+        for (size_t j = kdtree_nearest(tree, queries[i], k, o, d); j < k; ++j) {
+            o[j] = ~0u;
+            d[j] = M3D_FLOAT_MAX;
+        }
+    }
+}
+
+M3D_DEF size_t kdtree_radius(KDTree const &tree, Vec3 center, float radius, uint32_t *M3D_RESTRICT out, size_t max_out)
+{
+    if (tree.point_count == 0)
+        return 0;
+
+    size_t const inner = tree.leaf_count - 1;
+    float const  r2    = radius * radius;
+    size_t       found = 0;
+    float        d[M3D_KDTREE_LEAF_SIZE];
+
+    uint32_t stack[64];
+    int      top = 0;
+
+    stack[top++] = 0;
+
+    while (top > 0) {
+        size_t node = stack[--top];
+
+        while (node < inner) {
+            float diff = center[tree.axes[node]] - tree.splits[node];
+            if (diff * diff <= r2)
+                stack[top++] = uint32_t(diff < 0.0f ? 2 * node + 2 : 2 * node + 1);
+            node = diff < 0.0f ? 2 * node + 1 : 2 * node + 2;
+        }
+
+        size_t   leaf = node - inner;
+        uint32_t mask = m3d_kdtree_scan(tree, leaf, center, r2, d);
+
+        while (mask) {
+            int bit = m3d_lowest_bit(mask);
+            mask &= mask - 1;
+
+            if (found < max_out)
+                out[found] = tree.indices[leaf * M3D_KDTREE_LEAF_SIZE + size_t(bit)];
+            ++found;
+        }
+    }
+
+    return found;
+}
+
+M3D_DEF void kdtree_radius(KDTree const &tree, Vec3 const *M3D_RESTRICT centers, size_t count, float radius,
+                           uint32_t *M3D_RESTRICT out, size_t max_out, uint32_t *M3D_RESTRICT totals)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        totals[i] = uint32_t(kdtree_radius(tree, centers[i], radius, out + size_t(i) * max_out, max_out));
+}
+
+#undef M3D_KDTREE_FAR
+/**** END KDTree definitions ****/
+
+
+/**** BEGIN Decomposition definitions ****/
+// Eight floats worked on together, one matrix or box per lane, so the
+// decompositions and box tests have no branches.  Masks are all bits set with AVX
+// and 1 or 0 otherwise.
+#define M3D_LANES        8
+#define M3D_LANE_GROUPS  2
+
+#if defined(M3D_USE_AVX)
+struct M3dLanes {
+    __m256 v;
+};
+
+static inline M3dLanes m3d_lanes(float s)                       { M3dLanes r = { _mm256_set1_ps(s) };           return r; }
+static inline M3dLanes m3d_lanes_load(float const *p)           { M3dLanes r = { _mm256_loadu_ps(p) };          return r; }
+static inline void     m3d_lanes_store(float *p, M3dLanes a)    { _mm256_storeu_ps(p, a.v); }
+static inline M3dLanes operator + (M3dLanes a, M3dLanes b)      { M3dLanes r = { _mm256_add_ps(a.v, b.v) };     return r; }
+static inline M3dLanes operator - (M3dLanes a, M3dLanes b)      { M3dLanes r = { _mm256_sub_ps(a.v, b.v) };     return r; }
+static inline M3dLanes operator * (M3dLanes a, M3dLanes b)      { M3dLanes r = { _mm256_mul_ps(a.v, b.v) };     return r; }
+static inline M3dLanes operator / (M3dLanes a, M3dLanes b)      { M3dLanes r = { _mm256_div_ps(a.v, b.v) };     return r; }
+static inline M3dLanes m3d_lanes_sqrt(M3dLanes a)               { M3dLanes r = { _mm256_sqrt_ps(a.v) };         return r; }
+static inline M3dLanes m3d_lanes_min(M3dLanes a, M3dLanes b)    { M3dLanes r = { _mm256_min_ps(a.v, b.v) };     return r; }
+static inline M3dLanes m3d_lanes_max(M3dLanes a, M3dLanes b)    { M3dLanes r = { _mm256_max_ps(a.v, b.v) };     return r; }
+static inline M3dLanes m3d_lanes_lt(M3dLanes a, M3dLanes b)     { M3dLanes r = { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; return r; }
+static inline M3dLanes m3d_lanes_or(M3dLanes a, M3dLanes b)     { M3dLanes r = { _mm256_or_ps(a.v, b.v) };      return r; }
+static inline uint32_t m3d_lanes_mask(M3dLanes m)               { return uint32_t(_mm256_movemask_ps(m.v)); }
+
+static inline M3dLanes m3d_lanes_abs(M3dLanes a)
+{
+    M3dLanes r = { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) };
+    return r;
+}
+
+// 1 / sqrt(a) from the estimate and one Newton step, good to about
+// one unit in the last place.
+static inline M3dLanes m3d_lanes_rsqrt(M3dLanes a)
+{
+    __m256 y  = _mm256_rsqrt_ps(a.v);
+    __m256 hy = _mm256_mul_ps(_mm256_set1_ps(0.5f), y);
+    M3dLanes r = { _mm256_mul_ps(hy, _mm256_sub_ps(_mm256_set1_ps(3.0f), _mm256_mul_ps(_mm256_mul_ps(a.v, y), y))) };
+    return r;
+}
+
+// GCC splits blendv into single lanes without AVX2, the masks are
+// full width so and, andnot, and or do the same.
+static inline M3dLanes m3d_lanes_select(M3dLanes m, M3dLanes a, M3dLanes b)
+{
+    M3dLanes r = { _mm256_or_ps(_mm256_and_ps(m.v, a.v), _mm256_andnot_ps(m.v, b.v)) };
+    return r;
+}
+#else
+struct M3dLanes {
+    float v[M3D_LANES];
+};
+
+#define M3D_LANES_MAP(expr) M3dLanes r; for (int i = 0; i < M3D_LANES; ++i) r.v[i] = (expr); return r
+
+static inline M3dLanes m3d_lanes(float s)                       { M3D_LANES_MAP(s); }
+static inline M3dLanes m3d_lanes_load(float const *p)           { M3D_LANES_MAP(p[i]); }
+static inline void     m3d_lanes_store(float *p, M3dLanes a)    { for (int i = 0; i < M3D_LANES; ++i) p[i] = a.v[i]; }
+static inline M3dLanes operator + (M3dLanes a, M3dLanes b)      { M3D_LANES_MAP(a.v[i] + b.v[i]); }
+static inline M3dLanes operator - (M3dLanes a, M3dLanes b)      { M3D_LANES_MAP(a.v[i] - b.v[i]); }
+static inline M3dLanes operator * (M3dLanes a, M3dLanes b)      { M3D_LANES_MAP(a.v[i] * b.v[i]); }
+static inline M3dLanes operator / (M3dLanes a, M3dLanes b)      { M3D_LANES_MAP(a.v[i] / b.v[i]); }
+static inline M3dLanes m3d_lanes_sqrt(M3dLanes a)               { M3D_LANES_MAP(M3D_SQRTF(a.v[i])); }
+static inline M3dLanes m3d_lanes_rsqrt(M3dLanes a)              { M3D_LANES_MAP(1.0f / M3D_SQRTF(a.v[i])); }
+static inline M3dLanes m3d_lanes_min(M3dLanes a, M3dLanes b)    { M3D_LANES_MAP(min_of(a.v[i], b.v[i])); }
+static inline M3dLanes m3d_lanes_max(M3dLanes a, M3dLanes b)    { M3D_LANES_MAP(max_of(a.v[i], b.v[i])); }
+static inline M3dLanes m3d_lanes_abs(M3dLanes a)                { M3D_LANES_MAP(M3D_FABSF(a.v[i])); }
+static inline M3dLanes m3d_lanes_lt(M3dLanes a, M3dLanes b)     { M3D_LANES_MAP(a.v[i] < b.v[i] ? 1.0f : 0.0f); }
+static inline M3dLanes m3d_lanes_or(M3dLanes a, M3dLanes b)     { M3D_LANES_MAP(max_of(a.v[i], b.v[i])); }
+
+static inline uint32_t m3d_lanes_mask(M3dLanes m)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < M3D_LANES; ++i)
+        bits |= m.v[i] != 0.0f ? 1u << i : 0u;
+    return bits;
+}
+
+static inline M3dLanes m3d_lanes_select(M3dLanes m, M3dLanes a, M3dLanes b)
+{
+    M3D_LANES_MAP(m.v[i] != 0.0f ? a.v[i] : b.v[i]);
+}
+
+#undef M3D_LANES_MAP
+#endif
+
+// Jacobi rotation in the (p, q) plane zeroing s[p][q] of the symmetric
+// s, accumulated into the columns of v.
+static inline void m3d_jacobi_lanes(M3dLanes s[3][3], M3dLanes v[3][3], int p, int q)
+{
+    int const      r    = 3 - p - q;
+    M3dLanes const zero = m3d_lanes(0.0f);
+    M3dLanes const one  = m3d_lanes(1.0f);
+
+    // Entries below float precision next to the diagonal are dropped
+    // rather than rotated away, else they shrink into denormals which
+    // are very slow to compute with.
+    M3dLanes apq  = s[p][q];
+    M3dLanes d    = s[q][q] - s[p][p];
+    M3dLanes done = m3d_lanes_lt(m3d_lanes_abs(apq), m3d_lanes(1e-9f) * (m3d_lanes_abs(s[p][p]) + m3d_lanes_abs(s[q][q])) +
+                                                     m3d_lanes(1e-30f));
+
+    // t = tan of the rotation angle, the smaller root of
+    // t^2 + 2 t d / (2 apq) - 1 = 0, with one square root and divide
+    M3dLanes sign = m3d_lanes_select(m3d_lanes_lt(d, zero), m3d_lanes(-2.0f), m3d_lanes(2.0f));
+    M3dLanes root = m3d_lanes_sqrt(d * d + m3d_lanes(4.0f) * apq * apq);
+    M3dLanes t    = m3d_lanes_select(done, zero, sign * apq / (m3d_lanes_abs(d) + root));
+
+    // converged lanes keep an exact identity rotation, rsqrt of one is
+    // only approximately one
+    M3dLanes c  = m3d_lanes_select(done, one, m3d_lanes_rsqrt(t * t + one));
+    M3dLanes sn = t * c;
+
+    s[p][p] = s[p][p] - t * apq;
+    s[q][q] = s[q][q] + t * apq;
+    s[p][q] = s[q][p] = zero;
+
+    M3dLanes arp = s[r][p];
+    M3dLanes arq = s[r][q];
+    s[r][p] = s[p][r] = c * arp - sn * arq;
+    s[r][q] = s[q][r] = sn * arp + c * arq;
+
+    for (int k = 0; k < 3; ++k) {
+        M3dLanes vp = v[k][p];
+        M3dLanes vq = v[k][q];
+        v[k][p] = c * vp - sn * vq;
+        v[k][q] = sn * vp + c * vq;
+    }
+}
+
+// Orders the diagonal of s and the columns of v so the values are
+// largest first.  Swapping two columns mirrors, negating one of them
+// keeps v a rotation.
+static inline void m3d_sort_lanes(M3dLanes s[3][3], M3dLanes v[3][3], int p, int q)
+{
+    M3dLanes swap = m3d_lanes_lt(s[p][p], s[q][q]);
+    M3dLanes sp   = s[p][p];
+
+    s[p][p] = m3d_lanes_select(swap, s[q][q], sp);
+    s[q][q] = m3d_lanes_select(swap, sp, s[q][q]);
+
+    for (int k = 0; k < 3; ++k) {
+        M3dLanes vp = v[k][p];
+        v[k][p] = m3d_lanes_select(swap, v[k][q], vp);
+        v[k][q] = m3d_lanes_select(swap, m3d_lanes(0.0f) - vp, v[k][q]);
+    }
+}
+
+// Five sweeps take float matrices to convergence.  Every rotation is
+// a long chain of dependent square roots and divides, so the groups
+// are interleaved to keep several chains in flight.
+static inline void m3d_eigen_lanes(M3dLanes s[M3D_LANE_GROUPS][3][3], M3dLanes v[M3D_LANE_GROUPS][3][3])
+{
+    for (int g = 0; g < M3D_LANE_GROUPS; ++g)
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                v[g][r][c] = m3d_lanes(r == c ? 1.0f : 0.0f);
+
+    for (int sweep = 0; sweep < 5; ++sweep) {
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g)
+            m3d_jacobi_lanes(s[g], v[g], 0, 1);
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g)
+            m3d_jacobi_lanes(s[g], v[g], 0, 2);
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g)
+            m3d_jacobi_lanes(s[g], v[g], 1, 2);
+    }
+
+    for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+        m3d_sort_lanes(s[g], v[g], 0, 1);
+        m3d_sort_lanes(s[g], v[g], 0, 2);
+        m3d_sort_lanes(s[g], v[g], 1, 2);
+    }
+}
+
+// Givens rotation of rows p and q of b zeroing b[q][p], with the
+// half angle formulation that avoids cancellation, accumulated into
+// the columns of u.
+static inline void m3d_givens_lanes(M3dLanes b[3][3], M3dLanes u[3][3], int p, int q)
+{
+    M3dLanes const eps = m3d_lanes(1e-18f);
+
+    M3dLanes a1  = b[p][p];
+    M3dLanes a2  = b[q][p];
+    M3dLanes rho = m3d_lanes_sqrt(a1 * a1 + a2 * a2);
+    M3dLanes sh  = m3d_lanes_select(m3d_lanes_lt(eps, rho), a2, m3d_lanes(0.0f));
+    M3dLanes ch  = m3d_lanes_abs(a1) + m3d_lanes_max(rho, eps);
+
+    M3dLanes neg = m3d_lanes_lt(a1, m3d_lanes(0.0f));
+    M3dLanes t   = ch;
+    ch = m3d_lanes_select(neg, sh, ch);
+    sh = m3d_lanes_select(neg, t, sh);
+
+    M3dLanes w = m3d_lanes(1.0f) / m3d_lanes_sqrt(ch * ch + sh * sh);
+    ch = ch * w;
+    sh = sh * w;
+
+    M3dLanes c = m3d_lanes(1.0f) - m3d_lanes(2.0f) * sh * sh;
+    M3dLanes s = m3d_lanes(2.0f) * ch * sh;
+
+    for (int k = 0; k < 3; ++k) {
+        M3dLanes bp = b[p][k];
+        M3dLanes bq = b[q][k];
+        b[p][k] = c * bp + s * bq;
+        b[q][k] = c * bq - s * bp;
+
+        M3dLanes up = u[k][p];
+        M3dLanes uq = u[k][q];
+        u[k][p] = c * up + s * uq;
+        u[k][q] = c * uq - s * up;
+    }
+}
+
+static inline void m3d_svd_lanes(M3dLanes const a[M3D_LANE_GROUPS][3][3], M3dLanes u[M3D_LANE_GROUPS][3][3],
+                                 M3dLanes sigma[M3D_LANE_GROUPS][3], M3dLanes v[M3D_LANE_GROUPS][3][3])
+{
+    M3dLanes s[M3D_LANE_GROUPS][3][3];
+    for (int g = 0; g < M3D_LANE_GROUPS; ++g)
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                s[g][r][c] = a[g][0][r] * a[g][0][c] + a[g][1][r] * a[g][1][c] + a[g][2][r] * a[g][2][c];
+
+    m3d_eigen_lanes(s, v);
+
+    // b = a v has orthogonal columns, largest first, and its QR
+    // decomposition gives u and the singular values
+    for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+        M3dLanes b[3][3];
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                b[r][c] = a[g][r][0] * v[g][0][c] + a[g][r][1] * v[g][1][c] + a[g][r][2] * v[g][2][c];
+
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                u[g][r][c] = m3d_lanes(r == c ? 1.0f : 0.0f);
+
+        m3d_givens_lanes(b, u[g], 0, 1);
+        m3d_givens_lanes(b, u[g], 0, 2);
+        m3d_givens_lanes(b, u[g], 1, 2);
+
+        sigma[g][0] = b[0][0];
+        sigma[g][1] = b[1][1];
+        sigma[g][2] = b[2][2];
+    }
+}
+
+// Moves up to M3D_LANES matrices in and out of lanes, unused lanes hold
+// the identity.
+static inline void m3d_load_lanes(Mat3 const *A, size_t count, M3dLanes a[3][3])
+{
+    float lanes[9][M3D_LANES];
+
+    for (int i = 0; i < M3D_LANES; ++i)
+        for (int k = 0; k < 9; ++k)
+            lanes[k][i] = size_t(i) < count ? A[i].data[k] : (k % 4 == 0 ? 1.0f : 0.0f);
+
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 3; ++c)
+            a[r][c] = m3d_lanes_load(lanes[c * 3 + r]);
+}
+
+static inline void m3d_store_lanes(M3dLanes const a[3][3], Mat3 *A, size_t count)
+{
+    float lanes[9][M3D_LANES];
+
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 3; ++c)
+            m3d_lanes_store(lanes[c * 3 + r], a[r][c]);
+
+    for (size_t i = 0; i < count && i < M3D_LANES; ++i)
+        for (int k = 0; k < 9; ++k)
+            A[i].data[k] = lanes[k][i];
+}
+
+static inline void m3d_store_lanes(M3dLanes const x, M3dLanes const y, M3dLanes const z, Vec3 *v, size_t count)
+{
+    float lanes[3][M3D_LANES];
+
+    m3d_lanes_store(lanes[0], x);
+    m3d_lanes_store(lanes[1], y);
+    m3d_lanes_store(lanes[2], z);
+
+    for (size_t i = 0; i < count && i < M3D_LANES; ++i)
+        v[i] = vec3(lanes[0][i], lanes[1][i], lanes[2][i]);
+}
+
+M3D_DEF void svd(Mat3 const *M3D_RESTRICT A, Mat3 *M3D_RESTRICT U, Vec3 *M3D_RESTRICT sigma, Mat3 *M3D_RESTRICT V,
+                 size_t count)
+{
+    size_t const batch = M3D_LANES * M3D_LANE_GROUPS;
+
+    ptrdiff_t n = ptrdiff_t((count + batch - 1) / batch);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        M3dLanes a[M3D_LANE_GROUPS][3][3], u[M3D_LANE_GROUPS][3][3], v[M3D_LANE_GROUPS][3][3], s[M3D_LANE_GROUPS][3];
+
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+            size_t first = size_t(i) * batch + size_t(g) * M3D_LANES;
+            m3d_load_lanes(A + first, first < count ? count - first : 0, a[g]);
+        }
+
+        m3d_svd_lanes(a, u, s, v);
+
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+            size_t first = size_t(i) * batch + size_t(g) * M3D_LANES;
+            size_t left  = first < count ? count - first : 0;
+            m3d_store_lanes(u[g], U + first, left);
+            m3d_store_lanes(v[g], V + first, left);
+            m3d_store_lanes(s[g][0], s[g][1], s[g][2], sigma + first, left);
+        }
+    }
+}
+
+M3D_DEF void svd(Mat3 const &A, Mat3 *U, Vec3 *sigma, Mat3 *V)
+{
+    svd(&A, U, sigma, V, 1);
+}
+
+M3D_DEF void eigen_symmetric(Mat3 const *M3D_RESTRICT A, Vec3 *M3D_RESTRICT values, Mat3 *M3D_RESTRICT vectors,
+                             size_t count)
+{
+    size_t const batch = M3D_LANES * M3D_LANE_GROUPS;
+
+    ptrdiff_t n = ptrdiff_t((count + batch - 1) / batch);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        M3dLanes s[M3D_LANE_GROUPS][3][3], v[M3D_LANE_GROUPS][3][3];
+
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+            size_t first = size_t(i) * batch + size_t(g) * M3D_LANES;
+            m3d_load_lanes(A + first, first < count ? count - first : 0, s[g]);
+        }
+
+        m3d_eigen_lanes(s, v);
+
+        for (int g = 0; g < M3D_LANE_GROUPS; ++g) {
+            size_t first = size_t(i) * batch + size_t(g) * M3D_LANES;
+            size_t left  = first < count ? count - first : 0;
+            m3d_store_lanes(v[g], vectors + first, left);
+            m3d_store_lanes(s[g][0][0], s[g][1][1], s[g][2][2], values + first, left);
+        }
+    }
+}
+
+M3D_DEF void eigen_symmetric(Mat3 const &A, Vec3 *values, Mat3 *vectors)
+{
+    eigen_symmetric(&A, values, vectors, 1);
+}
+
+#undef M3D_LANE_GROUPS
+/**** END Decomposition definitions ****/
+
+
+/**** BEGIN OBB definitions ****/
+M3D_DEF Frustum frustum(Mat4 const &view_proj)
+{
+    Frustum f;
+
+    // row 3 plus or minus rows 0, 1, and 2 (Gribb and Hartmann)
+    for (int i = 0; i < 6; ++i) {
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        int   row  = i / 2;
+
+        float a = view_proj.at(3, 0) + sign * view_proj.at(row, 0);
+        float b = view_proj.at(3, 1) + sign * view_proj.at(row, 1);
+        float c = view_proj.at(3, 2) + sign * view_proj.at(row, 2);
+        float d = view_proj.at(3, 3) + sign * view_proj.at(row, 3);
+        float l = M3D_SQRTF(a * a + b * b + c * c);
+        float s = l > 0.0f ? 1.0f / l : 0.0f;
+
+        f.nx[i] = a * s;
+        f.ny[i] = b * s;
+        f.nz[i] = c * s;
+        f.d[i]  = d * s;
+    }
+
+    for (int i = 6; i < 8; ++i) {
+        f.nx[i] = f.ny[i] = f.nz[i] = 0.0f;
+        f.d[i]  = 1.0f;
+    }
+
+    return f;
+}
+
+// Sums are taken relative to the first point so that the variance of
+// points far from the origin does not cancel away.
+M3D_DEF Mat3 covariance(Vec3 const *points, size_t count, Vec3 *mean)
+{
+    Mat3 C = {};
+
+    if (count == 0) {
+        if (mean)
+            *mean = vec3(0.0f, 0.0f, 0.0f);
+        return C;
+    }
+
+    int const    chunks     = m3d_reduce_chunks(count);
+    size_t const chunk_size = (count + size_t(chunks) - 1) / size_t(chunks);
+    Vec3 const   origin     = points[0];
+
+    double sums[M3D_REDUCE_CHUNKS][9];
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t c = 0; c < ptrdiff_t(chunks); ++c) {
+        size_t begin = size_t(c) * chunk_size;
+        size_t end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+        double sx = 0.0, sy = 0.0, sz = 0.0;
+        double xx = 0.0, xy = 0.0, xz = 0.0, yy = 0.0, yz = 0.0, zz = 0.0;
+
+        for (size_t i = begin; i < end; ++i) {
+            double x = double(points[i].x - origin.x);
+            double y = double(points[i].y - origin.y);
+            double z = double(points[i].z - origin.z);
+
+            sx += x;     sy += y;     sz += z;
+            xx += x * x; xy += x * y; xz += x * z;
+            yy += y * y; yz += y * z; zz += z * z;
+        }
+
+        double *out = sums[c];
+        out[0] = sx; out[1] = sy; out[2] = sz;
+        out[3] = xx; out[4] = xy; out[5] = xz;
+        out[6] = yy; out[7] = yz; out[8] = zz;
+    }
+
+    double total[9] = {};
+    for (int c = 0; c < chunks; ++c)
+        for (int k = 0; k < 9; ++k)
+            total[k] += sums[c][k];
+
+    double const n  = double(count);
+    double const mx = total[0] / n;
+    double const my = total[1] / n;
+    double const mz = total[2] / n;
+
+    C.at(0, 0) = float(total[3] / n - mx * mx);
+    C.at(0, 1) = C.at(1, 0) = float(total[4] / n - mx * my);
+    C.at(0, 2) = C.at(2, 0) = float(total[5] / n - mx * mz);
+    C.at(1, 1) = float(total[6] / n - my * my);
+    C.at(1, 2) = C.at(2, 1) = float(total[7] / n - my * mz);
+    C.at(2, 2) = float(total[8] / n - mz * mz);
+
+    if (mean)
+        *mean = vec3(float(double(origin.x) + mx), float(double(origin.y) + my), float(double(origin.z) + mz));
+
+    return C;
+}
+
+// Extents along the principal axes and along x, y, and z are found in
+// the same pass, relative to the mean, and the smaller box is kept.
+M3D_DEF OBB obb(Vec3 const *points, size_t count)
+{
+    OBB box;
+    box.center       = vec3(0.0f, 0.0f, 0.0f);
+    box.axes         = mat3(identity());
+    box.half_extents = vec3(0.0f, 0.0f, 0.0f);
+
+    if (count == 0)
+        return box;
+
+    Vec3 mean;
+    Vec3 values;
+    Mat3 axes;
+    eigen_symmetric(covariance(points, count, &mean), &values, &axes);
+
+    Vec3 const a0 = vec3(axes.data[0], axes.data[1], axes.data[2]);
+    Vec3 const a1 = vec3(axes.data[3], axes.data[4], axes.data[5]);
+    Vec3 const a2 = vec3(axes.data[6], axes.data[7], axes.data[8]);
+
+    int const    chunks     = m3d_reduce_chunks(count);
+    size_t const chunk_size = (count + size_t(chunks) - 1) / size_t(chunks);
+
+    float lo[M3D_REDUCE_CHUNKS][6];
+    float hi[M3D_REDUCE_CHUNKS][6];
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t c = 0; c < ptrdiff_t(chunks); ++c) {
+        size_t begin = size_t(c) * chunk_size;
+        size_t end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+        Vec3 pmin = vec3( M3D_FLOAT_MAX,  M3D_FLOAT_MAX,  M3D_FLOAT_MAX);
+        Vec3 pmax = vec3(-M3D_FLOAT_MAX, -M3D_FLOAT_MAX, -M3D_FLOAT_MAX);
+        Vec3 amin = pmin;
+        Vec3 amax = pmax;
+
+        for (size_t i = begin; i < end; ++i) {
+            Vec3 d = points[i] - mean;
+            Vec3 p = vec3(dot(d, a0), dot(d, a1), dot(d, a2));
+
+            pmin = min_of(pmin, p);
+            pmax = max_of(pmax, p);
+            amin = min_of(amin, d);
+            amax = max_of(amax, d);
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            lo[c][k]     = pmin[k];
+            hi[c][k]     = pmax[k];
+            lo[c][k + 3] = amin[k];
+            hi[c][k + 3] = amax[k];
+        }
+    }
+
+    for (int c = 1; c < chunks; ++c) {
+        for (int k = 0; k < 6; ++k) {
+            lo[0][k] = min_of(lo[0][k], lo[c][k]);
+            hi[0][k] = max_of(hi[0][k], hi[c][k]);
+        }
+    }
+
+    Vec3 const pmin = vec3(lo[0][0], lo[0][1], lo[0][2]);
+    Vec3 const pmax = vec3(hi[0][0], hi[0][1], hi[0][2]);
+    Vec3 const amin = vec3(lo[0][3], lo[0][4], lo[0][5]);
+    Vec3 const amax = vec3(hi[0][3], hi[0][4], hi[0][5]);
+    Vec3 const pext = pmax - pmin;
+    Vec3 const aext = amax - amin;
+
+    // Flat or thin sets have next to no volume either way, rounding
+    // decides between the boxes then, so near ties go to the smaller
+    // surface area.
+    float const pvol  = pext.x * pext.y * pext.z;
+    float const avol  = aext.x * aext.y * aext.z;
+    float const parea = pext.x * pext.y + pext.y * pext.z + pext.z * pext.x;
+    float const aarea = aext.x * aext.y + aext.y * aext.z + aext.z * aext.x;
+    float const size  = max_of(max_of(aext.x, aext.y), aext.z);
+    bool  const tie   = M3D_FABSF(pvol - avol) <= 1e-5f * size * size * size;
+
+    if (tie ? parea < aarea : pvol < avol) {
+        Vec3 mid = 0.5f * (pmin + pmax);
+        box.center       = mean + mid.x * a0 + mid.y * a1 + mid.z * a2;
+        box.axes         = axes;
+        box.half_extents = 0.5f * pext;
+    }
+    else {
+        box.center       = mean + 0.5f * (amin + amax);
+        box.half_extents = 0.5f * aext;
+    }
+
+    return box;
+}
+
+// Boxes in lanes, a[k][i] is component i of axis k.  Lanes past count
+// repeat the first box.
+struct M3dObbLanes {
+    M3dLanes c[3];
+    M3dLanes a[3][3];
+    M3dLanes e[3];
+};
+
+static inline void m3d_load_lanes(OBB const *boxes, size_t count, M3dObbLanes *out)
+{
+    float lanes[15][M3D_LANES];
+
+    for (int i = 0; i < M3D_LANES; ++i) {
+        OBB const &box = boxes[size_t(i) < count ? i : 0];
+        for (int k = 0; k < 3; ++k) {
+            lanes[k][i]      = box.center[k];
+            lanes[k + 12][i] = box.half_extents[k];
+        }
+        for (int k = 0; k < 9; ++k)
+            lanes[k + 3][i] = box.axes.data[k];
+    }
+
+    for (int k = 0; k < 3; ++k) {
+        out->c[k] = m3d_lanes_load(lanes[k]);
+        out->e[k] = m3d_lanes_load(lanes[k + 12]);
+        for (int j = 0; j < 3; ++j)
+            out->a[k][j] = m3d_lanes_load(lanes[3 + 3 * k + j]);
+    }
+}
+
+static inline void m3d_store_mask(uint32_t bits, uint8_t *out, size_t count)
+{
+    for (size_t i = 0; i < count && i < M3D_LANES; ++i)
+        out[i] = uint8_t((bits >> i) & 1u);
+}
+
+// Culled when the center is further outside a plane than the box
+// reaches towards it.
+static inline M3dLanes m3d_frustum_cull_lanes(Frustum const &f, M3dObbLanes const &b)
+{
+    M3dLanes const zero = m3d_lanes(0.0f);
+    M3dLanes       out  = zero;
+
+    for (int p = 0; p < 6; ++p) {
+        M3dLanes nx = m3d_lanes(f.nx[p]);
+        M3dLanes ny = m3d_lanes(f.ny[p]);
+        M3dLanes nz = m3d_lanes(f.nz[p]);
+
+        M3dLanes r = b.e[0] * m3d_lanes_abs(nx * b.a[0][0] + ny * b.a[0][1] + nz * b.a[0][2]) +
+                     b.e[1] * m3d_lanes_abs(nx * b.a[1][0] + ny * b.a[1][1] + nz * b.a[1][2]) +
+                     b.e[2] * m3d_lanes_abs(nx * b.a[2][0] + ny * b.a[2][1] + nz * b.a[2][2]);
+        M3dLanes s = nx * b.c[0] + ny * b.c[1] + nz * b.c[2] + m3d_lanes(f.d[p]);
+
+        out = m3d_lanes_or(out, m3d_lanes_lt(s + r, zero));
+    }
+
+    return out;
+}
+
+// Gottschalk's test with b expressed in the frame of a.  The epsilon
+// on the absolute rotation keeps the edge axes of nearly parallel
+// edges, whose cross products vanish, from separating anything.
+static inline M3dLanes m3d_obb_separated_lanes(M3dObbLanes const &a, M3dObbLanes const &b)
+{
+    M3dLanes R[3][3], absR[3][3], t[3], d[3];
+
+    for (int k = 0; k < 3; ++k)
+        d[k] = b.c[k] - a.c[k];
+
+    for (int i = 0; i < 3; ++i) {
+        t[i] = a.a[i][0] * d[0] + a.a[i][1] * d[1] + a.a[i][2] * d[2];
+        for (int j = 0; j < 3; ++j) {
+            R[i][j]    = a.a[i][0] * b.a[j][0] + a.a[i][1] * b.a[j][1] + a.a[i][2] * b.a[j][2];
+            absR[i][j] = m3d_lanes_abs(R[i][j]) + m3d_lanes(1e-6f);
+        }
+    }
+
+    M3dLanes sep = m3d_lanes(0.0f);
+
+    for (int i = 0; i < 3; ++i) {
+        M3dLanes rb = b.e[0] * absR[i][0] + b.e[1] * absR[i][1] + b.e[2] * absR[i][2];
+        sep = m3d_lanes_or(sep, m3d_lanes_lt(a.e[i] + rb, m3d_lanes_abs(t[i])));
+    }
+
+    for (int j = 0; j < 3; ++j) {
+        M3dLanes ra   = a.e[0] * absR[0][j] + a.e[1] * absR[1][j] + a.e[2] * absR[2][j];
+        M3dLanes dist = t[0] * R[0][j] + t[1] * R[1][j] + t[2] * R[2][j];
+        sep = m3d_lanes_or(sep, m3d_lanes_lt(ra + b.e[j], m3d_lanes_abs(dist)));
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        int i1 = (i + 1) % 3;
+        int i2 = (i + 2) % 3;
+
+        for (int j = 0; j < 3; ++j) {
+            int j1 = (j + 1) % 3;
+            int j2 = (j + 2) % 3;
+
+            M3dLanes ra   = a.e[i1] * absR[i2][j] + a.e[i2] * absR[i1][j];
+            M3dLanes rb   = b.e[j1] * absR[i][j2] + b.e[j2] * absR[i][j1];
+            M3dLanes dist = t[i2] * R[i1][j] - t[i1] * R[i2][j];
+            sep = m3d_lanes_or(sep, m3d_lanes_lt(ra + rb, m3d_lanes_abs(dist)));
+        }
+    }
+
+    return sep;
+}
+
+M3D_DEF void intersect(Frustum const &frustum, OBB const *M3D_RESTRICT boxes, uint8_t *M3D_RESTRICT visible,
+                       size_t count)
+{
+    ptrdiff_t n = ptrdiff_t((count + M3D_LANES - 1) / M3D_LANES);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        size_t      first = size_t(i) * M3D_LANES;
+        M3dObbLanes b;
+
+        m3d_load_lanes(boxes + first, count - first, &b);
+        uint32_t culled = m3d_lanes_mask(m3d_frustum_cull_lanes(frustum, b));
+        m3d_store_mask(~culled, visible + first, count - first);
+    }
+}
+
+M3D_DEF bool intersect(Frustum const &frustum, OBB const &box)
+{
+    uint8_t visible;
+    intersect(frustum, &box, &visible, 1);
+    return visible != 0;
+}
+
+M3D_DEF void intersect(OBB const *M3D_RESTRICT a, OBB const *M3D_RESTRICT b, uint8_t *M3D_RESTRICT overlap,
+                       size_t count)
+{
+    ptrdiff_t n = ptrdiff_t((count + M3D_LANES - 1) / M3D_LANES);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        size_t      first = size_t(i) * M3D_LANES;
+        M3dObbLanes la, lb;
+
+        m3d_load_lanes(a + first, count - first, &la);
+        m3d_load_lanes(b + first, count - first, &lb);
+        uint32_t separated = m3d_lanes_mask(m3d_obb_separated_lanes(la, lb));
+        m3d_store_mask(~separated, overlap + first, count - first);
+    }
+}
+
+M3D_DEF bool intersect(OBB const &a, OBB const &b)
+{
+    uint8_t overlap;
+    intersect(&a, &b, &overlap, 1);
+    return overlap != 0;
+}
+
+/**** END OBB definitions ****/
+
+
+/**** BEGIN Sphere definitions ****/
+// Index and squared distance of the point furthest from c.
+static size_t m3d_furthest(Vec3 const *points, size_t count, Vec3 c, float *dist_sq)
+{
+    int const    chunks     = m3d_reduce_chunks(count);
+    size_t const chunk_size = (count + size_t(chunks) - 1) / size_t(chunks);
+
+    size_t best[M3D_REDUCE_CHUNKS];
+    float  best_d[M3D_REDUCE_CHUNKS];
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t k = 0; k < ptrdiff_t(chunks); ++k) {
+        size_t begin = size_t(k) * chunk_size;
+        size_t end   = begin + chunk_size < count ? begin + chunk_size : count;
+        size_t index = begin;
+        float  d_max = -1.0f;
+
+        for (size_t i = begin; i < end; ++i) {
+            Vec3  d  = points[i] - c;
+            float dd = dot(d, d);
+            if (dd > d_max) {
+                d_max = dd;
+                index = i;
+            }
+        }
+
+        best[k]   = index;
+        best_d[k] = d_max;
+    }
+
+    for (int k = 1; k < chunks; ++k) {
+        if (best_d[k] > best_d[0]) {
+            best_d[0] = best_d[k];
+            best[0]   = best[k];
+        }
+    }
+
+    *dist_sq = best_d[0];
+    return best[0];
+}
+
+M3D_DEF Sphere sphere(Vec3 const *points, size_t count)
+{
+    Sphere s = { vec3(0.0f, 0.0f, 0.0f), -1.0f };
+
+    if (count == 0)
+        return s;
+
+    // extents along the axes and the four cube diagonals, values only
+    // so the loop has no branches
+    Vec3 const dirs[7] = {
+        vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1),
+        vec3(1, 1, 1), vec3(1, 1, -1), vec3(1, -1, 1), vec3(1, -1, -1)
+    };
+
+    int const    chunks     = m3d_reduce_chunks(count);
+    size_t const chunk_size = (count + size_t(chunks) - 1) / size_t(chunks);
+
+    float lo[M3D_REDUCE_CHUNKS][7], hi[M3D_REDUCE_CHUNKS][7];
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t k = 0; k < ptrdiff_t(chunks); ++k) {
+        size_t begin = size_t(k) * chunk_size;
+        size_t end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+        // named bounds rather than a loop over dirs stay in registers
+        Vec3  amin = points[begin];
+        Vec3  amax = amin;
+        float d0_lo = M3D_FLOAT_MAX, d1_lo = M3D_FLOAT_MAX, d2_lo = M3D_FLOAT_MAX, d3_lo = M3D_FLOAT_MAX;
+        float d0_hi = -M3D_FLOAT_MAX, d1_hi = -M3D_FLOAT_MAX, d2_hi = -M3D_FLOAT_MAX, d3_hi = -M3D_FLOAT_MAX;
+
+        for (size_t i = begin; i < end; ++i) {
+            Vec3  p     = points[i];
+            float plus  = p.x + p.y;
+            float minus = p.x - p.y;
+            float d0    = plus + p.z;
+            float d1    = plus - p.z;
+            float d2    = minus + p.z;
+            float d3    = minus - p.z;
+
+            amin  = min_of(amin, p);
+            amax  = max_of(amax, p);
+            d0_lo = min_of(d0_lo, d0);
+            d0_hi = max_of(d0_hi, d0);
+            d1_lo = min_of(d1_lo, d1);
+            d1_hi = max_of(d1_hi, d1);
+            d2_lo = min_of(d2_lo, d2);
+            d2_hi = max_of(d2_hi, d2);
+            d3_lo = min_of(d3_lo, d3);
+            d3_hi = max_of(d3_hi, d3);
+        }
+
+        float const l[7] = { amin.x, amin.y, amin.z, d0_lo, d1_lo, d2_lo, d3_lo };
+        float const h[7] = { amax.x, amax.y, amax.z, d0_hi, d1_hi, d2_hi, d3_hi };
+
+        for (int j = 0; j < 7; ++j) {
+            lo[k][j] = l[j];
+            hi[k][j] = h[j];
+        }
+    }
+
+    for (int k = 1; k < chunks; ++k) {
+        for (int j = 0; j < 7; ++j) {
+            lo[0][j] = min_of(lo[0][j], lo[k][j]);
+            hi[0][j] = max_of(hi[0][j], hi[k][j]);
+        }
+    }
+
+    // the points at either end of the widest direction span the
+    // initial sphere
+    int   axis  = 0;
+    float width = -1.0f;
+    for (int j = 0; j < 7; ++j) {
+        float w = (hi[0][j] - lo[0][j]) * (j < 3 ? 1.0f : 0.57735027f);
+        if (w > width) {
+            width = w;
+            axis  = j;
+        }
+    }
+
+    size_t ends[M3D_REDUCE_CHUNKS][2];
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t k = 0; k < ptrdiff_t(chunks); ++k) {
+        size_t begin = size_t(k) * chunk_size;
+        size_t end   = begin + chunk_size < count ? begin + chunk_size : count;
+
+        ends[k][0] = ends[k][1] = count;
+        for (size_t i = begin; i < end; ++i) {
+            float d = dot(points[i], dirs[axis]);
+            if (d == lo[0][axis] && ends[k][0] == count)
+                ends[k][0] = i;
+            if (d == hi[0][axis] && ends[k][1] == count)
+                ends[k][1] = i;
+        }
+    }
+
+    size_t first = count, last = count;
+    for (int k = 0; k < chunks; ++k) {
+        first = first < count ? first : ends[k][0];
+        last  = last  < count ? last  : ends[k][1];
+    }
+
+    Vec3 a = points[first < count ? first : 0];
+    Vec3 b = points[last  < count ? last  : 0];
+
+    s.center = 0.5f * (a + b);
+    s.radius = 0.5f * length(b - a);
+
+    // Ritter's step with the furthest point instead of the next one,
+    // which keeps each pass parallel.  The last pass takes the radius
+    // to the furthest point so the result always encloses the points.
+    for (int pass = 0; pass < 8; ++pass) {
+        float  dist_sq;
+        size_t furthest = m3d_furthest(points, count, s.center, &dist_sq);
+        float  dist     = M3D_SQRTF(dist_sq);
+
+        if (dist <= s.radius)
+            break;
+
+        if (pass == 7) {
+            s.radius = dist;
+            break;
+        }
+
+        float grown = 0.5f * (s.radius + dist);
+        s.center = s.center + ((grown - s.radius) / dist) * (points[furthest] - s.center);
+        s.radius = grown;
+    }
+
+    // the moved center rounds, a last relative nudge keeps every point
+    // inside in float arithmetic
+    s.radius *= 1.0f + 4.0f * 1.1920929e-7f;
+    return s;
+}
+
+M3D_DEF Sphere merge(Sphere const &a, Sphere const &b)
+{
+    if (a.radius < 0.0f)
+        return b;
+    if (b.radius < 0.0f)
+        return a;
+
+    Vec3  d    = b.center - a.center;
+    float dist = length(d);
+
+    if (dist + b.radius <= a.radius)
+        return a;
+    if (dist + a.radius <= b.radius)
+        return b;
+
+    Sphere s;
+    s.radius = 0.5f * (dist + a.radius + b.radius);
+    s.center = a.center + ((s.radius - a.radius) / dist) * d;
+    return s;
+}
+
+M3D_DEF Sphere transform_sphere(Mat4 const &A, Sphere const &s)
+{
+    Vec3 c0 = vec3(A.data[0], A.data[1], A.data[2]);
+    Vec3 c1 = vec3(A.data[4], A.data[5], A.data[6]);
+    Vec3 c2 = vec3(A.data[8], A.data[9], A.data[10]);
+
+    // The squared stretch is the largest eigenvalue of the Gram matrix
+    // of the columns, bounded by its largest Gershgorin row sum and by
+    // its trace.  Both are exact when the columns are orthogonal.
+    float g00 = dot(c0, c0), g11 = dot(c1, c1), g22 = dot(c2, c2);
+    float g01 = M3D_FABSF(dot(c0, c1));
+    float g02 = M3D_FABSF(dot(c0, c2));
+    float g12 = M3D_FABSF(dot(c1, c2));
+    float rows     = max_of(g00 + g01 + g02, max_of(g11 + g01 + g12, g22 + g02 + g12));
+    float scale_sq = min_of(rows, g00 + g11 + g22);
+
+    Sphere out;
+    out.center = s.center.x * c0 + s.center.y * c1 + s.center.z * c2 + vec3(A.data[12], A.data[13], A.data[14]);
+    out.radius = s.radius * M3D_SQRTF(scale_sq);
+    return out;
+}
+
+M3D_DEF void transform_spheres(Mat4 const *M3D_RESTRICT matrices, Sphere const *M3D_RESTRICT in,
+                               Sphere *M3D_RESTRICT out, size_t count)
+{
+    ptrdiff_t n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i)
+        out[i] = transform_sphere(matrices[i], in[i]);
+}
+
+M3D_DEF bool intersect(Sphere const &a, Sphere const &b)
+{
+    Vec3  d = b.center - a.center;
+    float r = a.radius + b.radius;
+    return dot(d, d) <= r * r;
+}
+
+// Eight lanes from p with zeros past count.
+static inline M3dLanes m3d_lanes_load(float const *p, size_t count)
+{
+    if (count >= M3D_LANES)
+        return m3d_lanes_load(p);
+
+    float lanes[M3D_LANES] = {};
+    for (size_t i = 0; i < count; ++i)
+        lanes[i] = p[i];
+    return m3d_lanes_load(lanes);
+}
+
+// Bit i is set when sphere i of a, at the given lane position, is
+// separated from sphere i of b.
+static inline uint32_t m3d_spheres_apart(M3dLanes ax, M3dLanes ay, M3dLanes az, M3dLanes ar,
+                                         M3dLanes bx, M3dLanes by, M3dLanes bz, M3dLanes br)
+{
+    M3dLanes dx = bx - ax;
+    M3dLanes dy = by - ay;
+    M3dLanes dz = bz - az;
+    M3dLanes r  = ar + br;
+    return m3d_lanes_mask(m3d_lanes_lt(r * r, dx * dx + dy * dy + dz * dz));
+}
+
+M3D_DEF void intersect(Spheres const &a, Spheres const &b, uint8_t *M3D_RESTRICT overlap, size_t count)
+{
+    ptrdiff_t n = ptrdiff_t((count + M3D_LANES - 1) / M3D_LANES);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        size_t first = size_t(i) * M3D_LANES;
+        size_t left  = count - first;
+
+        uint32_t apart = m3d_spheres_apart(
+            m3d_lanes_load(a.x + first, left), m3d_lanes_load(a.y + first, left),
+            m3d_lanes_load(a.z + first, left), m3d_lanes_load(a.radius + first, left),
+            m3d_lanes_load(b.x + first, left), m3d_lanes_load(b.y + first, left),
+            m3d_lanes_load(b.z + first, left), m3d_lanes_load(b.radius + first, left));
+
+        for (size_t k = 0; k < left && k < M3D_LANES; ++k)
+            overlap[first + k] = uint8_t(((apart >> k) & 1u) ^ 1u);
+    }
+}
+
+M3D_DEF size_t intersect(Sphere const &s, Spheres const &spheres, size_t count,
+                         uint32_t *M3D_RESTRICT out, size_t max_out)
+{
+    M3dLanes const sx = m3d_lanes(s.center.x);
+    M3dLanes const sy = m3d_lanes(s.center.y);
+    M3dLanes const sz = m3d_lanes(s.center.z);
+    M3dLanes const sr = m3d_lanes(s.radius);
+
+    uint32_t const all   = (1u << M3D_LANES) - 1u;
+    size_t         found = 0;
+
+    for (size_t first = 0; first < count; first += M3D_LANES) {
+        size_t   left = count - first;
+        uint32_t hits = ~m3d_spheres_apart(sx, sy, sz, sr,
+                                           m3d_lanes_load(spheres.x + first, left),
+                                           m3d_lanes_load(spheres.y + first, left),
+                                           m3d_lanes_load(spheres.z + first, left),
+                                           m3d_lanes_load(spheres.radius + first, left)) & all;
+
+        if (left < M3D_LANES)
+            hits &= (1u << left) - 1u;
+
+        while (hits) {
+            int k = m3d_lowest_bit(hits);
+            hits &= hits - 1u;
+
+            if (found < max_out)
+                out[found] = uint32_t(first + size_t(k));
+            ++found;
+        }
+    }
+
+    return found;
+}
+
+/**** END Sphere definitions ****/
+
+
+/**** BEGIN SortSweep definitions ****/
+M3D_DEF size_t sort_sweep_bounds_size(size_t count)
+{
+    return 6 * (count + M3D_LANES);
+}
+
+M3D_DEF size_t sort_sweep_scratch_size(size_t count)
+{
+    return count * sizeof(uint64_t) + radix_sort_scratch_size(count);
+}
+
+// Unsigned keys that sort like the floats they come from.
+static inline uint32_t m3d_float_key(float f)
+{
+    M3dFloatBits bits;
+    bits.f = f;
+    return (bits.u & 0x80000000u) ? ~bits.u : (bits.u | 0x80000000u);
+}
+
+M3D_DEF void sort_sweep_init(SortSweep *sweep, AABB const *boxes, size_t count, void *scratch)
+{
+    double sum[3] = {}, sum_sq[3] = {};
+
+    for (size_t i = 0; i < count; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            double c = 0.5 * (double(boxes[i].min[k]) + double(boxes[i].max[k]));
+            sum[k]    += c;
+            sum_sq[k] += c * c;
+        }
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; ++k)
+        if (sum_sq[k] * double(count) - sum[k] * sum[k] > sum_sq[axis] * double(count) - sum[axis] * sum[axis])
+            axis = k;
+
+    // 64 bit slots keep the radix sort scratch behind the keys aligned
+    uint32_t *keys = static_cast<uint32_t *>(scratch);
+    for (size_t i = 0; i < count; ++i)
+        keys[i] = m3d_float_key(boxes[i].min[axis]);
+
+    radix_sort(keys, sweep->order, count, static_cast<unsigned char *>(scratch) + count * sizeof(uint64_t));
+
+    sweep->count = count;
+    sweep->axis  = axis;
+}
+
+M3D_DEF size_t sort_sweep_update(SortSweep *sweep, AABB const *M3D_RESTRICT boxes,
+                                 uint32_t *M3D_RESTRICT pairs, size_t max_pairs)
+{
+    size_t const count  = sweep->count;
+    size_t const stride = count + M3D_LANES;
+    int const    a      = sweep->axis;
+    int const    b      = (a + 1) % 3;
+    int const    c      = (a + 2) % 3;
+
+    uint32_t *M3D_RESTRICT order = sweep->order;
+    float    *M3D_RESTRICT lo_a  = sweep->bounds;
+    float    *M3D_RESTRICT hi_a  = lo_a + stride;
+    float    *M3D_RESTRICT lo_b  = hi_a + stride;
+    float    *M3D_RESTRICT hi_b  = lo_b + stride;
+    float    *M3D_RESTRICT lo_c  = hi_b + stride;
+    float    *M3D_RESTRICT hi_c  = lo_c + stride;
+
+    for (size_t i = 0; i < count; ++i)
+        lo_a[i] = boxes[order[i]].min[a];
+
+    // insertion sort, nearly linear when the order of last update
+    // still mostly holds
+    for (size_t i = 1; i < count; ++i) {
+        float    key   = lo_a[i];
+        uint32_t index = order[i];
+        size_t   j     = i;
+
+        while (j > 0 && lo_a[j - 1] > key) {
+            lo_a[j]  = lo_a[j - 1];
+            order[j] = order[j - 1];
+            --j;
+        }
+
+        lo_a[j]  = key;
+        order[j] = index;
+    }
+
+    ptrdiff_t const n = ptrdiff_t(count);
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t i = 0; i < n; ++i) {
+        AABB const &box = boxes[order[i]];
+        hi_a[i] = box.max[a];
+        lo_b[i] = box.min[b];
+        hi_b[i] = box.max[b];
+        lo_c[i] = box.min[c];
+        hi_c[i] = box.max[c];
+    }
+
+    // padding past the last box starts beyond everything and is empty
+    for (size_t i = count; i < stride; ++i) {
+        lo_a[i] = lo_b[i] = lo_c[i] = M3D_FLOAT_MAX;
+        hi_a[i] = hi_b[i] = hi_c[i] = -M3D_FLOAT_MAX;
+    }
+
+    uint32_t const all   = (1u << M3D_LANES) - 1u;
+    size_t         total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        M3dLanes const end    = m3d_lanes(hi_a[i]);
+        M3dLanes const box_lb = m3d_lanes(lo_b[i]);
+        M3dLanes const box_hb = m3d_lanes(hi_b[i]);
+        M3dLanes const box_lc = m3d_lanes(lo_c[i]);
+        M3dLanes const box_hc = m3d_lanes(hi_c[i]);
+
+        for (size_t j = i + 1; j < count; j += M3D_LANES) {
+            // boxes starting past the end of box i, which being sorted
+            // are the last lanes, end the sweep
+            uint32_t beyond = m3d_lanes_mask(m3d_lanes_lt(end, m3d_lanes_load(lo_a + j)));
+            uint32_t apart  = m3d_lanes_mask(m3d_lanes_or(
+                m3d_lanes_or(m3d_lanes_lt(box_hb, m3d_lanes_load(lo_b + j)),
+                             m3d_lanes_lt(m3d_lanes_load(hi_b + j), box_lb)),
+                m3d_lanes_or(m3d_lanes_lt(box_hc, m3d_lanes_load(lo_c + j)),
+                             m3d_lanes_lt(m3d_lanes_load(hi_c + j), box_lc))));
+
+            // the padding lanes still overlap boxes reaching to the
+            // largest float or infinity
+            uint32_t hits = ~(beyond | apart) & all;
+            if (count - j < M3D_LANES)
+                hits &= (1u << (count - j)) - 1u;
+
+            while (hits) {
+                int      k     = m3d_lowest_bit(hits);
+                uint32_t first = order[i];
+                uint32_t other = order[j + size_t(k)];
+                hits &= hits - 1u;
+
+                if (total < max_pairs) {
+                    pairs[2 * total]     = first < other ? first : other;
+                    pairs[2 * total + 1] = first < other ? other : first;
+                }
+                ++total;
+            }
+
+            if (beyond)
+                break;
+        }
+    }
+
+    return total;
+}
+/**** END SortSweep definitions ****/
+
+
+/**** BEGIN GJK definitions ****/
+#define M3D_GJK_MAX_ITERATIONS 64
+#define M3D_EPA_MAX_VERTICES   64
+#define M3D_EPA_MAX_FACES      128
+#define M3D_EPA_MAX_EDGES      128
+
+M3D_DEF Vec3 support_point(void const *point, Vec3)
+{
+    return *static_cast<Vec3 const *>(point);
+}
+
+// A zero direction picks an arbitrary point of the surface.
+static inline Vec3 m3d_unit_or_x(Vec3 d)
+{
+    float l = dot(d, d);
+    return l > 0.0f ? (1.0f / M3D_SQRTF(l)) * d : vec3(1.0f, 0.0f, 0.0f);
+}
+
+M3D_DEF Vec3 support_sphere(void const *sphere, Vec3 direction)
+{
+    Sphere const *s = static_cast<Sphere const *>(sphere);
+    return s->center + s->radius * m3d_unit_or_x(direction);
+}
+
+M3D_DEF Vec3 support_obb(void const *box, Vec3 direction)
+{
+    OBB const *b = static_cast<OBB const *>(box);
+    Vec3       p = b->center;
+
+    for (int k = 0; k < 3; ++k) {
+        Vec3 axis = vec3(b->axes.data[3 * k], b->axes.data[3 * k + 1], b->axes.data[3 * k + 2]);
+        p = p + (dot(axis, direction) < 0.0f ? -b->half_extents[k] : b->half_extents[k]) * axis;
+    }
+
+    return p;
+}
+
+M3D_DEF Vec3 support_capsule(void const *capsule, Vec3 direction)
+{
+    Capsule const *c = static_cast<Capsule const *>(capsule);
+    return (dot(c->b - c->a, direction) > 0.0f ? c->b : c->a) + c->radius * m3d_unit_or_x(direction);
+}
+
+M3D_DEF Vec3 support_hull(void const *hull, Vec3 direction)
+{
+    Hull const *h     = static_cast<Hull const *>(hull);
+    size_t      best  = 0;
+    float       d_max = -M3D_FLOAT_MAX;
+    size_t      i     = 0;
+
+    if (h->count >= 2 * M3D_LANES) {
+        float index[M3D_LANES];
+        for (int k = 0; k < M3D_LANES; ++k)
+            index[k] = float(k);
+
+        M3dLanes const dx   = m3d_lanes(direction.x);
+        M3dLanes const dy   = m3d_lanes(direction.y);
+        M3dLanes const dz   = m3d_lanes(direction.z);
+        M3dLanes const step = m3d_lanes(float(M3D_LANES));
+        M3dLanes       idx  = m3d_lanes_load(index);
+        M3dLanes       top  = m3d_lanes(-M3D_FLOAT_MAX);
+        M3dLanes       arg  = m3d_lanes(0.0f);
+
+        for (; i + M3D_LANES <= h->count; i += M3D_LANES) {
+            M3dLanes d = dx * m3d_lanes_load(h->x + i) + dy * m3d_lanes_load(h->y + i) + dz * m3d_lanes_load(h->z + i);
+            M3dLanes m = m3d_lanes_lt(top, d);
+            top = m3d_lanes_select(m, d, top);
+            arg = m3d_lanes_select(m, idx, arg);
+            idx = idx + step;
+        }
+
+        float tops[M3D_LANES], args[M3D_LANES];
+        m3d_lanes_store(tops, top);
+        m3d_lanes_store(args, arg);
+
+        for (int k = 0; k < M3D_LANES; ++k) {
+            if (tops[k] > d_max) {
+                d_max = tops[k];
+                best  = size_t(args[k]);
+            }
+        }
+    }
+
+    for (; i < h->count; ++i) {
+        float d = direction.x * h->x[i] + direction.y * h->y[i] + direction.z * h->z[i];
+        if (d > d_max) {
+            d_max = d;
+            best  = i;
+        }
+    }
+
+    return vec3(h->x[best], h->y[best], h->z[best]);
+}
+
+M3D_DEF Vec3 support(Convex const &shape, Vec3 direction)
+{
+    if (!shape.transform)
+        return shape.support(shape.shape, direction);
+
+    Mat3x4 const &A     = *shape.transform;
+    Vec3 const    local = vec3(A.at(0, 0) * direction.x + A.at(1, 0) * direction.y + A.at(2, 0) * direction.z,
+                               A.at(0, 1) * direction.x + A.at(1, 1) * direction.y + A.at(2, 1) * direction.z,
+                               A.at(0, 2) * direction.x + A.at(1, 2) * direction.y + A.at(2, 2) * direction.z);
+
+    return transform_point(A, shape.support(shape.shape, local));
+}
+
+static inline void m3d_gjk_vertex(Convex const &a, Convex const &b, Vec3 d, GjkSimplex *s, int k)
+{
+    s->dirs[k] = d;
+    s->a[k]    = support(a, d);
+    s->b[k]    = support(b, -d);
+}
+
+// Keeps the n vertices listed in keep, in that order, with weights
+// lambda.
+static inline void m3d_gjk_keep(GjkSimplex *s, Vec3 *w, int const *keep, int n, float const *lambda, float *weights)
+{
+    Vec3 a[3], b[3], dirs[3], u[3];
+
+    for (int k = 0; k < n; ++k) {
+        a[k]    = s->a[keep[k]];
+        b[k]    = s->b[keep[k]];
+        dirs[k] = s->dirs[keep[k]];
+        u[k]    = w[keep[k]];
+    }
+
+    for (int k = 0; k < n; ++k) {
+        s->a[k]    = a[k];
+        s->b[k]    = b[k];
+        s->dirs[k] = dirs[k];
+        w[k]       = u[k];
+        weights[k] = lambda[k];
+    }
+
+    s->count = n;
+}
+
+// Closest point to the origin of the triangle (w[i], w[j], w[k]) by
+// its Voronoi regions, as in Ericson's Real-Time Collision Detection.
+// The vertices of the feature it lies on go to keep with their weights
+// in lambda.
+static Vec3 m3d_gjk_triangle(Vec3 const *w, int i, int j, int k, int *keep, float *lambda, int *n)
+{
+    Vec3 const a  = w[i];
+    Vec3 const b  = w[j];
+    Vec3 const c  = w[k];
+    Vec3 const ab = b - a;
+    Vec3 const ac = c - a;
+
+    float d1 = -dot(ab, a);
+    float d2 = -dot(ac, a);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        keep[0] = i; lambda[0] = 1.0f; *n = 1;
+        return a;
+    }
+
+    float d3 = -dot(ab, b);
+    float d4 = -dot(ac, b);
+    if (d3 >= 0.0f && d4 <= d3) {
+        keep[0] = j; lambda[0] = 1.0f; *n = 1;
+        return b;
+    }
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        float t = d1 / (d1 - d3);
+        keep[0] = i; keep[1] = j; lambda[0] = 1.0f - t; lambda[1] = t; *n = 2;
+        return a + t * ab;
+    }
+
+    float d5 = -dot(ab, c);
+    float d6 = -dot(ac, c);
+    if (d6 >= 0.0f && d5 <= d6) {
+        keep[0] = k; lambda[0] = 1.0f; *n = 1;
+        return c;
+    }
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        float t = d2 / (d2 - d6);
+        keep[0] = i; keep[1] = k; lambda[0] = 1.0f - t; lambda[1] = t; *n = 2;
+        return a + t * ac;
+    }
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        float t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        keep[0] = j; keep[1] = k; lambda[0] = 1.0f - t; lambda[1] = t; *n = 2;
+        return b + t * (c - b);
+    }
+
+    float denom = 1.0f / (va + vb + vc);
+    float v     = vb * denom;
+    float u     = vc * denom;
+    keep[0] = i; keep[1] = j; keep[2] = k;
+    lambda[0] = 1.0f - v - u; lambda[1] = v; lambda[2] = u;
+    *n = 3;
+    return a + v * ab + u * ac;
+}
+
+// Reduces the simplex to the feature closest to the origin and returns
+// the closest point, a count of 4 is left when the origin is inside.
+static Vec3 m3d_gjk_closest(GjkSimplex *s, Vec3 *w, float *weights)
+{
+    int   keep[3];
+    float lambda[3];
+    int   n = 0;
+    Vec3  v = w[0];
+
+    if (s->count == 1) {
+        weights[0] = 1.0f;
+        return v;
+    }
+
+    if (s->count == 2) {
+        Vec3  ab    = w[1] - w[0];
+        float denom = dot(ab, ab);
+        float t     = denom > 0.0f ? -dot(w[0], ab) / denom : 0.0f;
+
+        if (t <= 0.0f) {
+            keep[0] = 0; lambda[0] = 1.0f; n = 1;
+        }
+        else if (t >= 1.0f) {
+            keep[0] = 1; lambda[0] = 1.0f; n = 1;
+            v = w[1];
+        }
+        else {
+            keep[0] = 0; keep[1] = 1; lambda[0] = 1.0f - t; lambda[1] = t; n = 2;
+            v = w[0] + t * ab;
+        }
+    }
+    else if (s->count == 3) {
+        v = m3d_gjk_triangle(w, 0, 1, 2, keep, lambda, &n);
+    }
+    else {
+        // faces with the vertex opposite, the origin is closest to a
+        // face it lies in front of.  A flat tetrahedron has no inside
+        // so all faces are tried.
+        static int const faces[4][4] = { {0, 1, 2, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {1, 3, 2, 0} };
+        float best = M3D_FLOAT_MAX;
+
+        float edge   = max_of(max_of(len_sq(w[1] - w[0]), len_sq(w[2] - w[0])), len_sq(w[3] - w[0]));
+        float volume = dot(w[1] - w[0], cross(w[2] - w[0], w[3] - w[0]));
+        bool  flat   = volume * volume <= 1e-12f * edge * edge * edge;
+
+        for (int f = 0; f < 4; ++f) {
+            Vec3 const a      = w[faces[f][0]];
+            Vec3 const normal = cross(w[faces[f][1]] - a, w[faces[f][2]] - a);
+            float      side_o = -dot(normal, a);
+            float      side_d = dot(normal, w[faces[f][3]] - a);
+
+            if (!flat && side_o * side_d >= 0.0f)
+                continue;
+
+            int   face_keep[3];
+            float face_lambda[3];
+            int   face_n;
+            Vec3  p = m3d_gjk_triangle(w, faces[f][0], faces[f][1], faces[f][2], face_keep, face_lambda, &face_n);
+
+            if (dot(p, p) < best) {
+                best = dot(p, p);
+                v    = p;
+                n    = face_n;
+                for (int k = 0; k < face_n; ++k) {
+                    keep[k]   = face_keep[k];
+                    lambda[k] = face_lambda[k];
+                }
+            }
+        }
+
+        if (n == 0) {
+            for (int k = 0; k < 4; ++k)
+                weights[k] = 0.25f;
+            return vec3(0.0f, 0.0f, 0.0f);
+        }
+    }
+
+    m3d_gjk_keep(s, w, keep, n, lambda, weights);
+    return v;
+}
+
+M3D_DEF bool gjk(Convex const &a, Convex const &b, GjkSimplex *simplex, ConvexResult *result)
+{
+    GjkSimplex &s = *simplex;
+    Vec3        w[4];
+    float       weights[4];
+
+    // evaluate the last directions again on the moved shapes, dropping
+    // vertices that now coincide
+    int const last = s.count < 0 ? 0 : (s.count > 4 ? 4 : s.count);
+    s.count = 0;
+
+    for (int k = 0; k < last; ++k) {
+        m3d_gjk_vertex(a, b, s.dirs[k], &s, s.count);
+        w[s.count] = s.a[s.count] - s.b[s.count];
+
+        bool repeated = false;
+        for (int j = 0; j < s.count; ++j)
+            repeated = repeated || len_sq(w[j] - w[s.count]) == 0.0f;
+        s.count += repeated ? 0 : 1;
+    }
+
+    if (s.count == 0) {
+        m3d_gjk_vertex(a, b, vec3(1.0f, 0.0f, 0.0f), &s, 0);
+        w[0]    = s.a[0] - s.b[0];
+        s.count = 1;
+    }
+
+    bool  overlap = false;
+    float scale   = 0.0f;
+    float best    = M3D_FLOAT_MAX;
+    Vec3  v       = w[0];
+
+    for (int k = 0; k < s.count; ++k)
+        scale = max_of(scale, len_sq(w[k]));
+
+    for (int iteration = 0; iteration < M3D_GJK_MAX_ITERATIONS; ++iteration) {
+        v = m3d_gjk_closest(&s, w, weights);
+
+        float vv = len_sq(v);
+        if (s.count == 4 || vv <= 1e-12f * scale) {
+            overlap = true;
+            break;
+        }
+
+        // no progress means rounding is stalling a degenerate simplex
+        if (vv >= best)
+            break;
+        best = vv;
+
+        m3d_gjk_vertex(a, b, -v, &s, s.count);
+        Vec3 next = s.a[s.count] - s.b[s.count];
+        scale = max_of(scale, len_sq(next));
+
+        // the new vertex gets no closer to the origin along v
+        if (vv - dot(v, next) <= 1e-6f * vv)
+            break;
+
+        w[s.count++] = next;
+    }
+
+    if (overlap) {
+        result->point_a  = s.a[0];
+        result->point_b  = s.a[0];
+        result->normal   = vec3(0.0f, 0.0f, 0.0f);
+        result->distance = 0.0f;
+        return true;
+    }
+
+    Vec3 pa = vec3(0.0f, 0.0f, 0.0f);
+    Vec3 pb = vec3(0.0f, 0.0f, 0.0f);
+    for (int k = 0; k < s.count; ++k) {
+        pa = pa + weights[k] * s.a[k];
+        pb = pb + weights[k] * s.b[k];
+    }
+
+    float distance = M3D_SQRTF(len_sq(v));
+
+    result->point_a  = pa;
+    result->point_b  = pb;
+    result->normal   = (-1.0f / distance) * v;
+    result->distance = distance;
+    return false;
+}
+
+struct M3dEpaFace {
+    int   v[3];
+    Vec3  normal;
+    float dist;
+};
+
+struct M3dEpa {
+    Vec3       w[M3D_EPA_MAX_VERTICES];
+    Vec3       a[M3D_EPA_MAX_VERTICES];
+    Vec3       b[M3D_EPA_MAX_VERTICES];
+    M3dEpaFace faces[M3D_EPA_MAX_FACES];
+    int        vertex_count;
+    int        face_count;
+    Vec3       interior;
+};
+
+static inline int m3d_epa_vertex(M3dEpa *p, Convex const &a, Convex const &b, Vec3 d)
+{
+    int k = p->vertex_count++;
+    p->a[k] = support(a, d);
+    p->b[k] = support(b, -d);
+    p->w[k] = p->a[k] - p->b[k];
+    return k;
+}
+
+// Adds the face (i, j, k) facing away from the interior point.
+static inline void m3d_epa_face(M3dEpa *p, int i, int j, int k)
+{
+    M3dEpaFace &f = p->faces[p->face_count++];
+    Vec3        n = cross(p->w[j] - p->w[i], p->w[k] - p->w[i]);
+
+    if (dot(n, p->w[i] - p->interior) < 0.0f) {
+        int t = j;
+        j = k;
+        k = t;
+        n = -n;
+    }
+
+    f.v[0]   = i;
+    f.v[1]   = j;
+    f.v[2]   = k;
+    f.normal = m3d_unit_or_x(n);
+    f.dist   = dot(f.normal, p->w[i]);
+}
+
+// Grows a simplex of one to three vertices into a tetrahedron by
+// searching along directions away from its span.
+static bool m3d_epa_tetrahedron(M3dEpa *p, Convex const &a, Convex const &b)
+{
+    Vec3 const axes[6] = {
+        vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1)
+    };
+
+    float scale = 0.0f;
+    for (int k = 0; k < p->vertex_count; ++k)
+        scale = max_of(scale, len_sq(p->w[k]));
+    float const eps = 1e-10f * max_of(scale, 1e-12f);
+
+    for (int attempt = 0; attempt < 6 && p->vertex_count == 1; ++attempt) {
+        int k = m3d_epa_vertex(p, a, b, axes[attempt]);
+        if (len_sq(p->w[k] - p->w[0]) <= eps)
+            --p->vertex_count;
+    }
+
+    if (p->vertex_count == 2) {
+        Vec3 e  = p->w[1] - p->w[0];
+        Vec3 ax = M3D_FABSF(e.x) < M3D_FABSF(e.y) ? (M3D_FABSF(e.x) < M3D_FABSF(e.z) ? axes[0] : axes[4])
+                                                 : (M3D_FABSF(e.y) < M3D_FABSF(e.z) ? axes[2] : axes[4]);
+        Vec3 d1 = cross(e, ax);
+        Vec3 d2 = cross(e, d1);
+        Vec3 dirs[4] = { d1, -d1, d2, -d2 };
+
+        for (int attempt = 0; attempt < 4 && p->vertex_count == 2; ++attempt) {
+            int k = m3d_epa_vertex(p, a, b, dirs[attempt]);
+            if (len_sq(cross(p->w[k] - p->w[0], e)) <= eps * len_sq(e))
+                --p->vertex_count;
+        }
+    }
+
+    if (p->vertex_count == 3) {
+        Vec3 n = cross(p->w[1] - p->w[0], p->w[2] - p->w[0]);
+        for (int attempt = 0; attempt < 2 && p->vertex_count == 3; ++attempt) {
+            int k = m3d_epa_vertex(p, a, b, attempt == 0 ? n : -n);
+            if (dot(p->w[k] - p->w[0], n) * dot(p->w[k] - p->w[0], n) <= eps * len_sq(n))
+                --p->vertex_count;
+        }
+    }
+
+    if (p->vertex_count != 4)
+        return false;
+
+    float volume = dot(p->w[1] - p->w[0], cross(p->w[2] - p->w[0], p->w[3] - p->w[0]));
+    return volume * volume > eps * eps * eps;
+}
+
+M3D_DEF bool epa(Convex const &a, Convex const &b, GjkSimplex const &simplex, ConvexResult *result)
+{
+    M3dEpa p;
+
+    result->point_a  = simplex.count > 0 ? simplex.a[0] : vec3(0.0f, 0.0f, 0.0f);
+    result->point_b  = result->point_a;
+    result->normal   = vec3(0.0f, 0.0f, 0.0f);
+    result->distance = 0.0f;
+
+    p.vertex_count = 0;
+    p.face_count   = 0;
+    for (int k = 0; k < simplex.count && k < 4; ++k) {
+        p.a[k] = simplex.a[k];
+        p.b[k] = simplex.b[k];
+        p.w[k] = simplex.a[k] - simplex.b[k];
+        ++p.vertex_count;
+    }
+
+    if (p.vertex_count == 0)
+        m3d_epa_vertex(&p, a, b, vec3(1.0f, 0.0f, 0.0f));
+
+    if (!m3d_epa_tetrahedron(&p, a, b))
+        return false;
+
+    p.interior = 0.25f * (p.w[0] + p.w[1] + p.w[2] + p.w[3]);
+    m3d_epa_face(&p, 0, 1, 2);
+    m3d_epa_face(&p, 0, 3, 1);
+    m3d_epa_face(&p, 0, 2, 3);
+    m3d_epa_face(&p, 1, 3, 2);
+
+    // A copy, since the overflow path below has already compacted
+    // p.faces when it gives up.
+    M3dEpaFace face;
+
+    for (;;) {
+        int closest = 0;
+        for (int f = 1; f < p.face_count; ++f)
+            if (p.faces[f].dist < p.faces[closest].dist)
+                closest = f;
+
+        face = p.faces[closest];
+
+        if (p.vertex_count == M3D_EPA_MAX_VERTICES)
+            break;
+
+        int   k    = m3d_epa_vertex(&p, a, b, face.normal);
+        float gain = dot(p.w[k], face.normal) - face.dist;
+
+        if (gain <= 1e-5f + 1e-4f * M3D_FABSF(face.dist)) {
+            --p.vertex_count;
+            break;
+        }
+
+        // remove the faces the new vertex sees, the edges they share
+        // with the rest form the horizon
+        int edges[M3D_EPA_MAX_EDGES][2];
+        int edge_count = 0;
+        int kept       = 0;
+        bool overflow  = false;
+
+        for (int f = 0; f < p.face_count; ++f) {
+            M3dEpaFace const &g = p.faces[f];
+
+            if (dot(g.normal, p.w[k] - p.w[g.v[0]]) <= 0.0f) {
+                p.faces[kept++] = g;
+                continue;
+            }
+
+            for (int e = 0; e < 3; ++e) {
+                int from = g.v[e];
+                int to   = g.v[(e + 1) % 3];
+                int twin = -1;
+
+                for (int h = 0; h < edge_count && twin < 0; ++h)
+                    if (edges[h][0] == to && edges[h][1] == from)
+                        twin = h;
+
+                if (twin >= 0) {
+                    edges[twin][0] = edges[edge_count - 1][0];
+                    edges[twin][1] = edges[edge_count - 1][1];
+                    --edge_count;
+                }
+                else if (edge_count < M3D_EPA_MAX_EDGES) {
+                    edges[edge_count][0] = from;
+                    edges[edge_count][1] = to;
+                    ++edge_count;
+                }
+                else {
+                    overflow = true;
+                }
+            }
+        }
+
+        if (overflow || kept + edge_count > M3D_EPA_MAX_FACES) {
+            // out of room, settle for the closest face so far
+            --p.vertex_count;
+            break;
+        }
+
+        p.face_count = kept;
+        for (int e = 0; e < edge_count; ++e)
+            m3d_epa_face(&p, edges[e][0], edges[e][1], k);
+    }
+
+    // barycentric coordinates of the origin projected onto the face
+    Vec3 const q   = face.dist * face.normal;
+    Vec3 const v0  = p.w[face.v[1]] - p.w[face.v[0]];
+    Vec3 const v1  = p.w[face.v[2]] - p.w[face.v[0]];
+    Vec3 const v2  = q - p.w[face.v[0]];
+    float      d00 = dot(v0, v0);
+    float      d01 = dot(v0, v1);
+    float      d11 = dot(v1, v1);
+    float      d20 = dot(v2, v0);
+    float      d21 = dot(v2, v1);
+    float      den = d00 * d11 - d01 * d01;
+    float      l1  = den != 0.0f ? (d11 * d20 - d01 * d21) / den : 0.0f;
+    float      l2  = den != 0.0f ? (d00 * d21 - d01 * d20) / den : 0.0f;
+    float      l0  = 1.0f - l1 - l2;
+
+    result->point_a  = l0 * p.a[face.v[0]] + l1 * p.a[face.v[1]] + l2 * p.a[face.v[2]];
+    result->point_b  = l0 * p.b[face.v[0]] + l1 * p.b[face.v[1]] + l2 * p.b[face.v[2]];
+    result->normal   = face.normal;
+    result->distance = -face.dist;
+    return true;
+}
+
+#undef M3D_EPA_MAX_EDGES
+#undef M3D_EPA_MAX_FACES
+#undef M3D_EPA_MAX_VERTICES
+#undef M3D_GJK_MAX_ITERATIONS
+/**** END GJK definitions ****/
+
+
+/**** BEGIN Particle definitions ****/
+#define M3D_PARTICLE_BLOCK 4096
+
+// The step constants broadcast once per block.
+struct M3dParticleLanes {
+    M3dLanes gx, gy, gz;
+    M3dLanes keep;
+    M3dLanes max_step;
+    M3dLanes lx, ly, lz;
+    M3dLanes ux, uy, uz;
+    M3dLanes dt;
+};
+
+static inline void m3d_lanes_store(float *p, M3dLanes a, size_t count)
+{
+    if (count >= M3D_LANES) {
+        m3d_lanes_store(p, a);
+        return;
+    }
+
+    float lanes[M3D_LANES];
+    m3d_lanes_store(lanes, a);
+    for (size_t i = 0; i < count; ++i)
+        p[i] = lanes[i];
+}
+
+static inline M3dLanes m3d_lanes_load_half(uint16_t const *p, size_t count)
+{
+#if defined(M3D_USE_AVX) && defined(M3D_USE_F16C)
+    if (count >= M3D_LANES) {
+        M3dLanes r = { _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p))) };
+        return r;
+    }
+#endif
+
+    float lanes[M3D_LANES] = {};
+    from_half(p, lanes, count < M3D_LANES ? count : M3D_LANES);
+    return m3d_lanes_load(lanes);
+}
+
+static inline void m3d_lanes_store_half(uint16_t *p, M3dLanes a, size_t count)
+{
+#if defined(M3D_USE_AVX) && defined(M3D_USE_F16C)
+    if (count >= M3D_LANES) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm256_cvtps_ph(a.v, _MM_FROUND_TO_NEAREST_INT));
+        return;
+    }
+#endif
+
+    float lanes[M3D_LANES];
+    m3d_lanes_store(lanes, a);
+    to_half(lanes, p, count < M3D_LANES ? count : M3D_LANES);
+}
+
+static inline M3dParticleLanes m3d_particle_lanes(ParticleForces const &forces, float dt, float gravity_scale)
+{
+    M3dParticleLanes c;
+    c.gx       = m3d_lanes(forces.gravity.x * gravity_scale);
+    c.gy       = m3d_lanes(forces.gravity.y * gravity_scale);
+    c.gz       = m3d_lanes(forces.gravity.z * gravity_scale);
+    c.keep     = m3d_lanes(clamp(1.0f - forces.drag * dt, 0.0f, 1.0f));
+    c.max_step = m3d_lanes(forces.max_speed);
+    c.lx       = m3d_lanes(forces.lower.x);
+    c.ly       = m3d_lanes(forces.lower.y);
+    c.lz       = m3d_lanes(forces.lower.z);
+    c.ux       = m3d_lanes(forces.upper.x);
+    c.uy       = m3d_lanes(forces.upper.y);
+    c.uz       = m3d_lanes(forces.upper.z);
+    c.dt       = m3d_lanes(dt);
+    return c;
+}
+
+// Scales (x, y, z) down to at most length limit, the floor on the
+// squared length keeps rsqrt finite for zero vectors.
+static inline void m3d_clamp_length_lanes(M3dLanes *x, M3dLanes *y, M3dLanes *z, M3dLanes limit)
+{
+    M3dLanes len_sq = m3d_lanes_max(*x * *x + *y * *y + *z * *z, m3d_lanes(1e-30f));
+    M3dLanes s      = m3d_lanes_min(m3d_lanes(1.0f), limit * m3d_lanes_rsqrt(len_sq));
+    *x = *x * s;
+    *y = *y * s;
+    *z = *z * s;
+}
+
+static inline M3dLanes m3d_clamp_lanes(M3dLanes v, M3dLanes lower, M3dLanes upper)
+{
+    return m3d_lanes_min(m3d_lanes_max(v, lower), upper);
+}
+
+static void m3d_euler_block(Particles const &p, M3dParticleLanes const &c, size_t begin, size_t end)
+{
+    bool const half = p.vx == nullptr;
+
+    for (size_t i = begin; i < end; i += M3D_LANES) {
+        size_t   n = end - i;
+        M3dLanes vx, vy, vz;
+
+        if (half) {
+            vx = m3d_lanes_load_half(p.hvx + i, n);
+            vy = m3d_lanes_load_half(p.hvy + i, n);
+            vz = m3d_lanes_load_half(p.hvz + i, n);
+        }
+        else {
+            vx = m3d_lanes_load(p.vx + i, n);
+            vy = m3d_lanes_load(p.vy + i, n);
+            vz = m3d_lanes_load(p.vz + i, n);
+        }
+
+        vx = (vx + c.gx) * c.keep;
+        vy = (vy + c.gy) * c.keep;
+        vz = (vz + c.gz) * c.keep;
+        m3d_clamp_length_lanes(&vx, &vy, &vz, c.max_step);
+
+        M3dLanes x = m3d_clamp_lanes(m3d_lanes_load(p.x + i, n) + vx * c.dt, c.lx, c.ux);
+        M3dLanes y = m3d_clamp_lanes(m3d_lanes_load(p.y + i, n) + vy * c.dt, c.ly, c.uy);
+        M3dLanes z = m3d_clamp_lanes(m3d_lanes_load(p.z + i, n) + vz * c.dt, c.lz, c.uz);
+
+        m3d_lanes_store(p.x + i, x, n);
+        m3d_lanes_store(p.y + i, y, n);
+        m3d_lanes_store(p.z + i, z, n);
+
+        if (half) {
+            m3d_lanes_store_half(p.hvx + i, vx, n);
+            m3d_lanes_store_half(p.hvy + i, vy, n);
+            m3d_lanes_store_half(p.hvz + i, vz, n);
+        }
+        else {
+            m3d_lanes_store(p.vx + i, vx, n);
+            m3d_lanes_store(p.vy + i, vy, n);
+            m3d_lanes_store(p.vz + i, vz, n);
+        }
+    }
+}
+
+static void m3d_verlet_block(Particles const &p, M3dParticleLanes const &c, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += M3D_LANES) {
+        size_t   n  = end - i;
+        M3dLanes x  = m3d_lanes_load(p.x + i, n);
+        M3dLanes y  = m3d_lanes_load(p.y + i, n);
+        M3dLanes z  = m3d_lanes_load(p.z + i, n);
+        M3dLanes dx = (x - m3d_lanes_load(p.px + i, n)) * c.keep + c.gx;
+        M3dLanes dy = (y - m3d_lanes_load(p.py + i, n)) * c.keep + c.gy;
+        M3dLanes dz = (z - m3d_lanes_load(p.pz + i, n)) * c.keep + c.gz;
+        m3d_clamp_length_lanes(&dx, &dy, &dz, c.max_step);
+
+        m3d_lanes_store(p.px + i, x, n);
+        m3d_lanes_store(p.py + i, y, n);
+        m3d_lanes_store(p.pz + i, z, n);
+        m3d_lanes_store(p.x + i, m3d_clamp_lanes(x + dx, c.lx, c.ux), n);
+        m3d_lanes_store(p.y + i, m3d_clamp_lanes(y + dy, c.ly, c.uy), n);
+        m3d_lanes_store(p.z + i, m3d_clamp_lanes(z + dz, c.lz, c.uz), n);
+    }
+}
+
+M3D_DEF void integrate_euler(Particles const &particles, ParticleForces const &forces, float dt, size_t count)
+{
+    M3dParticleLanes c      = m3d_particle_lanes(forces, dt, dt);
+    ptrdiff_t const  blocks = ptrdiff_t((count + M3D_PARTICLE_BLOCK - 1) / M3D_PARTICLE_BLOCK);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        size_t begin = size_t(b) * M3D_PARTICLE_BLOCK;
+        size_t end   = count - begin < M3D_PARTICLE_BLOCK ? count : begin + M3D_PARTICLE_BLOCK;
+        m3d_euler_block(particles, c, begin, end);
+    }
+}
+
+// Position Verlet, the step from the previous position stands in for
+// velocity * dt so drag scales it and max_speed limits it to
+// max_speed * dt.
+M3D_DEF void integrate_verlet(Particles const &particles, ParticleForces const &forces, float dt, size_t count)
+{
+    M3dParticleLanes c      = m3d_particle_lanes(forces, dt, dt * dt);
+    ptrdiff_t const  blocks = ptrdiff_t((count + M3D_PARTICLE_BLOCK - 1) / M3D_PARTICLE_BLOCK);
+
+    c.max_step = m3d_lanes(forces.max_speed * dt);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t b = 0; b < blocks; ++b) {
+        size_t begin = size_t(b) * M3D_PARTICLE_BLOCK;
+        size_t end   = count - begin < M3D_PARTICLE_BLOCK ? count : begin + M3D_PARTICLE_BLOCK;
+        m3d_verlet_block(particles, c, begin, end);
+    }
+}
+
+#undef M3D_PARTICLE_BLOCK
+/**** END Particle definitions ****/
+
+
+/**** BEGIN TransformBuffer definitions ****/
+// The middle slot index with this bit set has been published and not
+// yet taken by the reader.
+#define M3D_TRANSFORM_BUFFER_FRESH 4u
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define M3D_ATOMIC_EXCHANGE(p, v) uint32_t(_InterlockedExchange(reinterpret_cast<long volatile *>(p), long(v)))
+    #define M3D_ATOMIC_LOAD(p)        uint32_t(_InterlockedOr(reinterpret_cast<long volatile *>(p), 0))
+#else
+    #define M3D_ATOMIC_EXCHANGE(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+    #define M3D_ATOMIC_LOAD(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+M3D_DEF void transform_buffer_init(TransformBuffer *buffer, Mat4 *storage, size_t count)
+{
+    Mat4 const one = identity();
+
+    for (size_t i = 0; i < 3 * count; ++i)
+        storage[i] = one;
+
+    for (int k = 0; k < 3; ++k)
+        buffer->slots[k] = storage + size_t(k) * count;
+
+    buffer->count  = count;
+    buffer->back   = 0;
+    buffer->middle = 1;
+    buffer->front  = 2;
+}
+
+inline M3D_DEF Mat4 *transform_buffer_write(TransformBuffer *buffer)
+{
+    return buffer->slots[buffer->back];
+}
+
+// The release half of the exchange orders the writes to the slot
+// before the reader can take it.
+M3D_DEF void transform_buffer_publish(TransformBuffer *buffer)
+{
+    uint32_t previous = M3D_ATOMIC_EXCHANGE(&buffer->middle, buffer->back | M3D_TRANSFORM_BUFFER_FRESH);
+    buffer->back = previous & ~M3D_TRANSFORM_BUFFER_FRESH;
+}
+
+// Without a fresh slot the reader keeps its own, swapping would hand
+// back an older frame.  A publish between the load and the exchange
+// only means the reader takes that newer frame.
+M3D_DEF Mat4 const *transform_buffer_read(TransformBuffer *buffer)
+{
+    if (M3D_ATOMIC_LOAD(&buffer->middle) & M3D_TRANSFORM_BUFFER_FRESH) {
+        uint32_t previous = M3D_ATOMIC_EXCHANGE(&buffer->middle, buffer->front);
+        buffer->front = previous & ~M3D_TRANSFORM_BUFFER_FRESH;
+    }
+
+    return buffer->slots[buffer->front];
+}
+
+#undef M3D_ATOMIC_LOAD
+#undef M3D_ATOMIC_EXCHANGE
+#undef M3D_TRANSFORM_BUFFER_FRESH
+/**** END TransformBuffer definitions ****/
+
+
+/**** BEGIN Memory definitions ****/
+#if defined(_WIN32)
+    #if !defined(WIN32_LEAN_AND_MEAN)
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #if !defined(NOMINMAX)
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#define M3D_HUGE_PAGE  (size_t(2) << 20)
+#define M3D_SMALL_PAGE size_t(4096)
+
+static inline size_t m3d_align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+static void m3d_first_touch(unsigned char *memory, size_t size)
+{
+    ptrdiff_t const pages = ptrdiff_t((size + M3D_SMALL_PAGE - 1) / M3D_SMALL_PAGE);
+
+    M3D_PARALLEL_FOR
+    for (ptrdiff_t p = 0; p < pages; ++p)
+        memory[size_t(p) * M3D_SMALL_PAGE] = 0;
+}
+
+#if defined(_WIN32)
+M3D_DEF void *pages_alloc(size_t size, uint32_t flags)
+{
+    void *memory = nullptr;
+
+    // Large pages need the lock pages privilege, without it the call
+    // fails and normal pages are used.
+    if ((flags & M3D_PAGES_HUGE) && GetLargePageMinimum() > 0)
+        memory = VirtualAlloc(nullptr, m3d_align_up(size, GetLargePageMinimum()),
+                              MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+    if (memory == nullptr)
+        memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (memory != nullptr && (flags & M3D_PAGES_FIRST_TOUCH))
+        m3d_first_touch(static_cast<unsigned char *>(memory), size);
+
+    return memory;
+}
+
+M3D_DEF void pages_free(void *memory, size_t, uint32_t)
+{
+    if (memory != nullptr)
+        VirtualFree(memory, 0, MEM_RELEASE);
+}
+#else
+// Huge page sizes are rounded up to 2 MB, which is also what munmap
+// needs for MAP_HUGETLB memory.
+static inline size_t m3d_pages_size(size_t size, uint32_t flags)
+{
+    return m3d_align_up(size, (flags & M3D_PAGES_HUGE) ? M3D_HUGE_PAGE : M3D_SMALL_PAGE);
+}
+
+M3D_DEF void *pages_alloc(size_t size, uint32_t flags)
+{
+    size_t const length = m3d_pages_size(size, flags);
+    void        *memory = MAP_FAILED;
+
+    if (length == 0)
+        return nullptr;
+
+#if defined(MAP_HUGETLB)
+    // Only succeeds when huge pages have been reserved by the admin.
+    if (flags & M3D_PAGES_HUGE)
+        memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (memory == MAP_FAILED && (flags & M3D_PAGES_HUGE)) {
+        // Transparent huge pages only back 2 MB aligned ranges, so map
+        // one huge page more and trim both ends.
+        unsigned char *raw = static_cast<unsigned char *>(mmap(nullptr, length + M3D_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED)
+            return nullptr;
+
+        unsigned char *aligned = raw + (m3d_align_up(size_t(raw), M3D_HUGE_PAGE) - size_t(raw));
+        if (aligned != raw)
+            munmap(raw, size_t(aligned - raw));
+        if (aligned + length != raw + length + M3D_HUGE_PAGE)
+            munmap(aligned + length, size_t(raw + length + M3D_HUGE_PAGE - (aligned + length)));
+
+        memory = aligned;
+#if defined(MADV_HUGEPAGE)
+        madvise(memory, length, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (memory == MAP_FAILED)
+        memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED)
+        return nullptr;
+
+    if (flags & M3D_PAGES_FIRST_TOUCH)
+        m3d_first_touch(static_cast<unsigned char *>(memory), length);
+
+    return memory;
+}
+
+M3D_DEF void pages_free(void *memory, size_t size, uint32_t flags)
+{
+    if (memory != nullptr)
+        munmap(memory, m3d_pages_size(size, flags));
+}
+#endif
+
+M3D_DEF void arena_init(Arena *arena, void *memory, size_t size)
+{
+    arena->base = static_cast<unsigned char *>(memory);
+    arena->size = size;
+    arena->used = 0;
+}
+
+// The alignment is of the address, not the offset, so memory that is
+// not itself aligned still gives aligned arrays.
+M3D_DEF void *arena_alloc(Arena *arena, size_t size, size_t alignment)
+{
+    size_t const address = size_t(arena->base) + arena->used;
+    size_t const offset  = arena->used + (m3d_align_up(address, alignment) - address);
+
+    if (offset > arena->size || size > arena->size - offset)
+        return nullptr;
+
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+inline M3D_DEF void arena_reset(Arena *arena, size_t mark)
+{
+    arena->used = mark;
+}
+
+M3D_DEF bool pool_init(Pool *pool, void *memory, size_t size, size_t item_size, size_t alignment)
+{
+    size_t const address = size_t(memory);
+    size_t const skip    = m3d_align_up(address, alignment) - address;
+
+    pool->base      = static_cast<unsigned char *>(memory) + skip;
+    pool->item_size = m3d_align_up(item_size < sizeof(void *) ? sizeof(void *) : item_size, alignment);
+    pool->capacity  = size > skip ? (size - skip) / pool->item_size : 0;
+    pool->unused    = 0;
+    pool->free_list = nullptr;
+
+    return pool->capacity > 0;
+}
+
+M3D_DEF void *pool_alloc(Pool *pool)
+{
+    if (pool->free_list != nullptr) {
+        void *item      = pool->free_list;
+        pool->free_list = *static_cast<void **>(item);
+        return item;
+    }
+
+    if (pool->unused == pool->capacity)
+        return nullptr;
+
+    return pool->base + pool->item_size * pool->unused++;
+}
+
+M3D_DEF void pool_free(Pool *pool, void *item)
+{
+    *static_cast<void **>(item) = pool->free_list;
+    pool->free_list             = item;
+}
+
+#undef M3D_SMALL_PAGE
+#undef M3D_HUGE_PAGE
+/**** END Memory definitions ****/
+
+#undef M3D_LANES
+#undef M3D_REDUCE_CHUNKS
 
 #endif // M3D_IMPLEMENTATION
 #undef M3D_IMPLEMENTATION
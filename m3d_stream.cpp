@@ -0,0 +1,376 @@
+/*
+ * m3d_stream -- applies a Mat4 to a file of packed Vec3 or Vec4
+ * records without reading the whole file into memory.
+ *
+ * Both the input and output files are memory mapped and the records
+ * are transformed in chunks with the batched transform_points kernels,
+ * which split each chunk across threads when built with OpenMP.  At
+ * the end the achieved throughput is printed next to the throughput
+ * of the same kernel on data that is already in the cache so it is
+ * easy to tell whether a run was bound by I/O or by compute.
+ *
+ * Usage:
+ *
+ *     m3d_stream [-vec4] [-t x y z] [-r angle x y z] [-s x y z] input output
+ *
+ * The -t, -r, and -s options are composed left to right into the
+ * matrix, i.e. "-t 1 2 3 -s 2 2 2" gives translate(1,2,3) * scale(2,2,2).
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define M3D_IMPLEMENTATION
+#include "m3d.h"
+
+struct MappedFile {
+    unsigned char *data;
+    size_t         size;
+    bool           writable;
+#if defined(_WIN32)
+    HANDLE         file;
+    HANDLE         mapping;
+#else
+    int            fd;
+#endif
+};
+
+struct StreamStats {
+    size_t records;
+    double seconds;
+    double stream_gb_per_s;
+    double compute_gb_per_s;
+};
+
+#if defined(_WIN32)
+
+static bool map_file(char const *path, size_t size, bool writable, MappedFile *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->writable = writable;
+
+    DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+    DWORD create = writable ? CREATE_ALWAYS : OPEN_EXISTING;
+
+    f->file = CreateFileA(path, access, FILE_SHARE_READ, nullptr, create,
+                          FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f->file == INVALID_HANDLE_VALUE)
+        return false;
+
+    if (!writable) {
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(f->file, &file_size)) {
+            CloseHandle(f->file);
+            return false;
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+    }
+
+    f->size = size;
+    if (size == 0)
+        return true;
+
+    DWORD protect = writable ? PAGE_READWRITE : PAGE_READONLY;
+    f->mapping = CreateFileMappingA(f->file, nullptr, protect,
+                                    static_cast<DWORD>(static_cast<unsigned long long>(size) >> 32),
+                                    static_cast<DWORD>(size & 0xffffffff), nullptr);
+    if (f->mapping == nullptr) {
+        CloseHandle(f->file);
+        return false;
+    }
+
+    DWORD view = writable ? FILE_MAP_WRITE : FILE_MAP_READ;
+    f->data = static_cast<unsigned char *>(MapViewOfFile(f->mapping, view, 0, 0, size));
+    if (f->data == nullptr) {
+        CloseHandle(f->mapping);
+        CloseHandle(f->file);
+        return false;
+    }
+
+    return true;
+}
+
+static void unmap_file(MappedFile *f)
+{
+    if (f->data)
+        UnmapViewOfFile(f->data);
+    if (f->mapping)
+        CloseHandle(f->mapping);
+    if (f->file && f->file != INVALID_HANDLE_VALUE)
+        CloseHandle(f->file);
+    memset(f, 0, sizeof(*f));
+}
+
+static void release_chunk(MappedFile *, size_t, size_t)
+{
+    // Windows trims the working set of a mapped view on its own.
+}
+
+static bool same_file(MappedFile const *f, char const *path)
+{
+    BY_HANDLE_FILE_INFORMATION a;
+    BY_HANDLE_FILE_INFORMATION b;
+
+    // No access rights are needed to query the file, so this open does
+    // not collide with the share mode of the mapped input.
+    HANDLE other = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (other == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool same = GetFileInformationByHandle(f->file, &a) && GetFileInformationByHandle(other, &b) &&
+                a.dwVolumeSerialNumber == b.dwVolumeSerialNumber &&
+                a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+    CloseHandle(other);
+    return same;
+}
+
+#else
+
+static bool map_file(char const *path, size_t size, bool writable, MappedFile *f)
+{
+    memset(f, 0, sizeof(*f));
+
+    f->writable = writable;
+    f->fd       = writable ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+    if (f->fd < 0)
+        return false;
+
+    if (writable) {
+        if (ftruncate(f->fd, static_cast<off_t>(size)) != 0) {
+            close(f->fd);
+            return false;
+        }
+    }
+    else {
+        struct stat st;
+        if (fstat(f->fd, &st) != 0) {
+            close(f->fd);
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+    }
+
+    f->size = size;
+    if (size == 0)
+        return true;
+
+    int   prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(nullptr, size, prot, MAP_SHARED, f->fd, 0);
+    if (data == MAP_FAILED) {
+        close(f->fd);
+        return false;
+    }
+
+    f->data = static_cast<unsigned char *>(data);
+    madvise(f->data, size, MADV_SEQUENTIAL);
+    return true;
+}
+
+static void unmap_file(MappedFile *f)
+{
+    if (f->data)
+        munmap(f->data, f->size);
+    if (f->fd >= 0)
+        close(f->fd);
+    memset(f, 0, sizeof(*f));
+    f->fd = -1;
+}
+
+static void release_chunk(MappedFile *f, size_t offset, size_t size)
+{
+    // Start writing back finished output and drop consumed input so
+    // the resident set stays at a few chunks regardless of file size.
+    // The input mapping is read only and has nothing to write back.
+    if (f->fd >= 0 && size > 0) {
+        long   page  = sysconf(_SC_PAGESIZE);
+        size_t begin = offset - (offset % static_cast<size_t>(page));
+        if (f->writable)
+            msync(f->data + begin, offset + size - begin, MS_ASYNC);
+        madvise(f->data + begin, offset + size - begin, MADV_DONTNEED);
+    }
+}
+
+static bool same_file(MappedFile const *f, char const *path)
+{
+    struct stat a;
+    struct stat b;
+
+    return fstat(f->fd, &a) == 0 && stat(path, &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+#endif
+
+static void transform_chunk(Mat4 const &A, bool vec4_records,
+                            unsigned char const *in, unsigned char *out, size_t count)
+{
+    if (vec4_records)
+        transform_points(A, reinterpret_cast<Vec4 const *>(in), reinterpret_cast<Vec4 *>(out), count);
+    else
+        transform_points(A, reinterpret_cast<Vec3 const *>(in), reinterpret_cast<Vec3 *>(out), count);
+}
+
+// Throughput of the kernel on a buffer that stays in the cache.
+static double measure_compute(Mat4 const &A, bool vec4_records)
+{
+    size_t const record = vec4_records ? sizeof(Vec4) : sizeof(Vec3);
+    size_t const count  = (256 * 1024) / record;
+    int    const runs   = 64;
+
+    unsigned char *in  = static_cast<unsigned char *>(calloc(count, record));
+    unsigned char *out = static_cast<unsigned char *>(calloc(count, record));
+
+    transform_chunk(A, vec4_records, in, out, count);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+        transform_chunk(A, vec4_records, in, out, count);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    free(in);
+    free(out);
+
+    // bytes read plus bytes written
+    return (2.0 * runs * count * record) / (elapsed.count() * 1e9);
+}
+
+// Kept local to the tool rather than in m3d.h since the header does no
+// file I/O.
+static bool m3d_stream_transform(char const *in_path, char const *out_path,
+                                 Mat4 const &A, bool vec4_records, StreamStats *stats)
+{
+    size_t const record = vec4_records ? sizeof(Vec4) : sizeof(Vec3);
+    size_t const chunk  = (32u << 20) / record;
+
+    MappedFile in;
+    MappedFile out;
+
+    if (!map_file(in_path, 0, false, &in)) {
+        fprintf(stderr, "m3d_stream: cannot map input %s\n", in_path);
+        return false;
+    }
+
+    if (in.size % record != 0) {
+        fprintf(stderr, "m3d_stream: %s is not a whole number of %u byte records\n",
+                in_path, static_cast<unsigned>(record));
+        unmap_file(&in);
+        return false;
+    }
+
+    // The output is truncated when it is opened, so an output that is
+    // the input under another name, a link, or the same path would be
+    // destroyed before a single record is read.
+    if (same_file(&in, out_path)) {
+        fprintf(stderr, "m3d_stream: output %s is the same file as input %s\n", out_path, in_path);
+        unmap_file(&in);
+        return false;
+    }
+
+    if (!map_file(out_path, in.size, true, &out)) {
+        fprintf(stderr, "m3d_stream: cannot map output %s\n", out_path);
+        unmap_file(&in);
+        return false;
+    }
+
+    size_t const count = in.size / record;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < count; i += chunk) {
+        size_t n      = count - i < chunk ? count - i : chunk;
+        size_t offset = i * record;
+
+        transform_chunk(A, vec4_records, in.data + offset, out.data + offset, n);
+        release_chunk(&in, offset, n * record);
+        release_chunk(&out, offset, n * record);
+    }
+
+    unmap_file(&out);
+    unmap_file(&in);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    stats->records          = count;
+    stats->seconds          = elapsed.count();
+    stats->stream_gb_per_s  = stats->seconds > 0.0 ? (2.0 * count * record) / (stats->seconds * 1e9) : 0.0;
+    stats->compute_gb_per_s = measure_compute(A, vec4_records);
+
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: m3d_stream [-vec4] [-t x y z] [-r angle x y z] [-s x y z] input output\n");
+}
+
+static bool parse_floats(int argc, char *argv[], int *i, float *out, int count)
+{
+    if (*i + count >= argc)
+        return false;
+
+    for (int k = 0; k < count; ++k)
+        out[k] = static_cast<float>(atof(argv[++*i]));
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Mat4        A            = identity();
+    bool        vec4_records = false;
+    char const *paths[2]     = { nullptr, nullptr };
+    int         path_count   = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        float v[4];
+
+        if (strcmp(argv[i], "-vec4") == 0) {
+            vec4_records = true;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && parse_floats(argc, argv, &i, v, 3)) {
+            A = A * translate(v[0], v[1], v[2]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && parse_floats(argc, argv, &i, v, 4)) {
+            A = A * rotation(v[0], vec3(v[1], v[2], v[3]));
+        }
+        else if (strcmp(argv[i], "-s") == 0 && parse_floats(argc, argv, &i, v, 3)) {
+            A = A * scale(v[0], v[1], v[2]);
+        }
+        else if (argv[i][0] != '-' && path_count < 2) {
+            paths[path_count++] = argv[i];
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (path_count != 2) {
+        usage();
+        return 1;
+    }
+
+    StreamStats stats;
+    if (!m3d_stream_transform(paths[0], paths[1], A, vec4_records, &stats))
+        return 1;
+
+    printf("%zu records in %.3f s\n", stats.records, stats.seconds);
+    printf("stream:  %6.2f GB/s (read + write)\n", stats.stream_gb_per_s);
+    printf("compute: %6.2f GB/s (in cache)\n", stats.compute_gb_per_s);
+    printf("%s bound\n", stats.stream_gb_per_s < 0.5 * stats.compute_gb_per_s ? "I/O" : "compute");
+
+    return 0;
+}
@@ -9,6 +9,7 @@ if not exist %CD%\build (mkdir %CD%\build)
 pushd %CD%\build
 
 cl %CXXFLAGS% ../test_bench.cpp -Fe:m3d.exe -link -SUBSYSTEM:CONSOLE
+cl %CXXFLAGS% -openmp ../m3d_stream.cpp -Fe:m3d_stream.exe -link -SUBSYSTEM:CONSOLE
 
 if exist m3d.exe (cmd /C m3d.exe)
 
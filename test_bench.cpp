@@ -22,6 +22,38 @@ void m3d_print_test(char const* name, bool pass)
         printf("%s %s\n", name, pass ? "pass" : "FAIL");
 }
 
+// Checks a radius query around c that returned total points in found
+// and a nearest query that returned k points with their squared
+// distances against a brute force scan of the points.
+bool m3d_check_queries(Vec3 const *points, size_t count, Vec3 c, float r,
+                       uint32_t const *found, size_t total,
+                       uint32_t const *nearest, float const *dist_sq, size_t k)
+{
+    bool   pass  = true;
+    size_t brute = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (len_sq(points[i] - c) <= r * r) {
+            bool listed = false;
+            for (size_t j = 0; j < total; ++j)
+                listed = listed || found[j] == uint32_t(i);
+            pass = pass && listed;
+            ++brute;
+        }
+    }
+    pass = pass && total == brute;
+
+    for (size_t j = 0; j < k; ++j) {
+        size_t closer = 0;
+        for (size_t i = 0; i < count; ++i)
+            closer += len_sq(points[i] - c) < dist_sq[j] ? 1 : 0;
+        pass = pass && closer <= j && dist_sq[j] == len_sq(points[nearest[j]] - c);
+        pass = pass && (j == 0 || (dist_sq[j - 1] <= dist_sq[j] && nearest[j - 1] != nearest[j]));
+    }
+
+    return pass;
+}
+
 void m3d_test_suite()
 {
     printf("\n=== Running m3d Test Suite ===\n\n");
@@ -434,6 +466,167 @@ void m3d_test_suite()
         COUNT_TEST("Vec4 normalize", pass);
     }
 
+    {
+        bool pass = (to_half(1.0f)      == 0x3c00 &&
+                     to_half(-2.0f)     == 0xc000 &&
+                     to_half(0.0f)      == 0x0000 &&
+                     to_half(-0.0f)     == 0x8000 &&
+                     to_half(65504.0f)  == 0x7bff &&
+                     to_half(65520.0f)  == 0x7c00 &&
+                     to_half(1e10f)     == 0x7c00 &&
+                     to_half(5.96046448e-8f) == 0x0001 &&
+                     to_half(1e-9f)     == 0x0000 &&
+                     to_half(1.0f + 1.0f / 2048.0f) == 0x3c00 &&
+                     to_half(1.0f + 3.0f / 2048.0f) == 0x3c02 &&
+                     to_half(HUGE_VALF) == 0x7c00 &&
+                     (to_half(NAN) & 0x7fff) == 0x7e00);
+        COUNT_TEST("Half from float", pass);
+    }
+
+    {
+        // every non-NaN half survives a round trip through float
+        bool pass = from_half(0x3c00) == 1.0f && from_half(0x0001) == 5.96046448e-8f;
+        for (uint32_t h = 0; h < 0x10000; ++h) {
+            if ((h & 0x7c00) == 0x7c00 && (h & 0x03ff) != 0)
+                pass = pass && from_half(uint16_t(h)) != from_half(uint16_t(h));
+            else
+                pass = pass && to_half(from_half(uint16_t(h))) == h;
+        }
+        COUNT_TEST("Half to float round trip", pass);
+    }
+
+    {
+        Vec3  v = vec3(0.5f, -3.25f, 100.0f);
+        Half3 h = to_half(v);
+        Vec3  w = from_half(h);
+        Vec4  u = from_half(to_half(vec4(1, 2, 3, 4)));
+        Vec2  t = from_half(to_half(vec2(0.25f, 8.0f)));
+        bool pass = (sizeof(Half3) == 6 &&
+                     w.x == v.x && w.y == v.y && w.z == v.z &&
+                     u.x == 1.0f && u.y == 2.0f && u.z == 3.0f && u.w == 4.0f &&
+                     t.x == 0.25f && t.y == 8.0f);
+        COUNT_TEST("Half vector conversion", pass);
+    }
+
+    {
+        float    in[37];
+        uint16_t half[37];
+        float    out[37];
+        Vec3     vin[5];
+        Half3    vhalf[5];
+        Vec3     vout[5];
+        bool pass = true;
+
+        for (int i = 0; i < 37; ++i)
+            in[i] = (i - 18) * 1.37f + 1e-6f * i;
+        for (int i = 0; i < 5; ++i)
+            vin[i] = vec3(in[i], in[i + 5], in[i + 10]);
+
+        to_half(in, half, 37);
+        from_half(half, out, 37);
+        for (int i = 0; i < 37; ++i)
+            pass = pass && half[i] == to_half(in[i]) && out[i] == from_half(half[i]);
+
+        to_half(vin, vhalf, 5);
+        from_half(vhalf, vout, 5);
+        for (int i = 0; i < 5; ++i) {
+            Half3 h = to_half(vin[i]);
+            pass = pass && vhalf[i].x == h.x && vhalf[i].y == h.y && vhalf[i].z == h.z;
+            pass = pass && len_sq(vout[i] - from_half(h)) == 0.0f;
+        }
+        COUNT_TEST("Half batch conversion", pass);
+    }
+
+    {
+        Vec3 axes[6] = {
+            vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0),
+            vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1),
+        };
+        bool pass = true;
+        for (int i = 0; i < 6; ++i) {
+            pass = pass && len_sq(decode_oct16(encode_oct16(axes[i])) - axes[i]) < 1e-12f;
+            pass = pass && len_sq(decode_oct8(encode_oct8(axes[i])) - axes[i]) < 1e-12f;
+        }
+        pass = pass && encode_oct16(vec3(0, 0, 1)) == 0 && encode_oct16(vec3(1, 0, 0)) == 0x7fff;
+        COUNT_TEST("Octahedral encode axes", pass);
+    }
+
+    {
+        // max angular error of 0.004 and 0.96 degrees, measured as
+        // the length of the cross product to stay precise
+        float const max16 = sinf(to_radians(0.004f));
+        float const max8  = sinf(to_radians(0.96f));
+        Vec3     in[64];
+        uint32_t p16[64];
+        uint16_t p8[64];
+        Vec3     out16[64];
+        Vec3     out8[64];
+        bool pass = true;
+
+        for (int i = 0; i < 64; ++i) {
+            float a = 0.7f * i;
+            in[i] = normalize(vec3(cosf(a) * (i - 31.5f), sinf(a) * 17.0f, (i % 7) - 3.1f));
+        }
+
+        encode_oct16(in, p16, 64);
+        encode_oct8(in, p8, 64);
+        decode_oct16(p16, out16, 64);
+        decode_oct8(p8, out8, 64);
+        for (int i = 0; i < 64; ++i) {
+            pass = pass && p16[i] == encode_oct16(in[i]) && p8[i] == encode_oct8(in[i]);
+            pass = pass && len_sq(out16[i] - decode_oct16(p16[i])) == 0.0f;
+            pass = pass && len_sq(out8[i] - decode_oct8(p8[i])) == 0.0f;
+            pass = pass && length(cross(in[i], out16[i])) < max16 && dot(in[i], out16[i]) > 0.0f;
+            pass = pass && length(cross(in[i], out8[i])) < max8 && dot(in[i], out8[i]) > 0.0f;
+        }
+        COUNT_TEST("Octahedral batch encode and decode", pass);
+    }
+
+    {
+        Vec2 a = unpack_snorm16(pack_snorm16(vec2(-1.0f, 0.5f)));
+        Vec2 b = unpack_unorm16(pack_unorm16(vec2(2.0f, 0.25f)));
+        Vec4 c = unpack_snorm8(pack_snorm8(vec4(1.0f, -1.0f, 0.0f, -3.0f)));
+        Vec4 d = unpack_unorm8(pack_unorm8(vec4(1.0f, 0.0f, 0.5f, -1.0f)));
+        bool pass = (pack_snorm16(vec2(-1.0f, 1.0f)) == 0x7fff8001 &&
+                     pack_unorm8(vec4(1.0f, 0.0f, 1.0f, 0.0f)) == 0x00ff00ff &&
+                     pack_snorm8(vec4(-1.0f, 0.0f, 0.0f, 1.0f)) == 0x7f000081 &&
+                     a.x == -1.0f && fabsf(a.y - 0.5f) < 1.0f / 32767.0f &&
+                     b.x == 1.0f && fabsf(b.y - 0.25f) < 1.0f / 65535.0f &&
+                     c.x == 1.0f && c.y == -1.0f && c.z == 0.0f && c.w == -1.0f &&
+                     d.x == 1.0f && d.y == 0.0f && d.z == 128.0f / 255.0f && d.w == 0.0f &&
+                     unpack_snorm8(0x80).x == -1.0f);
+        COUNT_TEST("snorm and unorm packing", pass);
+    }
+
+    {
+        Vec2     v2[3] = { vec2(0.1f, -0.2f), vec2(0.9f, 0.3f), vec2(-0.7f, 1.0f) };
+        Vec4     v4[3] = { vec4(0.1f, -0.2f, 0.3f, 1.0f), vec4(0.5f, 0.5f, 0.25f, 0.0f),
+                           vec4(-1.0f, 0.9f, 0.75f, 0.6f) };
+        uint32_t p[4][3];
+        Vec2     u2[2][3];
+        Vec4     u4[2][3];
+        bool pass = true;
+
+        pack_snorm16(v2, p[0], 3);
+        pack_unorm16(v2, p[1], 3);
+        pack_snorm8(v4, p[2], 3);
+        pack_unorm8(v4, p[3], 3);
+        unpack_snorm16(p[0], u2[0], 3);
+        unpack_unorm16(p[1], u2[1], 3);
+        unpack_snorm8(p[2], u4[0], 3);
+        unpack_unorm8(p[3], u4[1], 3);
+
+        for (int i = 0; i < 3; ++i) {
+            pass = pass && p[0][i] == pack_snorm16(v2[i]) && p[1][i] == pack_unorm16(v2[i]);
+            pass = pass && p[2][i] == pack_snorm8(v4[i]) && p[3][i] == pack_unorm8(v4[i]);
+            pass = pass && len_sq(u2[0][i] - unpack_snorm16(p[0][i])) == 0.0f;
+            pass = pass && len_sq(u2[1][i] - unpack_unorm16(p[1][i])) == 0.0f;
+            pass = pass && len_sq(u4[0][i] - unpack_snorm8(p[2][i])) == 0.0f;
+            pass = pass && len_sq(u4[1][i] - unpack_unorm8(p[3][i])) == 0.0f;
+        }
+        COUNT_TEST("snorm and unorm batch packing", pass);
+    }
+
     {
         Mat4 A = identity();
         bool pass = (A.at(0, 0) == 1.0f &&
@@ -663,6 +856,1966 @@ void m3d_test_suite()
         COUNT_TEST("Mat4 scale * Vec4", pass);
     }
 
+    {
+        Mat4 A = translate(1, 2, 3) * rotation(30.0f, vec3(1, 2, 2)) * scale(2, 3, 4);
+        Mat4 B = perspectiveGL(60, 0.75f, 1, 10) * translate(-1, 0, 2);
+        Mat4 P = A * B;
+        Mat4 C;
+        mul_into(&C, A, B);
+        bool pass = true;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && C.data[i] == P.data[i];
+
+        // in place, also with the same matrix on both sides
+        Mat4 D = A;
+        D *= B;
+        Mat4 E = A;
+        E *= E;
+        Mat4 F = A * A;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && D.data[i] == P.data[i] && E.data[i] == F.data[i];
+
+        Mat4 G = P - B;
+        G += B;
+        G -= P;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && fabsf(G.data[i]) < 1e-5f;
+
+        Mat4 H = A;
+        pass = pass && inverse_inplace(&H);
+        Mat4 I = H * A;
+        for (int c = 0; c < 4; ++c)
+            for (int r = 0; r < 4; ++r)
+                pass = pass && fabsf(I.at(r, c) - (r == c ? 1.0f : 0.0f)) < 1e-5f;
+
+        Mat4 S = scale(0, 1, 1);
+        pass = pass && !inverse_inplace(&S) && S.at(0, 0) == 0.0f && S.at(1, 1) == 1.0f;
+        COUNT_TEST("Mat4 in place operations", pass);
+    }
+
+    {
+        Mat4 A     = perspectiveGL(60, 0.75f, 1, 10) * translate(1, 2, 3) * rotation(20.0f, vec3(1, 1, 1));
+        Vec3 p3[3] = { vec3(1, 2, 3), vec3(-4, 0, 2), vec3(0, 0, 0) };
+        Vec4 p4[3] = { vec4(1, 2, 3, 1), vec4(-4, 0, 2, 0), vec4(0, 0, 0, 2) };
+        Vec3 o3[3];
+        Vec4 o4[3];
+        bool pass = true;
+
+        transform_points(A, p3, o3, 3);
+        transform_points(A, p4, o4, 3);
+        for (int i = 0; i < 3; ++i) {
+            Vec4 a = A * vec4(p3[i], 1.0f);
+            Vec4 b = A * p4[i];
+            pass = pass && len_sq(o3[i] - a.xyz) < 1e-10f && len_sq(o4[i] - b) < 1e-10f;
+        }
+        COUNT_TEST("Mat4 batch transform_points", pass);
+    }
+
+    {
+        DVec3 a = dvec3(1.0, 2.0, 3.0);
+        DVec3 b = dvec3(4.0, 5.0, 6.0);
+        DVec3 c = cross(a, b);
+        DVec3 d = normalize(dvec3(3.0, 0.0, 4.0));
+        DVec4 e = dvec4(a, 1.0) + 2.0 * dvec4(1.0, 1.0, 1.0, 1.0);
+        Vec3  f = vec3(dvec3(vec3(1.5f, 2.5f, 3.5f)));
+        bool pass = (dot(a, b) == 32.0 &&
+                     c.x == -3.0 && c.y == 6.0 && c.z == -3.0 &&
+                     len_sq(b - a) == 27.0 &&
+                     fabs(d.x - 0.6) < 1e-15 && fabs(d.z - 0.8) < 1e-15 &&
+                     fabs(length(d) - 1.0) < 1e-15 &&
+                     e.x == 3.0 && e.y == 4.0 && e.z == 5.0 && e.w == 3.0 &&
+                     e.xyz.z == 5.0 && dot(e, e) == 59.0 &&
+                     f.x == 1.5f && f.y == 2.5f && f.z == 3.5f);
+        COUNT_TEST("DVec3 and DVec4 arithmetic", pass);
+    }
+
+    {
+        DMat4 A = dtranslate(1e7, 2e7, 3e7) * drotation(30.0, dvec3(1, 2, 3)) * dscale(2, 3, 4);
+        Mat4  B = translate(1e7f, 2e7f, 3e7f) * rotation(30.0f, vec3(1, 2, 3)) * scale(2, 3, 4);
+        Mat4  C = mat4(A);
+        DMat4 D = dmat4(B);
+        bool pass = true;
+        for (int i = 0; i < 16; ++i) {
+            pass = pass && fabs(C.data[i] - B.data[i]) <= 1e-6 * fabs(B.data[i]) + 1e-6;
+            pass = pass && D.data[i] == double(B.data[i]);
+        }
+        COUNT_TEST("DMat4 construction", pass);
+    }
+
+    {
+        bool  isInvertible = false;
+        DMat4 A = dtranslate(6.4e6, -1.2e5, 3.0) * drotation(70.0, dvec3(0, 1, 1)) * dscale(1, 2, 3);
+        DMat4 B = inverse(A, &isInvertible);
+        DMat4 C = A * B;
+        DVec4 p = B * (A * dvec4(1234.5, -6789.25, 42.0, 1.0));
+        bool pass = isInvertible;
+        for (int c = 0; c < 4; ++c)
+            for (int r = 0; r < 4; ++r)
+                pass = pass && fabs(C.at(r, c) - (r == c ? 1.0 : 0.0)) < 1e-9;
+        pass = pass && fabs(p.x - 1234.5) < 1e-8 && fabs(p.y + 6789.25) < 1e-8 && fabs(p.z - 42.0) < 1e-8;
+
+        inverse(dscale(0, 1, 1), &isInvertible);
+        pass = pass && !isInvertible;
+        COUNT_TEST("DMat4 inverse", pass);
+    }
+
+    {
+        // 6400 km away a float would only resolve half a meter
+        DVec3 camera = dvec3(6.4e6, 1.0e5, -2.5e6);
+        DVec3 in[7];
+        Vec3  out[7];
+        bool pass = true;
+
+        for (int i = 0; i < 7; ++i)
+            in[i] = camera + dvec3(0.001 * i, -0.5 * i, 12.25 + i);
+
+        to_camera_relative(camera, in, out, 7);
+        for (int i = 0; i < 7; ++i) {
+            pass = pass && fabsf(out[i].x - 0.001f * i) < 1e-6f;
+            pass = pass && out[i].y == -0.5f * i && out[i].z == 12.25f + i;
+        }
+        COUNT_TEST("DVec3 to_camera_relative", pass);
+    }
+
+    {
+        Mat3 A = mat3(rotation(30.0f, vec3(1, 2, 3)) * scale(2, 3, 4));
+        Mat3 B = inverse(A);
+        Mat3 C = A * B;
+        Mat3 D = transpose(A);
+        bool pass = true;
+        for (int c = 0; c < 3; ++c) {
+            for (int r = 0; r < 3; ++r) {
+                pass = pass && fabsf(C.at(r, c) - (r == c ? 1.0f : 0.0f)) < 1e-6f;
+                pass = pass && D.at(r, c) == A.at(c, r);
+            }
+        }
+        COUNT_TEST("Mat3 inverse and transpose", pass);
+    }
+
+    {
+        bool isInvertible = true;
+        Mat3 A = mat3(scale(1, 0, 1));
+        inverse(A, &isInvertible);
+        Vec3 b = mat3(scale(6, 2, 9)) * vec3(12, 3, 4);
+        bool pass = (isInvertible == false &&
+                     b.x == 72.0f && b.y == 6.0f && b.z == 36.0f);
+        COUNT_TEST("Mat3 non-invertible and Vec3 mult", pass);
+    }
+
+    {
+        Mat4 A = translate(4, 5, 6) * rotation(50.0f, vec3(0, 1, 1)) * scale(1, 4, 2);
+        Mat3 N = normal_matrix(A);
+        Mat3 expected = transpose(mat3(inverse(A)));
+        Vec3 n = normalize(N * vec3(1, 2, 3));
+        Vec3 m = normalize(expected * vec3(1, 2, 3));
+        bool pass = len_sq(n - m) < 1e-10f;
+        COUNT_TEST("Mat3 normal_matrix", pass);
+    }
+
+    {
+        Mat4 A[2] = { scale(1, 2, 4), rotation(90.0f, vec3(0, 0, 1)) };
+        Mat3 N[2];
+        Vec3 in[2] = { vec3(1, 1, 1), vec3(1, 0, 0) };
+        Vec3 out[2];
+
+        normal_matrix(A, N, 2);
+        transform_normals(N[0], in, out, 1);
+        transform_normals(N[1], in + 1, out + 1, 1);
+
+        // scale(1,2,4) has the inverse transpose diag(1, 1/2, 1/4)
+        Vec3 expected = normalize(vec3(1.0f, 0.5f, 0.25f));
+        bool pass = (len_sq(out[0] - expected) < 1e-10f &&
+                     len_sq(out[1] - vec3(0, 1, 0)) < 1e-10f);
+        COUNT_TEST("Mat3 batch normal_matrix", pass);
+    }
+
+    {
+        Mat4     P  = perspectiveGL(90.0f, 1.0f, 1.0f, 10.0f);
+        Viewport vp = viewport(10.0f, 20.0f, 800.0f, 600.0f);
+        Vec3     pts[6] = {
+            vec3(0, 0, -2), vec3(2, 2, -2), vec3(0, 0, -10),
+            vec3(0, 0, 1), vec3(-5, 0, -2), vec3(0, 3, -2),
+        };
+        Vec3     screen[6];
+        uint8_t  flags[6];
+
+        project_points(P, vp, pts, screen, flags, 6);
+
+        bool pass = (fabsf(screen[0].x - 410.0f) < 1e-4f &&
+                     fabsf(screen[0].y - 320.0f) < 1e-4f &&
+                     fabsf(screen[1].x - 810.0f) < 1e-4f &&
+                     fabsf(screen[1].y - 620.0f) < 1e-4f &&
+                     fabsf(screen[2].z - 1.0f)   < 1e-6f &&
+                     flags[0] == 0 && flags[1] == 0 && flags[2] == 0 &&
+                     (flags[3] & M3D_CLIP_NEAR) != 0 &&
+                     flags[4] == M3D_CLIP_LEFT &&
+                     flags[5] == M3D_CLIP_TOP);
+        COUNT_TEST("project_points", pass);
+    }
+
+    {
+        Mat4     VP = perspectiveGL(60.0f, 0.75f, 0.5f, 100.0f) * rotation(15.0f, vec3(0, 1, 0)) * translate(-1, -2, -3);
+        Viewport vp = viewport(0.0f, 0.0f, 1280.0f, 720.0f);
+        Vec3     pts[5] = { vec3(1, 2, -5), vec3(4, 0, -7), vec3(0, 2, -20), vec3(3, 3, 3), vec3(-9, 1, -6) };
+        Vec3     screen[5];
+        bool pass = true;
+
+        project_points(VP, vp, pts, screen, nullptr, 5);
+        for (int i = 0; i < 5; ++i) {
+            uint8_t flags;
+            Vec4    c = VP * vec4(pts[i], 1.0f);
+            Vec3    ndc = c.xyz / c.w;
+            Vec3    expected = vec3((ndc.x + 1.0f) * 640.0f, (ndc.y + 1.0f) * 360.0f, (ndc.z + 1.0f) * 0.5f);
+            Vec3    single = project_point(VP, vp, pts[i], &flags);
+            pass = pass && len_sq(screen[i] - expected) < 1e-6f && len_sq(single - screen[i]) == 0.0f;
+        }
+        COUNT_TEST("project_point matches manual projection", pass);
+    }
+
+    {
+        Mat4     VP = perspectiveGL(70.0f, 0.6f, 0.5f, 50.0f) * rotation(-25.0f, vec3(1, 1, 0)) * translate(0, -1, 4);
+        Viewport vp = viewport(5.0f, 7.0f, 1024.0f, 768.0f);
+        Vec3     pts[61];
+        Vec3     screen[61];
+        uint8_t  flags[61];
+        int      seen = 0;
+        srand(55);
+
+        // enough points for the eight wide path and a tail, inside and
+        // outside of every plane
+        for (int i = 0; i < 61; ++i)
+            pts[i] = vec3(float(rand() % 401 - 200), float(rand() % 401 - 200), float(rand() % 801 - 400)) * 0.3f;
+
+        project_points(VP, vp, pts, screen, flags, 61);
+        bool pass = true;
+        for (int i = 0; i < 61; ++i) {
+            uint8_t single_flags;
+            Vec3    single = project_point(VP, vp, pts[i], &single_flags);
+            pass  = pass && single_flags == flags[i];
+            pass  = pass && (flags[i] != 0 || len_sq(single - screen[i]) <= 1e-6f * len_sq(single));
+            seen |= flags[i];
+        }
+        pass = pass && seen == 63;
+        COUNT_TEST("project_points wide path matches single points", pass);
+    }
+
+    {
+        Mat4 A = inverse(orthoGL(-5, 8, 12, -7, 2, 25));
+        Mat4 B = inverse_orthoGL(-5, 8, 12, -7, 2, 25);
+        Mat4 C = inverse(perspectiveGL(-5, 8, 12, -7, 2, 25));
+        Mat4 D = inverse_perspectiveGL(-5, 8, 12, -7, 2, 25);
+        Mat4 E = inverse(perspectiveGL(75, 0.5625f, 0.1f, 100));
+        Mat4 F = inverse_perspectiveGL(75, 0.5625f, 0.1f, 100);
+        bool pass = true;
+        for (int i = 0; i < 16; ++i) {
+            pass = pass && fabsf(A.data[i] - B.data[i]) < 1e-5f;
+            pass = pass && fabsf(C.data[i] - D.data[i]) < 1e-5f;
+            pass = pass && fabsf(E.data[i] - F.data[i]) < 1e-4f * (1.0f + fabsf(F.data[i]));
+        }
+        COUNT_TEST("Mat4 closed form inverse projections", pass);
+    }
+
+    {
+        Mat4     V   = rotation(20.0f, vec3(0, 1, 0)) * translate(-1, -2, -3);
+        Mat4     P   = perspectiveGL(60.0f, 0.75f, 0.5f, 100.0f);
+        Mat4     inv = inverse(V) * inverse_perspectiveGL(60.0f, 0.75f, 0.5f, 100.0f);
+        Viewport vp  = viewport(5.0f, 10.0f, 640.0f, 480.0f);
+        Vec2     px[4] = { vec2(5, 10), vec2(325, 250), vec2(644.5f, 489.5f), vec2(100.25f, 300.75f) };
+        Ray      rays[4];
+        bool pass = true;
+
+        unproject_rays(inv, vp, px, rays, 4);
+        for (int i = 0; i < 4; ++i) {
+            Vec3 o = project_point(P * V, vp, rays[i].origin);
+            Vec3 q = project_point(P * V, vp, rays[i].origin + 10.0f * rays[i].direction);
+            pass = pass && fabsf(length(rays[i].direction) - 1.0f) < 1e-6f;
+            pass = pass && fabsf(o.x - px[i].x) < 1e-2f && fabsf(o.y - px[i].y) < 1e-2f && fabsf(o.z) < 1e-3f;
+            pass = pass && fabsf(q.x - px[i].x) < 1e-2f && fabsf(q.y - px[i].y) < 1e-2f;
+        }
+        COUNT_TEST("unproject_rays", pass);
+    }
+
+    {
+        Mat4   A = translate(1, 2, 3) * rotation(25.0f, vec3(1, 0, 1)) * scale(2, 3, 4);
+        Mat3x4 B = mat3x4(A);
+        Mat4   C = mat4(B);
+        bool pass = (sizeof(Mat3x4) == 48 &&
+                     B.at(0, 3) == 1.0f && B.at(1, 3) == 2.0f && B.at(2, 3) == 3.0f &&
+                     memcmp(&A, &C, sizeof(Mat4)) == 0);
+        COUNT_TEST("Mat3x4 to and from Mat4", pass);
+    }
+
+    {
+        Mat4   A = translate(1, 2, 3) * rotation(25.0f, vec3(1, 0, 1));
+        Mat4   B = scale(2, 3, 4) * translate(-4, 5, 1);
+        Mat4   C = A * B;
+        Mat3x4 D = mat3x4(A) * mat3x4(B);
+        bool pass = true;
+        for (int c = 0; c < 4; ++c)
+            for (int r = 0; r < 3; ++r)
+                pass = pass && fabsf(C.at(r, c) - D.at(r, c)) < 1e-5f;
+        COUNT_TEST("Mat3x4 multiplication", pass);
+    }
+
+    {
+        bool   isInvertible = false;
+        Mat4   A = translate(2.0f, 5.0f, 3.0f) * scale(3.0f, 4.0f, 8.0f);
+        Mat3x4 C = inverse(mat3x4(A), &isInvertible);
+        bool pass = (fabsf(C.at(0, 0) - 0.33333333f) < EPSILON &&
+                     fabsf(C.at(1, 1) - 0.25f)       < EPSILON &&
+                     fabsf(C.at(2, 2) - 0.125f)      < EPSILON &&
+                     fabsf(C.at(0, 3) - -0.6666666f) < EPSILON &&
+                     fabsf(C.at(1, 3) - -1.25f)      < EPSILON &&
+                     fabsf(C.at(2, 3) - -0.375f)     < EPSILON &&
+                     isInvertible == true);
+
+        inverse(mat3x4(scale(0, 0, 0)), &isInvertible);
+        pass = pass && isInvertible == false;
+        COUNT_TEST("Mat3x4 inverse", pass);
+    }
+
+    {
+        Mat4   A = translate(1, 2, 3) * rotation(70.0f, vec3(0, 1, 1)) * scale(2, 1, 3);
+        Mat3x4 B = mat3x4(A);
+        Vec3   in[2] = { vec3(4, 5, 6), vec3(-1, 0, 2) };
+        Vec3   pts[2];
+        Vec3   dirs[2];
+        bool pass = true;
+
+        transform_points(B, in, pts, 2);
+        transform_dirs(B, in, dirs, 2);
+        for (int i = 0; i < 2; ++i) {
+            Vec4 p = A * vec4(in[i], 1.0f);
+            Vec4 d = A * vec4(in[i], 0.0f);
+            pass = pass && len_sq(pts[i] - p.xyz) < 1e-10f && len_sq(dirs[i] - d.xyz) < 1e-10f;
+            pass = pass && len_sq(transform_point(B, in[i]) - p.xyz) < 1e-10f;
+            pass = pass && len_sq(transform_dir(B, in[i]) - d.xyz) < 1e-10f;
+        }
+        COUNT_TEST("Mat3x4 point and dir transform", pass);
+    }
+
+    {
+        Mat4   A[2] = { translate(1, 2, 3), rotation(30.0f, vec3(1, 0, 0)) };
+        Mat4   B[2] = { scale(2, 2, 2), translate(3, 2, 1) };
+        Mat3x4 a[2];
+        Mat3x4 b[2];
+        Mat3x4 c[2];
+        Mat4   C[2];
+        bool pass = true;
+
+        mat3x4(A, a, 2);
+        mat3x4(B, b, 2);
+        multiply(a, b, c, 2);
+        mat4(c, C, 2);
+        for (int i = 0; i < 2; ++i) {
+            Mat4 expected = A[i] * B[i];
+            for (int k = 0; k < 16; ++k)
+                pass = pass && fabsf(C[i].data[k] - expected.data[k]) < 1e-6f;
+        }
+        COUNT_TEST("Mat3x4 batch multiply", pass);
+    }
+
+    {
+        Mat4 A = translate(1.0f, 2.0f, 3.0f) * rotation(30.0f, vec3(1, 2, 3));
+        Mat4 B = mat4(dual_quat(A));
+        bool pass = true;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && fabsf(A.data[i] - B.data[i]) < 1e-6f;
+        COUNT_TEST("DualQuat from rigid Mat4", pass);
+    }
+
+    {
+        DualQuat dq = dual_quat(90.0f, vec3(0, 0, 1), vec3(1, 2, 3));
+        Mat4     A  = translate(1, 2, 3) * rotation(90.0f, vec3(0, 0, 1));
+        Vec3     p  = transform_point(dq, vec3(4, 5, 6));
+        Vec4     q  = A * vec4(4, 5, 6, 1);
+        Vec3     d  = transform_dir(dq, vec3(1, 0, 0));
+        bool pass = (fabsf(p.x - q.x) < 1e-5f &&
+                     fabsf(p.y - q.y) < 1e-5f &&
+                     fabsf(p.z - q.z) < 1e-5f &&
+                     fabsf(d.x - 0.0f) < 1e-6f &&
+                     fabsf(d.y - 1.0f) < 1e-6f &&
+                     fabsf(d.z - 0.0f) < 1e-6f);
+        COUNT_TEST("DualQuat transform point and dir", pass);
+    }
+
+    {
+        DualQuat a = dual_quat(45.0f, vec3(0, 1, 0), vec3(0, 0, 5));
+        DualQuat b = dual_quat(30.0f, vec3(1, 0, 0), vec3(2, 0, 0));
+        Mat4     A = mat4(a * b);
+        Mat4     B = mat4(a) * mat4(b);
+        bool pass = true;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && fabsf(A.data[i] - B.data[i]) < 1e-6f;
+        COUNT_TEST("DualQuat composition", pass);
+    }
+
+    {
+        DualQuat a = normalize(3.0f * dual_quat(60.0f, vec3(1, 1, 0), vec3(1, 2, 3)));
+        Vec3     p = transform_point(a, vec3(0, 0, 0));
+        bool pass = (fabsf(length(a.real) - 1.0f) < 1e-6f &&
+                     fabsf(dot(a.real, a.dual)) < 1e-6f &&
+                     fabsf(p.x - 1.0f) < 1e-5f &&
+                     fabsf(p.y - 2.0f) < 1e-5f &&
+                     fabsf(p.z - 3.0f) < 1e-5f);
+        COUNT_TEST("DualQuat normalize", pass);
+    }
+
+    {
+        DualQuat dqs[2] = {
+            dual_quat(0.0f,  vec3(0, 0, 1), vec3(0, 0, 0)),
+            -1.0f * dual_quat(90.0f, vec3(0, 0, 1), vec3(0, 0, 0)),
+        };
+        float    weights[2] = { 0.5f, 0.5f };
+        DualQuat c = blend(dqs, weights, 2);
+        Vec3     d = transform_dir(c, vec3(1, 0, 0));
+        bool pass = (fabsf(d.x - 0.70710678f) < 1e-6f &&
+                     fabsf(d.y - 0.70710678f) < 1e-6f &&
+                     fabsf(d.z) < 1e-6f);
+        COUNT_TEST("DualQuat blend", pass);
+    }
+
+    {
+        DualQuat palette[2] = {
+            dual_quat(90.0f, vec3(0, 0, 1), vec3(1, 0, 0)),
+            dual_quat(20.0f, vec3(0, 1, 0), vec3(0, 3, 0)),
+        };
+        uint16_t joints[8]  = { 0, 1, 0, 0,   1, 0, 0, 0 };
+        float    weights[8] = { 0.25f, 0.75f, 0, 0,   1, 0, 0, 0 };
+        Vec3     pos[2]     = { vec3(1, 2, 3), vec3(4, 5, 6) };
+        Vec3     nrm[2]     = { vec3(0, 0, 1), vec3(1, 0, 0) };
+        Vec3     out_pos[2];
+        Vec3     out_nrm[2];
+
+        skin(palette, joints, weights, pos, nrm, out_pos, out_nrm, 2);
+
+        DualQuat b = blend(palette, weights, 2);
+        Vec3     p = transform_point(b, pos[0]);
+        Vec3     q = transform_point(palette[1], pos[1]);
+        Vec3     n = transform_dir(palette[1], nrm[1]);
+        bool pass = (len_sq(p - out_pos[0]) < 1e-10f &&
+                     len_sq(q - out_pos[1]) < 1e-10f &&
+                     len_sq(n - out_nrm[1]) < 1e-10f);
+        COUNT_TEST("DualQuat skin", pass);
+
+        // 19 vertices cover the wide blocks and the scalar tail, one
+        // vertex at a time always takes the scalar path.
+        DualQuat pal[4] = {
+            palette[0], palette[1],
+            dual_quat(-150.0f, vec3(1, 1, 0), vec3(2, -1, 5)),
+            dual_quat(70.0f, vec3(0, 1, 1), vec3(-3, 0, 1)),
+        };
+        pal[3].real = -pal[3].real;
+        pal[3].dual = -pal[3].dual;
+
+        uint16_t many_joints[4*19];
+        float    many_weights[4*19];
+        Vec3     many_pos[19], many_nrm[19], wide_pos[19], wide_nrm[19];
+        for (int i = 0; i < 19; ++i) {
+            float sum = 0.0f;
+            for (int k = 0; k < 4; ++k) {
+                many_joints[4*i + k]  = uint16_t((i + 3*k) % 4);
+                many_weights[4*i + k] = float((i * 7 + k * 5) % 11 + 1);
+                sum += many_weights[4*i + k];
+            }
+            for (int k = 0; k < 4; ++k)
+                many_weights[4*i + k] /= sum;
+            many_pos[i] = vec3(float(i), 1.0f - float(i % 5), 0.5f * float(i));
+            many_nrm[i] = normalize(vec3(1.0f, float(i % 3), -float(i % 4)));
+        }
+
+        skin(pal, many_joints, many_weights, many_pos, many_nrm, wide_pos, wide_nrm, 19);
+        for (int i = 0; i < 19; ++i) {
+            Vec3 one_pos, one_nrm;
+            skin(pal, many_joints + 4*i, many_weights + 4*i, many_pos + i, many_nrm + i, &one_pos, &one_nrm, 1);
+            pass = pass && len_sq(one_pos - wide_pos[i]) == 0.0f && len_sq(one_nrm - wide_nrm[i]) == 0.0f;
+        }
+        COUNT_TEST("DualQuat skin batch matches single", pass);
+    }
+
+    {
+        DualQuat dq     = dual_quat(33.0f, vec3(1, 2, 3), vec3(4, 5, 6));
+        Vec3     in[11] = { vec3(1, 0, 0), vec3(0, 1, 0), vec3(7, 8, 9) };
+        Vec3     out[11];
+        bool pass = true;
+        for (int i = 3; i < 11; ++i)
+            in[i] = vec3(float(i), -2.0f * float(i), 0.25f);
+        transform_points(dq, in, out, 11);
+        for (int i = 0; i < 11; ++i)
+            pass = pass && len_sq(out[i] - transform_point(dq, in[i])) == 0.0f;
+        transform_dirs(dq, in, out, 11);
+        for (int i = 0; i < 11; ++i)
+            pass = pass && len_sq(out[i] - transform_dir(dq, in[i])) == 0.0f;
+        COUNT_TEST("DualQuat batch transform", pass);
+    }
+
+    {
+        Transform t = transform(vec3(1, 2, 3), 40.0f, vec3(1, 1, 0), vec3(2, 3, 4));
+        Mat4      A = mat4(t);
+        Mat4      B = translate(1, 2, 3) * rotation(40.0f, vec3(1, 1, 0)) * scale(2, 3, 4);
+        bool pass = true;
+        for (int i = 0; i < 16; ++i)
+            pass = pass && fabsf(A.data[i] - B.data[i]) < 1e-6f;
+        COUNT_TEST("Transform to Mat4", pass);
+    }
+
+    {
+        int32_t   parents[5] = { -1, -1, 0, 1, 2 };
+        int32_t   unsorted[5] = { -1, 2, -1, 0, 1 };
+        Transform locals[5];
+        Mat4      worlds[5];
+        uint8_t   dirty[5];
+        uint32_t  levels[4];
+        Hierarchy h = { parents, locals, worlds, dirty, levels, 5, 0, 3 };
+
+        bool pass = (hierarchy_build_levels(&h) &&
+                     h.level_count == 3 &&
+                     levels[0] == 0 && levels[1] == 2 &&
+                     levels[2] == 4 && levels[3] == 5);
+
+        h.parents = unsorted;
+        pass = pass && !hierarchy_build_levels(&h);
+
+        h.parents    = parents;
+        h.max_levels = 2;
+        pass = pass && !hierarchy_build_levels(&h);
+
+        COUNT_TEST("Hierarchy build levels", pass);
+    }
+
+    {
+        int32_t   parents[5] = { -1, -1, 0, 1, 2 };
+        Transform locals[5];
+        Mat4      worlds[5];
+        uint8_t   dirty[5];
+        uint32_t  levels[4];
+        Hierarchy h = { parents, locals, worlds, dirty, levels, 5, 0, 3 };
+
+        hierarchy_build_levels(&h);
+        for (int i = 0; i < 5; ++i)
+            locals[i] = transform(vec3(float(i), 1, 2), 10.0f * i, vec3(0, 1, 1), vec3(1, 2, 1));
+
+        hierarchy_update_all(&h);
+
+        bool pass = true;
+        for (int i = 0; i < 5; ++i) {
+            Mat4 expected = parents[i] < 0 ? mat4(locals[i]) : worlds[parents[i]] * mat4(locals[i]);
+            for (int k = 0; k < 16; ++k)
+                pass = pass && fabsf(worlds[i].data[k] - expected.data[k]) < 1e-5f;
+        }
+
+        // only the subtree of node 2 should be recomputed
+        Mat4 sentinel = Mat4 {};
+        worlds[3] = sentinel;
+        hierarchy_set_local(&h, 2, transform(vec3(5, 5, 5), 0.0f, vec3(1, 0, 0), vec3(1, 1, 1)));
+        hierarchy_update(&h);
+
+        Mat4 expected = worlds[0] * translate(5, 5, 5) * mat4(locals[4]);
+        for (int k = 0; k < 16; ++k)
+            pass = pass && fabsf(worlds[4].data[k] - expected.data[k]) < 1e-5f;
+        for (int i = 0; i < 5; ++i)
+            pass = pass && dirty[i] == 0;
+        pass = pass && memcmp(&worlds[3], &sentinel, sizeof(Mat4)) == 0;
+
+        COUNT_TEST("Hierarchy incremental update", pass);
+    }
+
+    {
+        Vec3 pts[3] = { vec3(-1, 2, 0), vec3(1, -1, 3), vec3(0, 0, -2) };
+        AABB box    = aabb(pts, 3);
+        Ray  hit    = { vec3(-5, 0, 0), vec3(1, 0, 0) };
+        Ray  miss   = { vec3(-5, 5, 0), vec3(1, 0, 0) };
+        Ray  inside = { vec3(0, 0, 0), normalize(vec3(1, 1, 1)) };
+        Ray  axis   = { vec3(0, 0, 10), vec3(0, 0, -1) };
+        float t = -1.0f;
+
+        bool pass = box.min.x == -1 && box.min.y == -1 && box.min.z == -2;
+        pass = pass && box.max.x == 1 && box.max.y == 2 && box.max.z == 3;
+        pass = pass && intersect(hit, box, 100.0f, &t) && t == 4.0f;
+        pass = pass && !intersect(hit, box, 3.5f);
+        pass = pass && !intersect(miss, box, 100.0f);
+        pass = pass && intersect(inside, box, 100.0f, &t) && t == 0.0f;
+        pass = pass && intersect(axis, box, 100.0f, &t) && t == 7.0f;
+        COUNT_TEST("Ray AABB slab test", pass);
+    }
+
+    {
+        Vec3  a = vec3(0, 0, 0), b = vec3(4, 0, 0), c = vec3(0, 4, 0);
+        Ray   front  = { vec3(1, 2, 5), vec3(0, 0, -1) };
+        Ray   back   = { vec3(1, 2, -5), vec3(0, 0, 1) };
+        Ray   behind = { vec3(1, 2, 5), vec3(0, 0, 1) };
+        Ray   side   = { vec3(3, 3, 5), vec3(0, 0, -1) };
+        float t, u, v;
+
+        bool pass = intersect(front, a, b, c, &t, &u, &v);
+        pass = pass && fabsf(t - 5.0f) < EPSILON && fabsf(u - 0.25f) < EPSILON && fabsf(v - 0.5f) < EPSILON;
+        pass = pass && intersect(back, a, b, c, &t, &u, &v) && fabsf(t - 5.0f) < EPSILON;
+        pass = pass && !intersect(behind, a, b, c, &t, &u, &v);
+        pass = pass && !intersect(side, a, b, c, &t, &u, &v);
+        COUNT_TEST("Ray triangle intersection", pass);
+    }
+
+    {
+        // layers of triangles facing the rays at increasing depth with
+        // random offsets so some rays miss the nearer layers
+        Vec3 tris[3 * 24];
+        Ray  rays[8];
+
+        srand(7);
+        for (int i = 0; i < 24; ++i) {
+            float x = float(rand() % 5) - 2.0f;
+            float y = float(rand() % 5) - 2.0f;
+            float z = -1.0f - float(rand() % 20);
+            tris[3*i + 0] = vec3(x - 1.0f, y - 1.0f, z);
+            tris[3*i + 1] = vec3(x + 2.0f, y - 1.0f, z);
+            tris[3*i + 2] = vec3(x - 1.0f, y + 2.0f, z);
+        }
+        for (int i = 0; i < 8; ++i)
+            rays[i] = { vec3(0.25f * i - 1.0f, 0.5f - 0.2f * i, 0.0f),
+                        normalize(vec3(0.01f * i, -0.02f * i, -1.0f)) };
+        rays[7].direction = vec3(0, 0, 1);
+
+        RayPacket4 p4;
+        RayPacket8 p8;
+        ray_packet(rays, 3, 50.0f, &p4);
+        ray_packet(rays, 8, 50.0f, &p8);
+
+        uint32_t mask4 = intersect_nearest(&p4, tris, 24);
+        uint32_t mask8 = intersect_nearest(&p8, tris, 24);
+        uint32_t expected = 0;
+
+        bool pass = true;
+        for (int i = 0; i < 8; ++i) {
+            // brute force over the single ray test for reference
+            RayHit ref = { 50.0f, 0.0f, 0.0f, ~0u };
+            for (uint32_t k = 0; k < 24; ++k) {
+                float t, u, v;
+                if (intersect(rays[i], tris[3*k], tris[3*k + 1], tris[3*k + 2], &t, &u, &v) && t < ref.t)
+                    ref = { t, u, v, k };
+            }
+
+            RayHit hit = { 50.0f, 0.0f, 0.0f, ~0u };
+            bool   found = intersect_nearest(rays[i], tris, 24, &hit);
+
+            pass = pass && found == (ref.prim != ~0u) && hit.prim == ref.prim;
+            pass = pass && fabsf(hit.t - ref.t) < 1e-5f && fabsf(hit.u - ref.u) < 1e-5f;
+            pass = pass && p8.prim[i] == ref.prim && fabsf(p8.t[i] - ref.t) < 1e-5f;
+            pass = pass && fabsf(p8.u[i] - ref.u) < 1e-5f && fabsf(p8.v[i] - ref.v) < 1e-5f;
+            if (i < 3)
+                pass = pass && p4.prim[i] == ref.prim && fabsf(p4.t[i] - ref.t) < 1e-5f;
+            if (ref.prim != ~0u)
+                expected |= 1u << i;
+        }
+
+        pass = pass && mask8 == expected && mask4 == (expected & 7u) && p4.prim[3] == ~0u;
+        pass = pass && (expected & 0x80u) == 0 && expected != 0;
+
+        AABB box = aabb(tris, 3 * 24);
+        pass = pass && intersect(p8, box) == 0x7fu;
+        pass = pass && intersect(p4, box) == 0x7u;
+        COUNT_TEST("RayPacket nearest hit matches single rays", pass);
+    }
+
+    {
+        size_t const count = 2000;
+        Vec3 *tris    = static_cast<Vec3 *>(malloc(3 * count * sizeof(Vec3)));
+        void *scratch = malloc(bvh_scratch_size(count));
+        BVH   bvh;
+
+        srand(11);
+        for (size_t i = 0; i < 3 * count; ++i) {
+            if (i % 3 == 0)
+                tris[i] = vec3(float(rand() % 1000), float(rand() % 1000), float(rand() % 1000)) * 0.01f;
+            else
+                tris[i] = tris[i - i % 3] + vec3(float(rand() % 100), float(rand() % 100), float(rand() % 100)) * 0.005f;
+        }
+
+        bvh_init(&bvh, static_cast<BVHNode *>(malloc(bvh_max_nodes(count) * sizeof(BVHNode))),
+                 static_cast<uint32_t *>(malloc(count * sizeof(uint32_t))));
+        bvh_build(&bvh, tris, count, scratch);
+
+        bool pass = bvh.prim_count == count && bvh.node_count <= bvh_max_nodes(count);
+
+        // every primitive is in exactly one leaf whose box contains it
+        uint8_t *seen = static_cast<uint8_t *>(calloc(count, 1));
+        for (size_t n = 0; n < bvh.node_count; ++n) {
+            BVHNode const &node = bvh.nodes[n];
+            for (int k = 0; k < 4; ++k) {
+                if (node.count[k] == 0) {
+                    pass = pass && (node.child[k] == uint32_t(M3D_BVH_EMPTY) || node.child[k] < bvh.node_count);
+                    continue;
+                }
+                pass = pass && node.count[k] <= M3D_BVH_LEAF_SIZE;
+                for (uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; ++i) {
+                    uint32_t p = bvh.prims[i];
+                    AABB     b = aabb(tris + 3 * p, 3);
+                    pass = pass && seen[p] == 0;
+                    pass = pass && b.min.x >= node.min_x[k] && b.min.y >= node.min_y[k] && b.min.z >= node.min_z[k];
+                    pass = pass && b.max.x <= node.max_x[k] && b.max.y <= node.max_y[k] && b.max.z <= node.max_z[k];
+                    seen[p] = 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < count; ++i)
+            pass = pass && seen[i] == 1;
+
+        // nearest hits match the brute force search
+        for (int i = 0; i < 200; ++i) {
+            Ray ray;
+            ray.origin    = vec3(-1.0f, float(rand() % 1000) * 0.01f, float(rand() % 1000) * 0.01f);
+            ray.direction = normalize(vec3(1.0f, float(rand() % 100 - 50) * 0.01f, float(rand() % 100 - 50) * 0.01f));
+
+            RayHit a = { 100.0f, 0.0f, 0.0f, ~0u };
+            RayHit b = { 100.0f, 0.0f, 0.0f, ~0u };
+            bool   found = bvh_intersect(bvh, tris, ray, &a);
+
+            pass = pass && found == intersect_nearest(ray, tris, count, &b);
+            pass = pass && a.prim == b.prim && a.t == b.t;
+        }
+
+        // box queries report every primitive whose box overlaps
+        uint32_t out[count];
+        AABB     query = { vec3(2, 3, 4), vec3(4, 5, 5) };
+        size_t   total = bvh_overlap(bvh, query, out, count);
+
+        memset(seen, 0, count);
+        for (size_t i = 0; i < total; ++i)
+            seen[out[i]] = 1;
+        for (size_t i = 0; i < count; ++i) {
+            AABB b = aabb(tris + 3 * i, 3);
+            bool overlaps = b.min.x <= query.max.x && b.max.x >= query.min.x &&
+                            b.min.y <= query.max.y && b.max.y >= query.min.y &&
+                            b.min.z <= query.max.z && b.max.z >= query.min.z;
+            pass = pass && (!overlaps || seen[i]);
+        }
+        pass = pass && total > 0 && total < count;
+        pass = pass && bvh_overlap(bvh, query, out, 3) == total;
+
+        COUNT_TEST("BVH build, ray and box queries", pass);
+
+        free(seen);
+        free(bvh.nodes);
+        free(bvh.prims);
+        free(scratch);
+        free(tris);
+    }
+
+    {
+        size_t const count = 2000;
+        Vec3 *tris    = static_cast<Vec3 *>(malloc(3 * count * sizeof(Vec3)));
+        void *scratch = malloc(bvh_scratch_size(count));
+        BVH   bvh;
+
+        srand(13);
+        for (size_t i = 0; i < 3 * count; ++i) {
+            if (i % 3 == 0)
+                tris[i] = vec3(float(rand() % 1000), float(rand() % 1000), float(rand() % 1000)) * 0.01f;
+            else
+                tris[i] = tris[i - i % 3] + vec3(float(rand() % 100), float(rand() % 100), float(rand() % 100)) * 0.005f;
+        }
+
+        bvh_init(&bvh, static_cast<BVHNode *>(malloc(bvh_max_nodes(count) * sizeof(BVHNode))),
+                 static_cast<uint32_t *>(malloc(count * sizeof(uint32_t))),
+                 static_cast<float *>(malloc(bvh_max_nodes(count) * sizeof(float))));
+        bvh_build(&bvh, tris, count, scratch);
+
+        uint32_t degraded[64];
+        bool pass = bvh_degraded(bvh, 1.5f, degraded, 64) == 0;
+
+        // moving everything together keeps the tree as good as it was
+        for (size_t i = 0; i < 3 * count; ++i)
+            tris[i] = tris[i] + vec3(3, -2, 1);
+        bvh_refit(&bvh, tris);
+
+        pass = pass && bvh_degraded(bvh, 1.5f, degraded, 64) == 0;
+        pass = pass && bvh.bounds.min.x >= 3.0f && bvh.bounds.min.y >= -2.0f && bvh.bounds.max.z <= 10.5f + 1.0f;
+
+        // scattering the triangles of one corner all over degrades the
+        // subtrees holding them but not the whole tree
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 *tri = tris + 3 * i;
+            if (tri[0].x < 5.0f && tri[0].y < 0.0f && tri[0].z < 3.0f) {
+                Vec3 d = vec3(float(rand() % 1000), float(rand() % 1000), float(rand() % 1000)) * 0.01f - tri[0] + vec3(3, -2, 1);
+                tri[0] = tri[0] + d;
+                tri[1] = tri[1] + d;
+                tri[2] = tri[2] + d;
+            }
+        }
+        bvh_refit(&bvh, tris);
+
+        size_t found = bvh_degraded(bvh, 1.5f, degraded, 64);
+        pass = pass && found > 0 && found <= 64;
+        for (size_t i = 0; i < found && i < 64; ++i)
+            pass = pass && degraded[i] != 0 && bvh_rebuild(&bvh, degraded[i], tris, scratch);
+        pass = pass && bvh_degraded(bvh, 1.5f, degraded, 64) == 0;
+        pass = pass && bvh.node_count <= bvh_max_nodes(count);
+
+        // refit and rebuilt trees still find the nearest hits
+        for (int i = 0; i < 200; ++i) {
+            Ray ray;
+            ray.origin    = vec3(2.0f, float(rand() % 1000) * 0.01f - 2.0f, float(rand() % 1000) * 0.01f + 1.0f);
+            ray.direction = normalize(vec3(1.0f, float(rand() % 100 - 50) * 0.01f, float(rand() % 100 - 50) * 0.01f));
+
+            RayHit a = { 100.0f, 0.0f, 0.0f, ~0u };
+            RayHit b = { 100.0f, 0.0f, 0.0f, ~0u };
+            bool   hit = bvh_intersect(bvh, tris, ray, &a);
+
+            pass = pass && hit == intersect_nearest(ray, tris, count, &b);
+            pass = pass && a.prim == b.prim && a.t == b.t;
+        }
+
+        COUNT_TEST("BVH refit and partial rebuild", pass);
+
+        free(bvh.nodes);
+        free(bvh.prims);
+        free(bvh.costs);
+        free(scratch);
+        free(tris);
+    }
+
+    {
+        AABB box;
+        box.min = vec3(-1, -1, -1);
+        box.max = vec3(1, 1, 1);
+
+        float const cell = 2.0f / 1024.0f;
+
+        bool pass = morton30(box, box.min) == 0 && morton63(box, box.min) == 0;
+        pass = pass && morton30(box, box.max) == 0x3fffffffu;
+        pass = pass && morton63(box, box.max) == 0x7fffffffffffffffull;
+        pass = pass && morton30(box, vec3(1, -1, -1)) == 0x09249249u;
+        pass = pass && morton30(box, vec3(-1, 1, -1)) == 0x12492492u;
+        pass = pass && morton30(box, vec3(-1, -1, 1)) == 0x24924924u;
+        pass = pass && morton30(box, box.min + vec3(1.5f * cell, 0, 0)) == 1;
+        pass = pass && morton30(box, box.min + vec3(0, 1.5f * cell, 0)) == 2;
+        pass = pass && morton30(box, box.min + vec3(0, 0, 1.5f * cell)) == 4;
+        pass = pass && morton30(box, box.min + vec3(2.5f * cell, 1.5f * cell, 0)) == 0x0a;
+        pass = pass && morton63(box, vec3(1, -1, -1)) == 0x1249249249249249ull;
+        // outside the box clamps to the nearest face
+        pass = pass && morton30(box, vec3(5, -5, -1)) == 0x09249249u;
+
+        Vec3     points[64];
+        uint32_t codes30[64];
+        uint64_t codes63[64];
+
+        srand(39);
+        for (int i = 0; i < 64; ++i)
+            points[i] = vec3(float(rand() % 2000 - 1000), float(rand() % 2000 - 1000), float(rand() % 2000 - 1000)) * 0.001f;
+
+        morton30(box, points, codes30, 64);
+        morton63(box, points, codes63, 64);
+        for (int i = 0; i < 64; ++i) {
+            pass = pass && codes30[i] == morton30(box, points[i]);
+            pass = pass && codes63[i] == morton63(box, points[i]);
+            // the high bits of the long code pick the same cell
+            pass = pass && uint32_t(codes63[i] >> 33) == codes30[i];
+        }
+
+        COUNT_TEST("Morton codes", pass);
+    }
+
+    {
+        size_t const count = 100000;
+        uint32_t *codes30 = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint32_t *keys30  = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint64_t *codes63 = static_cast<uint64_t *>(malloc(count * sizeof(uint64_t)));
+        uint64_t *keys63  = static_cast<uint64_t *>(malloc(count * sizeof(uint64_t)));
+        uint32_t *order   = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3     *sorted  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        void     *scratch = malloc(radix_sort_scratch_size(count));
+
+        // few distinct values in the low bits so stability matters, and
+        // a constant middle byte so one pass is skipped
+        srand(40);
+        for (size_t i = 0; i < count; ++i) {
+            codes30[i] = (uint32_t(rand() & 0x3ff) << 20) | 0x5a00u | uint32_t(rand() & 0x3);
+            codes63[i] = (uint64_t(uint32_t(rand())) << 40) | uint64_t(codes30[i]);
+            points[i]  = vec3(float(i), float(rand() % 100), 0.0f);
+            keys30[i]  = codes30[i];
+            keys63[i]  = codes63[i];
+        }
+
+        bool pass = true;
+
+        radix_sort(keys30, order, count, scratch);
+        for (size_t i = 0; i < count; ++i) {
+            pass = pass && keys30[i] == codes30[order[i]];
+            if (i > 0)
+                pass = pass && (keys30[i - 1] < keys30[i] || (keys30[i - 1] == keys30[i] && order[i - 1] < order[i]));
+        }
+
+        reorder(order, points, sorted, sizeof(Vec3), count);
+        for (size_t i = 0; i < count; ++i)
+            pass = pass && sorted[i].x == float(order[i]) && sorted[i].y == points[order[i]].y;
+
+        radix_sort(keys63, order, count, scratch);
+        for (size_t i = 0; i < count; ++i) {
+            pass = pass && keys63[i] == codes63[order[i]];
+            if (i > 0)
+                pass = pass && (keys63[i - 1] < keys63[i] || (keys63[i - 1] == keys63[i] && order[i - 1] < order[i]));
+        }
+
+        // odd sized elements take the byte path
+        unsigned char bytes[3 * 5] = { 0,1,2, 3,4,5, 6,7,8, 9,10,11, 12,13,14 };
+        unsigned char moved[3 * 5];
+        uint32_t      perm[5] = { 4, 0, 3, 1, 2 };
+        reorder(perm, bytes, moved, 3, 5);
+        for (int i = 0; i < 5; ++i)
+            pass = pass && moved[3*i] == 3 * perm[i] && moved[3*i + 2] == 3 * perm[i] + 2;
+
+        COUNT_TEST("Radix sort and reorder", pass);
+
+        free(scratch);
+        free(sorted);
+        free(points);
+        free(order);
+        free(keys63);
+        free(codes63);
+        free(keys30);
+        free(codes30);
+    }
+
+    {
+        size_t const count = 4000;
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        void     *scratch = malloc(hash_grid_scratch_size(count));
+        HashGrid  grid    = {};
+
+        grid.points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        grid.indices = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        grid.cells   = static_cast<uint32_t *>(malloc((hash_grid_table_size(count) + 1) * sizeof(uint32_t)));
+
+        // a dense clump and a sparse cloud around it, straddling zero
+        srand(41);
+        for (size_t i = 0; i < count; ++i) {
+            float s = i % 4 == 0 ? 0.2f : 0.01f;
+            points[i] = vec3(float(rand() % 1000 - 500), float(rand() % 1000 - 500), float(rand() % 1000 - 500)) * s;
+        }
+        hash_grid_build(&grid, points, count, 0.5f, scratch);
+
+        bool pass = grid.point_count == count;
+        for (size_t b = 0; b < grid.table_size; ++b)
+            pass = pass && grid.cells[b] <= grid.cells[b + 1];
+        pass = pass && grid.cells[grid.table_size] == count;
+
+        uint32_t found[count];
+        uint32_t nearest[8];
+        float    dist_sq[8];
+
+        for (int q = 0; q < 100; ++q) {
+            Vec3  c = vec3(float(rand() % 1200 - 600), float(rand() % 1200 - 600), float(rand() % 1200 - 600)) * 0.02f;
+            float r = float(rand() % 100) * 0.02f;
+
+            size_t total = hash_grid_radius(grid, c, r, found, count);
+            size_t k     = hash_grid_nearest(grid, c, 8, nearest, dist_sq);
+            pass = pass && k == 8 && m3d_check_queries(points, count, c, r, found, total, nearest, dist_sq, k);
+        }
+
+        // a huge radius falls back to scanning and far queries still work
+        pass = pass && hash_grid_radius(grid, vec3(0, 0, 0), 1000.0f, nullptr, 0) == count;
+        pass = pass && hash_grid_nearest(grid, vec3(1000, -1000, 50), 8, nearest, dist_sq) == 8;
+
+        COUNT_TEST("HashGrid radius and nearest queries", pass);
+
+        free(grid.cells);
+        free(grid.indices);
+        free(grid.points);
+        free(scratch);
+        free(points);
+    }
+
+    {
+        size_t const count = 3000;
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3     *welded  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint32_t *remap   = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        void     *scratch = malloc(weld_vertices_scratch_size(count));
+
+        // 1000 well separated vertices, each repeated three times with a
+        // small jitter and shuffled
+        srand(42);
+        for (size_t i = 0; i < count; ++i) {
+            size_t v = i % 1000;
+            Vec3   jitter = vec3(float(rand() % 100), float(rand() % 100), float(rand() % 100)) * 1e-5f;
+            points[i] = vec3(float(v % 10), float(v / 10 % 10), float(v / 100)) + jitter;
+        }
+        for (size_t i = count - 1; i > 0; --i) {
+            size_t j = size_t(rand()) % (i + 1);
+            Vec3   t = points[i];
+            points[i] = points[j];
+            points[j] = t;
+        }
+        for (size_t i = 0; i < count; ++i)
+            welded[i] = points[i];
+
+        size_t unique = weld_vertices(welded, count, 0.01f, remap, scratch);
+
+        bool pass = unique == 1000;
+        for (size_t i = 0; i < count; ++i)
+            pass = pass && remap[i] < unique && len_sq(welded[remap[i]] - points[i]) <= 0.01f * 0.01f;
+        for (size_t i = 1; i < unique; ++i)
+            pass = pass && len_sq(welded[i] - welded[i - 1]) > 0.5f;
+
+        // a chain 0.8 apart with eps 1, the third vertex is only near
+        // the second so it is kept and the fourth merges into it
+        Vec3     chain[4] = { vec3(0, 0, 0), vec3(0.8f, 0, 0), vec3(1.6f, 0, 0), vec3(2.4f, 0, 0) };
+        uint32_t chain_remap[4];
+        pass = pass && weld_vertices(chain, 4, 1.0f, chain_remap, scratch) == 2;
+        pass = pass && chain_remap[0] == 0 && chain_remap[1] == 0 && chain_remap[2] == 1 && chain_remap[3] == 1;
+        pass = pass && chain[0].x == 0.0f && chain[1].x == 1.6f;
+
+        COUNT_TEST("weld_vertices", pass);
+
+        free(scratch);
+        free(remap);
+        free(welded);
+        free(points);
+    }
+
+    {
+        size_t const sizes[3] = { 5, 17, 3001 };
+        bool         pass     = true;
+
+        srand(43);
+        for (int s = 0; s < 3; ++s) {
+            size_t const count = sizes[s];
+            size_t const slots = kdtree_leaf_count(count) * M3D_KDTREE_LEAF_SIZE;
+            size_t const inner = kdtree_leaf_count(count) - 1;
+
+            Vec3   *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+            void   *scratch = malloc(kdtree_scratch_size(count));
+            KDTree  tree    = {};
+
+            tree.x       = static_cast<float *>(malloc(slots * sizeof(float)));
+            tree.y       = static_cast<float *>(malloc(slots * sizeof(float)));
+            tree.z       = static_cast<float *>(malloc(slots * sizeof(float)));
+            tree.indices = static_cast<uint32_t *>(malloc(slots * sizeof(uint32_t)));
+            tree.splits  = static_cast<float *>(malloc((inner + 1) * sizeof(float)));
+            tree.axes    = static_cast<uint8_t *>(malloc(inner + 1));
+
+            // a flat, dense sheet with repeated points and a sparse cloud
+            for (size_t i = 0; i < count; ++i) {
+                if (i % 3 == 0)
+                    points[i] = vec3(float(rand() % 1000 - 500), float(rand() % 1000 - 500), float(rand() % 1000 - 500)) * 0.01f;
+                else
+                    points[i] = vec3(float(rand() % 50), float(rand() % 50), 0.0f) * 0.02f;
+            }
+            kdtree_build(&tree, points, count, scratch);
+
+            // every point is in exactly one slot and leaves hold 8 to
+            // 16, or all of them when there is only one leaf
+            size_t used = 0;
+            for (size_t leaf = 0; leaf < slots / M3D_KDTREE_LEAF_SIZE; ++leaf) {
+                size_t held = 0;
+                for (size_t i = leaf * M3D_KDTREE_LEAF_SIZE; i < (leaf + 1) * M3D_KDTREE_LEAF_SIZE; ++i) {
+                    if (tree.indices[i] != ~0u) {
+                        Vec3 q = points[tree.indices[i]];
+                        pass = pass && tree.x[i] == q.x && tree.y[i] == q.y && tree.z[i] == q.z;
+                        ++held;
+                    }
+                }
+                pass = pass && (slots == M3D_KDTREE_LEAF_SIZE ? held == count : held >= 8);
+                used += held;
+            }
+            pass = pass && used == count;
+
+            uint32_t *found = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+            uint32_t  nearest[8];
+            float     dist_sq[8];
+
+            for (int q = 0; q < 50; ++q) {
+                Vec3  c = vec3(float(rand() % 1200 - 600), float(rand() % 1200 - 600), float(rand() % 1200 - 600)) * 0.01f;
+                float r = float(rand() % 100) * 0.03f;
+
+                size_t total = kdtree_radius(tree, c, r, found, count);
+                size_t k     = kdtree_nearest(tree, c, 8, nearest, dist_sq);
+                pass = pass && k == (count < 8 ? count : 8);
+                pass = pass && m3d_check_queries(points, count, c, r, found, total, nearest, dist_sq, k);
+            }
+
+            // the batched queries give the same answers
+            uint32_t batch_found[4 * 8];
+            float    batch_dist[4 * 8];
+            uint32_t totals[4];
+            kdtree_nearest(tree, points, 4, 8, batch_found, batch_dist);
+            kdtree_radius(tree, points, 4, 0.1f, found, count / 4, totals);
+            for (size_t i = 0; i < 4; ++i) {
+                size_t k = kdtree_nearest(tree, points[i], 8, nearest, dist_sq);
+                for (size_t j = 0; j < 8; ++j)
+                    pass = pass && batch_dist[8*i + j] == (j < k ? dist_sq[j] : 3.402823466e+38f);
+                pass = pass && totals[i] == kdtree_radius(tree, points[i], 0.1f, nullptr, 0);
+            }
+
+            // radii whose square overflows find every point and no
+            // unused slots
+            pass = pass && kdtree_radius(tree, points[0], 1e20f, found, count) == count;
+            pass = pass && kdtree_radius(tree, points[0], INFINITY, nullptr, 0) == count;
+            for (size_t i = 0; i < count; ++i)
+                pass = pass && found[i] < count;
+
+            free(found);
+            free(tree.axes);
+            free(tree.splits);
+            free(tree.indices);
+            free(tree.z);
+            free(tree.y);
+            free(tree.x);
+            free(scratch);
+            free(points);
+        }
+
+        COUNT_TEST("KDTree nearest and radius queries", pass);
+    }
+
+    {
+        Mat3 A[13];
+        srand(44);
+        for (int i = 0; i < 13; ++i)
+            for (int k = 0; k < 9; ++k)
+                A[i].data[k] = float(rand() % 2000 - 1000) * 0.001f;
+
+        // identity, zero, a mirror, rank one and rank two
+        for (int k = 0; k < 9; ++k) {
+            A[0].data[k] = k % 4 == 0 ? 1.0f : 0.0f;
+            A[1].data[k] = 0.0f;
+            A[2].data[k] = k == 0 ? -2.0f : (k % 4 == 0 ? 1.0f : 0.0f);
+            A[3].data[k] = float((k % 3 + 1) * (k / 3 + 1));
+        }
+        A[4].data[6] = A[4].data[0] + A[4].data[3];
+        A[4].data[7] = A[4].data[1] + A[4].data[4];
+        A[4].data[8] = A[4].data[2] + A[4].data[5];
+
+        Mat3 U[13], V[13];
+        Vec3 sigma[13];
+        svd(A, U, sigma, V, 13);
+
+        bool pass = true;
+        for (int i = 0; i < 13; ++i) {
+            Mat3 S = {};
+            S.at(0, 0) = sigma[i].x;
+            S.at(1, 1) = sigma[i].y;
+            S.at(2, 2) = sigma[i].z;
+
+            Mat3 R  = U[i] * S * transpose(V[i]);
+            Mat3 UU = transpose(U[i]) * U[i];
+            Mat3 VV = transpose(V[i]) * V[i];
+
+            for (int k = 0; k < 9; ++k) {
+                float id = k % 4 == 0 ? 1.0f : 0.0f;
+                pass = pass && fabsf(R.data[k] - A[i].data[k]) < 1e-4f;
+                pass = pass && fabsf(UU.data[k] - id) < 1e-5f && fabsf(VV.data[k] - id) < 1e-5f;
+            }
+
+            Vec3  u0 = vec3(U[i].data[0], U[i].data[1], U[i].data[2]);
+            Vec3  u1 = vec3(U[i].data[3], U[i].data[4], U[i].data[5]);
+            Vec3  u2 = vec3(U[i].data[6], U[i].data[7], U[i].data[8]);
+            Vec3  v0 = vec3(V[i].data[0], V[i].data[1], V[i].data[2]);
+            Vec3  v1 = vec3(V[i].data[3], V[i].data[4], V[i].data[5]);
+            Vec3  v2 = vec3(V[i].data[6], V[i].data[7], V[i].data[8]);
+            Vec3  a0 = vec3(A[i].data[0], A[i].data[1], A[i].data[2]);
+            Vec3  a1 = vec3(A[i].data[3], A[i].data[4], A[i].data[5]);
+            Vec3  a2 = vec3(A[i].data[6], A[i].data[7], A[i].data[8]);
+            float det = dot(cross(a0, a1), a2);
+
+            pass = pass && dot(cross(u0, u1), u2) > 0.0f && dot(cross(v0, v1), v2) > 0.0f;
+            pass = pass && sigma[i].x >= sigma[i].y && sigma[i].y >= fabsf(sigma[i].z);
+            pass = pass && (det >= -1e-6f || sigma[i].z < 0.0f) && (det <= 1e-6f || sigma[i].z > 0.0f);
+
+            Mat3 u, v;
+            Vec3 s;
+            svd(A[i], &u, &s, &v);
+            pass = pass && s.x == sigma[i].x && s.y == sigma[i].y && s.z == sigma[i].z;
+        }
+
+        // the nearest rotation to a mirror is a half turn
+        pass = pass && sigma[2].z == -1.0f;
+
+        // U V^T of a scaled rotation is the rotation
+        Mat3 rot = mat3(rotation(0.7f, normalize(vec3(1, 2, 3)))) * mat3(scale(2, 3, 0.5f));
+        Mat3 u, v;
+        Vec3 s;
+        svd(rot, &u, &s, &v);
+        Mat4 R = mat4(u * transpose(v));
+        Mat4 E = rotation(0.7f, normalize(vec3(1, 2, 3)));
+        for (int k = 0; k < 16; ++k)
+            pass = pass && fabsf(R.data[k] - E.data[k]) < 1e-5f;
+
+        COUNT_TEST("SVD 3x3", pass);
+    }
+
+    {
+        Mat3 A[11];
+        srand(45);
+        for (int i = 0; i < 11; ++i) {
+            for (int r = 0; r < 3; ++r) {
+                for (int c = r; c < 3; ++c) {
+                    A[i].at(r, c) = float(rand() % 2000 - 1000) * 0.001f;
+                    A[i].at(c, r) = A[i].at(r, c);
+                }
+            }
+        }
+
+        // repeated eigenvalues
+        A[0] = mat3(scale(2, 2, 2));
+        A[1] = mat3(scale(1, 3, 1));
+
+        Vec3 values[11];
+        Mat3 vectors[11];
+        eigen_symmetric(A, values, vectors, 11);
+
+        bool pass = true;
+        for (int i = 0; i < 11; ++i) {
+            pass = pass && values[i].x >= values[i].y && values[i].y >= values[i].z;
+
+            for (int c = 0; c < 3; ++c) {
+                Vec3 x  = vec3(vectors[i].at(0, c), vectors[i].at(1, c), vectors[i].at(2, c));
+                Vec3 Ax = A[i] * x;
+                pass = pass && length(Ax - values[i].data[c] * x) < 1e-5f && fabsf(length(x) - 1.0f) < 1e-5f;
+            }
+
+            Vec3 x0 = vec3(vectors[i].at(0, 0), vectors[i].at(1, 0), vectors[i].at(2, 0));
+            Vec3 x1 = vec3(vectors[i].at(0, 1), vectors[i].at(1, 1), vectors[i].at(2, 1));
+            Vec3 x2 = vec3(vectors[i].at(0, 2), vectors[i].at(1, 2), vectors[i].at(2, 2));
+            pass = pass && fabsf(dot(cross(x0, x1), x2) - 1.0f) < 1e-5f;
+        }
+        pass = pass && values[1].x == 3.0f && values[1].y == 1.0f && values[1].z == 1.0f;
+
+        COUNT_TEST("Symmetric eigendecomposition 3x3", pass);
+    }
+
+    {
+        size_t const count = 20000;
+        Vec3 *points = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        srand(45);
+
+        // an 8 x 2 x 1 box, turned and moved far from the origin
+        Mat4 place = translate(1000.0f, -500.0f, 250.0f) * rotation(35.0f, normalize(vec3(1, -2, 3)));
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 p = vec3(float(rand() % 20001 - 10000) * 0.0004f,
+                          float(rand() % 20001 - 10000) * 0.0001f,
+                          float(rand() % 20001 - 10000) * 0.00005f);
+            points[i] = (place * vec4(p.x, p.y, p.z, 1.0f)).xyz;
+        }
+
+        Vec3   mean;
+        Mat3   C = covariance(points, count, &mean);
+        double m[3] = {}, c[3][3] = {};
+        for (size_t i = 0; i < count; ++i)
+            for (int r = 0; r < 3; ++r)
+                m[r] += double(points[i][r]) / double(count);
+        for (size_t i = 0; i < count; ++i)
+            for (int r = 0; r < 3; ++r)
+                for (int k = 0; k < 3; ++k)
+                    c[r][k] += (double(points[i][r]) - m[r]) * (double(points[i][k]) - m[k]) / double(count);
+
+        bool pass = true;
+        for (int r = 0; r < 3; ++r) {
+            pass = pass && fabs(double(mean[r]) - m[r]) < 1e-3;
+            for (int k = 0; k < 3; ++k)
+                pass = pass && fabs(double(C.at(r, k)) - c[r][k]) < 1e-4;
+        }
+
+        OBB box = obb(points, count);
+        Mat3 AA = transpose(box.axes) * box.axes;
+        for (int k = 0; k < 9; ++k)
+            pass = pass && fabsf(AA.data[k] - (k % 4 == 0 ? 1.0f : 0.0f)) < 1e-5f;
+
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 d = points[i] - box.center;
+            for (int k = 0; k < 3; ++k) {
+                Vec3 axis = vec3(box.axes.data[3 * k], box.axes.data[3 * k + 1], box.axes.data[3 * k + 2]);
+                pass = pass && fabsf(dot(d, axis)) <= box.half_extents[k] + 1e-3f;
+            }
+        }
+
+        // nearly the generating box and much tighter than the AABB
+        AABB  aligned = aabb(points, count);
+        Vec3  size    = aligned.max - aligned.min;
+        float volume  = 8.0f * box.half_extents.x * box.half_extents.y * box.half_extents.z;
+        pass = pass && volume < 1.02f * 16.0f && volume < 0.5f * size.x * size.y * size.z;
+        pass = pass && fabsf(box.half_extents.x - 4.0f) < 0.01f;
+
+        // evenly spread points keep the axis aligned box
+        Vec3 cube[8];
+        for (int k = 0; k < 8; ++k)
+            cube[k] = vec3(float(k & 1), float((k >> 1) & 1), float(k >> 2));
+        OBB cube_box = obb(cube, 8);
+        pass = pass && length(cube_box.center - vec3(0.5f, 0.5f, 0.5f)) < 1e-6f;
+        pass = pass && length(cube_box.half_extents - vec3(0.5f, 0.5f, 0.5f)) < 1e-6f;
+
+        // a flat 2 x 1 quad turned by 45 degrees keeps its own box
+        Vec3 quad[15];
+        Mat4 turn = rotation(45.0f, vec3(0, 0, 1));
+        for (int k = 0; k < 15; ++k)
+            quad[k] = (turn * vec4(float(k % 5) * 0.5f - 1.0f, float(k / 5) * 0.5f - 0.5f, 2.0f, 1.0f)).xyz;
+        OBB  quad_box = obb(quad, 15);
+        Vec3 he       = quad_box.half_extents;
+        pass = pass && fabsf(max_of(he.x, max_of(he.y, he.z)) - 1.0f) < 1e-4f;
+        pass = pass && fabsf(he.x + he.y + he.z - 1.5f) < 1e-3f;
+
+        free(points);
+        COUNT_TEST("OBB covariance fit", pass);
+    }
+
+    {
+        Mat4    view_proj = perspectiveGL(90.0f, 1.0f, 1.0f, 100.0f);
+        Frustum f         = frustum(view_proj);
+        OBB     boxes[200];
+        uint8_t visible[200];
+        srand(46);
+
+        for (int i = 0; i < 200; ++i) {
+            boxes[i].center       = vec3(float(rand() % 200 - 100), float(rand() % 200 - 100), float(rand() % 220 - 160));
+            boxes[i].axes         = mat3(rotation(float(rand() % 360), normalize(vec3(1, float(i % 5), 2))));
+            boxes[i].half_extents = vec3(float(rand() % 100 + 1) * 0.1f, float(rand() % 100 + 1) * 0.1f, 1.0f);
+        }
+        boxes[0].center = vec3(0, 0, -10);
+        boxes[1].center = vec3(0, 0, 10);
+        boxes[2].center = vec3(0, 0, -200);
+
+        intersect(f, boxes, visible, 200);
+
+        bool pass = visible[0] == 1 && visible[1] == 0 && visible[2] == 0;
+        int  kept = 0;
+        for (int i = 0; i < 200; ++i) {
+            pass = pass && intersect(f, boxes[i]) == (visible[i] != 0);
+            kept += visible[i];
+
+            // kept when a corner is inside, culled when all corners are
+            // outside of one plane
+            uint8_t all_out = 0x3f;
+            bool    inside  = false;
+            for (int k = 0; k < 8; ++k) {
+                Vec3 local = vec3((k & 1) ? 1.0f : -1.0f, (k & 2) ? 1.0f : -1.0f, (k & 4) ? 1.0f : -1.0f);
+                Vec3 p     = boxes[i].center + boxes[i].axes * hadamard(local, boxes[i].half_extents);
+                Vec4 clip  = view_proj * vec4(p.x, p.y, p.z, 1.0f);
+                uint8_t flags = 0;
+                flags |= clip.x < -clip.w ? M3D_CLIP_LEFT : 0;
+                flags |= clip.x >  clip.w ? M3D_CLIP_RIGHT : 0;
+                flags |= clip.y < -clip.w ? M3D_CLIP_BOTTOM : 0;
+                flags |= clip.y >  clip.w ? M3D_CLIP_TOP : 0;
+                flags |= clip.z < -clip.w ? M3D_CLIP_NEAR : 0;
+                flags |= clip.z >  clip.w ? M3D_CLIP_FAR : 0;
+                all_out &= flags;
+                inside = inside || flags == 0;
+            }
+            pass = pass && (!inside || visible[i]) && (all_out == 0 || !visible[i]);
+        }
+        pass = pass && kept > 10 && kept < 190;
+
+        COUNT_TEST("Frustum vs OBB culling", pass);
+    }
+
+    {
+        OBB a, b;
+        a.center       = vec3(0, 0, 0);
+        a.axes         = mat3(identity());
+        a.half_extents = vec3(1, 1, 1);
+        b              = a;
+
+        bool pass = intersect(a, b);
+        b.center  = vec3(2.1f, 0, 0);
+        pass = pass && !intersect(a, b);
+        b.axes = mat3(rotation(45.0f, vec3(0, 0, 1)));
+        pass = pass && intersect(a, b);
+        b.center = vec3(2.5f, 0, 0);
+        pass = pass && !intersect(a, b);
+
+        // crossed rods turned about their long axes are only separated
+        // by the cross product of the two long axes
+        a.axes         = mat3(rotation(45.0f, vec3(1, 0, 0)));
+        a.half_extents = vec3(2.0f, 0.1f, 0.1f);
+        b.axes         = mat3(rotation(45.0f, vec3(0, 1, 0)));
+        b.half_extents = vec3(0.1f, 2.0f, 0.1f);
+        b.center       = vec3(0, 0, 0.25f);
+        pass = pass && intersect(a, b);
+        b.center = vec3(0, 0, 0.3f);
+        pass = pass && !intersect(a, b);
+
+        // random pairs against sampled points and the batch version
+        OBB     as[100], bs[100];
+        uint8_t overlap[100];
+        srand(47);
+        for (int i = 0; i < 100; ++i) {
+            OBB *pair[2] = { &as[i], &bs[i] };
+            for (int k = 0; k < 2; ++k) {
+                pair[k]->center       = vec3(float(rand() % 100) * 0.05f, float(rand() % 100) * 0.05f, float(rand() % 100) * 0.05f);
+                pair[k]->axes         = mat3(rotation(float(rand() % 360), normalize(vec3(float(rand() % 9 + 1), float(rand() % 9), 1))));
+                pair[k]->half_extents = vec3(float(rand() % 20 + 1) * 0.1f, float(rand() % 20 + 1) * 0.1f, float(rand() % 20 + 1) * 0.1f);
+            }
+        }
+        intersect(as, bs, overlap, 100);
+
+        int overlaps = 0;
+        for (int i = 0; i < 100; ++i) {
+            pass = pass && intersect(as[i], bs[i]) == (overlap[i] != 0);
+            overlaps += overlap[i];
+
+            bool witness = false;
+            for (int k = 0; k < 9 * 9 * 9; ++k) {
+                Vec3 local = vec3(float(k % 9), float((k / 9) % 9), float(k / 81)) * 0.25f - vec3(1, 1, 1);
+                Vec3 p     = as[i].center + as[i].axes * hadamard(local, as[i].half_extents);
+                Vec3 q     = transpose(bs[i].axes) * (p - bs[i].center);
+                witness = witness || (fabsf(q.x) < bs[i].half_extents.x &&
+                                      fabsf(q.y) < bs[i].half_extents.y &&
+                                      fabsf(q.z) < bs[i].half_extents.z);
+            }
+            pass = pass && (!witness || overlap[i]);
+        }
+        pass = pass && overlaps > 10 && overlaps < 90;
+
+        COUNT_TEST("OBB vs OBB separating axes", pass);
+    }
+
+    {
+        size_t const count = 5000;
+        Vec3 *points = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        srand(48);
+
+        // points on a sphere of radius 2 and inside it
+        Vec3 const center = vec3(30.0f, -4.0f, 7.0f);
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 d = vec3(float(rand() % 2001 - 1000), float(rand() % 2001 - 1000), float(rand() % 2001 - 1000));
+            d = length(d) > 0.0f ? normalize(d) : vec3(1, 0, 0);
+            points[i] = center + (i % 3 == 0 ? 2.0f : float(rand() % 200) * 0.01f) * d;
+        }
+
+        Sphere s    = sphere(points, count);
+        bool   pass = s.radius >= 2.0f && s.radius < 2.0f * 1.05f;
+        for (size_t i = 0; i < count; ++i)
+            pass = pass && length(points[i] - s.center) <= s.radius;
+
+        Sphere one = sphere(points, 1);
+        pass = pass && one.radius >= 0.0f && one.radius < 1e-5f && length(one.center - points[0]) == 0.0f;
+        pass = pass && sphere(points, 0).radius < 0.0f;
+
+        // merging
+        Sphere a = { vec3(0, 0, 0), 1.0f };
+        Sphere b = { vec3(4, 0, 0), 2.0f };
+        Sphere c = { vec3(0.5f, 0, 0), 0.25f };
+        Sphere m = merge(a, b);
+        pass = pass && fabsf(m.radius - 3.5f) < 1e-6f && length(m.center - vec3(2.5f, 0, 0)) < 1e-6f;
+        pass = pass && merge(a, c).radius == 1.0f && merge(c, a).radius == 1.0f;
+        pass = pass && merge(a, sphere(points, 0)).radius == 1.0f && merge(sphere(points, 0), b).radius == 2.0f;
+
+        // transforming takes the largest scale
+        Mat4   T = translate(1, 2, 3) * rotation(30.0f, vec3(0, 1, 0)) * scale(1, 3, 2);
+        Sphere t = transform_sphere(T, s);
+        pass = pass && fabsf(t.radius - 3.0f * s.radius) < 1e-4f;
+        for (size_t i = 0; i < count; i += 7) {
+            Vec3 p = (T * vec4(points[i].x, points[i].y, points[i].z, 1.0f)).xyz;
+            pass = pass && length(p - t.center) <= t.radius * (1.0f + 1e-5f);
+        }
+
+        // a shear stretches the unit sphere by the golden ratio, more
+        // than its longest column
+        Mat4 S = identity();
+        S.at(0, 1) = 1.0f;
+        Sphere u = transform_sphere(S, a);
+        for (int i = 0; i < 64; ++i) {
+            float t0 = float(i) * 0.1f, t1 = float(i) * 0.37f;
+            Vec3  q  = vec3(M3D_COSF(t0) * M3D_COSF(t1), M3D_SINF(t0) * M3D_COSF(t1), M3D_SINF(t1));
+            pass = pass && length((S * vec4(q.x, q.y, q.z, 1.0f)).xyz - u.center) <= u.radius;
+        }
+        pass = pass && u.radius >= 1.618f && u.radius < 1.75f;
+
+        Mat4   Ts[3] = { T, identity(), scale(0.5f, 0.5f, 0.5f) };
+        Sphere in[3] = { s, a, b };
+        Sphere out[3];
+        transform_spheres(Ts, in, out, 3);
+        pass = pass && out[0].radius == t.radius && out[1].radius == 1.0f && out[2].radius == 1.0f;
+        pass = pass && length(out[2].center - vec3(2, 0, 0)) < 1e-6f;
+
+        free(points);
+        COUNT_TEST("Sphere fit, merge and transform", pass);
+    }
+
+    {
+        size_t const count = 203;
+        float   ax[count], ay[count], az[count], ar[count];
+        float   bx[count], by[count], bz[count], br[count];
+        uint8_t overlap[count];
+        srand(49);
+
+        for (size_t i = 0; i < count; ++i) {
+            ax[i] = float(rand() % 100) * 0.1f; ay[i] = float(rand() % 100) * 0.1f;
+            az[i] = float(rand() % 100) * 0.1f; ar[i] = float(rand() % 30) * 0.1f;
+            bx[i] = float(rand() % 100) * 0.1f; by[i] = float(rand() % 100) * 0.1f;
+            bz[i] = float(rand() % 100) * 0.1f; br[i] = float(rand() % 30) * 0.1f;
+        }
+
+        // exactly touching
+        ax[5] = 0.0f; ay[5] = 0.0f; az[5] = 0.0f; ar[5] = 1.0f;
+        bx[5] = 3.0f; by[5] = 0.0f; bz[5] = 0.0f; br[5] = 2.0f;
+
+        Spheres a = { ax, ay, az, ar };
+        Spheres b = { bx, by, bz, br };
+        intersect(a, b, overlap, count);
+
+        bool pass = overlap[5] == 1;
+        int  hits = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Sphere sa = { vec3(ax[i], ay[i], az[i]), ar[i] };
+            Sphere sb = { vec3(bx[i], by[i], bz[i]), br[i] };
+            pass = pass && intersect(sa, sb) == (overlap[i] != 0);
+            hits += overlap[i];
+        }
+        pass = pass && hits > 5 && hits < int(count) - 5;
+
+        // one against many, with the output cut short
+        Sphere   q = { vec3(5, 5, 5), 2.5f };
+        uint32_t found[count];
+        size_t   total = intersect(q, b, count, found, count);
+        size_t   next  = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Sphere sb = { vec3(bx[i], by[i], bz[i]), br[i] };
+            if (intersect(q, sb)) {
+                pass = pass && next < total && found[next] == uint32_t(i);
+                ++next;
+            }
+        }
+        pass = pass && next == total && total > 3;
+        pass = pass && intersect(q, b, count, found, 2) == total && found[0] != found[1];
+
+        COUNT_TEST("Sphere overlap arrays", pass);
+    }
+
+    {
+        size_t const count = 300;
+        AABB      boxes[count];
+        Vec3      velocity[count];
+        uint32_t  order[count];
+        float     bounds[6 * (count + 8)];
+        uint32_t  pairs[2 * 2000];
+        void     *scratch = malloc(sort_sweep_scratch_size(count));
+        SortSweep sweep   = { order, bounds, 0, 0 };
+        srand(50);
+
+        // spread along y so that is the sweep axis
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 p = vec3(float(rand() % 100) * 0.1f, float(rand() % 1000) * 0.1f, float(rand() % 100) * 0.1f);
+            Vec3 e = vec3(float(rand() % 10 + 1) * 0.1f, float(rand() % 10 + 1) * 0.1f, float(rand() % 10 + 1) * 0.1f);
+            boxes[i].min = p - e;
+            boxes[i].max = p + e;
+            velocity[i]  = vec3(float(rand() % 21 - 10), float(rand() % 21 - 10), float(rand() % 21 - 10)) * 0.02f;
+        }
+        boxes[7] = boxes[3];
+
+        sort_sweep_init(&sweep, boxes, count, scratch);
+        bool pass = sweep.axis == 1 && sweep.count == count && sort_sweep_bounds_size(count) <= 6 * (count + 8);
+
+        for (int frame = 0; frame < 5; ++frame) {
+            size_t total = sort_sweep_update(&sweep, boxes, pairs, 2000);
+
+            // each brute force pair is reported exactly once
+            size_t expected = 0;
+            for (size_t i = 0; i < count; ++i) {
+                for (size_t j = i + 1; j < count; ++j) {
+                    bool overlap = boxes[i].min.x <= boxes[j].max.x && boxes[j].min.x <= boxes[i].max.x &&
+                                   boxes[i].min.y <= boxes[j].max.y && boxes[j].min.y <= boxes[i].max.y &&
+                                   boxes[i].min.z <= boxes[j].max.z && boxes[j].min.z <= boxes[i].max.z;
+                    if (!overlap)
+                        continue;
+
+                    int seen = 0;
+                    for (size_t k = 0; k < total && k < 2000; ++k)
+                        seen += pairs[2 * k] == uint32_t(i) && pairs[2 * k + 1] == uint32_t(j);
+                    pass = pass && seen == 1;
+                    ++expected;
+                }
+            }
+            pass = pass && total == expected && total > 20 && total < 2000;
+
+            for (size_t i = 1; i < count; ++i)
+                pass = pass && boxes[order[i - 1]].min.y <= boxes[order[i]].min.y;
+
+            pass = pass && sort_sweep_update(&sweep, boxes, pairs, 3) == total;
+
+            for (size_t i = 0; i < count; ++i) {
+                boxes[i].min = boxes[i].min + velocity[i];
+                boxes[i].max = boxes[i].max + velocity[i];
+            }
+        }
+
+        // a world box spanning every float overlaps the other boxes but
+        // not the padding past them
+        AABB      world[3]   = { { vec3(0, 0, 0), vec3(1, 1, 1) },
+                                 { vec3(-M3D_FLOAT_MAX, -M3D_FLOAT_MAX, -M3D_FLOAT_MAX),
+                                   vec3(M3D_FLOAT_MAX, M3D_FLOAT_MAX, M3D_FLOAT_MAX) },
+                                 { vec3(5, 5, 5), vec3(6, 6, 6) } };
+        uint32_t  world_order[3];
+        float     world_bounds[6 * (3 + 8)];
+        SortSweep world_sweep = { world_order, world_bounds, 0, 0 };
+        sort_sweep_init(&world_sweep, world, 3, scratch);
+        pass = pass && sort_sweep_update(&world_sweep, world, pairs, 2000) == 2;
+        pass = pass && pairs[0] == 0 && pairs[1] == 1 && pairs[2] == 1 && pairs[3] == 2;
+
+        free(scratch);
+        COUNT_TEST("Sort and sweep broadphase", pass);
+    }
+
+    {
+        GjkSimplex   simplex = {};
+        ConvexResult result;
+
+        Sphere sa = { vec3(0, 0, 0), 1.0f };
+        Sphere sb = { vec3(3, 1, 0), 0.5f };
+        Convex a  = { support_sphere, &sa, nullptr };
+        Convex b  = { support_sphere, &sb, nullptr };
+
+        bool pass = !gjk(a, b, &simplex, &result);
+        pass = pass && fabsf(result.distance - (sqrtf(10.0f) - 1.5f)) < 1e-4f;
+        pass = pass && length(result.normal - normalize(vec3(3, 1, 0))) < 1e-3f;
+        pass = pass && length(result.point_a - normalize(vec3(3, 1, 0))) < 1e-3f;
+        pass = pass && fabsf(length(result.point_b - result.point_a) - result.distance) < 1e-4f;
+
+        // a box turned 45 degrees reaches its neighbour with an edge
+        OBB ba, bb;
+        ba.center       = vec3(0, 0, 0);
+        ba.axes         = mat3(identity());
+        ba.half_extents = vec3(1, 1, 1);
+        bb              = ba;
+        bb.center       = vec3(3, 0, 0);
+        bb.axes         = mat3(rotation(45.0f, vec3(0, 0, 1)));
+        Convex box_a = { support_obb, &ba, nullptr };
+        Convex box_b = { support_obb, &bb, nullptr };
+
+        simplex = GjkSimplex();
+        pass = pass && !gjk(box_a, box_b, &simplex, &result);
+        pass = pass && fabsf(result.distance - (2.0f - sqrtf(2.0f))) < 1e-5f;
+        pass = pass && fabsf(result.point_a.x - 1.0f) < 1e-5f && fabsf(result.point_b.x - (3.0f - sqrtf(2.0f))) < 1e-5f;
+
+        // a capsule and a point
+        Capsule capsule = { vec3(0, 0, 0), vec3(0, 4, 0), 0.5f };
+        Vec3    point   = vec3(2, 5, 0);
+        Convex  cap     = { support_capsule, &capsule, nullptr };
+        Convex  pt      = { support_point, &point, nullptr };
+        simplex = GjkSimplex();
+        pass = pass && !gjk(cap, pt, &simplex, &result);
+        pass = pass && fabsf(result.distance - (sqrtf(5.0f) - 0.5f)) < 1e-4f;
+
+        // a hull of the unit cube corners and inner points, placed by a
+        // scaling transform, against the same box as an OBB
+        float hx[40], hy[40], hz[40];
+        srand(51);
+        for (int k = 0; k < 40; ++k) {
+            hx[k] = k < 8 ? ((k & 1) ? 1.0f : -1.0f) : float(rand() % 199 - 99) * 0.01f;
+            hy[k] = k < 8 ? ((k & 2) ? 1.0f : -1.0f) : float(rand() % 199 - 99) * 0.01f;
+            hz[k] = k < 8 ? ((k & 4) ? 1.0f : -1.0f) : float(rand() % 199 - 99) * 0.01f;
+        }
+        // the corners last so the lanes and the tail both matter
+        for (int k = 0; k < 8; ++k) {
+            float t;
+            t = hx[k]; hx[k] = hx[39 - k]; hx[39 - k] = t;
+            t = hy[k]; hy[k] = hy[39 - k]; hy[39 - k] = t;
+            t = hz[k]; hz[k] = hz[39 - k]; hz[39 - k] = t;
+        }
+        Hull   hull  = { hx, hy, hz, 40 };
+        Mat3x4 place = mat3x4(translate(3, 0, 0) * rotation(45.0f, vec3(0, 0, 1)) * scale(1, 2, 1));
+        Convex hull_b = { support_hull, &hull, &place };
+        OBB    hb     = bb;
+        hb.half_extents = vec3(1, 2, 1);
+        Convex obb_b  = { support_obb, &hb, nullptr };
+
+        for (int k = 0; k < 20; ++k) {
+            Vec3 d = vec3(float(rand() % 21 - 10), float(rand() % 21 - 10), float(rand() % 21 - 10));
+            pass = pass && length(support(hull_b, d) - support(obb_b, d)) < 1e-5f;
+        }
+
+        ConvexResult expected;
+        simplex = GjkSimplex();
+        bool overlap_hull = gjk(box_a, hull_b, &simplex, &result);
+        simplex = GjkSimplex();
+        bool overlap_obb  = gjk(box_a, obb_b, &simplex, &expected);
+        pass = pass && overlap_hull && overlap_obb;
+
+        COUNT_TEST("GJK distance between convex shapes", pass);
+    }
+
+    {
+        GjkSimplex   simplex = {};
+        ConvexResult result;
+
+        OBB ba, bb;
+        ba.center       = vec3(0, 0, 0);
+        ba.axes         = mat3(identity());
+        ba.half_extents = vec3(1, 1, 1);
+        bb              = ba;
+        bb.center       = vec3(1.5f, 0.2f, 0.1f);
+        Convex box_a = { support_obb, &ba, nullptr };
+        Convex box_b = { support_obb, &bb, nullptr };
+
+        bool pass = gjk(box_a, box_b, &simplex, &result) && result.distance == 0.0f;
+        pass = pass && epa(box_a, box_b, simplex, &result);
+        pass = pass && fabsf(result.distance + 0.5f) < 1e-5f && length(result.normal - vec3(1, 0, 0)) < 1e-5f;
+        pass = pass && fabsf(result.point_a.x - 1.0f) < 1e-5f && fabsf(result.point_b.x - 0.5f) < 1e-5f;
+
+        Sphere sa = { vec3(0, 0, 0), 1.0f };
+        Sphere sb = { vec3(1.2f, 0.3f, 0.1f), 0.5f };
+        Convex a  = { support_sphere, &sa, nullptr };
+        Convex b  = { support_sphere, &sb, nullptr };
+        simplex = GjkSimplex();
+        pass = pass && gjk(a, b, &simplex, &result) && epa(a, b, simplex, &result);
+        pass = pass && fabsf(result.distance - (length(sb.center) - 1.5f)) < 1e-3f;
+        pass = pass && length(result.normal - normalize(sb.center)) < 0.05f;
+
+        // random boxes agree with the separating axis test, and warm
+        // starting from the last frame agrees with starting cold
+        OBB        as[50], bs[50];
+        GjkSimplex warm[50] = {};
+        srand(52);
+        for (int i = 0; i < 50; ++i) {
+            OBB *pair[2] = { &as[i], &bs[i] };
+            for (int k = 0; k < 2; ++k) {
+                pair[k]->center       = vec3(float(rand() % 100) * 0.04f, float(rand() % 100) * 0.04f, float(rand() % 100) * 0.04f);
+                pair[k]->axes         = mat3(rotation(float(rand() % 360), normalize(vec3(float(rand() % 9 + 1), float(rand() % 9), 1))));
+                pair[k]->half_extents = vec3(float(rand() % 20 + 1) * 0.1f, float(rand() % 20 + 1) * 0.1f, float(rand() % 20 + 1) * 0.1f);
+            }
+        }
+
+        int overlaps = 0;
+        for (int frame = 0; frame < 4; ++frame) {
+            for (int i = 0; i < 50; ++i) {
+                Convex ca = { support_obb, &as[i], nullptr };
+                Convex cb = { support_obb, &bs[i], nullptr };
+
+                ConvexResult cold, hot;
+                GjkSimplex   fresh = {};
+                bool overlap = gjk(ca, cb, &fresh, &cold);
+                bool warmed  = gjk(ca, cb, &warm[i], &hot);
+
+                if (overlap) {
+                    pass = pass && epa(ca, cb, fresh, &cold) && cold.distance <= 0.0f;
+                    if (cold.distance < -1e-3f)
+                        pass = pass && intersect(as[i], bs[i]) && warmed;
+                    ++overlaps;
+                }
+                else {
+                    pass = pass && fabsf(cold.distance - hot.distance) < 1e-4f;
+                    pass = pass && fabsf(length(cold.point_b - cold.point_a) - cold.distance) < 1e-4f;
+                    if (cold.distance > 1e-3f)
+                        pass = pass && !intersect(as[i], bs[i]) && !warmed;
+                }
+
+                bs[i].center = bs[i].center + vec3(0.05f, -0.03f, 0.02f);
+            }
+        }
+        pass = pass && overlaps > 10 && overlaps < 190;
+
+        COUNT_TEST("EPA penetration and GJK warm start", pass);
+    }
+
+    {
+        size_t const   count  = 1003;
+        float         *soa    = static_cast<float *>(malloc(9 * count * sizeof(float)));
+        uint16_t      *hv     = static_cast<uint16_t *>(malloc(3 * count * sizeof(uint16_t)));
+        Vec3          *pos    = static_cast<Vec3 *>(malloc(3 * count * sizeof(Vec3)));
+        Vec3          *vel    = pos + count;
+        Vec3          *prev   = pos + 2 * count;
+        Particles      p      = { soa, soa + count, soa + 2 * count, soa + 3 * count, soa + 4 * count, soa + 5 * count,
+                                  nullptr, nullptr, nullptr, soa + 6 * count, soa + 7 * count, soa + 8 * count };
+        ParticleForces forces = { vec3(0, -9.8f, 0), 0.5f, 6.0f, vec3(-10, 0, -10), vec3(10, 20, 10) };
+        float const    dt     = 1.0f / 60.0f;
+        srand(53);
+
+        for (size_t i = 0; i < count; ++i) {
+            pos[i] = vec3(float(rand() % 200 - 100) * 0.1f, float(rand() % 200) * 0.1f, float(rand() % 200 - 100) * 0.1f);
+            vel[i] = vec3(float(rand() % 21 - 10), float(rand() % 21 - 10), float(rand() % 21 - 10)) * 0.5f;
+            p.x[i] = pos[i].x; p.y[i] = pos[i].y; p.z[i] = pos[i].z;
+            p.vx[i] = vel[i].x; p.vy[i] = vel[i].y; p.vz[i] = vel[i].z;
+        }
+
+        // the same steps with Vec3 math, speed and box clamps included
+        for (int step = 0; step < 30; ++step) {
+            integrate_euler(p, forces, dt, count);
+            for (size_t i = 0; i < count; ++i) {
+                vel[i] = (vel[i] + forces.gravity * dt) * (1.0f - forces.drag * dt);
+                if (length(vel[i]) > forces.max_speed)
+                    vel[i] = normalize(vel[i]) * forces.max_speed;
+                pos[i] = max_of(min_of(pos[i] + vel[i] * dt, forces.upper), forces.lower);
+            }
+        }
+
+        bool pass = true;
+        for (size_t i = 0; i < count; ++i) {
+            pass = pass && length(vec3(p.x[i], p.y[i], p.z[i]) - pos[i]) < 1e-3f;
+            pass = pass && length(vec3(p.vx[i], p.vy[i], p.vz[i]) - vel[i]) < 1e-3f;
+            pass = pass && length(vel[i]) <= forces.max_speed * 1.0001f && p.y[i] >= 0.0f;
+        }
+
+        // half velocities follow the float ones to half precision
+        to_half(p.vx, hv, count);
+        to_half(p.vy, hv + count, count);
+        to_half(p.vz, hv + 2 * count, count);
+        for (size_t i = 0; i < count; ++i)
+            pos[i] = vec3(p.x[i], p.y[i], p.z[i]);
+
+        Particles h = p;
+        h.vx  = h.vy = h.vz = nullptr;
+        h.hvx = hv; h.hvy = hv + count; h.hvz = hv + 2 * count;
+        integrate_euler(p, forces, dt, count);
+        integrate_euler(h, forces, dt, count);
+        for (size_t i = 0; i < count; ++i) {
+            Vec3 hvel = vec3(from_half(h.hvx[i]), from_half(h.hvy[i]), from_half(h.hvz[i]));
+            pass = pass && length(hvel - vec3(p.vx[i], p.vy[i], p.vz[i])) < 1e-2f;
+        }
+
+        // Verlet with some particles moving sideways, against the same
+        // steps with the step limited to max_speed * dt
+        for (size_t i = 0; i < count; ++i) {
+            prev[i] = vec3(p.x[i], p.y[i], p.z[i]) - vec3(1.0f, 0, 0) * float(i % 3) * 0.05f;
+            p.px[i] = prev[i].x; p.py[i] = prev[i].y; p.pz[i] = prev[i].z;
+            pos[i]  = vec3(p.x[i], p.y[i], p.z[i]);
+        }
+        forces.drag = 0.0f;
+        for (int step = 0; step < 20; ++step) {
+            integrate_verlet(p, forces, dt, count);
+            for (size_t i = 0; i < count; ++i) {
+                Vec3 d = pos[i] - prev[i] + forces.gravity * dt * dt;
+                if (length(d) > forces.max_speed * dt)
+                    d = normalize(d) * forces.max_speed * dt;
+                prev[i] = pos[i];
+                pos[i]  = max_of(min_of(pos[i] + d, forces.upper), forces.lower);
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            pass = pass && length(vec3(p.x[i], p.y[i], p.z[i]) - pos[i]) < 1e-3f;
+            pass = pass && length(vec3(p.px[i], p.py[i], p.pz[i]) - prev[i]) < 1e-3f;
+        }
+
+        COUNT_TEST("Particle Euler and Verlet steps", pass);
+
+        free(pos);
+        free(hv);
+        free(soa);
+    }
+
+    {
+        size_t const    count = 5;
+        Mat4            storage[3 * count];
+        TransformBuffer buffer;
+
+        transform_buffer_init(&buffer, storage, count);
+        Mat4 const *seen = transform_buffer_read(&buffer);
+        bool        pass = seen[4].at(0, 0) == 1.0f && seen[4].at(0, 3) == 0.0f && transform_buffer_write(&buffer) != seen;
+
+        // reading without a publish keeps the same frame
+        for (size_t i = 0; i < count; ++i)
+            transform_buffer_write(&buffer)[i] = translate(1.0f, float(i), 0.0f);
+        pass = pass && transform_buffer_read(&buffer) == seen && seen[2].at(0, 3) == 0.0f;
+
+        transform_buffer_publish(&buffer);
+        seen = transform_buffer_read(&buffer);
+        pass = pass && seen[2].at(0, 3) == 1.0f && seen[2].at(1, 3) == 2.0f && transform_buffer_read(&buffer) == seen;
+
+        // frames published between reads are skipped, the reader gets
+        // the latest and its slot is never the one being written
+        int seen_frame = 1;
+        for (int frame = 2; frame < 6; ++frame) {
+            Mat4 *out = transform_buffer_write(&buffer);
+            pass = pass && out != seen;
+            for (size_t i = 0; i < count; ++i)
+                out[i] = translate(float(frame), float(i), 0.0f);
+            transform_buffer_publish(&buffer);
+            pass = pass && seen[3].at(0, 3) == float(seen_frame) && seen[3].at(1, 3) == 3.0f;
+            if (frame & 1) {
+                seen       = transform_buffer_read(&buffer);
+                seen_frame = frame;
+            }
+        }
+        pass = pass && seen[3].at(0, 3) == 5.0f;
+        pass = pass && transform_buffer_write(&buffer) != seen;
+
+#if defined(_OPENMP)
+        // a writer and a reader on two threads, every snapshot holds a
+        // whole frame and frames never go back, the reader gives up
+        // after a while in case the sections run one after the other
+        int const       frames = 20000;
+        int             bad    = 0;
+        Mat4            shared_storage[3 * count];
+        TransformBuffer shared;
+        transform_buffer_init(&shared, shared_storage, count);
+
+        #pragma omp parallel sections num_threads(2) reduction(+ : bad)
+        {
+            #pragma omp section
+            for (int frame = 1; frame <= frames; ++frame) {
+                Mat4 *out = transform_buffer_write(&shared);
+                for (size_t i = 0; i < count; ++i)
+                    out[i] = translate(float(frame), float(i), 0.0f);
+                transform_buffer_publish(&shared);
+            }
+
+            #pragma omp section
+            {
+                float last = 0.0f;
+                for (int r = 0; r < 50 * frames && last < float(frames); ++r) {
+                    Mat4 const *snap  = transform_buffer_read(&shared);
+                    float       frame = snap[0].at(0, 3);
+                    for (size_t i = 0; i < count; ++i) {
+                        float y = frame > 0.0f ? float(i) : 0.0f;
+                        bad += snap[i].at(0, 3) != frame || snap[i].at(1, 3) != y ? 1 : 0;
+                    }
+                    bad += frame < last ? 1 : 0;
+                    last = frame;
+                }
+            }
+        }
+        pass = pass && bad == 0;
+#endif
+
+        COUNT_TEST("Triple buffered transforms", pass);
+    }
+
+    {
+        size_t const   size   = 3u << 20;
+        unsigned char *memory = static_cast<unsigned char *>(pages_alloc(size, M3D_PAGES_HUGE | M3D_PAGES_FIRST_TOUCH));
+        bool           pass   = memory != nullptr && size_t(memory) % 4096 == 0 && memory[size - 1] == 0;
+        Arena          arena;
+        srand(54);
+
+        // unaligned memory still gives aligned arrays
+        arena_init(&arena, memory + 8, size - 8);
+        Mat4   *mats = static_cast<Mat4 *>(arena_alloc(&arena, 1000 * sizeof(Mat4)));
+        size_t  mark = arena.used;
+        Vec3   *vecs = static_cast<Vec3 *>(arena_alloc(&arena, 7 * sizeof(Vec3), 16));
+        pass = pass && size_t(mats) % M3D_CACHE_LINE == 0 && size_t(vecs) % 16 == 0 && vecs >= reinterpret_cast<Vec3 *>(mats + 1000);
+        pass = pass && arena_alloc(&arena, size) == nullptr && arena.used == mark + 7 * sizeof(Vec3);
+        arena_reset(&arena, mark);
+        pass = pass && arena_alloc(&arena, 7 * sizeof(Vec3), 16) == vecs;
+
+        // scratch for a batched function comes from the arena too
+        size_t const count = 5000;
+        uint32_t    *codes = static_cast<uint32_t *>(arena_alloc(&arena, count * sizeof(uint32_t)));
+        uint32_t    *order = static_cast<uint32_t *>(arena_alloc(&arena, count * sizeof(uint32_t)));
+        void        *work  = arena_alloc(&arena, radix_sort_scratch_size(count));
+        for (size_t i = 0; i < count; ++i)
+            codes[i] = uint32_t(rand()) * 2654435761u;
+        radix_sort(codes, order, count, work);
+        for (size_t i = 1; i < count; ++i)
+            pass = pass && codes[i - 1] <= codes[i];
+        arena_reset(&arena);
+        pass = pass && arena.used == 0;
+
+        // a pool hands out every item once, then the freed ones
+        Pool   pool;
+        void  *items[40];
+        bool   ready = pool_init(&pool, memory + 1, 40 * 80 + 63, 72);
+        pass = pass && ready && pool.item_size == 128 && pool.capacity == 25;
+        size_t taken = 0;
+        while (taken < 40 && (items[taken] = pool_alloc(&pool)) != nullptr)
+            ++taken;
+        pass = pass && taken == 25 && size_t(items[24]) % M3D_CACHE_LINE == 0;
+        pool_free(&pool, items[3]);
+        pool_free(&pool, items[9]);
+        pass = pass && pool_alloc(&pool) == items[9] && pool_alloc(&pool) == items[3] && pool_alloc(&pool) == nullptr;
+
+        pages_free(memory, size, M3D_PAGES_HUGE | M3D_PAGES_FIRST_TOUCH);
+
+        COUNT_TEST("Arena, pool, and page memory", pass);
+    }
+
 #undef COUNT_TEST
 
     printf("\n%zd tests run -- %zd passed -- %zd failed\n\n",
@@ -720,6 +2873,22 @@ void m3d_print_benchmark(char const* name, u64 min, u64 max, double avg)
                name, min, max, avg);
 }
 
+void m3d_print_batch_benchmark(char const* name, size_t count, u64 min, double avg)
+{
+    static char   const *DOTS     = "...................................";
+    static size_t const  DOTS_LEN = strlen(DOTS);
+
+    size_t len = strlen(name) + 1; // add one for a space
+    double n   = static_cast<double>(count);
+
+    if (len < DOTS_LEN)
+        printf("%s %s Cycles per item min: %6.2f, average: %6.2f\n",
+               name, DOTS + len, static_cast<double>(min) / n, avg / n);
+    else
+        printf("%s Cycles per item min: %6.2f, average: %6.2f\n",
+               name, static_cast<double>(min) / n, avg / n);
+}
+
 #define COUNT_OF(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 struct Rng {
@@ -1015,6 +3184,10 @@ void m3d_benchmark_suite()
                   Mat4 A = perspectiveGL(rng[0], rng[1], rng[2], rng[3]),
                   garbage += sum_mat(A));
 
+    RUN_BENCHMARK("Mat4 inverse_perspectiveGL", {}, {},
+                  Mat4 A = inverse_perspectiveGL(rng[0], rng[1], rng[2], rng[3], rng[4], rng[5]),
+                  garbage += sum_mat(A));
+
     RUN_BENCHMARK("Mat4 translate", {}, {},
                   Mat4 A = translate(rng[0], rng[1], rng[2]),
                   garbage += sum_mat(A));
@@ -1051,10 +3224,889 @@ void m3d_benchmark_suite()
                   Vec4 c = B * a,
                   garbage += c.x + c.y + c.z + c.w);
 
+    RUN_BENCHMARK("Mat3 normal_matrix", {},
+                  Mat4 A = translate(rng[0], rng[1], rng[2]) * scale(rng[3], rng[4], rng[5]),
+                  Mat3 N = normal_matrix(A),
+                  garbage += N.data[0] + N.data[4] + N.data[8]);
+
+    RUN_BENCHMARK("Mat3 inverse transpose via Mat4", {},
+                  Mat4 A = translate(rng[0], rng[1], rng[2]) * scale(rng[3], rng[4], rng[5]),
+                  Mat3 N = transpose(mat3(inverse(A))),
+                  garbage += N.data[0] + N.data[4] + N.data[8]);
+
+    RUN_BENCHMARK("Mat3x4 inverse",
+                  bool isInvertible = false,
+                  Mat3x4 A = mat3x4(translate(rng[0], rng[1], rng[2])),
+                  Mat3x4 B = inverse(A, &isInvertible),
+                  garbage += B.data[9]);
+
+    RUN_BENCHMARK("Mat3x4 multiplication",
+                  Mat3x4 A = mat3x4(scale(rng[0], rng[1], rng[2])),
+                  Mat3x4 B = mat3x4(translate(rng[3], rng[4], rng[5])),
+                  Mat3x4 C = B * A,
+                  garbage += C.data[0] + C.data[9]);
+
+    RUN_BENCHMARK("DualQuat from rigid Mat4", {},
+                  Mat4 A = translate(rng[0], rng[1], rng[2]) * rotation(rng[3], vec3(0,0,1)),
+                  DualQuat dq = dual_quat(A),
+                  garbage += dq.real.x + dq.dual.w);
+
+    RUN_BENCHMARK("DualQuat transform_point",
+                  DualQuat dq = dual_quat(rng[0], vec3(0,0,1), vec3(rng[1], rng[2], rng[3])),
+                  Vec3 p = vec3(rng[4], rng[5], rng[6]),
+                  Vec3 q = transform_point(dq, p),
+                  garbage += q.x + q.y + q.z);
+
+    /*
+     * Batch benchmarks run a kernel over an array large enough to
+     * spill out of the caches, so the outlier filtering above does
+     * not apply.  Instead each kernel runs a handful of times and the
+     * cycle counts are reported per item processed.
+     */
+#define RUN_BATCH_BENCHMARK(benchmark, count, bench, write_garbage)     \
+    {                                                                   \
+        int const bm_count = 10;                                        \
+        double bm_sum = 0.0;                                            \
+        u64    bm_min = _UI64_MAX;                                      \
+        for (int bm_i = 0; bm_i < bm_count; ++bm_i) {                   \
+            u64 bm_start = get_start_cycles();                          \
+            bench;                                                      \
+            u64 bm_end = get_end_cycles();                              \
+            u64 bm_delta = bm_end - bm_start;                           \
+            bm_sum += static_cast<double>(bm_delta);                    \
+            bm_min = bm_min_of(bm_min, bm_delta);                       \
+            write_garbage;                                              \
+        }                                                               \
+        double bm_avg = bm_sum / static_cast<double>(bm_count);         \
+        m3d_print_batch_benchmark(benchmark, (count), bm_min, bm_avg);  \
+    }
+
+    puts("");
+
+    {
+        size_t const count = 1 << 20;
+        float    *in   = static_cast<float *>(malloc(count * sizeof(float)));
+        float    *out  = static_cast<float *>(malloc(count * sizeof(float)));
+        uint16_t *half = static_cast<uint16_t *>(malloc(count * sizeof(uint16_t)));
+
+        for (size_t i = 0; i < count; ++i)
+            in[i] = (float(rand()) / float(RAND_MAX) - 0.5f) * 1000.0f;
+
+        RUN_BATCH_BENCHMARK("Half to_half array", count,
+                            to_half(in, half, count),
+                            garbage += float(half[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Half from_half array", count,
+                            from_half(half, out, count),
+                            garbage += out[count / 2]);
+
+        free(in);
+        free(out);
+        free(half);
+    }
+
+    {
+        size_t const count = 1 << 20;
+        Vec3     *in  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3     *out = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint32_t *p16 = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint16_t *p8  = static_cast<uint16_t *>(malloc(count * sizeof(uint16_t)));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            in[i] = normalize(vec3(rng[0] - 2.5f, rng[1] - 2.5f, rng[2] - 2.5f));
+        }
+
+        RUN_BATCH_BENCHMARK("Octahedral encode_oct16 array", count,
+                            encode_oct16(in, p16, count),
+                            garbage += float(p16[count / 2] & 0xff));
+
+        RUN_BATCH_BENCHMARK("Octahedral decode_oct16 array", count,
+                            decode_oct16(p16, out, count),
+                            garbage += out[count / 2].x);
+
+        RUN_BATCH_BENCHMARK("Octahedral encode_oct8 array", count,
+                            encode_oct8(in, p8, count),
+                            garbage += float(p8[count / 2] & 0xff));
+
+        RUN_BATCH_BENCHMARK("Octahedral decode_oct8 array", count,
+                            decode_oct8(p8, out, count),
+                            garbage += out[count / 2].x);
+
+        free(in);
+        free(out);
+        free(p16);
+        free(p8);
+    }
+
+    {
+        size_t const count  = 1 << 20;
+        DVec3        camera = dvec3(6.4e6, 1.0e5, -2.5e6);
+        DVec3       *in     = static_cast<DVec3 *>(malloc(count * sizeof(DVec3)));
+        Vec3        *out    = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            in[i] = camera + dvec3(rng[0] * 1e3, rng[1] * 1e3, rng[2] * 1e3);
+        }
+
+        RUN_BATCH_BENCHMARK("DVec3 to_camera_relative", count,
+                            to_camera_relative(camera, in, out, count),
+                            garbage += out[count / 2].x);
+
+        free(in);
+        free(out);
+    }
+
+    {
+        size_t const count = 1 << 18;
+        Mat4   *A4  = static_cast<Mat4 *>(malloc(count * sizeof(Mat4)));
+        Mat4   *B4  = static_cast<Mat4 *>(malloc(count * sizeof(Mat4)));
+        Mat4   *C4  = static_cast<Mat4 *>(malloc(count * sizeof(Mat4)));
+        Mat3x4 *A   = static_cast<Mat3x4 *>(malloc(count * sizeof(Mat3x4)));
+        Mat3x4 *B   = static_cast<Mat3x4 *>(malloc(count * sizeof(Mat3x4)));
+        Mat3x4 *C   = static_cast<Mat3x4 *>(malloc(count * sizeof(Mat3x4)));
+        Vec3   *in  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3   *out = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            A4[i] = translate(rng[0], rng[1], rng[2]) * rotation(rng[3], vec3(0,0,1));
+            B4[i] = translate(rng[4], rng[5], rng[6]) * scale(rng[7], rng[8], rng[9]);
+            in[i] = vec3(rng[10], rng[11], rng[12]);
+        }
+
+        mat3x4(A4, A, count);
+        mat3x4(B4, B, count);
+
+        RUN_BATCH_BENCHMARK("Mat4 multiplication array", count,
+                            for (size_t i = 0; i < count; ++i) C4[i] = A4[i] * B4[i],
+                            garbage += sum_mat(C4[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Mat4 mul_into array", count,
+                            for (size_t i = 0; i < count; ++i) mul_into(&C4[i], A4[i], B4[i]),
+                            garbage += sum_mat(C4[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Mat4 *= array", count,
+                            for (size_t i = 0; i < count; ++i) (C4[i] = A4[i]) *= B4[i],
+                            garbage += sum_mat(C4[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Mat3x4 multiply", count,
+                            multiply(A, B, C, count),
+                            garbage += C[count / 2].data[9]);
+
+        RUN_BATCH_BENCHMARK("Mat3x4 transform_points", count,
+                            transform_points(A[0], in, out, count),
+                            garbage += out[count / 2].x);
+
+        RUN_BATCH_BENCHMARK("Mat4 transform_points", count,
+                            transform_points(A4[0], in, out, count),
+                            garbage += out[count / 2].x);
+
+        {
+            Mat4     VP    = perspectiveGL(60.0f, 0.75f, 0.5f, 100.0f) * translate(-2, -2, -8);
+            Viewport vp    = viewport(0.0f, 0.0f, 1920.0f, 1080.0f);
+            uint8_t *flags = static_cast<uint8_t *>(malloc(count * sizeof(uint8_t)));
+
+            RUN_BATCH_BENCHMARK("Mat4 project_points", count,
+                                project_points(VP, vp, in, out, flags, count),
+                                garbage += out[count / 2].x + flags[count / 2]);
+
+            RUN_BATCH_BENCHMARK("Mat4 project_points no flags", count,
+                                project_points(VP, vp, in, out, nullptr, count),
+                                garbage += out[count / 2].x);
+
+            RUN_BATCH_BENCHMARK("Mat4 manual projection", count,
+                                for (size_t i = 0; i < count; ++i) {
+                                    Vec4 c = VP * vec4(in[i], 1.0f);
+                                    Vec3 ndc = c.xyz / c.w;
+                                    out[i] = vec3((ndc.x + 1.0f) * 960.0f, (ndc.y + 1.0f) * 540.0f,
+                                                  (ndc.z + 1.0f) * 0.5f);
+                                },
+                                garbage += out[count / 2].x);
+
+
+            Mat4  inv    = inverse(VP);
+            Vec2 *pixels = static_cast<Vec2 *>(malloc(count * sizeof(Vec2)));
+            Ray  *rays   = static_cast<Ray *>(malloc(count * sizeof(Ray)));
+
+            for (size_t i = 0; i < count; ++i)
+                pixels[i] = vec2(float(i % 1920), float((i / 1920) % 1080));
+
+            RUN_BATCH_BENCHMARK("Mat4 unproject_rays", count,
+                                unproject_rays(inv, vp, pixels, rays, count),
+                                garbage += rays[count / 2].direction.x);
+
+            RUN_BATCH_BENCHMARK("Mat4 manual unproject", count,
+                                for (size_t i = 0; i < count; ++i) {
+                                    float x = pixels[i].x / 960.0f - 1.0f;
+                                    float y = pixels[i].y / 540.0f - 1.0f;
+                                    Vec4  a = inv * vec4(x, y, -1.0f, 1.0f);
+                                    Vec4  b = inv * vec4(x, y, 1.0f, 1.0f);
+                                    rays[i].origin    = a.xyz / a.w;
+                                    rays[i].direction = normalize(b.xyz / b.w - rays[i].origin);
+                                },
+                                garbage += rays[count / 2].direction.x);
+
+            free(pixels);
+            free(rays);
+            free(flags);
+        }
+
+        free(A4);
+        free(B4);
+        free(C4);
+        free(A);
+        free(B);
+        free(C);
+        free(in);
+        free(out);
+    }
+
+    {
+        size_t const count   = 1 << 18;
+        DualQuat     palette[64];
+        Vec3        *pos     = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3        *nrm     = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3        *out_pos = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3        *out_nrm = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint16_t    *joints  = static_cast<uint16_t *>(malloc(4 * count * sizeof(uint16_t)));
+        float       *weights = static_cast<float *>(malloc(4 * count * sizeof(float)));
+
+        for (size_t i = 0; i < COUNT_OF(palette); ++i) {
+            Rng rng = create_rng();
+            palette[i] = dual_quat(rng[0] * 72.0f, vec3(rng[1], rng[2], rng[3]),
+                                   vec3(rng[4], rng[5], rng[6]));
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            pos[i] = vec3(rng[0], rng[1], rng[2]);
+            nrm[i] = normalize(vec3(rng[3], rng[4], rng[5]));
+            for (int k = 0; k < 4; ++k) {
+                joints[4*i + k]  = static_cast<uint16_t>(rand() % COUNT_OF(palette));
+                weights[4*i + k] = 0.25f;
+            }
+        }
+
+        RUN_BATCH_BENCHMARK("DualQuat transform_points", count,
+                            transform_points(palette[0], pos, out_pos, count),
+                            garbage += out_pos[count / 2].x);
+
+        RUN_BATCH_BENCHMARK("DualQuat skin", count,
+                            skin(palette, joints, weights, pos, nrm, out_pos, out_nrm, count),
+                            garbage += out_pos[count / 2].x + out_nrm[count / 2].y);
+
+        free(pos);
+        free(nrm);
+        free(out_pos);
+        free(out_nrm);
+        free(joints);
+        free(weights);
+    }
+
+    {
+        size_t const count      = 1 << 16;
+        size_t const max_levels = 16;
+        Hierarchy    h;
+
+        h.parents      = static_cast<int32_t *>(malloc(count * sizeof(int32_t)));
+        h.locals       = static_cast<Transform *>(malloc(count * sizeof(Transform)));
+        h.worlds       = static_cast<Mat4 *>(malloc(count * sizeof(Mat4)));
+        h.dirty        = static_cast<uint8_t *>(malloc(count * sizeof(uint8_t)));
+        h.level_starts = static_cast<uint32_t *>(malloc((max_levels + 1) * sizeof(uint32_t)));
+        h.count        = count;
+        h.max_levels   = max_levels;
+
+        // a wide tree of 64 roots with each node having up to 4 children
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            h.parents[i] = i < 64 ? -1 : int32_t((i - 64) / 4);
+            h.locals[i]  = transform(vec3(rng[0], rng[1], rng[2]), rng[3] * 72.0f,
+                                     vec3(rng[4], rng[5], rng[6]), vec3(1, 1, 1));
+        }
+
+        hierarchy_build_levels(&h);
+        hierarchy_update_all(&h);
+
+        RUN_BATCH_BENCHMARK("Hierarchy naive full recompute", count,
+                            for (size_t i = 0; i < count; ++i) {
+                                int32_t p = h.parents[i];
+                                h.worlds[i] = p < 0 ? mat4(h.locals[i]) : h.worlds[p] * mat4(h.locals[i]);
+                            },
+                            garbage += sum_mat(h.worlds[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Hierarchy update 5% dirty", count,
+                            for (size_t i = 0; i < count; i += 20) h.dirty[(i * 7919) % count] = 1;
+                            hierarchy_update(&h),
+                            garbage += sum_mat(h.worlds[count / 2]));
+
+        free(h.parents);
+        free(h.locals);
+        free(h.worlds);
+        free(h.dirty);
+        free(h.level_starts);
+    }
+
+    {
+        size_t const tri_count = 256;
+        size_t const ray_count = 4096;
+        size_t const count     = tri_count * ray_count;
+        Vec3  *tris = static_cast<Vec3 *>(malloc(3 * tri_count * sizeof(Vec3)));
+        Ray   *rays = static_cast<Ray *>(malloc(ray_count * sizeof(Ray)));
+        RayHit hit;
+
+        for (size_t i = 0; i < tri_count; ++i) {
+            Rng rng = create_rng();
+            for (int k = 0; k < 3; ++k)
+                tris[3*i + k] = vec3(rng[3*k] - 2.5f, rng[3*k + 1] - 2.5f, -rng[3*k + 2] - 1.0f);
+        }
+        for (size_t i = 0; i < ray_count; ++i) {
+            Rng rng = create_rng();
+            rays[i].origin    = vec3(0, 0, 0);
+            rays[i].direction = normalize(vec3(rng[0] - 2.5f, rng[1] - 2.5f, -5.0f));
+        }
+
+        RUN_BATCH_BENCHMARK("Ray intersect_nearest per triangle", count,
+                            for (size_t i = 0; i < ray_count; ++i) {
+                                hit.t = 100.0f;
+                                intersect_nearest(rays[i], tris, tri_count, &hit);
+                            },
+                            garbage += hit.t);
+
+        RUN_BATCH_BENCHMARK("RayPacket8 intersect_nearest per triangle", count,
+                            for (size_t i = 0; i < ray_count; i += 8) {
+                                RayPacket8 packet;
+                                ray_packet(rays + i, 8, 100.0f, &packet);
+                                intersect_nearest(&packet, tris, tri_count);
+                                hit.t = packet.t[0];
+                            },
+                            garbage += hit.t);
+
+        free(tris);
+        free(rays);
+    }
+
+    {
+        size_t const count     = 1 << 20;
+        size_t const ray_count = 1 << 16;
+        Vec3   *tris    = static_cast<Vec3 *>(malloc(3 * count * sizeof(Vec3)));
+        Ray    *rays    = static_cast<Ray *>(malloc(ray_count * sizeof(Ray)));
+        RayHit *hits    = static_cast<RayHit *>(malloc(ray_count * sizeof(RayHit)));
+        void   *scratch = malloc(bvh_scratch_size(count));
+        BVH     bvh;
+
+        bvh_init(&bvh, static_cast<BVHNode *>(malloc(bvh_max_nodes(count) * sizeof(BVHNode))),
+                 static_cast<uint32_t *>(malloc(count * sizeof(uint32_t))),
+                 static_cast<float *>(malloc(bvh_max_nodes(count) * sizeof(float))));
+
+        // small random triangles filling a box 100 units wide
+        for (size_t i = 0; i < count; ++i) {
+            Rng  rng = create_rng();
+            Vec3 p   = 20.0f * vec3(rng[0], rng[1], rng[2]);
+            tris[3*i + 0] = p;
+            tris[3*i + 1] = p + 0.1f * vec3(rng[3], rng[4], rng[5]);
+            tris[3*i + 2] = p + 0.1f * vec3(rng[6], rng[7], rng[8]);
+        }
+        for (size_t i = 0; i < ray_count; ++i) {
+            Rng rng = create_rng();
+            rays[i].origin    = vec3(-10.0f, 20.0f * rng[0], 20.0f * rng[1]);
+            rays[i].direction = normalize(vec3(20.0f, rng[2] - 2.5f, rng[3] - 2.5f));
+        }
+
+        RUN_BATCH_BENCHMARK("BVH build 1M triangles", count,
+                            bvh_build(&bvh, tris, count, scratch),
+                            garbage += bvh.bounds.max.x);
+
+        RUN_BATCH_BENCHMARK("BVH refit 1M triangles", count,
+                            bvh_refit(&bvh, tris),
+                            garbage += bvh.bounds.max.x);
+
+        RUN_BATCH_BENCHMARK("BVH degraded check", bvh.node_count,
+                            uint32_t worst;
+                            garbage += float(bvh_degraded(bvh, 1.5f, &worst, 1)),
+                            garbage += bvh.bounds.max.y);
+
+        RUN_BATCH_BENCHMARK("BVH intersect rays", ray_count,
+                            for (size_t i = 0; i < ray_count; ++i) hits[i].t = 1000.0f;
+                            bvh_intersect(bvh, tris, rays, hits, ray_count),
+                            garbage += hits[ray_count / 2].t);
+
+        RUN_BATCH_BENCHMARK("BVH overlap boxes", ray_count,
+                            for (size_t i = 0; i < ray_count; ++i) {
+                                AABB box;
+                                box.min = rays[i].origin + vec3(20, 0, 0);
+                                box.max = box.min + vec3(1, 1, 1);
+                                hits[i].prim = uint32_t(bvh_overlap(bvh, box, nullptr, 0));
+                            },
+                            garbage += float(hits[ray_count / 2].prim));
+
+        free(bvh.nodes);
+        free(bvh.prims);
+        free(bvh.costs);
+        free(scratch);
+        free(hits);
+        free(rays);
+        free(tris);
+    }
+
+    {
+        size_t const count = 1 << 20;
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3     *sorted  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint32_t *codes30 = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint32_t *keys30  = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint64_t *codes63 = static_cast<uint64_t *>(malloc(count * sizeof(uint64_t)));
+        uint64_t *keys63  = static_cast<uint64_t *>(malloc(count * sizeof(uint64_t)));
+        uint32_t *order   = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        void     *scratch = malloc(radix_sort_scratch_size(count));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            points[i] = 20.0f * vec3(rng[0], rng[1], rng[2]);
+        }
+
+        AABB const box = aabb(points, count);
+
+        RUN_BATCH_BENCHMARK("Morton morton30 array", count,
+                            morton30(box, points, codes30, count),
+                            garbage += float(codes30[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Morton morton63 array", count,
+                            morton63(box, points, codes63, count),
+                            garbage += float(codes63[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Radix sort 30 bit codes", count,
+                            for (size_t i = 0; i < count; ++i) keys30[i] = codes30[i];
+                            radix_sort(keys30, order, count, scratch),
+                            garbage += float(order[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Radix sort 63 bit codes", count,
+                            for (size_t i = 0; i < count; ++i) keys63[i] = codes63[i];
+                            radix_sort(keys63, order, count, scratch),
+                            garbage += float(order[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Radix sort reorder Vec3", count,
+                            reorder(order, points, sorted, sizeof(Vec3), count),
+                            garbage += sorted[count / 2].x);
+
+        free(scratch);
+        free(order);
+        free(keys63);
+        free(codes63);
+        free(keys30);
+        free(codes30);
+        free(sorted);
+        free(points);
+    }
+
+    {
+        size_t const count       = 1 << 20;
+        size_t const query_count = 1 << 16;
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        Vec3     *welded  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint32_t *remap   = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        uint32_t *found   = static_cast<uint32_t *>(malloc(8 * query_count * sizeof(uint32_t)));
+        float    *dist_sq = static_cast<float *>(malloc(8 * query_count * sizeof(float)));
+        void     *scratch = malloc(weld_vertices_scratch_size(count));
+        HashGrid  grid    = {};
+
+        grid.points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        grid.indices = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        grid.cells   = static_cast<uint32_t *>(malloc((hash_grid_table_size(count) + 1) * sizeof(uint32_t)));
+
+        // about one point per unit cube
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            points[i] = 20.0f * vec3(rng[0], rng[1], rng[2]);
+        }
+
+        RUN_BATCH_BENCHMARK("HashGrid build 1M points", count,
+                            hash_grid_build(&grid, points, count, 1.0f, scratch),
+                            garbage += grid.points[count / 2].x);
+
+        RUN_BATCH_BENCHMARK("HashGrid radius queries", query_count,
+                            for (size_t i = 0; i < query_count; ++i)
+                                found[i] = uint32_t(hash_grid_radius(grid, points[i], 1.0f, found + query_count, 64)),
+                            garbage += float(found[query_count / 2]));
+
+        RUN_BATCH_BENCHMARK("HashGrid 8 nearest queries", query_count,
+                            hash_grid_nearest(grid, points, query_count, 8, found, dist_sq),
+                            garbage += dist_sq[8 * (query_count / 2) + 7]);
+
+        RUN_BATCH_BENCHMARK("HashGrid weld_vertices 1M", count,
+                            for (size_t i = 0; i < count; ++i) welded[i] = points[i];
+                            garbage += float(weld_vertices(welded, count, 0.01f, remap, scratch)),
+                            garbage += welded[count / 2].y);
+
+        free(grid.cells);
+        free(grid.indices);
+        free(grid.points);
+        free(scratch);
+        free(dist_sq);
+        free(found);
+        free(remap);
+        free(welded);
+        free(points);
+    }
+
+    {
+        size_t const count       = 1 << 20;
+        size_t const query_count = 1 << 16;
+        size_t const slots       = kdtree_leaf_count(count) * M3D_KDTREE_LEAF_SIZE;
+        Vec3     *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        uint32_t *found   = static_cast<uint32_t *>(malloc(8 * query_count * sizeof(uint32_t)));
+        float    *dist_sq = static_cast<float *>(malloc(8 * query_count * sizeof(float)));
+        uint32_t *totals  = static_cast<uint32_t *>(malloc(query_count * sizeof(uint32_t)));
+        void     *scratch = malloc(kdtree_scratch_size(count));
+        KDTree    tree    = {};
+
+        tree.x       = static_cast<float *>(malloc(slots * sizeof(float)));
+        tree.y       = static_cast<float *>(malloc(slots * sizeof(float)));
+        tree.z       = static_cast<float *>(malloc(slots * sizeof(float)));
+        tree.indices = static_cast<uint32_t *>(malloc(slots * sizeof(uint32_t)));
+        tree.splits  = static_cast<float *>(malloc(kdtree_leaf_count(count) * sizeof(float)));
+        tree.axes    = static_cast<uint8_t *>(malloc(kdtree_leaf_count(count)));
+
+        // the same points as the HashGrid benchmarks
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            points[i] = 20.0f * vec3(rng[0], rng[1], rng[2]);
+        }
+
+        RUN_BATCH_BENCHMARK("KDTree build 1M points", count,
+                            kdtree_build(&tree, points, count, scratch),
+                            garbage += tree.x[slots / 2]);
+
+        RUN_BATCH_BENCHMARK("KDTree radius queries", query_count,
+                            kdtree_radius(tree, points, query_count, 1.0f, found, 8, totals),
+                            garbage += float(totals[query_count / 2]));
+
+        RUN_BATCH_BENCHMARK("KDTree 8 nearest queries", query_count,
+                            kdtree_nearest(tree, points, query_count, 8, found, dist_sq),
+                            garbage += dist_sq[8 * (query_count / 2) + 7]);
+
+        free(tree.axes);
+        free(tree.splits);
+        free(tree.indices);
+        free(tree.z);
+        free(tree.y);
+        free(tree.x);
+        free(scratch);
+        free(totals);
+        free(dist_sq);
+        free(found);
+        free(points);
+    }
+
+    {
+        size_t const count = 1 << 16;
+        Mat3 *A       = static_cast<Mat3 *>(malloc(count * sizeof(Mat3)));
+        Mat3 *U       = static_cast<Mat3 *>(malloc(count * sizeof(Mat3)));
+        Mat3 *V       = static_cast<Mat3 *>(malloc(count * sizeof(Mat3)));
+        Vec3 *sigma   = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            for (int k = 0; k < 9; ++k)
+                A[i].data[k] = rng[k] - 2.5f;
+        }
+
+        RUN_BATCH_BENCHMARK("Mat3 svd array", count,
+                            svd(A, U, sigma, V, count),
+                            garbage += sigma[count / 2].x);
+
+        for (size_t i = 0; i < count; ++i)
+            A[i] = transpose(A[i]) * A[i];
+
+        RUN_BATCH_BENCHMARK("Mat3 eigen_symmetric array", count,
+                            eigen_symmetric(A, sigma, V, count),
+                            garbage += sigma[count / 2].x);
+
+        free(sigma);
+        free(V);
+        free(U);
+        free(A);
+    }
+
+    {
+        size_t const count     = 1 << 20;
+        size_t const box_count = 1 << 16;
+        Vec3    *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        OBB     *a       = static_cast<OBB *>(malloc(box_count * sizeof(OBB)));
+        OBB     *b       = static_cast<OBB *>(malloc(box_count * sizeof(OBB)));
+        uint8_t *results = static_cast<uint8_t *>(malloc(box_count));
+        Frustum  f       = frustum(perspectiveGL(90.0f, 1.0f, 1.0f, 100.0f));
+        OBB      box     = {};
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            points[i] = vec3(4.0f * rng[0], rng[1], 0.5f * rng[2]);
+        }
+
+        for (size_t i = 0; i < box_count; ++i) {
+            Rng rng = create_rng();
+            a[i].center       = 20.0f * vec3(rng[0], rng[1], -rng[2]) - vec3(50, 50, 0);
+            a[i].axes         = mat3(rotation(72.0f * rng[3], normalize(vec3(rng[4], rng[5], 1))));
+            a[i].half_extents = vec3(rng[6], rng[7], rng[8]);
+            b[i].center       = a[i].center + vec3(rng[9], rng[10], rng[11]);
+            b[i].axes         = mat3(rotation(72.0f * rng[12], normalize(vec3(1, rng[13], rng[14]))));
+            b[i].half_extents = a[i].half_extents;
+        }
+
+        RUN_BATCH_BENCHMARK("OBB covariance fit 1M points", count,
+                            box = obb(points, count),
+                            garbage += box.half_extents.x);
+
+        RUN_BATCH_BENCHMARK("Frustum vs OBB array", box_count,
+                            intersect(f, a, results, box_count),
+                            garbage += float(results[box_count / 2]));
+
+        RUN_BATCH_BENCHMARK("OBB vs OBB array", box_count,
+                            intersect(a, b, results, box_count),
+                            garbage += float(results[box_count / 2]));
+
+        free(results);
+        free(b);
+        free(a);
+        free(points);
+    }
+
+    {
+        size_t const count = 1 << 20;
+        Vec3    *points  = static_cast<Vec3 *>(malloc(count * sizeof(Vec3)));
+        float   *soa     = static_cast<float *>(malloc(8 * count * sizeof(float)));
+        uint8_t *overlap = static_cast<uint8_t *>(malloc(count));
+        uint32_t *found  = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        Spheres  a       = { soa, soa + count, soa + 2 * count, soa + 3 * count };
+        Spheres  b       = { soa + 4 * count, soa + 5 * count, soa + 6 * count, soa + 7 * count };
+        Sphere   s       = {};
+        Sphere   q       = { vec3(50, 50, 50), 5.0f };
+        size_t   total   = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            points[i] = 20.0f * vec3(rng[0], rng[1], rng[2]);
+            a.x[i] = points[i].x; a.y[i] = points[i].y; a.z[i] = points[i].z; a.radius[i] = 0.2f * rng[3];
+            b.x[i] = 20.0f * rng[4]; b.y[i] = 20.0f * rng[5]; b.z[i] = 20.0f * rng[6]; b.radius[i] = 0.2f * rng[7];
+        }
+
+        RUN_BATCH_BENCHMARK("Sphere fit 1M points", count,
+                            s = sphere(points, count),
+                            garbage += s.radius);
+
+        RUN_BATCH_BENCHMARK("Sphere vs sphere arrays", count,
+                            intersect(a, b, overlap, count),
+                            garbage += float(overlap[count / 2]));
+
+        RUN_BATCH_BENCHMARK("Sphere query vs 1M spheres", count,
+                            total = intersect(q, a, count, found, count),
+                            garbage += float(total));
+
+        free(found);
+        free(overlap);
+        free(soa);
+        free(points);
+    }
+
+    {
+        size_t const count     = 1 << 15;
+        size_t const max_pairs = 1 << 20;
+        AABB     *boxes   = static_cast<AABB *>(malloc(2 * count * sizeof(AABB)));
+        AABB     *moved   = boxes + count;
+        uint32_t *pairs   = static_cast<uint32_t *>(malloc(2 * max_pairs * sizeof(uint32_t)));
+        void     *scratch = malloc(sort_sweep_scratch_size(count));
+        SortSweep sweep   = {};
+        size_t    total   = 0;
+        int       frame   = 0;
+
+        sweep.order  = static_cast<uint32_t *>(malloc(count * sizeof(uint32_t)));
+        sweep.bounds = static_cast<float *>(malloc(sort_sweep_bounds_size(count) * sizeof(float)));
+
+        // two frames of boxes jittered against each other
+        for (size_t i = 0; i < count; ++i) {
+            Rng  rng = create_rng();
+            Vec3 p   = 8.0f * vec3(rng[0], rng[1], rng[2]);
+            Vec3 e   = 0.1f * vec3(rng[3], rng[4], rng[5]) + vec3(0.2f, 0.2f, 0.2f);
+            Vec3 v   = 0.02f * vec3(rng[6], rng[7], rng[8]) - vec3(0.05f, 0.05f, 0.05f);
+            boxes[i].min = p - e;
+            boxes[i].max = p + e;
+            moved[i].min = boxes[i].min + v;
+            moved[i].max = boxes[i].max + v;
+        }
+
+        sort_sweep_init(&sweep, boxes, count, scratch);
+        total = sort_sweep_update(&sweep, boxes, pairs, max_pairs);
+
+        RUN_BATCH_BENCHMARK("Sort and sweep 32k moving boxes", count,
+                            total = sort_sweep_update(&sweep, (frame++ & 1) ? boxes : moved, pairs, max_pairs),
+                            garbage += float(total));
+
+        RUN_BATCH_BENCHMARK("Sort and sweep per reported pair", total,
+                            total = sort_sweep_update(&sweep, (frame++ & 1) ? boxes : moved, pairs, max_pairs),
+                            garbage += float(total));
+
+        free(sweep.bounds);
+        free(sweep.order);
+        free(scratch);
+        free(pairs);
+        free(boxes);
+    }
+
+    {
+        size_t const count = 1 << 14;
+        OBB          *a       = static_cast<OBB *>(malloc(2 * count * sizeof(OBB)));
+        OBB          *b       = a + count;
+        Convex       *shapes  = static_cast<Convex *>(malloc(3 * count * sizeof(Convex)));
+        Convex       *ca      = shapes;
+        Convex       *cb      = shapes + count;
+        Convex       *ch      = shapes + 2 * count;
+        Mat3x4       *places  = static_cast<Mat3x4 *>(malloc(count * sizeof(Mat3x4)));
+        GjkSimplex   *simplex = static_cast<GjkSimplex *>(malloc(count * sizeof(GjkSimplex)));
+        ConvexResult *results = static_cast<ConvexResult *>(malloc(count * sizeof(ConvexResult)));
+        uint8_t      *overlap = static_cast<uint8_t *>(malloc(count));
+        float        *verts   = static_cast<float *>(malloc(3 * 64 * sizeof(float)));
+        Hull          hull    = { verts, verts + 64, verts + 128, 64 };
+        size_t        overlap_count = 0;
+
+        // points on a sphere of radius 0.5
+        for (int k = 0; k < 64; ++k) {
+            Rng  rng = create_rng();
+            Vec3 p   = 0.5f * normalize(vec3(rng[0], rng[1], rng[2]) - vec3(2.5f, 2.5f, 2.5f));
+            verts[k]       = p.x;
+            verts[64 + k]  = p.y;
+            verts[128 + k] = p.z;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            a[i].center       = vec3(rng[0], rng[1], rng[2]);
+            a[i].axes         = mat3(rotation(72.0f * rng[3], normalize(vec3(rng[4], rng[5], 1))));
+            a[i].half_extents = 0.1f * vec3(rng[6], rng[7], rng[8]) + vec3(0.1f, 0.1f, 0.1f);
+            b[i].center       = a[i].center + 0.4f * vec3(rng[9], rng[10], rng[11]) - vec3(1, 1, 1);
+            b[i].axes         = mat3(rotation(72.0f * rng[12], normalize(vec3(1, rng[13], rng[14]))));
+            b[i].half_extents = a[i].half_extents;
+            places[i]         = mat3x4(translate(b[i].center.x, b[i].center.y, b[i].center.z));
+
+            ca[i].support   = support_obb;
+            ca[i].shape     = &a[i];
+            ca[i].transform = nullptr;
+            cb[i].support   = support_obb;
+            cb[i].shape     = &b[i];
+            cb[i].transform = nullptr;
+            ch[i].support   = support_hull;
+            ch[i].shape     = &hull;
+            ch[i].transform = &places[i];
+        }
+
+        RUN_BATCH_BENCHMARK("GJK OBB pairs, cold start", count,
+                            for (size_t i = 0; i < count; ++i) {
+                                simplex[i].count = 0;
+                                overlap[i] = gjk(ca[i], cb[i], &simplex[i], &results[i]);
+                            },
+                            garbage += results[count / 2].distance);
+
+        RUN_BATCH_BENCHMARK("GJK OBB pairs, warm start", count,
+                            for (size_t i = 0; i < count; ++i)
+                                overlap[i] = gjk(ca[i], cb[i], &simplex[i], &results[i]),
+                            garbage += results[count / 2].distance);
+
+        for (size_t i = 0; i < count; ++i)
+            overlap_count += overlap[i];
+
+        RUN_BATCH_BENCHMARK("EPA overlapping OBB pairs", overlap_count,
+                            for (size_t i = 0; i < count; ++i)
+                                if (overlap[i])
+                                    epa(ca[i], cb[i], simplex[i], &results[i]),
+                            garbage += results[count / 2].distance);
+
+        RUN_BATCH_BENCHMARK("GJK OBB vs hull, cold start", count,
+                            for (size_t i = 0; i < count; ++i) {
+                                simplex[i].count = 0;
+                                gjk(ca[i], ch[i], &simplex[i], &results[i]);
+                            },
+                            garbage += results[count / 2].distance);
+
+        free(verts);
+        free(overlap);
+        free(results);
+        free(simplex);
+        free(places);
+        free(shapes);
+        free(a);
+    }
+
+    {
+        size_t const   count  = 1 << 22;
+        float         *soa    = static_cast<float *>(malloc(9 * count * sizeof(float)));
+        uint16_t      *hv     = static_cast<uint16_t *>(malloc(3 * count * sizeof(uint16_t)));
+        Particles      p      = { soa, soa + count, soa + 2 * count, soa + 3 * count, soa + 4 * count, soa + 5 * count,
+                                  hv, hv + count, hv + 2 * count, soa + 6 * count, soa + 7 * count, soa + 8 * count };
+        Particles      h      = p;
+        ParticleForces forces = { vec3(0, -9.8f, 0), 0.2f, 50.0f, vec3(-100, 0, -100), vec3(100, 100, 100) };
+
+        h.vx = h.vy = h.vz = nullptr;
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            p.x[i]  = 20.0f * rng[0]; p.y[i]  = 20.0f * rng[1]; p.z[i]  = 20.0f * rng[2];
+            p.vx[i] = rng[3] - 2.5f;  p.vy[i] = rng[4];         p.vz[i] = rng[5] - 2.5f;
+            p.px[i] = p.x[i];         p.py[i] = p.y[i];         p.pz[i] = p.z[i];
+        }
+        to_half(p.vx, hv, 3 * count);
+
+        RUN_BATCH_BENCHMARK("Particle Euler step, 4M", count,
+                            integrate_euler(p, forces, 1.0f / 60.0f, count),
+                            garbage += p.y[count / 2]);
+
+        RUN_BATCH_BENCHMARK("Particle Euler step, half v, 4M", count,
+                            integrate_euler(h, forces, 1.0f / 60.0f, count),
+                            garbage += p.y[count / 2]);
+
+        RUN_BATCH_BENCHMARK("Particle Verlet step, 4M", count,
+                            integrate_verlet(p, forces, 1.0f / 60.0f, count),
+                            garbage += p.y[count / 2]);
+
+        free(hv);
+        free(soa);
+    }
+
+    {
+        size_t const count = 1 << 20;
+        size_t const size  = count * (sizeof(Mat4) + sizeof(Mat3x4)) + 2 * M3D_CACHE_LINE;
+        void        *heap  = malloc(size);
+        void        *huge  = pages_alloc(size, M3D_PAGES_HUGE | M3D_PAGES_FIRST_TOUCH);
+        Arena        a, b;
+
+        arena_init(&a, heap, size);
+        arena_init(&b, huge, size);
+        Mat4   *heap_in  = static_cast<Mat4 *>(arena_alloc(&a, count * sizeof(Mat4)));
+        Mat3x4 *heap_out = static_cast<Mat3x4 *>(arena_alloc(&a, count * sizeof(Mat3x4)));
+        Mat4   *huge_in  = static_cast<Mat4 *>(arena_alloc(&b, count * sizeof(Mat4)));
+        Mat3x4 *huge_out = static_cast<Mat3x4 *>(arena_alloc(&b, count * sizeof(Mat3x4)));
+
+        for (size_t i = 0; i < count; ++i) {
+            Rng rng = create_rng();
+            heap_in[i] = huge_in[i] = translate(rng[0], rng[1], rng[2]) * rotation(rng[3] * 72.0f, vec3(rng[4], rng[5], 1.0f));
+        }
+
+        RUN_BATCH_BENCHMARK("mat3x4 from 1M Mat4, malloc", count,
+                            mat3x4(heap_in, heap_out, count),
+                            garbage += heap_out[count / 2].data[3]);
+
+        RUN_BATCH_BENCHMARK("mat3x4 from 1M Mat4, huge pages", count,
+                            mat3x4(huge_in, huge_out, count),
+                            garbage += huge_out[count / 2].data[3]);
+
+        pages_free(huge, size, M3D_PAGES_HUGE | M3D_PAGES_FIRST_TOUCH);
+        free(heap);
+    }
+
     puts("\n");
     printf("Garbage out: %f\n\n", garbage);
     
 #undef RUN_BENCHMARK
+#undef RUN_BATCH_BENCHMARK
 }
 
 int main(int, char *[])